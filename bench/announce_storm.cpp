@@ -0,0 +1,156 @@
+// Simulates a restart with tens of thousands of torrents, all of which want to send
+// their `started` event at once, through `announce_scheduler` to a few local UDP
+// tracker stand-ins. Reports how many announces each tracker receives per second,
+// which the scheduler's per tracker limits must keep bounded, instead of the whole
+// burst arriving in the first second. (The rate limit allows a second's worth of
+// announces in a burst, so the first second may see up to twice the limit.)
+//
+// usage: announce_storm [torrents] [trackers] [seconds]
+
+#include "announce_scheduler.hpp"
+#include "settings.hpp"
+#include "time.hpp"
+#include "tracker.hpp"
+#include "udp_tracker_socket.hpp"
+#include "udp_tracker_stand_in.hpp"
+#include "utp_socket.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+#include <asio/executor_work_guard.hpp>
+#include <asio/io_context.hpp>
+
+using namespace tide;
+
+// The defaults `engine` chooses.
+constexpr int max_in_flight_per_tracker = 8;
+constexpr int max_announces_per_second_per_tracker = 20;
+const seconds max_jitter(10);
+
+/** Dispatches due announces every 100ms, like `engine::update`. */
+void update(deadline_timer& timer, announce_scheduler& scheduler)
+{
+    cached_clock::update();
+    scheduler.dispatch();
+    start_timer(timer, milliseconds(100), [&timer, &scheduler](const error_code& e) {
+        if(!e) {
+            update(timer, scheduler);
+        }
+    });
+}
+
+int main(int argc, char** argv)
+{
+    const int num_torrents = argc > 1 ? std::atoi(argv[1]) : 50000;
+    const int num_trackers = std::max(1, argc > 2 ? std::atoi(argv[2]) : 5);
+    const seconds length(argc > 3 ? std::atoi(argv[3]) : 15);
+
+    asio::io_context ios;
+    auto work = asio::make_work_guard(ios);
+    utp_socket_manager socket(ios);
+    error_code ec;
+    socket.open(0, ec);
+    if(ec) {
+        std::printf("could not open UDP socket: %s\n", ec.message().c_str());
+        return 1;
+    }
+    udp_tracker_socket tracker_socket(socket);
+
+    settings s;
+    std::vector<std::unique_ptr<udp_tracker_stand_in>> stand_ins;
+    std::vector<std::unique_ptr<udp_tracker>> trackers;
+    for(auto i = 0; i < num_trackers; ++i) {
+        stand_ins.emplace_back(std::make_unique<udp_tracker_stand_in>(ios));
+        trackers.emplace_back(std::make_unique<udp_tracker>(
+                tracker_socket, stand_ins.back()->url(), s));
+    }
+
+    announce_scheduler scheduler;
+    scheduler.set_max_in_flight_per_tracker(max_in_flight_per_tracker);
+    scheduler.set_max_announces_per_second_per_tracker(
+            max_announces_per_second_per_tracker);
+    scheduler.set_max_jitter(max_jitter);
+
+    // Each torrent announces to one of the trackers, and like `torrent`, torrents
+    // with fewer peers get a more urgent (lower) priority.
+    cached_clock::update();
+    std::vector<sha1_hash> torrents(num_torrents);
+    int64_t num_responses = 0;
+    int64_t num_errors = 0;
+    for(auto i = 0; i < num_torrents; ++i) {
+        // A torrent is identified by its info hash, which is also its token.
+        auto& info_hash = torrents[i];
+        std::fill(info_hash.begin(), info_hash.end(), 0);
+        info_hash[0] = i >> 16;
+        info_hash[1] = i >> 8;
+        info_hash[2] = i;
+        auto& tracker = *trackers[i % num_trackers];
+        scheduler.schedule(&info_hash, tracker_request::started, tracker, 1 + i % 50,
+                [&info_hash, &tracker, &num_responses, &num_errors](
+                        announce_scheduler::in_flight_announce in_flight) {
+                    tracker_request request;
+                    request.info_hash = info_hash;
+                    request.peer_id = info_hash;
+                    request.port = 6881;
+                    request.uploaded = request.downloaded = request.left = 0;
+                    request.event = tracker_request::started;
+                    tracker.announce(request,
+                            [&num_responses, &num_errors,
+                                    in_flight = std::move(in_flight)](
+                                    const error_code& error, tracker_response) mutable {
+                                in_flight.reset();
+                                ++(error ? num_errors : num_responses);
+                            });
+                });
+    }
+
+    deadline_timer update_timer(ios);
+    update(update_timer, scheduler);
+    const auto start = clock::now();
+    while(clock::now() - start < length) {
+        ios.run_one();
+    }
+
+    std::printf("%i torrents announcing to %i trackers, limits: %i in flight and %i/s "
+                "per tracker, jitter %llis\n\n",
+            num_torrents, num_trackers, max_in_flight_per_tracker,
+            max_announces_per_second_per_tracker,
+            static_cast<long long>(max_jitter.count()));
+    std::printf("second  announces (all trackers)  busiest tracker\n");
+    for(auto second = 0; second < length.count(); ++second) {
+        int total = 0;
+        int busiest = 0;
+        for(const auto& stand_in : stand_ins) {
+            const auto& counts = stand_in->num_announces_per_second();
+            const int n = second < int(counts.size()) ? counts[second] : 0;
+            total += n;
+            busiest = std::max(busiest, n);
+        }
+        std::printf("%6i  %26i  %15i\n", second, total, busiest);
+    }
+    int peak = 0;
+    for(const auto& stand_in : stand_ins) {
+        peak = std::max(peak, stand_in->peak_announces_per_second());
+    }
+    std::printf("\npeak %i announces/s per tracker (without the scheduler all %i would "
+                "arrive at once)\n",
+            peak, num_torrents);
+    std::printf("%lli responses, %lli errors, %i announces still scheduled (about %lis "
+                "to go)\n",
+            static_cast<long long>(num_responses), static_cast<long long>(num_errors),
+            scheduler.num_scheduled_announces(),
+            long(scheduler.num_scheduled_announces()
+                    / (num_trackers * max_announces_per_second_per_tracker)));
+
+    for(auto& tracker : trackers) {
+        tracker->abort();
+    }
+    for(auto& stand_in : stand_ins) {
+        stand_in->close();
+    }
+    socket.close();
+}
@@ -0,0 +1,112 @@
+// Measures how many announces per second the UDP trackers, all sharing one socket,
+// can complete against local UDP tracker stand-ins, by keeping many announces in
+// flight at once without any scheduling.
+//
+// usage: announce_throughput [announces] [trackers] [announces in flight]
+
+#include "settings.hpp"
+#include "time.hpp"
+#include "tracker.hpp"
+#include "udp_tracker_socket.hpp"
+#include "udp_tracker_stand_in.hpp"
+#include "utp_socket.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+#include <asio/executor_work_guard.hpp>
+#include <asio/io_context.hpp>
+
+using namespace tide;
+
+struct announcer
+{
+    std::vector<std::unique_ptr<udp_tracker>>& trackers;
+    int num_announces;
+    int num_started = 0;
+    int num_responses = 0;
+    int num_errors = 0;
+
+    int num_completed() const noexcept { return num_responses + num_errors; }
+
+    /** Starts the next announce, if any are left, once the previous one completes. */
+    void announce()
+    {
+        if(num_started == num_announces) {
+            return;
+        }
+        const int i = num_started++;
+        tracker_request request;
+        std::fill(request.info_hash.begin(), request.info_hash.end(), 0);
+        request.info_hash[0] = i >> 16;
+        request.info_hash[1] = i >> 8;
+        request.info_hash[2] = i;
+        request.peer_id = request.info_hash;
+        request.port = 6881;
+        request.uploaded = request.downloaded = request.left = 0;
+        request.event = tracker_request::started;
+        trackers[i % trackers.size()]->announce(
+                request, [this](const error_code& error, tracker_response) {
+                    ++(error ? num_errors : num_responses);
+                    announce();
+                });
+    }
+};
+
+int main(int argc, char** argv)
+{
+    const int num_announces = argc > 1 ? std::atoi(argv[1]) : 100000;
+    const int num_trackers = std::max(1, argc > 2 ? std::atoi(argv[2]) : 5);
+    const int num_in_flight = std::max(1, argc > 3 ? std::atoi(argv[3]) : 500);
+
+    asio::io_context ios;
+    auto work = asio::make_work_guard(ios);
+    utp_socket_manager socket(ios);
+    error_code ec;
+    socket.open(0, ec);
+    if(ec) {
+        std::printf("could not open UDP socket: %s\n", ec.message().c_str());
+        return 1;
+    }
+    udp_tracker_socket tracker_socket(socket);
+
+    settings s;
+    std::vector<std::unique_ptr<udp_tracker_stand_in>> stand_ins;
+    std::vector<std::unique_ptr<udp_tracker>> trackers;
+    for(auto i = 0; i < num_trackers; ++i) {
+        stand_ins.emplace_back(std::make_unique<udp_tracker_stand_in>(ios));
+        trackers.emplace_back(std::make_unique<udp_tracker>(
+                tracker_socket, stand_ins.back()->url(), s));
+    }
+
+    announcer a{trackers, num_announces};
+    const auto start = clock::now();
+    for(auto i = 0; i < num_in_flight; ++i) {
+        a.announce();
+    }
+    while(a.num_completed() < num_announces) {
+        ios.run_one();
+    }
+    const double elapsed_s = to_int<microseconds>(clock::now() - start) / 1e6;
+
+    int64_t num_received = 0;
+    for(const auto& stand_in : stand_ins) {
+        num_received += stand_in->num_announces();
+    }
+    std::printf("%i announces to %i trackers, %i in flight: %.2fs, %.0f announces/s\n",
+            num_announces, num_trackers, num_in_flight, elapsed_s,
+            a.num_completed() / elapsed_s);
+    std::printf("%i responses, %i errors, %lli announces received by the trackers\n",
+            a.num_responses, a.num_errors, static_cast<long long>(num_received));
+
+    for(auto& tracker : trackers) {
+        tracker->abort();
+    }
+    for(auto& stand_in : stand_ins) {
+        stand_in->close();
+    }
+    socket.close();
+}
@@ -0,0 +1,187 @@
+// Starts a network of DHT nodes on loopback, all of which join it through the first
+// node, then announces torrents from random nodes and looks each of them up from
+// another node, reporting how long it takes a lookup to find the first peer.
+//
+// usage: dht_loopback [nodes] [lookups]
+
+#include "dht.hpp"
+#include "random.hpp"
+#include "settings.hpp"
+#include "time.hpp"
+#include "utp_socket.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <asio/executor_work_guard.hpp>
+#include <asio/io_context.hpp>
+
+using namespace tide;
+
+constexpr int max_queries_per_second = 500;
+
+struct node
+{
+    settings config;
+    std::unique_ptr<utp_socket_manager> socket;
+    std::unique_ptr<dht_node> dht;
+};
+
+/**
+ * Keeps `cached_clock`, on which the DHT relies for its timeouts, up to date, the way
+ * `engine` does.
+ */
+void tick(deadline_timer& timer)
+{
+    cached_clock::update();
+    start_timer(timer, milliseconds(10), [&timer](const error_code& error) {
+        if(!error) {
+            tick(timer);
+        }
+    });
+}
+
+/** Runs `ios` until `is_done` returns true or `timeout` elapses. */
+template <typename Predicate>
+bool run_until(asio::io_context& ios, const duration timeout, Predicate is_done)
+{
+    const auto deadline = clock::now() + timeout;
+    while(!is_done()) {
+        if(clock::now() >= deadline) {
+            return false;
+        }
+        ios.run_one();
+    }
+    return true;
+}
+
+sha1_hash random_info_hash()
+{
+    sha1_hash h;
+    for(auto& b : h) {
+        b = util::random_int(0xff);
+    }
+    return h;
+}
+
+double percentile(std::vector<double> xs, const double p)
+{
+    std::sort(xs.begin(), xs.end());
+    return xs[std::min(int(xs.size()) - 1, int(p * xs.size()))];
+}
+
+int main(int argc, char** argv)
+{
+    const int num_nodes = std::max(2, argc > 1 ? std::atoi(argv[1]) : 100);
+    const int num_lookups = argc > 2 ? std::atoi(argv[2]) : 50;
+
+    asio::io_context ios;
+    auto work = asio::make_work_guard(ios);
+    deadline_timer tick_timer(ios);
+    tick(tick_timer);
+
+    std::vector<node> nodes(num_nodes);
+    uint16_t bootstrap_port = 0;
+    for(auto i = 0; i < num_nodes; ++i) {
+        auto& n = nodes[i];
+        n.config.max_dht_queries_per_second = max_queries_per_second;
+        n.config.dht_bootstrap_nodes.clear();
+        if(i > 0) {
+            n.config.dht_bootstrap_nodes.push_back(
+                    "127.0.0.1:" + std::to_string(bootstrap_port));
+        }
+        n.socket = std::make_unique<utp_socket_manager>(ios);
+        error_code ec;
+        n.socket->open(0, ec);
+        if(ec) {
+            std::printf("could not open UDP socket: %s\n", ec.message().c_str());
+            return 1;
+        }
+        if(i == 0) {
+            bootstrap_port = n.socket->local_endpoint(ec).port();
+        }
+        n.dht = std::make_unique<dht_node>(ios, *n.socket, n.config);
+    }
+
+    // Every node but the first joins through the first, one after the other, so that
+    // the first node can pass on the nodes that joined before to those that join
+    // later.
+    const auto join_start = clock::now();
+    nodes[0].dht->start();
+    int num_joined = 1;
+    for(auto i = 1; i < num_nodes; ++i) {
+        // The node's lookup of its own id starts once the bootstrap node's address
+        // is resolved.
+        auto& dht = *nodes[i].dht;
+        dht.start();
+        const auto has_lookup = [&dht] { return dht.num_lookups() > 0; };
+        const auto has_no_lookup = [&dht] { return dht.num_lookups() == 0; };
+        if(run_until(ios, seconds(1), has_lookup)
+                && run_until(ios, seconds(5), has_no_lookup)) {
+            ++num_joined;
+        }
+    }
+    const auto join_time = clock::now() - join_start;
+    // Let the pings with which nodes answer queries from unknown nodes conclude.
+    run_until(ios, milliseconds(500), [] { return false; });
+    int min_table_size = num_nodes;
+    double avg_table_size = 0;
+    for(const auto& n : nodes) {
+        min_table_size = std::min(min_table_size, n.dht->num_nodes());
+        avg_table_size += double(n.dht->num_nodes()) / num_nodes;
+    }
+    std::printf("%i of %i nodes joined in %.2fs, routing table size min %i avg %.1f\n",
+            num_joined, num_nodes, to_int<milliseconds>(join_time) / 1e3, min_table_size,
+            avg_table_size);
+
+    std::vector<double> times_ms;
+    for(auto i = 0; i < num_lookups; ++i) {
+        const auto info_hash = random_info_hash();
+        const int announcer = util::random_int(num_nodes - 1);
+        int searcher = util::random_int(num_nodes - 2);
+        if(searcher >= announcer) {
+            ++searcher;
+        }
+
+        // The announce is made to the closest nodes once the announcer's lookup of
+        // the torrent concludes.
+        auto& a = *nodes[announcer].dht;
+        a.get_peers(info_hash, 6881, [](std::vector<tcp::endpoint>) {});
+        run_until(ios, seconds(30), [&a] { return a.num_lookups() == 0; });
+
+        // The lookup may conclude without finding the announcer, if it converges on
+        // other nodes than the announce did. It also goes on after it found a peer,
+        // so the flag is shared with the handler.
+        auto& s = *nodes[searcher].dht;
+        auto is_found = std::make_shared<bool>(false);
+        const auto start = clock::now();
+        s.get_peers(info_hash, 0, [is_found](std::vector<tcp::endpoint> peers) {
+            *is_found = *is_found || !peers.empty();
+        });
+        run_until(ios, seconds(30),
+                [&is_found, &s] { return *is_found || (s.num_lookups() == 0); });
+        if(*is_found) {
+            times_ms.push_back(to_int<microseconds>(clock::now() - start) / 1e3);
+        }
+    }
+
+    if(!times_ms.empty()) {
+        double avg = 0;
+        for(const auto t : times_ms) {
+            avg += t / times_ms.size();
+        }
+        std::printf("time to first peer (ms): avg %.2f  p50 %.2f  p90 %.2f  max %.2f\n",
+                avg, percentile(times_ms, 0.5), percentile(times_ms, 0.9),
+                percentile(times_ms, 1));
+    }
+    std::printf("%i of %i lookups found a peer\n", int(times_ms.size()), num_lookups);
+
+    for(auto& n : nodes) {
+        n.dht->stop();
+        n.socket->close();
+    }
+}
@@ -0,0 +1,152 @@
+// Measures how evenly the rate limiter hierarchy divides bandwidth among 500 peers
+// that all want as much as they can get, and how close the aggregate throughput
+// stays to the configured caps.
+//
+// usage: rate_limiter_fairness [seconds per scenario]
+
+#include "rate_limiter.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace tide;
+
+constexpr int num_peers = 500;
+constexpr int block_size = 0x4000;
+
+struct peer
+{
+    std::unique_ptr<peer_rate_limiter> limiter;
+    int torrent;
+    int64_t num_bytes = 0;
+    bool is_waiting = false;
+};
+
+struct scenario
+{
+    const char* name;
+    int global_rate;
+    int num_torrents;
+    // Each torrent's limit, or unlimited.
+    std::vector<int> torrent_rates;
+    // The limit of the uTP class in each torrent (every other peer is a uTP peer).
+    int utp_rate = rate_limiter::unlimited;
+    int peer_rate = rate_limiter::unlimited;
+};
+
+/** Jain's fairness index: 1 if all got the same, 1/n if one got everything. */
+double fairness_index(const std::vector<double>& xs)
+{
+    double sum = 0;
+    double sum_of_squares = 0;
+    for(const auto x : xs) {
+        sum += x;
+        sum_of_squares += x * x;
+    }
+    return sum_of_squares == 0 ? 1 : sum * sum / (xs.size() * sum_of_squares);
+}
+
+void print_group(const char* name, const std::vector<double>& rates)
+{
+    if(rates.empty()) {
+        return;
+    }
+    double total = 0;
+    for(const auto r : rates) {
+        total += r;
+    }
+    const auto minmax = std::minmax_element(rates.begin(), rates.end());
+    std::printf("  %-14s %4zu peers  total %9.0f B/s  per peer min %7.0f max %7.0f"
+                "  fairness %.4f\n",
+            name, rates.size(), total, *minmax.first, *minmax.second,
+            fairness_index(rates));
+}
+
+void run(const scenario& s, const seconds length)
+{
+    rate_limiter global;
+    global.set_max_download_rate(s.global_rate);
+    std::vector<std::unique_ptr<torrent_rate_limiter>> torrents;
+    for(auto i = 0; i < s.num_torrents; ++i) {
+        torrents.emplace_back(std::make_unique<torrent_rate_limiter>(global));
+        torrents.back()->set_max_download_rate(s.torrent_rates[i]);
+        torrents.back()
+                ->peer_class_rate_limiter(peer_class::utp)
+                .set_max_download_rate(s.utp_rate);
+    }
+    std::vector<peer> peers(num_peers);
+    for(auto i = 0; i < num_peers; ++i) {
+        auto& p = peers[i];
+        p.torrent = i % s.num_torrents;
+        const auto c = i % 2 ? peer_class::utp : peer_class::tcp;
+        p.limiter = std::make_unique<peer_rate_limiter>(*torrents[p.torrent], c);
+        p.limiter->set_max_download_rate(s.peer_rate);
+    }
+
+    // Like `engine`, distribute quota every 100ms, and in between let each peer
+    // that isn't waiting for quota request another block's worth.
+    const auto start = clock::now();
+    while(clock::now() - start < length) {
+        for(auto& p : peers) {
+            if(p.is_waiting) {
+                continue;
+            }
+            const int n = p.limiter->request_download_quota(block_size);
+            if(n > 0) {
+                p.num_bytes += n;
+            } else {
+                p.is_waiting = true;
+                p.limiter->subscribe_for_download_quota(
+                        &p, block_size, [&p](const int n) {
+                            p.num_bytes += n;
+                            p.is_waiting = false;
+                        });
+            }
+        }
+        global.distribute_quota();
+        std::this_thread::sleep_for(milliseconds(100));
+    }
+    const double elapsed_s = to_int<microseconds>(clock::now() - start) / 1e6;
+
+    std::printf("%s (%.1fs)\n", s.name, elapsed_s);
+    std::vector<double> all;
+    for(auto t = 0; t < s.num_torrents; ++t) {
+        std::vector<double> tcp;
+        std::vector<double> utp;
+        for(auto i = 0; i < num_peers; ++i) {
+            if(peers[i].torrent == t) {
+                const double rate = peers[i].num_bytes / elapsed_s;
+                (i % 2 ? utp : tcp).push_back(rate);
+                all.push_back(rate);
+            }
+        }
+        char name[32];
+        std::snprintf(name, sizeof name, "torrent %i tcp", t);
+        print_group(name, tcp);
+        std::snprintf(name, sizeof name, "torrent %i utp", t);
+        print_group(name, utp);
+    }
+    print_group("all", all);
+    std::printf("  cap %i B/s\n\n", s.global_rate);
+}
+
+int main(int argc, char** argv)
+{
+    const seconds length(argc > 1 ? std::atoi(argv[1]) : 5);
+    const int unlimited = rate_limiter::unlimited;
+
+    run({"one torrent, 2 MB/s global cap", 2000000, 1, {unlimited}}, length);
+    run({"five torrents, one capped at 200 kB/s", 2000000, 5,
+                {200000, unlimited, unlimited, unlimited, unlimited}},
+            length);
+    run({"one torrent, uTP class capped at 500 kB/s", 2000000, 1, {unlimited},
+                500000},
+            length);
+    run({"one torrent, peers capped at 2 kB/s", 2000000, 1, {unlimited}, unlimited,
+                2000},
+            length);
+}
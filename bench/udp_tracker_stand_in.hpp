@@ -0,0 +1,126 @@
+#ifndef TIDE_BENCH_UDP_TRACKER_STAND_IN_HEADER
+#define TIDE_BENCH_UDP_TRACKER_STAND_IN_HEADER
+
+#include "endian.hpp"
+#include "socket.hpp"
+#include "time.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <asio/io_context.hpp>
+
+namespace tide {
+
+/**
+ * A minimal UDP tracker (BEP 15) on loopback for the benchmarks to announce to. It
+ * answers connect and announce requests right away, with no peers, and counts the
+ * announces it receives in each second since it was created.
+ */
+class udp_tracker_stand_in
+{
+    udp::socket socket_;
+    udp::endpoint sender_endpoint_;
+    std::array<char, 1500> receive_buffer_;
+    time_point start_time_ = clock::now();
+    std::vector<int> num_announces_per_second_;
+    int64_t num_announces_ = 0;
+
+public:
+    explicit udp_tracker_stand_in(asio::io_context& ios)
+        : socket_(ios, udp::endpoint(asio::ip::address_v4::loopback(), 0))
+    {
+        // Benchmarks send in bursts, which shouldn't be lost to a small buffer.
+        error_code ec;
+        socket_.set_option(udp::socket::receive_buffer_size(4 * 1024 * 1024), ec);
+        receive();
+    }
+
+    std::string url() const
+    {
+        return "udp://127.0.0.1:" + std::to_string(socket_.local_endpoint().port())
+                + "/announce";
+    }
+
+    int64_t num_announces() const noexcept { return num_announces_; }
+
+    const std::vector<int>& num_announces_per_second() const noexcept
+    {
+        return num_announces_per_second_;
+    }
+
+    int peak_announces_per_second() const noexcept
+    {
+        return num_announces_per_second_.empty()
+                ? 0
+                : *std::max_element(num_announces_per_second_.begin(),
+                        num_announces_per_second_.end());
+    }
+
+    void close()
+    {
+        error_code ec;
+        socket_.close(ec);
+    }
+
+private:
+    void receive()
+    {
+        socket_.async_receive_from(asio::buffer(receive_buffer_), sender_endpoint_,
+                [this](const error_code& error, const size_t size) {
+                    if(error == asio::error::operation_aborted) {
+                        return;
+                    } else if(!error) {
+                        handle_request(size);
+                    }
+                    receive();
+                });
+    }
+
+    void handle_request(const int size)
+    {
+        if(size < 16) {
+            return;
+        }
+        const char* request = receive_buffer_.data();
+        const int32_t action = endian::read_network<int32_t>(request + 8);
+        const int32_t transaction_id = endian::read_network<int32_t>(request + 12);
+        char response[20];
+        endian::write_network<int32_t>(response, action);
+        endian::write_network<int32_t>(response + 4, transaction_id);
+        if(action == 0) {
+            // The connection id is opaque to the client.
+            endian::write_network<int64_t>(response + 8, 0x5eed);
+            send(response, 16);
+        } else if((action == 1) && (size >= 98)) {
+            count_announce();
+            endian::write_network<int32_t>(response + 8, 1800); // interval
+            endian::write_network<int32_t>(response + 12, 0); // leechers
+            endian::write_network<int32_t>(response + 16, 0); // seeders
+            send(response, 20);
+        }
+    }
+
+    void count_announce()
+    {
+        const int second = to_int<seconds>(clock::now() - start_time_);
+        if(second >= int(num_announces_per_second_.size())) {
+            num_announces_per_second_.resize(second + 1, 0);
+        }
+        ++num_announces_per_second_[second];
+        ++num_announces_;
+    }
+
+    void send(const char* data, const int size)
+    {
+        error_code ec;
+        socket_.send_to(asio::buffer(data, size), sender_endpoint_, 0, ec);
+    }
+};
+
+} // tide
+
+#endif // TIDE_BENCH_UDP_TRACKER_STAND_IN_HEADER
@@ -0,0 +1,237 @@
+// Compares uTP, as implemented by `utp_socket`, with the kernel's TCP over loopback:
+// the throughput of a bulk transfer in one direction, and the round trip time of
+// small messages sent back and forth one at a time.
+//
+// usage: utp_vs_tcp [megabytes to transfer] [round trips]
+
+#include "stream_socket.hpp"
+#include "time.hpp"
+#include "utp_socket.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <asio/executor_work_guard.hpp>
+#include <asio/io_context.hpp>
+#include <asio/ip/tcp.hpp>
+
+using namespace tide;
+
+constexpr int chunk_size = 0x10000;
+constexpr int message_size = 64;
+
+/** The two ends of a connection, once established. */
+struct connection
+{
+    std::unique_ptr<stream_socket> client;
+    std::unique_ptr<stream_socket> server;
+};
+
+/** Sends `num_bytes` from `from` to `to` as fast as possible. */
+struct bulk_transfer
+{
+    stream_socket& from;
+    stream_socket& to;
+    int64_t num_bytes;
+    int64_t num_sent = 0;
+    int64_t num_received = 0;
+    std::vector<char> send_buffer = std::vector<char>(chunk_size, 'x');
+    std::vector<char> receive_buffer = std::vector<char>(chunk_size);
+
+    void send()
+    {
+        const auto n = std::min<int64_t>(chunk_size, num_bytes - num_sent);
+        if(n == 0) {
+            return;
+        }
+        from.async_write_some({asio::buffer(send_buffer.data(), n)},
+                [this](const error_code& error, const size_t n) {
+                    if(error) {
+                        std::printf("send error: %s\n", error.message().c_str());
+                        return;
+                    }
+                    num_sent += n;
+                    send();
+                });
+    }
+
+    void receive()
+    {
+        to.async_read_some(asio::buffer(receive_buffer),
+                [this](const error_code& error, const size_t n) {
+                    if(error) {
+                        std::printf("receive error: %s\n", error.message().c_str());
+                        return;
+                    }
+                    num_received += n;
+                    if(num_received < num_bytes) {
+                        receive();
+                    }
+                });
+    }
+};
+
+/** Bounces a small message between the two ends `num_round_trips` times. */
+struct ping_pong
+{
+    stream_socket& client;
+    stream_socket& server;
+    int num_round_trips;
+    int num_completed = 0;
+    std::vector<char> message = std::vector<char>(message_size, 'p');
+    std::vector<char> client_buffer = std::vector<char>(message_size);
+    std::vector<char> server_buffer = std::vector<char>(message_size);
+
+    /** Reads exactly `buffer.size()` bytes, then invokes `handler`. */
+    static void read_message(stream_socket& s, std::vector<char>& buffer, int offset,
+            std::function<void()> handler)
+    {
+        s.async_read_some(asio::buffer(buffer.data() + offset, buffer.size() - offset),
+                [&s, &buffer, offset, handler](const error_code& error, const size_t n) {
+                    if(error) {
+                        std::printf("receive error: %s\n", error.message().c_str());
+                    } else if(offset + int(n) < int(buffer.size())) {
+                        read_message(s, buffer, offset + n, std::move(handler));
+                    } else {
+                        handler();
+                    }
+                });
+    }
+
+    /** Messages are small enough to always be written in one go. */
+    void write_message(stream_socket& s)
+    {
+        s.async_write_some({asio::buffer(message)}, [](const error_code&, size_t) {});
+    }
+
+    void start()
+    {
+        serve();
+        ping();
+    }
+
+    void ping()
+    {
+        write_message(client);
+        read_message(client, client_buffer, 0, [this] {
+            if(++num_completed < num_round_trips) {
+                ping();
+            }
+        });
+    }
+
+    void serve()
+    {
+        read_message(server, server_buffer, 0, [this] {
+            write_message(server);
+            serve();
+        });
+    }
+};
+
+connection connect_tcp(asio::io_context& ios)
+{
+    tcp::acceptor acceptor(ios, tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+    tcp::socket server(ios);
+    tcp::socket client(ios);
+    int num_connected = 0;
+    const auto on_connected = [&num_connected](const error_code&) { ++num_connected; };
+    acceptor.async_accept(server, on_connected);
+    client.async_connect(acceptor.local_endpoint(), on_connected);
+    while(num_connected < 2) {
+        ios.run_one();
+    }
+    // Otherwise the small messages of the round trip test are held back by Nagle's
+    // algorithm.
+    server.set_option(tcp::no_delay(true));
+    client.set_option(tcp::no_delay(true));
+    return {std::make_unique<tcp_stream_socket>(ios, std::move(client)),
+            std::make_unique<tcp_stream_socket>(ios, std::move(server))};
+}
+
+connection connect_utp(utp_socket_manager& client_manager,
+        utp_socket_manager& server_manager)
+{
+    connection c;
+    server_manager.set_accept_handler(
+            [&c](std::unique_ptr<utp_socket> s) { c.server = std::move(s); });
+    error_code ec;
+    const auto port = server_manager.local_endpoint(ec).port();
+    auto client = std::make_unique<utp_socket>(client_manager);
+    client->open(tcp::v4(), ec);
+    bool is_connected = false;
+    client->async_connect(tcp::endpoint(asio::ip::address_v4::loopback(), port),
+            [&is_connected](const error_code& error) { is_connected = !error; });
+    auto& ios = client_manager.get_io_context();
+    while(!is_connected || !c.server) {
+        ios.run_one();
+    }
+    c.client = std::move(client);
+    return c;
+}
+
+/** Runs `ios` until `is_done` returns true, returning the time that took. */
+template <typename Predicate>
+duration run_until(asio::io_context& ios, Predicate is_done)
+{
+    const auto start = clock::now();
+    while(!is_done()) {
+        ios.run_one();
+    }
+    return clock::now() - start;
+}
+
+void measure(const char* name, asio::io_context& ios, connection& c,
+        const int64_t num_bytes, const int num_round_trips)
+{
+    bulk_transfer transfer{*c.client, *c.server, num_bytes};
+    transfer.send();
+    transfer.receive();
+    const double transfer_s
+            = to_int<microseconds>(run_until(ios, [&transfer] {
+                  return transfer.num_received >= transfer.num_bytes;
+              })) / 1e6;
+
+    ping_pong pp{*c.client, *c.server, num_round_trips};
+    pp.start();
+    const double ping_pong_us = to_int<microseconds>(run_until(ios, [&pp] {
+        return pp.num_completed >= pp.num_round_trips;
+    }));
+
+    std::printf("%-4s %8.1f MB/s  %8.1f us/round trip\n", name,
+            num_bytes / transfer_s / 1e6, ping_pong_us / num_round_trips);
+}
+
+int main(int argc, char** argv)
+{
+    const int64_t num_bytes = int64_t(argc > 1 ? std::atoi(argv[1]) : 100) * 1000000;
+    const int num_round_trips = argc > 2 ? std::atoi(argv[2]) : 10000;
+
+    asio::io_context ios;
+    // Keep `ios` from stopping whenever it runs out of work between the tests.
+    auto work = asio::make_work_guard(ios);
+    auto tcp_connection = connect_tcp(ios);
+    measure("tcp", ios, tcp_connection, num_bytes, num_round_trips);
+
+    utp_socket_manager client_manager(ios);
+    utp_socket_manager server_manager(ios);
+    error_code ec;
+    client_manager.open(0, ec);
+    if(!ec) {
+        server_manager.open(0, ec);
+    }
+    if(ec) {
+        std::printf("could not open uTP socket: %s\n", ec.message().c_str());
+        return 1;
+    }
+    auto utp_connection = connect_utp(client_manager, server_manager);
+    measure("utp", ios, utp_connection, num_bytes, num_round_trips);
+
+    // The sockets must be destroyed before their managers.
+    utp_connection = connection();
+    client_manager.close();
+    server_manager.close();
+}
@@ -45,6 +45,7 @@
 #include "tide/torrent_args.hpp"
 #include "tide/torrent_handle.hpp"
 #include "tide/torrent_info.hpp"
+#include "tide/trace.hpp"
 #include "tide/tracker.hpp"
 #include "tide/types.hpp"
 #include "tide/view.hpp"
@@ -3,9 +3,16 @@
 
 #include "alerts.hpp"
 
-#include <deque>
-#include <memory>
+#include <atomic>
+#include <cstddef> // max_align_t
+#include <cstdint>
+#include <functional> // function
+#include <memory> // unique_ptr
 #include <mutex>
+#include <new> // placement new
+#include <type_traits> // is_base_of
+#include <utility> // forward
+#include <vector>
 
 namespace tide {
 
@@ -13,48 +20,191 @@ namespace tide {
  * This is the entity through which internal components can send notifications to the
  * end user of the library. This is done with objects derived from the alert base class.
  *
- * It is thread-safe, i.e. users thread can safely retrieve the latest alerts without
- * having to do external mutual exclusion.
+ * Posting an alert is lock-free and does not allocate in the common case: alerts
+ * whose categories are not in the category mask are never constructed, the rest are
+ * constructed in an arena of the posting thread (each producer thread has its own)
+ * and passed to the consumer through a bounded multi-producer single-consumer ring.
+ * If the ring is full, new alerts are dropped (and counted) until user catches up.
+ *
+ * User retrieves alerts in batches with `pop_alerts`, and may register a handler to
+ * be woken when there are new alerts, instead of having to poll.
  */
 class alert_queue
 {
-    std::deque<std::unique_ptr<alert>> queue_;
-    std::mutex queue_mutex_;
+    // Alerts are allocated from chunks of this size (minus the chunk's header).
+    static constexpr int chunk_size = 64 * 1024;
+
+    struct producer;
+
+    struct chunk
+    {
+        // The number of live alerts in this chunk, plus one while it's the current
+        // chunk of its producer. When it drops to 0, the chunk is recycled.
+        std::atomic<int> num_refs{1};
+        int num_bytes_used = 0;
+        producer* owner;
+        alignas(std::max_align_t) char data[chunk_size];
+
+        explicit chunk(producer* p) : owner(p) {}
+    };
+
+    // The arena of a single producer thread.
+    struct producer
+    {
+        // Only accessed by the producer thread.
+        chunk* current = nullptr;
+
+        // A chunk freed by the consumer, kept so that the producer need not allocate
+        // a new one when its current chunk runs out.
+        std::atomic<chunk*> spare{nullptr};
+    };
+
+    struct cell
+    {
+        std::atomic<uint64_t> sequence;
+        alert* a;
+        chunk* c;
+    };
+
+    // The ring buffer. Its size is a power of two.
+    std::unique_ptr<cell[]> cells_;
+    uint64_t capacity_mask_;
+
+    // The producers' next position, and the consumer's next position in `cells_`.
+    alignas(64) std::atomic<uint64_t> tail_{0};
+    alignas(64) uint64_t head_ = 0;
+
+    // The alerts returned by the last `pop_alerts` call, which are destroyed on the
+    // next call.
+    std::vector<std::pair<alert*, chunk*>> popped_alerts_;
+
+    // Only alerts in these categories (see `alert::category`) are posted.
+    std::atomic<int> category_mask_{~0};
 
-    // If the number of alerts in queue_ reaches this value, new entries will push out
-    // the oldest entries in queue_.
-    int capacity_;
+    std::atomic<int> num_dropped_alerts_{0};
+
+    // Set by the consumer when it retrieves alerts. The first producer that posts an
+    // alert after that clears it and invokes `notify_handler_`.
+    std::atomic<bool> should_notify_{false};
+    std::function<void()> notify_handler_;
+    std::mutex notify_handler_mutex_;
+
+    // Each thread that posts alerts is registered here the first time it does so.
+    std::vector<std::unique_ptr<producer>> producers_;
+    std::mutex producers_mutex_;
+
+    // Unique among all alert queues ever created, so that a thread can tell which of
+    // the producers it registered with belongs to this queue.
+    const uint64_t id_;
 
 public:
-    alert_queue(const int capacity = 0) : capacity_(capacity) {}
+    /** `capacity` is rounded up to the nearest power of two. */
+    explicit alert_queue(const int capacity = 16384);
+    ~alert_queue();
+
+    alert_queue(const alert_queue&) = delete;
+    alert_queue& operator=(const alert_queue&) = delete;
+
+    int category_mask() const noexcept
+    {
+        return category_mask_.load(std::memory_order_relaxed);
+    }
+
+    void set_category_mask(const int mask) noexcept
+    {
+        category_mask_.store(mask, std::memory_order_relaxed);
+    }
+
+    /** Returns the number of alerts dropped so far because the queue was full. */
+    int num_dropped_alerts() const noexcept
+    {
+        return num_dropped_alerts_.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Returns whether alerts of type `Alert` would be posted. Components may use this
+     * to avoid gathering the data for alerts nobody wants.
+     */
+    template <typename Alert>
+    bool should_post() const noexcept
+    {
+        return (Alert::static_category & category_mask()) != 0;
+    }
 
-    /** Constructs a new alert in place. */
-    template <typename Event, typename... Args>
+    /**
+     * Constructs a new alert in place, if its categories are enabled. This may be
+     * called from any thread.
+     */
+    template <typename Alert, typename... Args>
     void emplace(Args&&... args);
 
     /**
-     * Removes and returns all alerts that have been placed in the queue in a
-     * thread-safe manner (under a mutex).
+     * Replaces the contents of `alerts` with the alerts that have been posted since
+     * the last call, in the order they were posted. The alerts are owned by the
+     * queue and stay valid until the next call to this function, so it must only be
+     * called by a single thread at a time.
+     */
+    void pop_alerts(std::vector<alert*>& alerts);
+
+    /**
+     * Registers `handler` to be invoked when an alert is posted after a call to
+     * `pop_alerts` (or after the handler is set), i.e. it is invoked at most once
+     * between two `pop_alerts` calls. The handler is invoked on the thread posting
+     * the alert, so it must be cheap and thread-safe, such as signaling a condition
+     * variable, writing to an eventfd, or posting an event to user's own event loop,
+     * which then calls `pop_alerts`.
+     */
+    void set_notify_handler(std::function<void()> handler);
+
+private:
+    /** Returns the calling thread's producer, registering it first if necessary. */
+    producer& local_producer();
+
+    /**
+     * Returns `size` bytes aligned to `alignment` in the current chunk of `p`,
+     * starting a new chunk if the current one has no room left.
      */
-    std::deque<std::unique_ptr<alert>> extract_alerts();
+    void* allocate(producer& p, const int size, const int alignment);
+
+    /** Drops a reference to `c`, recycling it if it was the last one. */
+    static void release(chunk* c) noexcept;
+
+    /** Returns false if the ring is full. */
+    bool push(alert* a, chunk* c) noexcept;
+
+    void notify();
 };
 
-template <typename Event, typename... Args>
+template <typename Alert, typename... Args>
 void alert_queue::emplace(Args&&... args)
 {
-    std::lock_guard<std::mutex> l(queue_mutex_);
-    queue_.emplace_back(std::make_unique<Event>(std::forward<Args>(args)...));
-    if(queue_.size() > capacity_) {
-        queue_.pop_front();
+    static_assert(std::is_base_of<alert, Alert>::value,
+            "only types inheriting from alert may be posted");
+    static_assert(sizeof(Alert) <= chunk_size, "alert too large for alert_queue");
+
+    if(!should_post<Alert>()) {
+        return;
     }
-}
 
-inline std::deque<std::unique_ptr<alert>> alert_queue::extract_alerts()
-{
-    std::deque<std::unique_ptr<alert>> queue;
-    std::lock_guard<std::mutex> l(queue_mutex_);
-    queue.swap(queue_);
-    return queue;
+    producer& p = local_producer();
+    void* buffer = allocate(p, sizeof(Alert), alignof(Alert));
+    Alert* a = new(buffer) Alert(std::forward<Args>(args)...);
+    // The producer holds a reference to its current chunk, so the chunk can't be
+    // recycled before the alert's reference is added.
+    chunk* c = p.current;
+    c->num_refs.fetch_add(1, std::memory_order_relaxed);
+
+    if(!push(a, c)) {
+        a->~Alert();
+        release(c);
+        num_dropped_alerts_.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    if(should_notify_.load(std::memory_order_relaxed)
+            && should_notify_.exchange(false, std::memory_order_acq_rel)) {
+        notify();
+    }
 }
 
 } // namespace tide
@@ -1,6 +1,7 @@
 #ifndef TIDE_ALERTS_HEADER
 #define TIDE_ALERTS_HEADER
 
+#include "counters.hpp"
 #include "disk_io.hpp"
 #include "metainfo.hpp"
 #include "peer_session.hpp"
@@ -44,6 +45,11 @@ struct alert
     alert& operator=(alert&&) = default;
     virtual ~alert() {}
 
+    /**
+     * Every concrete alert type also declares its categories in a static
+     * `static_category` constant, which this returns, so that `alert_queue` can
+     * discard alerts of unwanted categories without constructing them.
+     */
     virtual int category() const noexcept = 0;
 };
 
@@ -51,8 +57,9 @@ struct alert
 struct error_alert : public alert
 {
     std::error_code error;
+    static constexpr int static_category = category::error;
     explicit error_alert(std::error_code ec) : error(ec) {}
-    int category() const noexcept override { return category::error; }
+    int category() const noexcept override { return static_category; }
 };
 
 // -- individual torrent related alerts --
@@ -61,8 +68,9 @@ struct error_alert : public alert
 struct torrent_alert : public alert
 {
     torrent_handle handle;
+    static constexpr int static_category = torrent;
     explicit torrent_alert(torrent_handle h) : handle(h) {}
-    int category() const noexcept override { return torrent; }
+    int category() const noexcept override { return static_category; }
 };
 
 struct torrent_added_alert final : public torrent_alert
@@ -87,11 +95,11 @@ struct torrent_started_alert final : public torrent_alert
 
 struct torrent_stats_alert final : public torrent_alert
 {
+    // Only in the stats category, so that these may be switched off without
+    // also switching off the rest of the torrent alerts.
+    static constexpr int static_category = category::stats;
     explicit torrent_stats_alert(torrent_handle h) : torrent_alert(h) {}
-    int category() const noexcept override
-    {
-        return torrent_alert::category() | category::stats;
-    }
+    int category() const noexcept override { return static_category; }
 };
 
 struct download_complete_alert final : public torrent_alert
@@ -112,10 +120,29 @@ struct file_complete_alert final : public torrent_alert
     {}
 };
 
+/** Posted when we don't have a time critical piece by its deadline. */
+struct piece_deadline_missed_alert final : public torrent_alert
+{
+    piece_index_t piece;
+    time_point deadline;
+
+    piece_deadline_missed_alert(torrent_handle h, piece_index_t p, time_point d)
+        : torrent_alert(h), piece(p), deadline(d)
+    {}
+
+    static constexpr int static_category =
+            torrent_alert::static_category | category::performance;
+
+    int category() const noexcept override { return static_category; }
+};
+
 // -- tracker related alerts --
 
 struct tracker_alert : public alert
-{};
+{
+    static constexpr int static_category = tracker;
+    int category() const noexcept override { return static_category; }
+};
 
 // -- individual peer related alerts --
 
@@ -124,8 +151,9 @@ struct peer_alert : public alert
 {
     tcp::endpoint endpoint;
     peer_id_t peer_id;
+    static constexpr int static_category = peer;
     peer_alert(tcp::endpoint ep, peer_id_t pid) : endpoint(std::move(ep)), peer_id(pid) {}
-    int category() const noexcept override { return peer; }
+    int category() const noexcept override { return static_category; }
 };
 
 struct peer_stats_alert final : public peer_alert
@@ -136,10 +164,8 @@ struct peer_stats_alert final : public peer_alert
     //, stats(std::move(s))
     {}
 
-    int category() const noexcept override
-    {
-        return peer_alert::category() | category::stats;
-    }
+    static constexpr int static_category = category::stats;
+    int category() const noexcept override { return static_category; }
 };
 
 // -- storage related alerts --
@@ -147,7 +173,8 @@ struct peer_stats_alert final : public peer_alert
 /** Base class for storage related alerts. */
 struct storage_alert : public alert
 {
-    int category() const noexcept override { return storage; }
+    static constexpr int static_category = storage;
+    int category() const noexcept override { return static_category; }
 };
 
 /*
@@ -168,11 +195,24 @@ struct disk_io_stats final : public stats_alert
 };
 */
 
+/**
+ * Posted every `settings::stats_aggregation_interval` with a snapshot of engine's
+ * performance counters, which may be indexed with `counters::id`.
+ */
+struct counters_alert final : public alert
+{
+    counters::snapshot_type values;
+    static constexpr int static_category = category::stats;
+    explicit counters_alert(counters::snapshot_type v) : values(v) {}
+    int category() const noexcept override { return static_category; }
+};
+
 struct metainfo_parsed_alert final : public alert
 {
     class metainfo metainfo;
+    static constexpr int static_category = async_result;
     metainfo_parsed_alert(class metainfo m) : metainfo(std::move(m)) {}
-    int category() const noexcept { return async_result; }
+    int category() const noexcept override { return static_category; }
 };
 
 /** Convenience method to cast an alert to the specified one. */
@@ -0,0 +1,157 @@
+#ifndef TIDE_ANNOUNCE_SCHEDULER_HEADER
+#define TIDE_ANNOUNCE_SCHEDULER_HEADER
+
+#include "time.hpp"
+
+#include <cstdint>
+#include <functional> // function
+#include <map>
+#include <memory> // shared_ptr
+#include <string>
+#include <utility> // pair
+#include <vector>
+
+namespace tide {
+
+class tracker;
+
+/**
+ * Torrents don't announce to trackers at will, but through this `engine` wide
+ * scheduler, which bounds the number of announces that are in flight to, and the
+ * number of announces that are sent per second to, each tracker. Otherwise, with
+ * many torrents starting at once (e.g. after a restart or when the network comes
+ * back up), they'd all announce at the same time and trackers would throttle or
+ * ban us.
+ *
+ * Announces are also spread out in time: each is delayed by a random amount of up to
+ * `max_jitter`, except for urgent ones (those that are forced or that stop a
+ * torrent), so that torrents that become due in the same moment (such as all
+ * torrents sending their `started` event after a restart) don't stay in lockstep. Of
+ * the announces that are due, those with the lowest priority value are sent first.
+ *
+ * A dispatched announce is in flight for as long as the `in_flight_announce` its
+ * handler is given is kept alive.
+ */
+class announce_scheduler
+{
+public:
+    // A unique value used to identify a subscriber.
+    using token_type = void*;
+    constexpr static int unlimited = -1;
+
+    // The priority of forced announces and of those that stop a torrent. These are
+    // not delayed.
+    constexpr static int urgent = 0;
+
+    /**
+     * Concludes the announce when its last copy is destroyed, so that an announce
+     * whose handler is dropped by the tracker (e.g. because it was aborted) without
+     * being invoked doesn't take up one of the tracker's in flight slots forever.
+     */
+    using in_flight_announce = std::shared_ptr<void>;
+
+private:
+    int max_in_flight_per_tracker_ = unlimited;
+    int max_announces_per_second_per_tracker_ = unlimited;
+    duration max_jitter_ = seconds(0);
+
+    // A token may have several announces scheduled with a tracker, as long as they
+    // are for different events.
+    using announce_key = std::pair<token_type, int>;
+
+    struct announce
+    {
+        announce_key key;
+        int priority;
+        time_point due_time;
+        std::function<void(in_flight_announce)> handler;
+    };
+
+    struct tracker_queue
+    {
+        // The announces whose delay hasn't passed yet, as a min-heap on `due_time`.
+        std::vector<announce> waiting;
+
+        // The announces that are due, as a min-heap on `priority`, then `due_time`.
+        std::vector<announce> ready;
+
+        // The priority of each announce that is in either of the heaps.
+        std::map<announce_key, int> scheduled;
+
+        // Shared with the `in_flight_announce`s of the dispatched announces, which
+        // decrement it (unless the scheduler is gone by then).
+        std::shared_ptr<int> num_in_flight = std::make_shared<int>(0);
+
+        // The number of announces that may be sent right away. This is refilled at
+        // the per second rate, up to a second's worth.
+        double num_available_announces = 0;
+        time_point last_refill_time;
+    };
+
+    // Trackers are shared by all torrents, so they're identified by their URL (rather
+    // than the address of their instance, which may be reused by another tracker once
+    // the instance is gone). A queue is removed once it has no more announces and its
+    // limits no longer hold anything back.
+    std::map<std::string, tracker_queue> trackers_;
+
+    int64_t num_dispatched_announces_ = 0;
+
+public:
+    int max_in_flight_per_tracker() const noexcept { return max_in_flight_per_tracker_; }
+    int max_announces_per_second_per_tracker() const noexcept
+    {
+        return max_announces_per_second_per_tracker_;
+    }
+    duration max_jitter() const noexcept { return max_jitter_; }
+
+    /** `n` may be `unlimited`. */
+    void set_max_in_flight_per_tracker(const int n);
+    void set_max_announces_per_second_per_tracker(const int n);
+    void set_max_jitter(const duration d);
+
+    /** Returns the number of announces waiting to be dispatched, to all trackers. */
+    int num_scheduled_announces() const noexcept;
+    int64_t num_dispatched_announces() const noexcept
+    {
+        return num_dispatched_announces_;
+    }
+
+    /**
+     * Schedules `handler`, which is expected to send an announce to `tracker`, to be
+     * invoked once the announce is due and the limits of `tracker` allow it. A lower
+     * `priority` value means the announce is more important. `event` is opaque to
+     * the scheduler, and only serves to tell apart a token's announces (torrents pass
+     * their tracker event), so that e.g. a regular announce can't replace a pending
+     * `completed` event.
+     *
+     * If `token` already has an announce for `event` scheduled with `tracker`, this
+     * is a no-op, unless `priority` is more urgent than that of the scheduled
+     * announce, in which case the scheduled announce is made more urgent, but never
+     * delayed.
+     *
+     * `handler` must hold on to the `in_flight_announce` it's given until the
+     * announce completes.
+     */
+    void schedule(const token_type token, const int event, const tracker& tracker,
+            const int priority, std::function<void(in_flight_announce)> handler);
+
+    /** Cancels all announces scheduled by `token`. */
+    void unsubscribe(const token_type token);
+
+    /**
+     * Invokes the handlers of the announces that are due, as far as the limits of
+     * their trackers allow.
+     *
+     * This must be called at regular intervals (currently done by `engine`).
+     */
+    void dispatch();
+
+private:
+    void make_more_urgent(tracker_queue& queue, const announce_key& key,
+            const int priority, const time_point now);
+    void refill(tracker_queue& queue, const time_point now);
+};
+
+} // tide
+
+#endif // TIDE_ANNOUNCE_SCHEDULER_HEADER
@@ -6,7 +6,6 @@
 
 #include <cassert>
 #include <cstdint>
-#include <cstdlib> // atoi
 #include <iterator>
 #include <memory>
 #include <optional>
@@ -32,8 +31,10 @@ enum class bencode_errc
     bstring_missing_colon,
     bnumber_trailing_zeros,
     bnumber_missing_end_token,
+    bnumber_invalid,
     out_of_range,
     unknown_type,
+    too_deeply_nested,
 };
 
 struct bencode_error_category : public error_category
@@ -117,6 +118,22 @@ struct btoken
 
 namespace detail {
 
+/**
+ * The state that is shared by all containers decoded from the same buffer: the
+ * tokens describing the entire object tree and the bencoded buffer itself. The buffer
+ * is either owned (when decoding a std::string, it's moved in here), or borrowed,
+ * in which case it's decoded in place and `owner`, if set, keeps it alive (e.g. the
+ * memory mapping of a file).
+ */
+struct decoded_buffer
+{
+    std::vector<btoken> tokens;
+    std::string owned_source;
+    std::shared_ptr<const void> owner;
+    // Refers to either owned_source or the borrowed buffer.
+    string_view source;
+};
+
 class bcontainer;
 void format_map(std::stringstream& ss, const bcontainer& map,
         const btoken* head = nullptr, int nesting_level = 0);
@@ -125,22 +142,21 @@ void format_list(std::stringstream& ss, const bcontainer& list,
 
 /**
  * Defines common operations for container type bencode classes (list, map).
- * It holds a contiguous sequence of btokens and the raw bencoded string and provides
- * shared_ptr semantics, so for any given copy there exists only a single token list
- * and encoded string. Since all belements are read only, this avoids memory churn
- * and space overhead and is cache friendly.
+ * It refers to a contiguous sequence of btokens and the raw bencoded string and
+ * provides shared_ptr semantics, so for any given copy there exists only a single
+ * token list and encoded string. Since all belements are read only, this avoids
+ * memory churn and space overhead and is cache friendly.
  */
 class bcontainer
 {
-    // This is the entire list of tokens, no matter if the container is nested and
-    // only needs a subset of it. This is to always keep the reference count of
-    // tokens_ (and encoded_) at at least one. To refer to the actual start of the
-    // container, use head_.
-    std::shared_ptr<std::vector<btoken>> tokens_;
-    std::shared_ptr<const std::string> encoded_;
+    // This holds the entire list of tokens, no matter if the container is nested and
+    // only needs a subset of it. This is to always keep the reference count of the
+    // tokens and the encoded string at at least one. To refer to the actual start of
+    // the container, use head_.
+    std::shared_ptr<const decoded_buffer> buffer_;
 
     // Both container types (list, map) have a head token that defines the start and
-    // size of the container. head_ points into tokens_, to the btoken that's the
+    // size of the container. head_ points into the tokens, to the btoken that's the
     // conceptual head of this container.
     const btoken* head_ = nullptr;
 
@@ -149,15 +165,13 @@ protected:
 
     /**
      * This ctor is called the first time a container is decoded from a bencoded
-     * string, it stores the tokens buffer, the encoded string and initializes the
-     * head of the container to the first element in the tokens buffer.
+     * string, it stores the decoded buffer and initializes the head of the container
+     * to the first element in the tokens buffer.
      */
-    bcontainer(std::vector<btoken>&& tokens, std::string&& encoded)
-        : tokens_(std::make_shared<std::vector<btoken>>(std::move(tokens)))
-        , encoded_(std::make_shared<const std::string>(std::move(encoded)))
-        , head_(tokens_->data())
+    explicit bcontainer(std::shared_ptr<const decoded_buffer> buffer)
+        : buffer_(std::move(buffer)), head_(buffer_->tokens.data())
     {
-        assert(!tokens_->empty());
+        assert(!buffer_->tokens.empty());
     }
 
     /**
@@ -165,8 +179,7 @@ protected:
      * enclosing container (regardless of actual type (list, map), because both use
      * only the fields in bcontainer, so slicing the derived containers is OK).
      */
-    bcontainer(const bcontainer& b, const btoken* head)
-        : tokens_(b.tokens_), encoded_(b.encoded_), head_(head)
+    bcontainer(const bcontainer& b, const btoken* head) : buffer_(b.buffer_), head_(head)
     {}
 
     /** Returns the head of this container. */
@@ -183,14 +196,10 @@ protected:
     }
 
 public:
-    bcontainer(const bcontainer& other)
-        : tokens_(other.tokens_), encoded_(other.encoded_), head_(other.head_)
-    {}
+    bcontainer(const bcontainer& other) : buffer_(other.buffer_), head_(other.head_) {}
 
     bcontainer(bcontainer&& other)
-        : tokens_(std::move(other.tokens_))
-        , encoded_(std::move(other.encoded_))
-        , head_(other.head_)
+        : buffer_(std::move(other.buffer_)), head_(other.head_)
     {
         other.head_ = nullptr;
     }
@@ -198,8 +207,7 @@ public:
     bcontainer& operator=(const bcontainer& other)
     {
         if(this != &other) {
-            tokens_ = other.tokens_;
-            encoded_ = other.encoded_;
+            buffer_ = other.buffer_;
             head_ = other.head_;
         }
         return *this;
@@ -208,9 +216,8 @@ public:
     bcontainer& operator=(bcontainer&& other)
     {
         if(this != &other) {
-            tokens_ = std::move(other.tokens_);
-            encoded_ = std::move(other.encoded_);
-            head_ = std::move(other.head_);
+            buffer_ = std::move(other.buffer_);
+            head_ = other.head_;
             other.head_ = nullptr;
         }
         return *this;
@@ -220,8 +227,11 @@ public:
 
     bool empty() const noexcept { return size() == 0; }
 
-    /** Returns a refernce to the raw bencoded string of the entire container. */
-    const std::string& source() const noexcept { return *encoded_; }
+    /** Returns a view of the raw bencoded string of the entire (root) container. */
+    string_view source() const noexcept
+    {
+        return buffer_ ? buffer_->source : string_view();
+    }
 
     /**
      * Returns a substring (view) of the portion of the source string that is the
@@ -237,25 +247,48 @@ public:
             const btoken* head, int nesting_level);
 };
 
+/**
+ * Parses the unsigned decimal number in [first, last). The range has already been
+ * validated by the decoder to consist only of digits and to fit in an int64_t, so
+ * there is no need to look for the end of the number or to check for overflow.
+ */
+inline int64_t parse_digits(const char* first, const char* const last) noexcept
+{
+    int64_t n = 0;
+    for(; first != last; ++first) {
+        n = n * 10 + (*first - '0');
+    }
+    return n;
+}
+
 inline string_view make_string_view_from_token(
-        const std::string& encoded, const btoken& token)
+        const string_view encoded, const btoken& token)
 {
-    assert(token.offset < encoded.length());
-    const int str_length = std::atoi(&encoded[token.offset]);
-    const int str_start = token.offset + token.length;
-    assert(str_start + str_length <= encoded.length());
-    return string_view(encoded.c_str() + str_start, str_length);
+    assert(token.type == btype::string);
+    assert(token.offset + token.length <= encoded.length());
+    // The header is the string's length followed by a colon.
+    const char* const header = encoded.data() + token.offset;
+    const int str_length = parse_digits(header, header + token.length - 1);
+    assert(token.offset + token.length + str_length <= encoded.length());
+    return string_view(header + token.length, str_length);
 }
 
-inline std::string make_string_from_token(const std::string& encoded, const btoken& token)
+inline std::string make_string_from_token(const string_view encoded, const btoken& token)
 {
     return make_string_view_from_token(encoded, token);
 }
 
-inline int64_t make_number_from_token(const std::string& encoded, const btoken& token)
+inline int64_t make_number_from_token(const string_view encoded, const btoken& token)
 {
-    assert(token.offset < encoded.length());
-    return atol(encoded.c_str() + token.offset + 1);
+    assert(token.type == btype::number);
+    assert(token.offset + token.length <= encoded.length());
+    // Skip the 'i' header and the 'e' end token.
+    const char* const first = encoded.data() + token.offset + 1;
+    const char* const last = encoded.data() + token.offset + token.length - 1;
+    if(*first == '-') {
+        return -parse_digits(first + 1, last);
+    }
+    return parse_digits(first, last);
 }
 
 } // namespace detail
@@ -347,8 +380,8 @@ public:
 
     blist() = default;
 
-    blist(std::vector<btoken>&& tokens, std::string&& encoded)
-        : bcontainer(std::move(tokens), std::move(encoded))
+    explicit blist(std::shared_ptr<const detail::decoded_buffer> buffer)
+        : bcontainer(std::move(buffer))
     {}
 
     blist(const bcontainer& b, const btoken* list_head) : bcontainer(b, list_head) {}
@@ -540,8 +573,8 @@ class bmap final : public detail::bcontainer, public belement
 public:
     bmap() = default;
 
-    bmap(std::vector<btoken>&& tokens, std::string&& encoded)
-        : bcontainer(std::move(tokens), std::move(encoded))
+    explicit bmap(std::shared_ptr<const detail::decoded_buffer> buffer)
+        : bcontainer(std::move(buffer))
     {}
 
     bmap(const detail::bcontainer& b, const btoken* map_head) : bcontainer(b, map_head) {}
@@ -730,6 +763,16 @@ inline std::ostream& operator<<(std::ostream& out, const bmap& b)
 bmap decode_bmap(std::string s);
 bmap decode_bmap(std::string s, error_code& error);
 
+/**
+ * Decodes the bencoded dictionary in `buffer` in place, i.e. without copying it.
+ * The resulting bmap (and all containers extracted from it) refers to `buffer`, so
+ * the buffer must outlive them, unless it's kept alive by `owner`, which is shared by
+ * the resulting containers. `owner` may be null if the bmap is only used while the
+ * buffer is known to be alive (e.g. when parsing a message in its receive handler).
+ */
+bmap decode_bmap(string_view buffer, std::shared_ptr<const void> owner,
+        error_code& error);
+
 /**
  * Decodes a bencoded list into a blist instance.
  * The resulting blist instance takes ownership of the intput string.
@@ -737,6 +780,10 @@ bmap decode_bmap(std::string s, error_code& error);
 blist decode_blist(std::string s);
 blist decode_blist(std::string s, error_code& error);
 
+/** The in place counterpart of decode_blist, see the in place decode_bmap overload. */
+blist decode_blist(string_view buffer, std::shared_ptr<const void> owner,
+        error_code& error);
+
 /**
  * Returns one of the four bencode types. If the parsed type is a single bnumber or
  * bstring, the source string is discarded, whereas if the parsed type is a container,
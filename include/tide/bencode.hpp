@@ -10,6 +10,52 @@
 
 namespace tide {
 
+/**
+ * Writes bencoded values straight into a caller supplied buffer, by appending to it,
+ * rather than building up an intermediate representation like bmap_encoder does.
+ * The buffer may be cleared and reused for the next message, so once it's grown
+ * large enough, encoding doesn't allocate at all.
+ *
+ * Map keys are not sorted for us, they must be written in lexicographical order
+ * (as bencode requires), which is easy when the keys are known beforehand, i.e. when
+ * the message has a fixed schema (e.g. resume data or extension messages). The order
+ * is verified in debug builds. Use bmap_encoder if the keys are not known in advance.
+ *
+ * E.g. the extended handshake is written as:
+ *   std::string buffer;
+ *   bencoder(buffer).begin_map()
+ *       .key("m").begin_map().key("ut_pex").number(1).end_map()
+ *       .key("p").number(port)
+ *       .end_map();
+ */
+class bencoder
+{
+    std::string& buffer_;
+
+#ifndef NDEBUG
+    // The last key written in each of the currently open maps (innermost last), to
+    // verify that keys are written in order.
+    std::vector<std::string> last_keys_;
+#endif // NDEBUG
+
+public:
+    explicit bencoder(std::string& buffer) : buffer_(buffer) {}
+
+    std::string& buffer() noexcept { return buffer_; }
+
+    bencoder& number(const int64_t n);
+    bencoder& string(string_view s);
+
+    bencoder& begin_list();
+    bencoder& end_list();
+
+    bencoder& begin_map();
+    bencoder& end_map();
+
+    /** Writes a map key, which must be greater than the previous key in this map. */
+    bencoder& key(string_view k);
+};
+
 std::string bencode_string(string_view s);
 std::string bencode_number(const int64_t);
 
@@ -1,8 +1,11 @@
 #ifndef TIDE_BITFIELD_HEADER
 #define TIDE_BITFIELD_HEADER
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <iterator>
 #include <limits>
 #include <stdexcept>
@@ -20,11 +23,17 @@ namespace tide {
  * By calling data(), the underlying byte array is returned, which can be used to send
  * the bitfield over the wire (this means the excess bits are always kept zero, as
  * mandated by the protocol).
+ *
+ * Bulk operations (counting, the bitwise operators, finding set bits) work on 64-bit
+ * words rather than individual bytes or bits, as bitfields of large torrents may have
+ * millions of bits.
  */
 struct bitfield
 {
     class reference;
     class const_iterator;
+    class set_bit_iterator;
+    struct set_bit_range;
 
     using value_type = bool;
     using difference_type = std::ptrdiff_t;
@@ -34,6 +43,10 @@ struct bitfield
     using const_pointer = const value_type*;
     using const_reverse_iterator = std::reverse_iterator<const_iterator>;
     using block_type = uint8_t;
+    using word_type = uint64_t;
+
+    // Returned by find_first and find_next if there are no more set bits.
+    static constexpr size_type npos = size_type(-1);
 
 private:
     std::vector<block_type> blocks_;
@@ -157,24 +170,23 @@ public:
 
     bool are_all_set() const noexcept
     {
-        static constexpr auto all_set = std::numeric_limits<block_type>::max();
-        const size_type last_block = blocks_.size() - 1;
-        for(size_type i = 0; i < last_block; ++i) {
-            if(blocks_[i] != all_set) {
-                return false;
-            }
-        }
-        // need to check the last block separately because of the zerod out excess bits
-        const block_type last_block_mask = ~block_type(0) << num_excess_bits();
-        return blocks_[last_block] == last_block_mask;
+        // Since the excess bits are always zero, all bits are set iff all but those
+        // are set.
+        return count() == size();
     }
 
     bool are_any_set() const noexcept { return !are_none_set(); }
 
     bool are_none_set() const noexcept
     {
-        for(const auto& block : blocks_) {
-            if(block != 0) {
+        const size_type num_full_words = blocks_.size() / sizeof(word_type);
+        for(size_type i = 0; i < num_full_words; ++i) {
+            if(load_word(blocks_.data(), i) != 0) {
+                return false;
+            }
+        }
+        for(auto i = num_full_words * sizeof(word_type); i < blocks_.size(); ++i) {
+            if(blocks_[i] != 0) {
                 return false;
             }
         }
@@ -213,17 +225,83 @@ public:
     const_iterator cend() const noexcept { return const_iterator(*this, num_bits_); }
 
     /** Returns the Hamming weight of this bitfield. */
-    size_type count() const
+    size_type count() const noexcept
     {
+        const size_type num_full_words = blocks_.size() / sizeof(word_type);
         size_type n = 0;
-        for(size_type i = 0; i < size(); ++i) {
-            if((*this)[i]) {
-                ++n;
-            }
+        for(size_type i = 0; i < num_full_words; ++i) {
+            n += __builtin_popcountll(load_word(blocks_.data(), i));
+        }
+        for(auto i = num_full_words * sizeof(word_type); i < blocks_.size(); ++i) {
+            n += __builtin_popcount(blocks_[i]);
         }
         return n;
     }
 
+    /** Returns the number of 64-bit words needed to hold all bits. */
+    size_type num_words() const noexcept
+    {
+        return (num_bits_ + bits_per_word() - 1) / bits_per_word();
+    }
+
+    /**
+     * Returns bits [i * 64, i * 64 + 64) as a single word, the first of which is in
+     * the word's most significant bit. Bits past the end are zero. This is meant for
+     * combining several bitfields one word at a time without creating temporaries.
+     */
+    word_type word(const size_type i) const noexcept
+    {
+        assert(i < num_words());
+        const size_type begin = i * sizeof(word_type);
+        if(begin + sizeof(word_type) <= blocks_.size()) {
+            // The first block must end up in the most significant byte, i.e. this is
+            // a big endian load.
+            const word_type w = load_word(blocks_.data(), i);
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+            return __builtin_bswap64(w);
+#else
+            return w;
+#endif
+        }
+        word_type w = 0;
+        const size_type n = blocks_.size() - begin;
+        for(size_type b = 0; b < n; ++b) {
+            w = (w << 8) | blocks_[begin + b];
+        }
+        return w << 8 * (sizeof(word_type) - n);
+    }
+
+    /** Returns the index of the first set bit, or npos if none are set. */
+    size_type find_first() const noexcept { return find_next(0); }
+
+    /** Returns the index of the first set bit at or after `bit`, or npos. */
+    size_type find_next(const size_type bit) const noexcept
+    {
+        if(bit >= size()) {
+            return npos;
+        }
+        size_type i = bit / bits_per_word();
+        // Mask off the bits before `bit` in its word.
+        word_type w = word(i) & (~word_type(0) >> (bit % bits_per_word()));
+        const size_type n = num_words();
+        while(w == 0) {
+            if(++i == n) {
+                return npos;
+            }
+            w = word(i);
+        }
+        // The first bit is the most significant, so count the leading zeros.
+        return i * bits_per_word() + __builtin_clzll(w);
+    }
+
+    /**
+     * Returns a range over the indices of the set bits, in ascending order, which
+     * skips unset bits a word at a time:
+     *
+     * for(const auto piece : pieces.set_bits()) { ... }
+     */
+    set_bit_range set_bits() const noexcept;
+
     std::string to_string() const
     {
         std::string s(size(), '0');
@@ -242,40 +320,25 @@ public:
         return b;
     }
 
-    bitfield& operator&=(const bitfield& other)
+    bitfield& operator&=(const bitfield& other) noexcept
     {
-        const size_type end = std::min(blocks_.size(), other.blocks_.size());
-        for(size_type i = 0; i < end; ++i) {
-            blocks_[i] &= other.blocks_[i];
-        }
-        return *this;
+        return combine(other, [](auto a, auto b) { return a & b; });
     }
 
-    bitfield& operator|=(const bitfield& other)
+    bitfield& operator|=(const bitfield& other) noexcept
     {
-        const size_type end = std::min(blocks_.size(), other.blocks_.size());
-        for(size_type i = 0; i < end; ++i) {
-            blocks_[i] |= other.blocks_[i];
-        }
-        return *this;
+        return combine(other, [](auto a, auto b) { return a | b; });
     }
 
-    bitfield& operator^=(const bitfield& other)
+    bitfield& operator^=(const bitfield& other) noexcept
     {
-        const size_type end = std::min(blocks_.size(), other.blocks_.size());
-        for(size_type i = 0; i < end; ++i) {
-            blocks_[i] ^= other.blocks_[i];
-        }
-        return *this;
+        return combine(other, [](auto a, auto b) { return a ^ b; });
     }
 
-    bitfield& operator-=(const bitfield& other)
+    /** Clears the bits that are set in `other`, i.e. computes the set difference. */
+    bitfield& operator-=(const bitfield& other) noexcept
     {
-        const size_type end = std::min(blocks_.size(), other.blocks_.size());
-        for(size_type i = 0; i < end; ++i) {
-            blocks_[i] = ~other.blocks_[i];
-        }
-        return *this;
+        return combine(other, [](auto a, auto b) { return a & ~b; });
     }
 
     // TODO
@@ -321,6 +384,50 @@ public:
     }
 
 private:
+    /**
+     * Applies `op` to the corresponding blocks of this and `other` in place. Blocks
+     * are processed in words, which compilers readily vectorize, and only the blocks
+     * that don't make up a full word are processed one by one.
+     */
+    template <typename Op>
+    bitfield& combine(const bitfield& other, Op op) noexcept
+    {
+        const size_type n = std::min(blocks_.size(), other.blocks_.size());
+        const size_type num_full_words = n / sizeof(word_type);
+        block_type* a = blocks_.data();
+        const block_type* b = other.blocks_.data();
+        for(size_type i = 0; i < num_full_words; ++i) {
+            store_word(a, i, op(load_word(a, i), load_word(b, i)));
+        }
+        for(auto i = num_full_words * sizeof(word_type); i < n; ++i) {
+            a[i] = block_type(op(a[i], b[i]));
+        }
+        return *this;
+    }
+
+    /**
+     * Loads and stores the `i`th word of blocks in memory order, which, unlike `word`,
+     * doesn't preserve the order of bits but is sufficient for bitwise operations and
+     * counting.
+     */
+    static word_type load_word(const block_type* blocks, const size_type i) noexcept
+    {
+        word_type w;
+        std::memcpy(&w, blocks + i * sizeof(word_type), sizeof(word_type));
+        return w;
+    }
+
+    static void store_word(
+            block_type* blocks, const size_type i, const word_type w) noexcept
+    {
+        std::memcpy(blocks + i * sizeof(word_type), &w, sizeof(word_type));
+    }
+
+    static constexpr size_type bits_per_word() noexcept
+    {
+        return sizeof(word_type) * 8;
+    }
+
     static constexpr size_type num_blocks_for(const size_type num_bits) noexcept
     {
         return std::ceil(double(num_bits) / bits_per_block());
@@ -539,6 +646,67 @@ public:
     };
 };
 
+class bitfield::set_bit_iterator
+{
+    const bitfield* bitfield_;
+    size_type bit_;
+
+public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = size_type;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const size_type*;
+    using reference = size_type;
+
+    set_bit_iterator(const bitfield& bitfield, size_type bit)
+        : bitfield_(&bitfield), bit_(bit)
+    {}
+
+    size_type operator*() const noexcept { return bit_; }
+
+    set_bit_iterator& operator++() noexcept
+    {
+        bit_ = bitfield_->find_next(bit_ + 1);
+        return *this;
+    }
+
+    set_bit_iterator operator++(int) noexcept
+    {
+        auto tmp(*this);
+        ++*this;
+        return tmp;
+    }
+
+    friend bool operator==(
+            const set_bit_iterator& a, const set_bit_iterator& b) noexcept
+    {
+        return a.bit_ == b.bit_;
+    }
+
+    friend bool operator!=(
+            const set_bit_iterator& a, const set_bit_iterator& b) noexcept
+    {
+        return !(a == b);
+    }
+};
+
+struct bitfield::set_bit_range
+{
+    const bitfield* bits;
+
+    set_bit_iterator begin() const noexcept
+    {
+        return set_bit_iterator(*bits, bits->find_first());
+    }
+
+    set_bit_iterator end() const noexcept { return set_bit_iterator(*bits, npos); }
+};
+
+inline bitfield::set_bit_range bitfield::set_bits() const noexcept
+{
+    return set_bit_range{this};
+}
+
 inline void swap(bitfield& a, bitfield& b)
 {
     using std::swap;
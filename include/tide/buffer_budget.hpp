@@ -0,0 +1,137 @@
+#ifndef TIDE_BUFFER_BUDGET_HEADER
+#define TIDE_BUFFER_BUDGET_HEADER
+
+#include "throughput_rate.hpp"
+
+#include <deque>
+#include <functional> // function
+
+namespace tide {
+
+/**
+ * Each `peer_session` has a receive and a send buffer which, left to their own
+ * devices, may grow up to `peer_session_settings::max_receive_buffer_size` and
+ * `max_send_buffer_size`, respectively. With thousands of connections this may add
+ * up to much more memory than is available, so all sessions pay for their buffers
+ * out of this single `engine` wide budget.
+ *
+ * While less than half of the budget is in use, sessions may grow their buffers
+ * freely. Past that point each session is entitled to a share of the budget that is
+ * proportional to its share of the engine's total throughput in that direction, so
+ * fast sessions keep large buffers while idle ones are expected to shrink theirs.
+ * When the budget is exhausted sessions stop reading from their sockets and stop
+ * issuing new requests until memory is released by others, at which point those
+ * that subscribed are resumed.
+ *
+ * All values are in bytes.
+ */
+class buffer_budget
+{
+public:
+    // A unique value used to identify a subscriber.
+    using token_type = void*;
+    constexpr static int unlimited = -1;
+
+    // Regardless of its throughput, a session is always allowed to hold this much
+    // memory for each of its buffers, so that it can receive a full block message
+    // plus some protocol chatter. Without this a session could stall in the middle
+    // of a message waiting for memory that may never be released.
+    constexpr static int min_session_share = 0x4000 + 13 + 128;
+
+private:
+    // The maximum number of bytes all sessions' buffers combined may occupy.
+    int capacity_ = unlimited;
+
+    // The number of bytes currently held by sessions. This may temporarily exceed
+    // `capacity_` as sessions are always granted `min_session_share` bytes and
+    // because shrinking `capacity_` does not forcibly reclaim memory.
+    int num_reserved_bytes_ = 0;
+
+    // The aggregate throughput of all sessions, used to determine what share of the
+    // budget an individual session is entitled to.
+    throughput_rate download_rate_;
+    throughput_rate upload_rate_;
+
+    struct subscriber
+    {
+        token_type token;
+        std::function<void()> handler;
+    };
+
+    // Sessions that could not reserve memory wait here until some is released.
+    std::deque<subscriber> subscribers_;
+
+public:
+    int capacity() const noexcept { return capacity_; }
+    int num_reserved_bytes() const noexcept { return num_reserved_bytes_; }
+
+    /** Returns the number of bytes that may still be reserved, or `unlimited`. */
+    int num_available_bytes() const noexcept;
+
+    /** Returns true if no more memory may be reserved until some is released. */
+    bool is_exhausted() const noexcept;
+
+    /**
+     * Sets the budget's capacity to `n`. If more memory is in use than `n`,
+     * nothing is reclaimed forcibly but sessions will shrink their buffers the
+     * next time they adjust them and no more memory is handed out until usage
+     * falls below `n`.
+     */
+    void set_capacity(const int n);
+
+    /** Returns `num_desired_bytes` or less of the budget, which may be 0. */
+    int reserve(const int num_desired_bytes);
+
+    /**
+     * Reserves `n` bytes even if this would exceed the capacity. This is used for
+     * memory that has already been allocated or that sessions may not go without
+     * (see `min_session_share`).
+     */
+    void force_reserve(const int n);
+
+    /**
+     * Returns `n` bytes to the budget and, if it's no longer exhausted, resumes
+     * those that have subscribed for memory, in the order they subscribed.
+     */
+    void release(const int n);
+
+    /**
+     * Sessions should report every transfer so that the engine wide throughput,
+     * against which each session's fair share is measured, can be tracked.
+     */
+    void record_received_bytes(const int n) { download_rate_.update(n); }
+    void record_sent_bytes(const int n) { upload_rate_.update(n); }
+
+    /**
+     * Returns the number of bytes a session whose throughput in the given
+     * direction is `session_rate` may hold in its receive or send buffer, or
+     * `unlimited` if the budget is not under pressure and any session may grow
+     * its buffers up to the configured maximums. The returned value is never
+     * below `min_session_share`.
+     */
+    int fair_receive_share(const int session_rate) const
+    {
+        return fair_share(download_rate_, session_rate);
+    }
+
+    int fair_send_share(const int session_rate) const
+    {
+        return fair_share(upload_rate_, session_rate);
+    }
+
+    /**
+     * Invokes `handler` once memory is released. If `token` is already subscribed,
+     * this does nothing.
+     */
+    void subscribe(const token_type token, std::function<void()> handler);
+
+    /** Removes the handler associated with `token`, if any. */
+    void unsubscribe(const token_type token);
+
+private:
+    int fair_share(const throughput_rate& total_rate, const int session_rate) const;
+};
+
+} // tide
+
+#endif // TIDE_BUFFER_BUDGET_HEADER
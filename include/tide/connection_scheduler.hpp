@@ -0,0 +1,128 @@
+#ifndef TIDE_CONNECTION_SCHEDULER_HEADER
+#define TIDE_CONNECTION_SCHEDULER_HEADER
+
+#include "sliding_average.hpp"
+#include "time.hpp"
+
+#include <cstdint>
+#include <deque>
+#include <functional> // function
+
+namespace tide {
+
+/**
+ * Outgoing connections are not initiated by torrents at will, but through this
+ * `engine` wide scheduler, which bounds the number of half-open connections (i.e.
+ * those that have been initiated but not yet established) across all torrents.
+ * Otherwise, with many torrents starting at once, we'd send out bursts of SYNs
+ * that could get us rate limited by firewalls along the way and tie up file
+ * descriptors in connections most of which will time out anyway.
+ *
+ * Torrents that wish to connect to peers subscribe for connection slots, and
+ * each time `distribute_slots` is called the free slots are handed out one by one,
+ * in round robin order, so that every torrent gets a fair share regardless of how
+ * many peers it wants to connect to.
+ *
+ * Connection attempts are counted from `on_connect_started` and must be concluded
+ * with exactly one of `on_connect_succeeded` and `on_connect_failed`. The
+ * outcomes are also used to keep track of the connect latency and success ratio.
+ */
+class connection_scheduler
+{
+public:
+    // A unique value used to identify a subscriber.
+    using token_type = void*;
+    constexpr static int unlimited = -1;
+
+private:
+    // The maximum number of connections that may be in the connecting state at
+    // any given time.
+    int max_half_open_connections_ = unlimited;
+    int num_half_open_connections_ = 0;
+
+    struct subscriber
+    {
+        token_type token;
+        int num_desired_slots;
+        int num_granted_slots = 0;
+        std::function<void(int)> handler;
+    };
+
+    // Those waiting for connection slots, in the order in which they are served.
+    std::deque<subscriber> subscribers_;
+
+    int64_t num_successful_connects_ = 0;
+    int64_t num_failed_connects_ = 0;
+
+    // The time it takes to establish a connection, in milliseconds.
+    sliding_average<int, 20> avg_connect_latency_;
+
+public:
+    int max_half_open_connections() const noexcept { return max_half_open_connections_; }
+    int num_half_open_connections() const noexcept { return num_half_open_connections_; }
+
+    /** Returns the number of connections that may still be started, or `unlimited`. */
+    int num_available_slots() const noexcept;
+
+    /**
+     * Sets the half-open limit to `n`, which may be `unlimited`. If there are
+     * more connections in progress than `n`, they are not aborted, but no new
+     * slots are granted until enough of them have concluded.
+     */
+    void set_max_half_open_connections(const int n);
+
+    /**
+     * Registers `handler` which is invoked with the number of slots, at least one
+     * and at most `num_desired_slots`, granted to `token` in the next call to
+     * `distribute_slots`. If `token` is already subscribed, only its desired number
+     * of slots is updated.
+     *
+     * Granted slots are not reserved: the handler is expected to immediately start
+     * as many connections as it can (calling `on_connect_started` for each) and
+     * slots it doesn't use are simply left for others.
+     */
+    void subscribe(const token_type token, const int num_desired_slots,
+            std::function<void(int)> handler);
+
+    /** Removes the handler associated with `token`, if any. */
+    void unsubscribe(const token_type token);
+
+    /**
+     * Distributes the free slots among subscribers in round robin order. Those that
+     * were granted slots are removed from the queue after their handlers are
+     * invoked and have to subscribe again should they need more, which places them
+     * at the back of the queue.
+     *
+     * This must be called at regular intervals (currently done by `engine`).
+     */
+    void distribute_slots();
+
+    /**
+     * Bookkeeping of connection attempts. A connection may be started even if no
+     * slots are available (e.g. when a stopped connection is resumed), in which
+     * case the half-open limit is temporarily exceeded.
+     */
+    void on_connect_started() noexcept { ++num_half_open_connections_; }
+    void on_connect_succeeded(const duration latency);
+    void on_connect_failed();
+
+    int64_t num_successful_connects() const noexcept { return num_successful_connects_; }
+    int64_t num_failed_connects() const noexcept { return num_failed_connects_; }
+
+    /** Returns the ratio of successful connects to all concluded connect attempts. */
+    double connect_success_ratio() const noexcept;
+
+    milliseconds avg_connect_latency() const noexcept
+    {
+        return milliseconds(avg_connect_latency_.mean());
+    }
+
+    milliseconds connect_latency_deviation() const noexcept
+    {
+        return milliseconds(avg_connect_latency_.deviation());
+    }
+};
+
+} // tide
+
+#endif // TIDE_CONNECTION_SCHEDULER_HEADER
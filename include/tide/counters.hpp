@@ -0,0 +1,166 @@
+#ifndef TIDE_COUNTERS_HEADER
+#define TIDE_COUNTERS_HEADER
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+namespace tide {
+
+/**
+ * The registry of engine-wide performance counters, shared by all subsystems, through
+ * which user can monitor engine's performance (see `counters_alert`).
+ *
+ * There are two kinds of values: counters, which only ever increase (e.g. the number
+ * of blocks written to disk), and gauges, which reflect the current state of some
+ * component (e.g. the number of queued disk jobs). Values that are updated on hot
+ * paths are incremented as they change, with relaxed atomic operations, so this may be
+ * used from any thread. Gauges, and counters that the subsystems already keep for
+ * themselves, are instead set by `engine` when it samples the registry, right before
+ * taking a snapshot.
+ *
+ * All durations are in nanoseconds.
+ */
+class counters
+{
+public:
+    enum id
+    {
+        // -- counters --
+
+        // The disk IO jobs executed on disk_io's thread pool, how long they were
+        // queued and how long they took to execute in total, and the portion of the
+        // latter spent on writing, reading and hashing.
+        num_disk_jobs,
+        disk_job_queue_time,
+        disk_job_execution_time,
+        disk_write_time,
+        disk_read_time,
+        disk_hash_time,
+        num_disk_write_ops,
+        num_disk_read_ops,
+
+        num_blocks_written,
+        num_blocks_read,
+        num_read_cache_hits,
+        num_read_cache_misses,
+        num_disk_buffer_allocations,
+
+        // The number of payload and protocol bytes exchanged with all peers.
+        num_bytes_sent,
+        num_bytes_received,
+
+        // Incoming connections attached to a torrent after their handshake, the
+        // outcomes of our outgoing connection attempts, and the connections
+        // (incoming or outgoing) refused because of `endpoint_filter`.
+        num_incoming_connections,
+        num_successful_connects,
+        num_failed_connects,
+        num_blocked_connections,
+
+        // The number of times sessions had to wait for bandwidth quota, and how long
+        // they waited in total.
+        num_download_quota_waits,
+        num_upload_quota_waits,
+        download_quota_wait_time,
+        upload_quota_wait_time,
+
+        // The number of times the piece picker was asked for a new piece, of which
+        // the failed ones yielded nothing, and the time spent picking.
+        num_piece_picks,
+        num_failed_piece_picks,
+        piece_pick_time,
+
+        num_dropped_alerts,
+        num_dropped_log_entries,
+
+        // -- gauges --
+
+        num_connections,
+        num_half_open_connections,
+        num_active_leeches,
+        num_active_seeds,
+
+        num_disk_threads,
+        num_active_disk_threads,
+        disk_job_queue_size,
+        num_partial_pieces,
+        num_buffered_blocks,
+        read_cache_size,
+        read_cache_capacity,
+
+        // The number of sessions currently waiting for bandwidth quota.
+        num_download_quota_waiters,
+        num_upload_quota_waiters,
+
+        num_counters
+    };
+
+    static constexpr int first_gauge = num_connections;
+
+    using snapshot_type = std::array<int64_t, num_counters>;
+
+private:
+    // The counters at the front, up to this one, are updated by disk_io's threads.
+    static constexpr int num_disk_counters = num_disk_buffer_allocations + 1;
+
+    // The disk counters are kept apart from the rest, each group starting on its own
+    // cache line, so that disk_io's threads incrementing theirs don't keep taking the
+    // cache lines of the counters that the network thread updates away from it.
+    alignas(64) std::array<std::atomic<int64_t>, num_disk_counters> disk_values_{};
+    alignas(64) std::array<std::atomic<int64_t>, num_counters - num_disk_counters>
+            values_{};
+
+public:
+    counters() = default;
+    counters(const counters&) = delete;
+    counters& operator=(const counters&) = delete;
+
+    void increment(const id c, const int64_t n = 1) noexcept
+    {
+        counter(c).fetch_add(n, std::memory_order_relaxed);
+    }
+
+    void set(const id c, const int64_t value) noexcept
+    {
+        counter(c).store(value, std::memory_order_relaxed);
+    }
+
+    int64_t operator[](const id c) const noexcept
+    {
+        return counter(c).load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Returns the current value of each counter and gauge. As they are read one by
+     * one, without synchronizing with updates, related values may be slightly off.
+     */
+    snapshot_type snapshot() const noexcept
+    {
+        snapshot_type s;
+        for(auto i = 0; i < num_counters; ++i) {
+            s[i] = counter(id(i)).load(std::memory_order_relaxed);
+        }
+        return s;
+    }
+
+    static bool is_gauge(const id c) noexcept { return c >= first_gauge; }
+
+    /** Returns the name of `c`, which is the same as its enumerator's name. */
+    static const char* name(const id c) noexcept;
+
+private:
+    std::atomic<int64_t>& counter(const id c) noexcept
+    {
+        return c < num_disk_counters ? disk_values_[c] : values_[c - num_disk_counters];
+    }
+
+    const std::atomic<int64_t>& counter(const id c) const noexcept
+    {
+        return c < num_disk_counters ? disk_values_[c] : values_[c - num_disk_counters];
+    }
+};
+
+} // namespace tide
+
+#endif // TIDE_COUNTERS_HEADER
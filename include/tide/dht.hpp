@@ -0,0 +1,355 @@
+#ifndef TIDE_DHT_HEADER
+#define TIDE_DHT_HEADER
+
+#include "bdecode.hpp"
+#include "bencode.hpp"
+#include "socket.hpp"
+#include "string_view.hpp"
+#include "time.hpp"
+#include "types.hpp"
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <asio/io_context.hpp>
+
+namespace tide {
+
+class utp_socket_manager;
+struct settings;
+
+/**
+ * The Kademlia routing table of a DHT node (BEP 5), which holds the nodes we know
+ * about, organized by their distance from our own node id.
+ *
+ * Bucket i holds the nodes whose id shares exactly i leading bits with ours, except
+ * for the last bucket, which holds all nodes that share at least that many. Only the
+ * last bucket is ever split (when it overflows), so the table has about
+ * log2(n / bucket_size) buckets for a network of n nodes, and we know many nodes
+ * close to us and only a few far away.
+ *
+ * Only nodes that responded to one of our queries are placed in a bucket. Nodes
+ * that we only heard about (e.g. in another node's response, or because they sent
+ * us a query) are kept in the bucket's replacement cache, and take the place of
+ * nodes in the bucket that stop responding.
+ */
+class dht_routing_table
+{
+public:
+    // The maximum number of nodes in a bucket (Kademlia's k).
+    constexpr static int bucket_size = 8;
+
+    // A node that failed to respond to this many queries in a row is replaced as
+    // soon as there is a node to replace it with.
+    constexpr static int max_node_failures = 2;
+
+    struct node_entry
+    {
+        sha1_hash id;
+        udp::endpoint endpoint;
+        // When the node last responded to a query of ours.
+        time_point last_seen_time;
+        // The number of queries in a row the node failed to respond to.
+        int num_failures = 0;
+
+        bool is_bad() const noexcept { return num_failures >= max_node_failures; }
+    };
+
+private:
+    struct bucket
+    {
+        std::vector<node_entry> nodes;
+        std::vector<node_entry> replacements;
+        // Buckets in which nothing changed in a while are refreshed by looking up
+        // a random id in their range.
+        time_point last_changed_time;
+    };
+
+    sha1_hash own_id_;
+    std::vector<bucket> buckets_;
+
+public:
+    explicit dht_routing_table(const sha1_hash& own_id);
+
+    const sha1_hash& own_id() const noexcept { return own_id_; }
+    int num_buckets() const noexcept { return buckets_.size(); }
+    int num_nodes() const noexcept;
+
+    /**
+     * Records the node with `id` at `endpoint`. If `has_responded` is set, it's placed
+     * in (or kept fresh in) its bucket, if there is room for it, or if it may replace
+     * a bad node. Otherwise it's put in the bucket's replacement cache.
+     */
+    void add_node(const sha1_hash& id, const udp::endpoint& endpoint,
+            const bool has_responded);
+
+    /**
+     * Returns whether the node with `id` is not in a bucket yet but would be placed
+     * in one if it responded to a query, in which case it's worth pinging.
+     */
+    bool would_add_node(const sha1_hash& id) const noexcept;
+
+    /** Records that the node at `endpoint` failed to respond to a query. */
+    void node_failed(const udp::endpoint& endpoint);
+
+    /**
+     * Returns at most `n` nodes from the buckets, that are not bad, ordered by
+     * their distance to `target`.
+     */
+    std::vector<node_entry> find_closest_nodes(
+            const sha1_hash& target, const int n) const;
+
+    /**
+     * Returns the index of a bucket in which nothing changed in the past `interval`
+     * and marks it as refreshed, or -1 if there is none.
+     */
+    int pick_bucket_to_refresh(const duration interval);
+
+    /** Returns a random id that falls into the bucket at `index`. */
+    sha1_hash random_id_in_bucket(const int index) const;
+
+private:
+    int bucket_index(const sha1_hash& id) const noexcept;
+    void split_last_bucket();
+};
+
+/**
+ * A node in the Mainline DHT (BEP 5), through which torrents find peers without the
+ * help of trackers.
+ *
+ * Lookups are iterative: the `alpha` closest nodes to the target that we know of are
+ * queried in parallel, and the nodes they return are merged into the lookup's list of
+ * candidates, until the `bucket_size` closest candidates have all been queried.
+ * A query that's not answered within a couple of seconds no longer holds up the
+ * lookup, but a late response is still processed.
+ *
+ * The number of queries we send and the number of queries from other nodes that we
+ * answer are both limited to `settings::max_dht_queries_per_second`. Lookups that
+ * exceed the limit are resumed on the next tick.
+ *
+ * The node does not have its own socket but sends and receives its messages through
+ * the UDP socket of the `utp_socket_manager`, which passes on every datagram that is
+ * not a uTP packet.
+ */
+class dht_node
+{
+public:
+    // The number of queries a lookup has in flight at a time.
+    constexpr static int alpha = 3;
+
+    // The most candidates a lookup keeps track of. Those furthest from the target
+    // are dropped first.
+    constexpr static int max_lookup_candidates = 100;
+
+    // The bounds on the peers we store for other nodes' announces.
+    constexpr static int max_stored_torrents = 1000;
+    constexpr static int max_stored_peers_per_torrent = 100;
+
+private:
+    asio::io_context& ios_;
+    utp_socket_manager& socket_;
+    const settings& settings_;
+
+    dht_routing_table routing_table_;
+
+    struct lookup
+    {
+        enum class type
+        {
+            find_node,
+            get_peers
+        };
+
+        struct candidate
+        {
+            enum class state
+            {
+                fresh,
+                queried,
+                responded,
+                failed
+            };
+
+            sha1_hash id;
+            udp::endpoint endpoint;
+            enum state state = state::fresh;
+            // The write token sent in a get_peers response, with which we may
+            // announce to the node.
+            std::string token;
+        };
+
+        enum type type;
+        sha1_hash target;
+
+        // If set, once a get_peers lookup concludes, we announce ourselves on this
+        // port to the closest nodes.
+        uint16_t announce_port = 0;
+
+        // Ordered by the candidates' distance to `target`.
+        std::vector<candidate> candidates;
+
+        // The number of queries that are waiting for a response and that haven't
+        // been deemed slow yet.
+        int num_in_flight = 0;
+
+        time_point start_time;
+        int num_peers_found = 0;
+
+        // Set once the lookup has concluded, after which late responses to its
+        // queries are ignored.
+        bool is_done = false;
+
+        // Invoked with every batch of peers found by a get_peers lookup.
+        std::function<void(std::vector<tcp::endpoint>)> handler;
+    };
+
+    // Lookups are removed once they conclude.
+    std::vector<std::shared_ptr<lookup>> lookups_;
+
+    /** A query of ours that is waiting for a response. */
+    struct transaction
+    {
+        udp::endpoint endpoint;
+        time_point send_time;
+        // The lookup this query is part of, if any.
+        std::shared_ptr<lookup> parent;
+        bool is_slow = false;
+    };
+
+    // Outstanding queries are mapped to their transaction ids.
+    std::unordered_map<uint16_t, transaction> transactions_;
+    uint16_t next_transaction_id_;
+
+    /** Limits the number of queries per second. */
+    struct query_budget
+    {
+        double num_queries = 0;
+        time_point last_refill_time;
+
+        /** Returns true and takes a query from the budget if it isn't depleted. */
+        bool consume(const int max_queries_per_second);
+    };
+
+    query_budget outgoing_query_budget_;
+    query_budget incoming_query_budget_;
+
+    struct stored_peer
+    {
+        tcp::endpoint endpoint;
+        time_point announce_time;
+    };
+
+    // The peers that announced to us, by info hash.
+    std::map<sha1_hash, std::vector<stored_peer>> peer_store_;
+
+    // Write tokens are derived from the requester's IP address and a secret that is
+    // rotated every few minutes. Tokens derived from the previous secret are still
+    // accepted, so that a token remains valid for at least one rotation period.
+    std::array<std::array<uint8_t, 8>, 2> token_secrets_;
+    time_point last_secret_rotation_time_;
+
+    // The resolved endpoints of `settings::dht_bootstrap_nodes`. These are only
+    // used to join the network and are never added to the routing table.
+    std::vector<udp::endpoint> bootstrap_endpoints_;
+    time_point last_bootstrap_time_;
+
+    udp::resolver resolver_;
+    deadline_timer tick_timer_;
+    bool is_running_ = false;
+
+public:
+    dht_node(asio::io_context& ios, utp_socket_manager& socket, const settings& s);
+
+    /**
+     * Starts receiving messages through `socket_` (which must be open) and joins the
+     * network through the bootstrap nodes.
+     */
+    void start();
+    void stop();
+
+    bool is_running() const noexcept { return is_running_; }
+    const sha1_hash& id() const noexcept { return routing_table_.own_id(); }
+    int num_nodes() const noexcept { return routing_table_.num_nodes(); }
+    int num_lookups() const noexcept { return lookups_.size(); }
+
+    /** Returns the UDP port on which we're reachable, or 0 if not running. */
+    uint16_t port() const;
+
+    /**
+     * Pings the node at `endpoint` and adds it to the routing table if it responds.
+     * This is used for the nodes peers advertise in PORT messages.
+     */
+    void add_node(const udp::endpoint& endpoint);
+
+    /**
+     * Looks up the peers of the torrent identified by `info_hash`, each batch of which
+     * is passed to `handler` as soon as it arrives. If `port` is not 0, once the
+     * lookup concludes we announce to the closest nodes that we're accepting
+     * connections for the torrent on `port`.
+     */
+    void get_peers(const sha1_hash& info_hash, const uint16_t port,
+            std::function<void(std::vector<tcp::endpoint>)> handler);
+
+private:
+    void bootstrap();
+    void on_bootstrap_nodes_resolved(
+            const error_code& error, udp::resolver::iterator it, const uint16_t port);
+
+    void start_lookup(std::shared_ptr<lookup> l);
+    void continue_lookup(const std::shared_ptr<lookup>& l);
+    void finish_lookup(const std::shared_ptr<lookup>& l);
+    void add_lookup_candidate(
+            lookup& l, const sha1_hash& id, const udp::endpoint& endpoint);
+    void handle_lookup_response(const std::shared_ptr<lookup>& l,
+            const udp::endpoint& endpoint, const sha1_hash& id, const bmap& response);
+    void handle_lookup_failure(
+            const std::shared_ptr<lookup>& l, const udp::endpoint& endpoint);
+
+    /**
+     * Sends the query `method` with `arguments` (to which our id is added) to
+     * `endpoint`. If `l` is set, the response is passed on to the lookup.
+     */
+    void send_query(const udp::endpoint& endpoint, const std::string& method,
+            bmap_encoder arguments, std::shared_ptr<lookup> l = nullptr);
+    void send_message(const udp::endpoint& endpoint, const std::string& message);
+
+    void on_datagram(
+            const udp::endpoint& endpoint, const uint8_t* data, const int size);
+    void handle_response(
+            const udp::endpoint& endpoint, const string_view tid, const bmap& message);
+    void handle_error(const udp::endpoint& endpoint, const string_view tid);
+    void handle_query(
+            const udp::endpoint& endpoint, const string_view tid, const bmap& message);
+
+    void send_response(
+            const udp::endpoint& endpoint, const string_view tid, bmap_encoder values);
+    void send_error(const udp::endpoint& endpoint, const string_view tid,
+            const int code, const std::string& message);
+
+    std::string make_token(const udp::endpoint& endpoint, const int secret_index) const;
+    bool is_token_valid(const udp::endpoint& endpoint, string_view token) const;
+    void store_peer(const sha1_hash& info_hash, const tcp::endpoint& peer);
+
+    /** Returns the compact node info of the nodes closest to `target`. */
+    std::string closest_nodes_to(const sha1_hash& target) const;
+
+    bool is_bootstrap_endpoint(const udp::endpoint& endpoint) const noexcept;
+
+    void start_ticking();
+    void on_tick(const error_code& error);
+    void time_out_transactions(const time_point now);
+    void expire_stored_peers(const time_point now);
+
+    template <typename... Args>
+    void log(const char* format, Args&&... args) const;
+};
+
+} // tide
+
+#endif // TIDE_DHT_HEADER
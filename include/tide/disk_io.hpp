@@ -6,12 +6,14 @@
 #include "bitfield.hpp"
 #include "block_cache.hpp"
 #include "block_source.hpp"
+#include "counters.hpp"
 #include "disk_buffer.hpp"
 #include "disk_io_error.hpp"
 #include "exponential_backoff.hpp"
 #include "interval.hpp"
 #include "log.hpp"
 #include "path.hpp"
+#include "piece_hashes.hpp"
 #include "sha1_hasher.hpp"
 #include "string_view.hpp"
 #include "thread_pool.hpp"
@@ -32,7 +34,6 @@
 namespace tide {
 
 class metainfo;
-class bmap_encoder;
 struct torrent_info;
 struct disk_io_settings;
 
@@ -43,46 +44,16 @@ struct disk_io_settings;
 class disk_io
 {
 public:
+    /**
+     * The state of disk_io's buffers. Everything else it measures (such as the number
+     * of blocks written and read, cache hits, and job latencies) is recorded in the
+     * engine-wide `counters`.
+     */
     struct stats
     {
-        int num_blocks_written = 0;
-        int num_blocks_read = 0;
-
-        int num_read_cache_hits = 0;
-        int num_read_cache_misses = 0;
-
-        int read_cache_capacity = 0;
-        int read_cache_size = 0;
-
-        // int write_queue_size = 0;
-        // int read_queue_size = 0;
-        // int peak_write_queue_size = 0;
-        // int peak_read_queue_size = 0;
-
-        // How many of each jobs are currently being performed by threads.
-        // TODO since we merge hashing and writing in some cases, this would not be
-        // representative of the number of working threads
-        // int num_hashing_threads = 0;
-        // int num_writing_threads = 0;
-        // int num_reading_threads = 0;
-
-        // int num_threads = 0;
-
         // The number of in-progress pieces and blocks buffered in disk_io.
         int num_partial_pieces = 0;
         int num_buffered_blocks = 0;
-
-        // The average number of milliseconds a job is queued up (is waiting to be
-        // executed).
-        // milliseconds avg_wait_time{0};
-        // milliseconds avg_write_time{0};
-        // milliseconds avg_read_time{0};
-        // milliseconds avg_hash_time{0};
-
-        // milliseconds total_job_time{0};
-        // milliseconds total_write_time{0};
-        // milliseconds total_read_time{0};
-        // milliseconds total_hash_time{0};
     };
 
 private:
@@ -93,6 +64,9 @@ private:
 
     const disk_io_settings& settings_;
 
+    // Engine-wide performance counters, which may be updated from any thread.
+    counters& counters_;
+
     // All disk jobs are posted to and executed by this thread pool. Note that anything
     // posted to this that accesses fields in disk_io will need to partake in mutual
     // exclusion.
@@ -339,7 +313,7 @@ private:
         // until the last async operation.
         std::atomic<int> num_pending_ops{0};
 
-        torrent_entry(const torrent_info& info, string_view piece_hashes,
+        torrent_entry(const torrent_info& info, piece_hashes hashes,
                 path resume_data_path);
 
         bool is_block_valid(const block_info& block);
@@ -363,9 +337,16 @@ private:
     exponential_backoff<120> retry_delay_;
 
 public:
-    disk_io(asio::io_context& network_ios, const disk_io_settings& settings);
+    disk_io(asio::io_context& network_ios, const disk_io_settings& settings,
+            counters& counters);
     ~disk_io();
 
+    /**
+     * Sets disk_io's gauges and the counters kept by its thread pool in the
+     * engine-wide `counters`, which is done right before they're sampled.
+     */
+    void update_counters();
+
     int num_buffered_pieces();
     int num_buffered_blocks();
     int num_buffered_blocks(const torrent_id_t id);
@@ -388,7 +369,14 @@ public:
      * torrent_storage_handle is returned.
      */
     torrent_storage_handle allocate_torrent(
-            const torrent_info& info, std::string piece_hashes, std::error_code& error);
+            const torrent_info& info, piece_hashes hashes, std::error_code& error);
+
+    /**
+     * Maps the piece hashes of the torrent that were written alongside its resume
+     * data. This only sets up the mapping (the hashes are paged in as they're read),
+     * so unlike most other operations it's done synchronously.
+     */
+    piece_hashes map_piece_hashes(const torrent_id_t id, std::error_code& error);
     void move_torrent(const torrent_id_t id, std::string new_path,
             std::function<void(const std::error_code&)> handler);
     void rename_torrent(const torrent_id_t id, std::string name,
@@ -404,8 +392,12 @@ public:
      */
     void erase_torrent_resume_data(
             const torrent_id_t id, std::function<void(const std::error_code&)> handler);
-    void save_torrent_resume_data(const torrent_id_t id, bmap_encoder resume_data,
-            std::function<void(const std::error_code&)> handler);
+    /**
+     * Saves the bencoded resume data. Once it's saved, the buffer holding it is
+     * handed back to the handler, so that it may be reused.
+     */
+    void save_torrent_resume_data(const torrent_id_t id, std::string resume_data,
+            std::function<void(const std::error_code&, std::string)> handler);
     void load_torrent_resume_data(const torrent_id_t id,
             std::function<void(const std::error_code&, bmap)> handler);
 
@@ -602,6 +594,9 @@ private:
     /** id must be valid, otherwise an assertion will fail. */
     torrent_entry& find_torrent_entry(const torrent_id_t id);
 
+    /** Returns the path of the torrent's resume data file. */
+    path resume_data_path(const torrent_id_t id) const;
+
     enum class log_event
     {
         info,
@@ -3,27 +3,158 @@
 
 #include "address.hpp"
 #include "socket.hpp"
+#include "string_view.hpp"
+
+#include <cstdint>
+#include <memory> // shared_ptr
+#include <utility> // pair
+#include <vector>
 
 namespace tide {
 
+/**
+ * A set of blocked IPv4 and IPv6 address ranges, compact enough to hold blocklists
+ * of millions of ranges and fast enough to be consulted for every peer.
+ *
+ * Rules are first accumulated, then `build` sorts and merges them into disjoint
+ * intervals, kept in flat arrays, after which lookups are a binary search. IPv4
+ * lookups are further narrowed by an index on the upper 16 bits of the address, so
+ * that only the few intervals starting in the same /16 block need to be searched.
+ *
+ * A built filter is not modified by lookups, so it may be built on any thread and
+ * then shared (see `endpoint_filter::set_blocklist`).
+ */
+class ip_filter
+{
+    // An IPv6 address as a 128 bit integer, most significant half first, so that
+    // the ordering of these matches that of the addresses.
+    using uint128 = std::pair<uint64_t, uint64_t>;
+
+    struct v6_range
+    {
+        uint128 first;
+        uint128 last;
+    };
+
+    // The first and last addresses of the disjoint, sorted IPv4 intervals, kept in
+    // separate arrays so that binary searching touches only the first addresses.
+    std::vector<uint32_t> v4_firsts_;
+    std::vector<uint32_t> v4_lasts_;
+
+    // The number of intervals in `v4_firsts_` that start before each /16 block, plus
+    // a sentinel, i.e. the intervals that may contain an address in block `b` are in
+    // the range [max(v4_index_[b], 1) - 1, v4_index_[b + 1]). Empty when there are
+    // no IPv4 intervals.
+    std::vector<uint32_t> v4_index_;
+
+    std::vector<v6_range> v6_ranges_;
+
+    // Rules added since the last `build`. Lookups may only be made once these have
+    // been merged into the intervals above.
+    std::vector<std::pair<uint32_t, uint32_t>> pending_v4_ranges_;
+    std::vector<v6_range> pending_v6_ranges_;
+
+public:
+    int num_v4_ranges() const noexcept { return v4_firsts_.size(); }
+    int num_v6_ranges() const noexcept { return v6_ranges_.size(); }
+    bool empty() const noexcept { return v4_firsts_.empty() && v6_ranges_.empty(); }
+    bool is_built() const noexcept
+    {
+        return pending_v4_ranges_.empty() && pending_v6_ranges_.empty();
+    }
+
+    /**
+     * Blocks all addresses in the range [first, last]. Both must be of the same
+     * address family and `first` must not be greater than `last`, otherwise the
+     * rule is ignored. The rule takes effect on the next call to `build`.
+     */
+    void add_rule(const address& first, const address& last);
+    void add_rule(const address& ip) { add_rule(ip, ip); }
+
+    /**
+     * Unblocks all addresses in the range [first, last]. Pending rules are built
+     * first, and the change takes effect immediately.
+     */
+    void remove_rule(const address& first, const address& last);
+    void remove_rule(const address& ip) { remove_rule(ip, ip); }
+
+    /**
+     * Adds the rules in `blocklist`, one per line, then builds the filter. Lines may
+     * be in the P2P plaintext format (`description:first-last`), the DAT format
+     * (`first - last , level , description`, where rules with a level above 127 are
+     * allow rules and are skipped), CIDR notation (`ip/prefix`) or single addresses.
+     * Empty lines and those starting with `#` or `//` are ignored.
+     *
+     * Returns the number of lines that could not be parsed, which are skipped.
+     */
+    int parse(string_view blocklist);
+
+    /** Sorts and merges the pending rules into the filter's intervals. */
+    void build();
+
+    /** The filter must be built. IPv4 mapped IPv6 addresses are looked up as IPv4. */
+    bool is_blocked(const address& ip) const noexcept;
+    bool is_blocked(const uint32_t ip) const noexcept;
+
+private:
+    bool is_blocked(const uint128& ip) const noexcept;
+
+    /** Parses a single line and adds its rule, returning false if it's malformed. */
+    bool parse_line(const char* begin, const char* end);
+
+    void build_v4_index();
+};
+
+/**
+ * Decides which peers we may connect to and accept connections from. Individual
+ * addresses, address ranges, ports and endpoints may be blocked by user, and in
+ * addition an `ip_filter` blocklist may be installed, e.g. one loaded from a
+ * published list of millions of ranges.
+ *
+ * This is only used on the network thread. A new blocklist is built elsewhere and
+ * then handed to this with `set_blocklist`, which is a pointer swap, so lookups are
+ * never paused while a list is loaded.
+ */
 class endpoint_filter
 {
+    // The addresses and ranges blocked by user.
+    ip_filter ip_rules_;
+
+    // Sorted, so they may be binary searched.
+    std::vector<uint16_t> blocked_ports_;
+    std::vector<tcp::endpoint> blocked_endpoints_;
+
+    // May be null. It's immutable so that it can be built on another thread (and
+    // may be shared by several filters).
+    std::shared_ptr<const ip_filter> blocklist_;
+
 public:
-    bool is_allowed(const tcp::endpoint& ep)
+    bool is_allowed(const tcp::endpoint& ep) const noexcept
     {
-        // TODO
-        return true;
+        return is_allowed(ep.address(), ep.port());
     }
 
+    bool is_allowed(const address& ip, const uint16_t port) const noexcept;
+
     void block_ip(const address& ip);
-    void block_ip_range(const address& ip);
+    void block_ip_range(const address& first, const address& last);
     void block_port(const uint16_t port);
     void block_endpoint(const tcp::endpoint& ep);
 
     void unblock_ip(const address& ip);
-    void unblock_ip_range(const address& ip);
+    void unblock_ip_range(const address& first, const address& last);
     void unblock_port(const uint16_t port);
     void unblock_endpoint(const tcp::endpoint& ep);
+
+    /**
+     * Replaces the current blocklist with `blocklist`, which must be built. Passing
+     * null removes the blocklist.
+     */
+    void set_blocklist(std::shared_ptr<const ip_filter> blocklist);
+    const std::shared_ptr<const ip_filter>& blocklist() const noexcept
+    {
+        return blocklist_;
+    }
 };
 
 } // namespace tide
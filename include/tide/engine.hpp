@@ -2,6 +2,11 @@
 #define TIDE_ENGINE_HEADER
 
 #include "alert_queue.hpp"
+#include "announce_scheduler.hpp"
+#include "buffer_budget.hpp"
+#include "connection_scheduler.hpp"
+#include "counters.hpp"
+#include "dht.hpp"
 #include "disk_io.hpp"
 #include "endpoint_filter.hpp"
 #include "engine_info.hpp"
@@ -13,6 +18,9 @@
 #include "torrent_args.hpp"
 #include "torrent_handle.hpp"
 #include "types.hpp"
+#include "udp_tracker_socket.hpp"
+#include "upload_slot_allocator.hpp"
+#include "utp_socket.hpp"
 
 #include <cstdint>
 #include <functional>
@@ -41,6 +49,11 @@ class engine
     // also passed to disk_io for callbacks to be posted on network thread.
     asio::io_context network_ios_;
 
+    // Engine-wide performance counters, shared by all components (so it must be
+    // constructed before them). A snapshot of these is posted to user as
+    // a `counters_alert` every `settings::stats_aggregation_interval`.
+    counters counters_;
+
     // All disk related tasks are done through this class, so only a single
     // object exists at any given time. Each torrent instance, and their
     // peer_sessions receive a reference to this object.
@@ -48,12 +61,43 @@ class engine
 
     rate_limiter rate_limiter_;
 
+    // All `peer_session`s' receive and send buffers are allocated out of this
+    // budget, so that memory usage is bounded regardless of the number of
+    // connections.
+    buffer_budget buffer_budget_;
+
+    // All uTP connections, incoming and outgoing, are multiplexed over the single
+    // UDP socket owned by this, bound to the same port as our TCP listener, which is
+    // shared with the DHT and UDP trackers. It must outlive all torrents and their
+    // `peer_session`s.
+    utp_socket_manager utp_socket_manager_;
+
+    // All UDP trackers send and receive through this, which routes their traffic
+    // over the socket of `utp_socket_manager_`, and which must outlive them.
+    udp_tracker_socket udp_tracker_socket_;
+
+    // Torrents may only initiate outgoing connections with a slot granted by
+    // this, which bounds the number of half-open connections across all torrents.
+    connection_scheduler connection_scheduler_;
+
+    // Upload slots are shared among the auto managed torrents by this, in a global
+    // unchoke round.
+    upload_slot_allocator upload_slot_allocator_;
+
+    // Torrents announce to trackers through this, which spreads the announces out
+    // and bounds how many are sent to each tracker.
+    announce_scheduler announce_scheduler_;
+
+    // Our node in the Mainline DHT, through which torrents find peers in addition
+    // to their trackers.
+    dht_node dht_node_;
+
     // Rules may be applied for filtering specific IP addresses and ports.
     endpoint_filter endpoint_filter_;
 
     // Internal entities within tide::engine communicate with user
     // asynchronously via an alert channel. This is done by accumulating alerts
-    // in this queue until user manually extracts them. It's thread-safe.
+    // in this queue until user extracts them. It's thread-safe and lock-free.
     alert_queue alert_queue_;
 
     // `torrent`s are categorized by whether they're leeches or seeds. Leeches,
@@ -105,6 +149,9 @@ class engine
 
     engine_info info_;
 
+    // When the last `counters_alert` was posted.
+    time_point last_counters_alert_time_;
+
 public:
     /**
      * The constructor immediately starts `engine`'s internal update cycle on
@@ -120,10 +167,21 @@ public:
     void resume();
 
     /**
-     * Returns a queue of all the alerts that occurred since the last call to
-     * this function. Events are chronologically ordered.
+     * Replaces the contents of `alerts` with all the alerts that occurred since the
+     * last call to this function, in chronological order. The alerts are owned by
+     * `engine` and remain valid until the next call, so this must not be called
+     * concurrently.
      */
-    std::deque<std::unique_ptr<alert>> alerts();
+    void pop_alerts(std::vector<alert*>& alerts);
+
+    /**
+     * Registers `handler` to be invoked when there are new alerts to pop, so that
+     * user need not poll for them. It is invoked at most once after each call to
+     * `pop_alerts`, on one of `engine`'s threads, so it should only notify user's
+     * thread (e.g. by posting to its event loop or writing to an eventfd) which
+     * then pops the alerts.
+     */
+    void set_alert_notify_handler(std::function<void()> handler);
 
     /** Returns whether engine has managed to set up a listening port. */
     bool is_listening() const noexcept;
@@ -187,6 +245,17 @@ public:
     // torrent_handle find_torrent(const sha1_hash& info_hash);
     // torrent_handle find_torrent(const torrent_id_t id);
 
+    /**
+     * Replaces the blocklist consulted for every peer we connect to, accept a
+     * connection from, or learn of from trackers, the DHT, or other peers. Peers
+     * that are connected but no longer allowed are disconnected.
+     *
+     * The potentially expensive building of `blocklist` (see `ip_filter::build`)
+     * is done on the calling thread, so the network thread only has to swap it in.
+     * An empty filter removes the blocklist.
+     */
+    void set_ip_blocklist(ip_filter blocklist);
+
     void set_torrent_queue_position(const torrent_handle& torrent, const int pos);
     void increment_torrent_queue_position(const torrent_handle& torrent);
     void decrement_torrent_queue_position(const torrent_handle& torrent);
@@ -210,8 +279,34 @@ private:
     std::vector<tracker_entry> get_trackers(const metainfo& metainfo);
     bool has_tracker(string_view url) const noexcept;
 
+    /**
+     * Starts a session for a connection initiated by peer, which is kept in
+     * `incoming_connections_` until peer's handshake tells us which torrent it
+     * is for.
+     */
+    void accept_peer_connection(
+            tcp::endpoint endpoint, std::unique_ptr<stream_socket> socket);
+
+    /**
+     * Called by an incoming session once it has received peer's handshake.
+     * Moves the session to the torrent identified by `info_hash`, or returns an
+     * invalid `torrent_frontend` if there is no such torrent or it refused the
+     * session.
+     */
+    torrent_frontend attach_incoming_connection(
+            const tcp::endpoint& endpoint, const sha1_hash& info_hash);
+
+    /** Removes the incoming sessions that disconnected before their handshake. */
+    void remove_stopped_incoming_connections();
+
     void update(const error_code& error = error_code());
 
+    /**
+     * Sets the gauges in `counters_` and the counters that components keep for
+     * themselves, so that a snapshot of them is up to date.
+     */
+    void update_counters();
+
     /** Moves all torrents that became seeds in `leeches_` to `seeds_`. */
     void relocate_new_seeds();
 
@@ -1,6 +1,7 @@
 #ifndef TIDE_ENGINE_INFO_HEADER
 #define TIDE_ENGINE_INFO_HEADER
 
+#include "time.hpp"
 #include "types.hpp"
 
 namespace tide {
@@ -20,6 +21,16 @@ struct engine_info
     int num_auto_managed_torrents = 0;
 
     int num_connections = 0;
+
+    // Outgoing connection attempts that are in progress and the outcomes of those
+    // that have concluded. The success ratio is
+    // num_successful_connects / (num_successful_connects + num_failed_connects).
+    int num_half_open_connections = 0;
+    int64_t num_successful_connects = 0;
+    int64_t num_failed_connects = 0;
+
+    // The time it takes to establish a connection.
+    milliseconds avg_connect_latency{0};
 };
 
 } // namespace tide
@@ -15,14 +15,14 @@ namespace extensions {
  */
 enum
 {
-    // Currently NOT supported.
+    // Supported if `settings::enable_dht` is set.
     dht = 0,
     // Experimental support.
     fast = 2,
     // Currently NOT supported, but may be supported in the future.
     nat_traversal = 3,
-    // Not going to be supported, only used to identify a peer's extensions.
-    libtorrent = 20,
+    // The extension protocol (BEP 10), over which we support peer exchange (BEP 11).
+    extension_protocol = 20,
     // Not going to be supported.
     location_aware_protocol = 43,
     // Not going to be supported, only used to identify a peer's extensions.
@@ -58,7 +58,7 @@ inline std::string to_string(const flags& flags)
                     case dht: return "DHT";
                     case fast: return "Fast";
                     case nat_traversal: return "NAT traversal";
-                    case libtorrent: return "libtorrent";
+                    case extension_protocol: return "extension protocol";
                     case location_aware_protocol: return "location aware protocol 1.0";
                     case azureus: return "Azureus";
                     default: return "unknown";
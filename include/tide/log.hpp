@@ -3,16 +3,32 @@
 
 #include "path.hpp"
 #include "socket.hpp"
+#include "string_view.hpp"
 #include "types.hpp"
 
-#include <fstream>
-#include <map>
-#include <mutex>
+#include <algorithm> // min
+#include <atomic>
+#include <cstdint>
+#include <cstring> // memcpy, strlen
 #include <string>
+#include <type_traits>
 
 namespace tide {
 namespace log {
 
+/**
+ * Logging is asynchronous: the logging thread only records a compact binary entry
+ * (a timestamp, the address of the format string, and the arguments) in a lock-free
+ * ring buffer of its own, and the entries of all threads are formatted and written
+ * to disk by a background thread. Nothing is recorded for subsystems and priorities
+ * that are switched off at runtime. If a thread's ring is full (i.e. the background
+ * thread can't keep up) its entries are dropped rather than blocking the thread.
+ *
+ * Format strings must be string literals (or otherwise outlive the process), as only
+ * their addresses are recorded. Arguments may be integers, floating point numbers,
+ * pointers and strings, the latter of which are copied (and may be truncated).
+ */
+
 enum class priority
 {
     low,
@@ -20,22 +36,277 @@ enum class priority
     high
 };
 
-void log_torrent(const torrent_id_t torrent, const std::string& header,
-        const std::string& log, const priority priority = priority::normal);
-void log_peer_session(const torrent_id_t torrent, const tcp::endpoint& endpoint,
-        const std::string& header, const std::string& log,
-        const priority priority = priority::normal);
-void log_engine(const std::string& header, const std::string& log,
-        const priority priority = priority::normal);
-void log_disk_io(const std::string& header, const std::string& log,
-        const bool concurrent = false, const priority priority = priority::normal);
+enum class subsystem
+{
+    engine,
+    torrent,
+    peer_session,
+    disk_io
+};
+
+constexpr int num_subsystems = 4;
+
+/** Only entries of `s` with at least priority `p` are logged. */
+void set_min_priority(const subsystem s, const priority p) noexcept;
+
+/** Switches off all logging of `s` until `set_min_priority` is called for it. */
+void disable(const subsystem s) noexcept;
+
+inline bool is_enabled(const subsystem s, const priority p) noexcept;
+
+/** Returns the number of entries dropped so far because a thread's ring was full. */
+int num_dropped_entries() noexcept;
 
 /**
- * Call this in a SIGABRT handler so that even when an assertion fires, everything
- * buffered is written to disk.
+ * Formats and writes all recorded entries on the calling thread, then flushes the
+ * log files. Call this in a SIGABRT handler so that even when an assertion fires,
+ * everything buffered is written to disk.
  */
 void flush();
 
+namespace detail {
+
+// The index of the lowest priority logged for each subsystem, or one above the
+// highest priority if the subsystem is disabled.
+extern std::atomic<int> min_priorities[num_subsystems];
+
+// Strings longer than this are truncated when recorded.
+constexpr int max_string_length = 512;
+
+enum arg_type : uint8_t
+{
+    int_arg,
+    uint_arg,
+    float_arg,
+    pointer_arg,
+    string_arg
+};
+
+struct entry_header
+{
+    // The size of the entry, including this header and the arguments that follow it.
+    uint32_t size;
+    uint8_t subsystem;
+    uint8_t priority;
+    uint8_t num_args;
+    // Whether the entry has a remote endpoint and whether its first argument is a
+    // tag (e.g. a tracker's URL) that goes into the entry's header.
+    bool has_endpoint;
+    bool has_tag;
+    uint16_t port;
+    // The connection's age in seconds, or -1.
+    int32_t connection_age;
+    torrent_id_t torrent;
+    // An IPv4 address is stored as an IPv4 mapped IPv6 address.
+    uint8_t address[16];
+    // Nanoseconds on the steady clock.
+    int64_t timestamp;
+    const char* event;
+    const char* format;
+};
+
+/**
+ * Returns a buffer of `size` bytes in the calling thread's ring, or null if the ring
+ * is full. The buffer must then be committed with `commit_entry`.
+ */
+uint8_t* begin_entry(const int size);
+void commit_entry(const int size) noexcept;
+
+int64_t now_ns() noexcept;
+
+inline int encoded_size(string_view s) noexcept
+{
+    return 3 + std::min(int(s.size()), max_string_length);
+}
+
+inline int encoded_size(const char* s) noexcept
+{
+    return encoded_size(string_view(s ? s : "(null)"));
+}
+
+inline int encoded_size(char* s) noexcept
+{
+    return encoded_size(const_cast<const char*>(s));
+}
+
+inline int encoded_size(const std::string& s) noexcept
+{
+    return encoded_size(string_view(s));
+}
+
+template <typename T>
+constexpr int encoded_size(const T&) noexcept
+{
+    static_assert(std::is_arithmetic<T>::value || std::is_enum<T>::value
+                    || std::is_pointer<T>::value,
+            "unsupported log argument type");
+    return 9;
+}
+
+inline void encode(uint8_t*& out, string_view s) noexcept
+{
+    const uint16_t length = std::min(int(s.size()), max_string_length);
+    *out++ = string_arg;
+    std::memcpy(out, &length, 2);
+    std::memcpy(out + 2, s.data(), length);
+    out += 2 + length;
+}
+
+inline void encode(uint8_t*& out, const char* s) noexcept
+{
+    encode(out, string_view(s ? s : "(null)"));
+}
+
+inline void encode(uint8_t*& out, char* s) noexcept
+{
+    encode(out, const_cast<const char*>(s));
+}
+
+inline void encode(uint8_t*& out, const std::string& s) noexcept
+{
+    encode(out, string_view(s));
+}
+
+template <typename T>
+void encode(uint8_t*& out, const T& value) noexcept
+{
+    if constexpr(std::is_floating_point<T>::value) {
+        const double d = value;
+        *out = float_arg;
+        std::memcpy(out + 1, &d, 8);
+    } else if constexpr(std::is_pointer<T>::value) {
+        const uint64_t n = reinterpret_cast<uintptr_t>(value);
+        *out = pointer_arg;
+        std::memcpy(out + 1, &n, 8);
+    } else if constexpr(std::is_enum<T>::value || std::is_signed<T>::value) {
+        const int64_t n = static_cast<int64_t>(value);
+        *out = int_arg;
+        std::memcpy(out + 1, &n, 8);
+    } else {
+        const uint64_t n = value;
+        *out = uint_arg;
+        std::memcpy(out + 1, &n, 8);
+    }
+    out += 9;
+}
+
+/**
+ * Records an entry in the calling thread's ring. `endpoint` may be null, and `tag`
+ * may be empty.
+ */
+template <typename... Args>
+void record(const subsystem s, const priority p, const torrent_id_t torrent,
+        const tcp::endpoint* endpoint, const int connection_age, string_view tag,
+        const char* event, const char* format, const Args&... args)
+{
+    int size = sizeof(entry_header) + (0 + ... + encoded_size(args));
+    if(!tag.empty()) {
+        size += encoded_size(tag);
+    }
+    // Keep entries aligned so that the headers can be read in place.
+    size = (size + 7) & ~7;
+    uint8_t* out = begin_entry(size);
+    if(out == nullptr) {
+        return;
+    }
+
+    auto& header = *reinterpret_cast<entry_header*>(out);
+    header.size = size;
+    header.subsystem = uint8_t(s);
+    header.priority = uint8_t(p);
+    header.num_args = sizeof...(args) + (tag.empty() ? 0 : 1);
+    header.has_endpoint = endpoint != nullptr;
+    header.has_tag = !tag.empty();
+    header.connection_age = connection_age;
+    header.torrent = torrent;
+    header.timestamp = now_ns();
+    header.event = event;
+    header.format = format;
+    if(endpoint) {
+        const auto& ip = endpoint->address();
+        const auto bytes = ip.is_v4()
+                ? asio::ip::make_address_v6(asio::ip::v4_mapped, ip.to_v4()).to_bytes()
+                : ip.to_v6().to_bytes();
+        std::memcpy(header.address, bytes.data(), 16);
+        header.port = endpoint->port();
+    }
+
+    out += sizeof(entry_header);
+    if(!tag.empty()) {
+        encode(out, tag);
+    }
+    (encode(out, args), ...);
+    commit_entry(size);
+}
+
+} // detail
+
+inline bool is_enabled(const subsystem s, const priority p) noexcept
+{
+#ifdef TIDE_ENABLE_LOGGING
+    return int(p) >= detail::min_priorities[int(s)].load(std::memory_order_relaxed);
+#else
+    return false;
+#endif // TIDE_ENABLE_LOGGING
+}
+
+template <typename... Args>
+void log_engine(const char* event, const priority p, const char* format,
+        const Args&... args)
+{
+    if(is_enabled(subsystem::engine, p)) {
+        detail::record(subsystem::engine, p, -1, nullptr, -1, {}, event, format,
+                args...);
+    }
+}
+
+/** Like `log_engine`, but `url` is prepended to the entry's header. */
+template <typename... Args>
+void log_tracker(string_view url, const char* event, const priority p,
+        const char* format, const Args&... args)
+{
+    if(is_enabled(subsystem::engine, p)) {
+        detail::record(subsystem::engine, p, -1, nullptr, -1, url, event, format,
+                args...);
+    }
+}
+
+template <typename... Args>
+void log_torrent(const torrent_id_t torrent, const char* event, const priority p,
+        const char* format, const Args&... args)
+{
+    if(is_enabled(subsystem::torrent, p)) {
+        detail::record(subsystem::torrent, p, torrent, nullptr, -1, {}, event, format,
+                args...);
+    }
+}
+
+/**
+ * `torrent` is -1 for incoming connections not yet attached to a torrent, and
+ * `connection_age` is the number of seconds since the connection was established, or
+ * -1 if it's not established.
+ */
+template <typename... Args>
+void log_peer_session(const torrent_id_t torrent, const tcp::endpoint& endpoint,
+        const int connection_age, const char* event, const priority p,
+        const char* format, const Args&... args)
+{
+    if(is_enabled(subsystem::peer_session, p)) {
+        detail::record(subsystem::peer_session, p, torrent, &endpoint, connection_age,
+                {}, event, format, args...);
+    }
+}
+
+template <typename... Args>
+void log_disk_io(const char* event, const priority p, const char* format,
+        const Args&... args)
+{
+    if(is_enabled(subsystem::disk_io, p)) {
+        detail::record(subsystem::disk_io, p, -1, nullptr, -1, {}, event, format,
+                args...);
+    }
+}
+
 } // log
 } // tide
 
@@ -44,6 +44,8 @@ struct message
         have_none = 15,
         reject_request = 16,
         allowed_fast = 17,
+        // -- Extension protocol messages --
+        extended = 20,
     };
 
     int type;
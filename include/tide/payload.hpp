@@ -30,6 +30,8 @@ struct payload
     payload(const uint8_t (&arr)[N]) : data(std::begin(arr), std::end(arr))
     {}
 
+    void clear() noexcept { data.clear(); }
+
     payload& i8(const int8_t h)
     {
         data.emplace_back(h);
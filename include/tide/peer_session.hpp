@@ -12,16 +12,19 @@
 #include "message_parser.hpp"
 #include "peer_session_error.hpp"
 #include "per_round_counter.hpp"
+#include "rate_limiter.hpp"
 #include "send_buffer.hpp"
 #include "sliding_average.hpp"
 #include "socket.hpp"
 #include "stats.hpp"
+#include "stream_socket.hpp"
 #include "throughput_rate.hpp"
 #include "time.hpp"
 #include "torrent_frontend.hpp"
 #include "types.hpp"
 
 #include <memory>
+#include <string>
 #include <vector>
 
 #include <asio/io_context.hpp>
@@ -29,7 +32,7 @@
 namespace tide {
 
 class peer_session_settings;
-class torrent_rate_limiter;
+class buffer_budget;
 class disk_read_buffer;
 class piece_download;
 class torrent_info;
@@ -117,13 +120,26 @@ private:
     // We receive from socket directly into message_parser's internal buffer.
     message_parser message_parser_;
 
-    // For now socket is tcp only but this will be a generic stream socket
-    // (hence the pointer), which then may be tcp, udp, ssl<tcp>, socks5 etc
-    std::unique_ptr<tcp::socket> socket_;
+    // This is a generic stream socket (hence the pointer), which may be tcp or utp,
+    // and in the future ssl<tcp>, socks5 etc.
+    std::unique_ptr<stream_socket> socket_;
 
     // We may be rate limited so we must always request upload and download
-    // bandwidth quota before proceeding to do either of those functions.
-    torrent_rate_limiter& rate_limiter_;
+    // bandwidth quota before proceeding to do either of those functions. This is
+    // the lowest level of the rate limiter hierarchy, below our torrent's limiter
+    // for our peer class (and below the global limiter until we're attached to a
+    // torrent).
+    peer_rate_limiter rate_limiter_;
+
+    // The memory of our receive and send buffers is paid for out of this
+    // `engine` wide budget, so we must reserve memory before growing either
+    // buffer and give it back when we shrink them.
+    buffer_budget& buffer_budget_;
+
+    // The number of bytes of `buffer_budget_` we currently hold for the receive
+    // and send buffers, respectively.
+    int num_reserved_receive_bytes_ = 0;
+    int num_reserved_send_bytes_ = 0;
 
     // These are the tunable parameters that the user provides.
     const peer_session_settings& settings_;
@@ -371,14 +387,32 @@ private:
     // and a torrent info hash could be extracted. It is not used otherwise.
     std::function<torrent_frontend(const sha1_hash&)> torrent_attacher_;
 
+    // The id peer assigned to the ut_pex message in its extended handshake (BEP 10),
+    // or 0 if peer doesn't support peer exchange or hasn't told us yet.
+    int peer_pex_id_ = 0;
+
+    // The port on which peer accepts connections, as advertised in its extended
+    // handshake, or 0 if unknown.
+    uint16_t peer_listen_port_ = 0;
+
+    // The peers we have advertised to peer so far (i.e. all those that were added
+    // minus those that were dropped in the PEX messages we sent), sorted. The next
+    // PEX message only contains the difference between this and the current swarm.
+    std::vector<tcp::endpoint> advertised_pex_peers_;
+    time_point last_pex_send_time_;
+
 public:
     /**
      * Instantiate an outbound connection (when connections are made by torrent,
      * i.e. the torrent is known), but does NOT start the session or connect,
      * that is done by calling `start`.
+     *
+     * `socket` must not be open yet. If it's a uTP socket and the connection
+     * can't be established over uTP, it's attempted over TCP instead.
      */
     peer_session(asio::io_context& ios, tcp::endpoint peer_endpoint,
-            torrent_rate_limiter& rate_limiter, const peer_session_settings& settings,
+            torrent_rate_limiter& rate_limiter, buffer_budget& buffer_budget,
+            const peer_session_settings& settings, std::unique_ptr<stream_socket> socket,
             torrent_frontend torrent);
 
     /**
@@ -390,6 +424,9 @@ public:
      * available in the ctor), so start has to be called once the `peer_session`
      * is constructed, after which the session is continued.
      *
+     * Until then, the session's bandwidth is only limited by `global_rate_limiter`
+     * and its own limits.
+     *
      * The `torrent_attacher` handler is called after we receive peer's handshake.
      * This is used to locate the torrent to which this connection belongs.
      * After this, we have the torrent's info hash so we can send our handshake
@@ -399,8 +436,8 @@ public:
      * the connection is closed and this `peer_session` may be removed.
      */
     peer_session(asio::io_context& ios, tcp::endpoint peer_endpoint,
-            torrent_rate_limiter& rate_limiter, const peer_session_settings& settings,
-            std::unique_ptr<tcp::socket> socket,
+            rate_limiter& global_rate_limiter, buffer_budget& buffer_budget,
+            const peer_session_settings& settings, std::unique_ptr<stream_socket> socket,
             std::function<torrent_frontend(const sha1_hash&)> torrent_attacher);
 
     /**
@@ -437,6 +474,13 @@ public:
     void unchoke_peer();
     void suggest_piece(const piece_index_t piece);
 
+    /**
+     * Sends peer a PEX message (BEP 11) with the endpoints in `peers` that we haven't
+     * advertised yet and the advertised ones that are no longer in `peers`. Nothing
+     * is sent if peer doesn't support PEX, or if we sent one less than a minute ago.
+     */
+    void send_pex(const std::vector<tcp::endpoint>& peers);
+
     /**
      * This is called (by `torrent`) when a piece was successfully downloaded.
      * It may alter our interest in peer.
@@ -518,6 +562,8 @@ public:
     bool is_peer_on_parole() const noexcept;
     bool is_peer_seed() const noexcept;
     bool is_outbound() const noexcept;
+    /** Whether we're connected to peer over uTP (rather than TCP). */
+    bool is_utp() const noexcept;
     bool has_pending_disk_op() const noexcept;
     bool has_pending_socket_op() const noexcept;
     bool has_pending_async_op() const noexcept;
@@ -533,6 +579,7 @@ public:
     void get_detailed_stats(detailed_stats& s) const noexcept;
 
     time_point last_outgoing_unchoke_time() const noexcept;
+    time_point connection_started_time() const noexcept;
     time_point connection_established_time() const noexcept;
     seconds connection_duration() const noexcept;
 
@@ -541,8 +588,17 @@ public:
     const tcp::endpoint& local_endpoint() const noexcept;
     const tcp::endpoint& remote_endpoint() const noexcept;
 
+    /**
+     * Returns the endpoint on which peer accepts connections. This is the remote
+     * endpoint of outbound connections, but for inbound connections it's only known
+     * if peer sent its listen port in its extended handshake, and a default
+     * constructed endpoint is returned otherwise.
+     */
+    tcp::endpoint listen_endpoint() const noexcept;
+
     int upload_rate() const noexcept;
     int download_rate() const noexcept;
+    int peak_upload_rate() const noexcept;
 
     /**
      * Returns how many bytes were transferred since the last time the function was
@@ -553,9 +609,13 @@ public:
     int num_bytes_downloaded_this_round() const noexcept;
 
 private:
-    /** Initializes fields common to both constructors. */
+    /**
+     * Initializes fields common to both constructors. `rate_limiter_` is placed
+     * below `rate_limiter` until it's attached to its torrent.
+     */
     peer_session(asio::io_context& ios, tcp::endpoint peer_endpoint,
-            torrent_rate_limiter& rate_limiter, const peer_session_settings& settings);
+            rate_limiter& rate_limiter, buffer_budget& buffer_budget,
+            const peer_session_settings& settings, std::unique_ptr<stream_socket> socket);
 
     /**
      * If our interest changes, sends the corresponding send_{un,}interested
@@ -570,6 +630,12 @@ private:
     void connect();
     void on_connected(const error_code& error = error_code());
 
+    /**
+     * Called when a uTP connection could not be established. Replaces the socket
+     * with a TCP socket and starts connecting anew.
+     */
+    void fall_back_to_tcp(const error_code& error);
+
     /**
      * This is called by each of the four async operations callbacks if they
      * detect that we're disconnecting (gracefully stopping). If there are no
@@ -610,6 +676,13 @@ private:
     void on_sent(const error_code& error, size_t num_bytes_sent);
     void update_send_stats(const int num_bytes_sent) noexcept;
 
+    /**
+     * Returns the number of bytes the send buffer may hold before we stop serving
+     * peer's requests, which is the lesser of our fair share of the buffer budget
+     * and `peer_session_settings::max_send_buffer_size`.
+     */
+    int send_buffer_capacity() const;
+
     // ---------
     // receiving
     // ---------
@@ -638,6 +711,27 @@ private:
     /** Attempts to reserve download quota but if it fails, subscribes for more. */
     void request_receive_quota(const int num_bytes);
 
+    /**
+     * Reserves at most `num_bytes` of the buffer budget for growing the receive
+     * buffer and returns the number of bytes reserved. The receive buffer may
+     * always grow up to `buffer_budget::min_session_share` bytes so that we're
+     * never stalled in the middle of a message.
+     */
+    int reserve_receive_buffer_space(const int num_bytes);
+
+    /**
+     * If the buffer budget is exhausted, we can't receive until other sessions
+     * release memory, so this registers a handler with the budget that resumes
+     * the receive cycle (and requests) once this happens.
+     */
+    void subscribe_for_buffer_memory();
+
+    /**
+     * Brings our reservations in the buffer budget in line with the actual sizes
+     * of the receive and send buffers, which may have grown or shrunk since.
+     */
+    void update_buffer_reservations();
+
     /**
      * Accounts for the bytes read, subtracts num_bytes_received from the send
      * quota, checks if the async_read_some operation read all available bytes
@@ -648,8 +742,8 @@ private:
     void update_receive_stats(const int num_bytes_received) noexcept;
 
     /**
-     * If we got choked or received vastly fewer bytes than the current buffer
-     * capacity and don't expect too many more bytes, receive buffer is shrunk.
+     * If we got choked, or if the buffer budget is under pressure and we hold
+     * more of it than our throughput warrants, receive buffer is shrunk.
      */
     void adjust_receive_buffer(const bool was_choked, const size_t num_bytes_received);
     bool am_expecting_block() const noexcept;
@@ -694,12 +788,17 @@ private:
     void handle_cancel();
     void handle_block();
     // -- DHT extension messages --
+    void handle_port();
     // -- Fast extension messages --
     void handle_suggest_piece();
     void handle_have_all();
     void handle_have_none();
     void handle_reject_request();
     void handle_allowed_fast();
+    // -- Extension protocol messages --
+    void handle_extended();
+    void handle_extended_handshake(const_view<uint8_t> data);
+    void handle_pex(const_view<uint8_t> data);
 
     /**
      * BitComet rejects messages by way of sending an empty block message, so
@@ -828,6 +927,9 @@ private:
     void send_reject_request(const block_info& block);
     void send_allowed_fast(const piece_index_t piece);
     void send_allowed_fast_set();
+    // -- Extension protocol messages --
+    void send_extended_handshake();
+    void send_extended(const int extended_id, const std::string& data);
 
     /** Sends either a bitfield, have_all or have_none. */
     void send_piece_availability();
@@ -857,6 +959,26 @@ private:
     view<pending_block> make_requests_in_endgame_mode();
     view<pending_block> view_of_new_requests(const int n);
 
+    /**
+     * Returns whether all pieces we need are being downloaded and all their blocks
+     * are requested, in which case torrent enters end-game mode.
+     */
+    bool is_every_block_requested() const noexcept;
+
+    /**
+     * In end-game mode, requests blocks from this peer that are already requested
+     * from other peers but have been outstanding for a while, so that the slowest
+     * peers don't hold up completion. See
+     * `peer_session_settings::max_end_game_requests_per_block`.
+     *
+     * If `only_time_critical` is set, this is restricted to the pieces whose deadline
+     * is closer than `peer_session_settings::time_critical_redundancy_margin`, which
+     * is done regardless of end-game mode.
+     *
+     * New requests are placed in outgoing_requests_, and their number is returned.
+     */
+    int make_redundant_requests(const bool only_time_critical = false);
+
     /**
      * Tries to pick blocks from downloads in which this peer participates. We
      * always strive to download as few simultaneous blocks at a time from
@@ -875,11 +997,16 @@ private:
      *
      * New requests are placed in outgoing_requests_.
      *
+     * Only downloads of this peer's speed class are joined, unless
+     * `ignore_speed_class` is set, which is done once the piece picker has no
+     * more pieces to hand out, so that no peer idles while others still have
+     * unrequested blocks.
+     *
      * The number of blocks that have been placed in the request queue are
      * returned.
      */
-    int join_download();
-    std::shared_ptr<piece_download> find_shared_download();
+    int join_download(const bool ignore_speed_class = false);
+    std::shared_ptr<piece_download> find_shared_download(const bool ignore_speed_class);
 
     /**
      * Starts a new download and registers it in shared_downloads_ so that other
@@ -1034,6 +1161,11 @@ inline bool peer_session::is_outbound() const noexcept
     return info_.is_outbound;
 }
 
+inline bool peer_session::is_utp() const noexcept
+{
+    return socket_->type() == stream_socket::transport::utp;
+}
+
 inline bool peer_session::has_pending_disk_op() const noexcept
 {
     return op_state_[op::disk_read] || op_state_[op::disk_write];
@@ -1064,6 +1196,11 @@ inline time_point peer_session::last_outgoing_unchoke_time() const noexcept
     return info_.last_outgoing_unchoke_time;
 }
 
+inline time_point peer_session::connection_started_time() const noexcept
+{
+    return info_.connection_started_time;
+}
+
 inline time_point peer_session::connection_established_time() const noexcept
 {
     return info_.connection_established_time;
@@ -1091,6 +1228,16 @@ inline const tcp::endpoint& peer_session::remote_endpoint() const noexcept
     return info_.remote_endpoint;
 }
 
+inline tcp::endpoint peer_session::listen_endpoint() const noexcept
+{
+    if(is_outbound()) {
+        return info_.remote_endpoint;
+    } else if(peer_listen_port_ != 0) {
+        return tcp::endpoint(info_.remote_endpoint.address(), peer_listen_port_);
+    }
+    return {};
+}
+
 inline int peer_session::num_bytes_uploaded_this_round() const noexcept
 {
     const auto n = num_uploaded_piece_bytes_;
@@ -1115,6 +1262,11 @@ inline int peer_session::upload_rate() const noexcept
     return info_.upload_rate.rate();
 }
 
+inline int peer_session::peak_upload_rate() const noexcept
+{
+    return info_.upload_rate.peak();
+}
+
 // -- pending block --
 
 inline bool operator==(const pending_block& a, const pending_block& b) noexcept
@@ -23,6 +23,19 @@ struct piece_download
     using peer_id_type = tcp::endpoint;
     class peer;
 
+    /**
+     * Peers are classified by how fast we download from them, and a download is only
+     * shared by peers of the class of the peer that started it, so that slow peers
+     * don't hold up the pieces of fast peers. Downloads started by fast peers are not
+     * shared at all (see `peer_session::find_shared_download`).
+     */
+    enum class speed_class : uint8_t
+    {
+        slow,
+        medium,
+        fast
+    };
+
     struct block
     {
         enum class status : uint8_t
@@ -116,6 +129,8 @@ private:
     // upper limit from this value.
     milliseconds avg_request_rtt_{0};
 
+    enum speed_class speed_class_ = speed_class::medium;
+
 public:
     piece_download(const piece_index_t index, const int piece_length);
 
@@ -143,6 +158,13 @@ public:
 
     milliseconds average_request_rtt() const noexcept;
 
+    /**
+     * The speed class of the peer that started this download, or of the peer that
+     * took it over after all its previous participants left.
+     */
+    enum speed_class speed_class() const noexcept;
+    void set_speed_class(const enum speed_class c) noexcept;
+
     /**
      * When we have downloaded a block from a peer, we must register it with the
      * piece_download so that the completion handler can be invoked in post_hash_result
@@ -225,6 +247,20 @@ public:
     template <typename RequestQueue>
     int pick_blocks(RequestQueue& queue, const peer_id_type& id, const int n);
 
+    /**
+     * Used in end-game mode, this picks up to n blocks that have been requested from
+     * other peers but haven't arrived yet, for peer to download as well. Whichever
+     * copy arrives first wins, and the cancel handlers of the other peers are invoked
+     * (see got_block).
+     *
+     * Only blocks that have been requested at least `min_request_age` ago and from
+     * fewer than `max_peers_per_block` peers are picked. The number of blocks placed
+     * in queue is returned.
+     */
+    template <typename RequestQueue>
+    int pick_redundant_blocks(RequestQueue& queue, const peer_id_type& id, const int n,
+            const duration min_request_age, const int max_peers_per_block);
+
 private:
     void update_average_request_rtt(const duration& rtt);
     block_info pick_block(peer& peer, int offset_hint);
@@ -290,6 +326,16 @@ inline milliseconds piece_download::average_request_rtt() const noexcept
     return avg_request_rtt_;
 }
 
+inline enum piece_download::speed_class piece_download::speed_class() const noexcept
+{
+    return speed_class_;
+}
+
+inline void piece_download::set_speed_class(const enum speed_class c) noexcept
+{
+    speed_class_ = c;
+}
+
 template <typename RequestQueue>
 int piece_download::pick_blocks(RequestQueue& queue, const peer_id_type& id, const int n)
 {
@@ -311,6 +357,32 @@ int piece_download::pick_blocks(RequestQueue& queue, const peer_id_type& id, con
     return num_picked;
 }
 
+template <typename RequestQueue>
+int piece_download::pick_redundant_blocks(RequestQueue& queue, const peer_id_type& id,
+        const int n, const duration min_request_age, const int max_peers_per_block)
+{
+    auto& peer = find_peer(id);
+    const auto now = cached_clock::now();
+    int num_picked = 0;
+    for(auto i = 0; (i < num_blocks()) && (num_picked < n); ++i) {
+        block& block = blocks_[i];
+        if((block.status != block::status::requested)
+                || (int(block.peers.size()) >= max_peers_per_block)
+                || (now - block.request_time < min_request_age)
+                || peer.is_requesting_block(block)) {
+            continue;
+        }
+        // The block's request time is left as is, as it's the original request that
+        // we measure timeouts and round trip times against.
+        peer.blocks.emplace_back(std::ref(block));
+        block.peers.emplace_back(peer.id);
+        const int offset = i * 0x4000;
+        queue.emplace_back(piece_index(), offset, block_length(offset));
+        ++num_picked;
+    }
+    return num_picked;
+}
+
 } // namespace tide
 
 #endif // TIDE_PIECE_DOWNLOAD_HEADER
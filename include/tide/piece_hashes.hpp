@@ -0,0 +1,70 @@
+#ifndef TIDE_PIECE_HASHES_HEADER
+#define TIDE_PIECE_HASHES_HEADER
+
+#include "error_code.hpp"
+#include "path.hpp"
+#include "string_view.hpp"
+#include "types.hpp"
+
+#include <cassert>
+#include <memory>
+#include <string>
+
+namespace tide {
+
+/**
+ * The expected SHA-1 hashes of all pieces of a torrent, as a single immutable block of
+ * memory. Copies share the same block, so a torrent's hashes are kept only once, no
+ * matter how many parties (the torrent, its storage) hold on to them. This matters
+ * because torrents may have millions of pieces, i.e. tens of MB of hashes.
+ *
+ * The hashes are either held in memory, or memory mapped from a sidecar file (see
+ * `write` and `map_file`), in which case they're only paged in by the OS as they're
+ * read, and may be paged out again under memory pressure.
+ *
+ * Since the memory is never written to, an instance may be read by multiple threads
+ * concurrently.
+ */
+class piece_hashes
+{
+    // Keeps the memory pointed to by data_ alive, be it a string or a mapping.
+    std::shared_ptr<const void> owner_;
+    const char* data_ = nullptr;
+    int num_pieces_ = 0;
+
+public:
+    piece_hashes() = default;
+
+    /** Copies the concatenated hashes, e.g. the "pieces" field of the metainfo. */
+    explicit piece_hashes(string_view hashes);
+
+    /**
+     * Maps the sidecar file at `path`, which must have been created with `write`. If
+     * it doesn't exist or is invalid (its length is not a multiple of 20), error is
+     * set and an empty instance is returned.
+     */
+    static piece_hashes map_file(const path& path, error_code& error);
+
+    /** Writes the hashes to the sidecar file at `path`, replacing it if it exists. */
+    void write(const path& path, error_code& error) const;
+
+    bool empty() const noexcept { return num_pieces_ == 0; }
+    int num_pieces() const noexcept { return num_pieces_; }
+
+    /** Returns all hashes concatenated. */
+    string_view data() const noexcept
+    {
+        return string_view(data_, size_t(num_pieces_) * 20);
+    }
+
+    /** Returns the hash of `piece`, which must be in [0, num_pieces). */
+    string_view operator[](const piece_index_t piece) const noexcept
+    {
+        assert((piece >= 0) && (piece < num_pieces_));
+        return string_view(data_ + size_t(piece) * 20, 20);
+    }
+};
+
+} // tide
+
+#endif // TIDE_PIECE_HASHES_HEADER
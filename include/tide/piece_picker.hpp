@@ -3,6 +3,7 @@
 
 #include "bitfield.hpp"
 #include "interval.hpp"
+#include "time.hpp"
 #include "types.hpp"
 
 #include <vector>
@@ -14,46 +15,58 @@ class piece_picker
     // A full piece availability map of our pieces.
     bitfield my_pieces_;
 
+    // The pieces that have been picked (or reserved) but not yet downloaded. This is
+    // kept as a bitfield, rather than a flag per piece, so that the pieces that may
+    // be picked from a peer can be determined 64 pieces at a time.
+    bitfield reserved_pieces_;
+
     struct piece
     {
         piece_index_t index;
         uint16_t frequency;
-        bool is_reserved;
 
         piece() = default;
-        piece(piece_index_t i, uint16_t f = 0, bool r = false)
-            : index(i), frequency(f), is_reserved(r)
-        {}
+        piece(piece_index_t i, uint16_t f = 0) : index(i), frequency(f) {}
     };
 
-    // These are the pieces that we still need (regardless of frequency) to
-    // download.
-    // They are ordered according to priority (highest to lowest) and frequency
-    // (lowest to highest). As soon as we get a piece, it is removed from here.
+    // All pieces of the torrent. The pieces that we still need to download come
+    // first, grouped into frequency buckets in ascending order of frequency (see
+    // `bucket_begins_`), followed by the pieces that we have, in no particular order.
+    // The frequency of the pieces we have is tracked as well, so that a piece that
+    // we lose can be put back in its bucket.
+    //
+    // A frequency change moves a piece to the adjacent bucket by swapping it with
+    // the piece at the boundary of its bucket and moving the boundary past it, so
+    // it's a constant time operation, and the buckets never need to be sorted.
+    // Within a bucket pieces are in no particular order.
     std::vector<piece> pieces_;
 
-    // An entry in this vector represents a priority group with a [begin, end)
-    // interval that denotes the boundaries of the group.
-    // It is ordered by highest priority to lowest priority, with the default
-    // group always positioned as the last group. However, the default group is
-    // not allocated a slot in this list as it's always the last group. This
-    // allows us to avoid allocating the vector if there are no priority pieces.
-    std::vector<interval> priority_groups_;
-
-    // Since `pieces_` is ordered by priority and frequency, we need a fast way to
-    // retrieve individual pieces (by their indices). This vector is fully
-    // allocated to `num_pieces` and stores indices into `pieces_`, and a piece's
-    // position can be retrieved by `piece_pos_map_[piece_index]`.
-    // While this vector always holds all pieces, pieces that we no longer need
-    // to download are removed from `pieces_`. Those are mapped to `invalid_pos`.
+    // Bucket `f` holds the needed pieces with frequency `f`, which are in the range
+    // [bucket_begins_[f], bucket_begins_[f + 1]) in `pieces_`. The last entry is
+    // the end of the needed pieces, i.e. the number of pieces left. There is always
+    // at least one bucket, and buckets are only added, so there may be empty ones.
+    std::vector<int> bucket_begins_;
+
+    // Since `pieces_` is ordered by frequency, we need a fast way to retrieve
+    // individual pieces (by their indices). This vector is fully allocated to
+    // `num_pieces` and stores indices into `pieces_`, and a piece's position can be
+    // retrieved by `piece_pos_map_[piece_index]`.
     std::vector<int> piece_pos_map_;
-    static constexpr int invalid_pos = -1;
 
-    // Keeping `pieces_` sorted at all times is an expensive operation, and we
-    // only need to reorder pieces when we actually pick a piece. That is, piece
-    // frequency changes cause this flag to be set, and if this flag is set when
-    // picking, we need to call `rebuild_frequency_map` beforehand.
-    bool is_dirty_ = false;
+public:
+    /** A piece that is needed by a certain time, see `set_deadline`. */
+    struct time_critical_piece
+    {
+        piece_index_t index;
+        time_point deadline;
+    };
+
+private:
+    // The pieces that have a deadline, in ascending order of their deadlines. Pieces
+    // with equal deadlines are in the order in which their deadlines were set. These
+    // are usually the few pieces just ahead of a media player's playback position,
+    // so this is kept small and a linear search suffices.
+    std::vector<time_critical_piece> time_critical_pieces_;
 
 public:
     /** Describes the strategy used for picking pieces. */
@@ -69,14 +82,16 @@ public:
         // This is the mode in which a torrent operates after concluding the initial
         // phase with random, unless set to sequential.
         rarest_first,
-        // If we download sequentially, we can drop a lot of the piece map logic
-        // by always keeping `pieces_` ordered by piece indices.
+        // The needed pieces are picked in the order of their indices.
         sequential
     };
 
 private:
     strategy strategy_ = strategy::rarest_first;
 
+    // See `set_run_affinity`. Negative if disabled.
+    int run_affinity_ = -1;
+
 public:
     explicit piece_picker(int num_pieces);
     explicit piece_picker(bitfield downloaded_pieces);
@@ -101,6 +116,17 @@ public:
     enum strategy strategy() const noexcept;
     void set_strategy(const enum strategy s) noexcept;
 
+    /**
+     * If enabled (`n` is not negative), the rarest first strategy prefers pieces that
+     * extend a run of adjacent pieces that we have or are downloading, so that pieces
+     * are written to disk in longer sequential runs, which benefits rotational drives.
+     * Such a piece is picked over a rarer piece as long as its frequency is at most
+     * `n` higher, i.e. a value of 0 only breaks ties among the rarest pieces. This
+     * costs a scan of the bitfields with each pick.
+     */
+    void set_run_affinity(const int n) noexcept;
+    int run_affinity() const noexcept;
+
     /**
      * The availability of a piece is mapped to the position in frequency_map
      * corresponding to the piece's index. The pieces we have already downloaded are
@@ -129,7 +155,8 @@ public:
 
     /**
      * Picks and reserves the most suitable piece from available_pieces, or returns
-     * invalid_piece_index if none could be picked.
+     * invalid_piece_index if none could be picked. Time critical pieces are picked
+     * first, in the order of their deadlines, regardless of the strategy.
      */
     piece_index_t pick(const bitfield& available_pieces);
 
@@ -159,6 +186,20 @@ public:
     void dont_want_piece(const piece_index_t piece);
     void dont_want_pieces(const interval pieces);
 
+    /**
+     * Makes `piece` time critical, i.e. it is picked before any piece that has no or
+     * a later deadline. Setting the deadline of a piece that already has one
+     * replaces it. Pieces that we have are ignored, and a piece's deadline is
+     * cleared once we get it.
+     */
+    void set_deadline(const piece_index_t piece, const time_point deadline);
+    void clear_deadline(const piece_index_t piece);
+    void clear_deadlines();
+
+    /** Returns the deadline of `piece`, or time_point::max() if it has none. */
+    time_point deadline(const piece_index_t piece) const noexcept;
+    const std::vector<time_critical_piece>& time_critical_pieces() const noexcept;
+
     /**
      * Places pieces at the beginning of the to-download-next queue, regardless whether
      * they're fully available.
@@ -189,14 +230,56 @@ public:
 
     /**
      * Used only for debugging, returns a beautified string of the to-be-downloaded
-     * pieces, ordered by priority groups and frequency.
+     * pieces, grouped into frequency buckets.
      */
     std::string to_string() const;
 
 private:
-    void rebuild_frequency_map() noexcept;
-    void rebuild_group(std::vector<piece>::iterator begin,
-            std::vector<piece>::iterator end) noexcept;
+    int num_buckets() const noexcept { return bucket_begins_.size() - 1; }
+    bool is_needed(const int pos) const noexcept { return pos < bucket_begins_.back(); }
+
+    /** Reorders the needed pieces into buckets by their current frequencies. */
+    void rebuild_buckets();
+
+    /** Swaps the pieces at the two positions in `pieces_` and updates their mapping. */
+    void swap_pieces(const int a, const int b) noexcept;
+
+    /**
+     * Moves the needed piece at `pos` out of the needed range, to the front of the
+     * pieces we have, by passing it through the boundaries of all higher buckets.
+     */
+    void remove_from_buckets(int pos) noexcept;
+
+    /** The inverse of `remove_from_buckets`, which puts the piece into its bucket. */
+    void add_to_buckets(int pos);
+
+    /**
+     * Returns the position of the first piece in [begin, end) that can be picked,
+     * starting the search at a random position and wrapping around, or
+     * invalid_piece_index. At most `scan_length` pieces are looked at, and
+     * `scan_length` is decreased by the number of pieces that were.
+     */
+    int find_pickable(const int begin, const int end,
+            const bitfield& available_pieces, int& scan_length) const noexcept;
+
+    /**
+     * Returns the piece to pick from the pieces in `available_pieces` that we need
+     * and that are not reserved. These are determined 64 pieces at a time from the
+     * bitfields, and words without any of them are skipped, so only the candidates
+     * are looked up. The search starts at `first_word` and wraps around. Unless
+     * `is_rarest_first` is set, the first candidate is returned.
+     */
+    piece_index_t pick_candidate(const bitfield& available_pieces,
+            const int first_word, const bool is_rarest_first) const noexcept;
+
+    /**
+     * Returns the rarest piece in `available_pieces` that we can pick, that is
+     * adjacent to a piece we have or have reserved, and whose frequency is at most
+     * `max_frequency`, or invalid_piece_index if there is none. The search stops at
+     * the first piece with `min_frequency`.
+     */
+    piece_index_t pick_run_extension(const bitfield& available_pieces,
+            const int min_frequency, const int max_frequency) const noexcept;
 };
 
 inline int piece_picker::num_pieces() const noexcept
@@ -211,7 +294,7 @@ inline int piece_picker::num_have_pieces() const noexcept
 
 inline int piece_picker::num_pieces_left() const noexcept
 {
-    return pieces_.size();
+    return bucket_begins_.back();
 }
 
 inline void piece_picker::make_top_priority(
@@ -247,6 +330,22 @@ inline bool piece_picker::has_all_pieces() const noexcept
     return num_pieces_left() == 0;
 }
 
+inline const std::vector<piece_picker::time_critical_piece>&
+piece_picker::time_critical_pieces() const noexcept
+{
+    return time_critical_pieces_;
+}
+
+inline void piece_picker::set_run_affinity(const int n) noexcept
+{
+    run_affinity_ = n;
+}
+
+inline int piece_picker::run_affinity() const noexcept
+{
+    return run_affinity_;
+}
+
 inline enum piece_picker::strategy piece_picker::strategy() const noexcept
 {
     return strategy_;
@@ -1,15 +1,44 @@
 #ifndef TIDE_RATE_LIMITER_HEADER
 #define TIDE_RATE_LIMITER_HEADER
 
+#include "time.hpp"
+
+#include <array>
+#include <cstdint>
 #include <deque>
 #include <functional> // function
 
 namespace tide {
 
+/**
+ * Within a torrent, peers are grouped into classes, each of which may be given its
+ * own limits, e.g. so that uTP peers, which yield to other traffic, may use more
+ * bandwidth than TCP peers.
+ */
+enum class peer_class : uint8_t
+{
+    tcp,
+    utp
+};
+
+constexpr int num_peer_classes = 2;
+
 /**
  * This class acts as a container for (upload and download) bandwidth quota,
- * which needs to be periodically refilled, after which network entities can
- * then request quota which they can use.
+ * from which network entities can request quota which they can use.
+ *
+ * Rate limiters form a hierarchy (global -> torrent -> peer class -> peer, with each
+ * session requesting quota through its own rate limiter): each has a token bucket
+ * per direction and may have a parent, and quota granted through a rate limiter is
+ * charged to it and all its ancestors, so a request may only be granted as much as
+ * every level allows. Buckets are refilled continuously
+ * based on the time elapsed since they were last refilled, rather than in discrete
+ * chunks, so throughput remains smooth even at low rate limits.
+ *
+ * When not enough quota is available, entities may subscribe for more. These are
+ * queued in the root of the hierarchy (the scheduler) and are served in deficit
+ * round robin order each time `distribute_quota` is called, so that no single
+ * subscriber may starve others.
  *
  * All values are in bytes.
  */
@@ -19,22 +48,57 @@ struct rate_limiter
     using token_type = void*;
     constexpr static int unlimited = -1;
 
+    // In each round of deficit round robin, every waiting subscriber's deficit is
+    // increased by a quantum, which is the most it may be granted in that round.
+    // The quantum is chosen such that all subscribers may be served from a full
+    // bucket, but is no larger than this, so that subscribers are served in small
+    // slices in rapid succession rather than in large bursts.
+    constexpr static int max_quantum = 0x4000;
+
+    // Requests for quota are not granted fewer than this many bytes (unless fewer
+    // were requested).
+    constexpr static int min_quota_grant = 1024;
+
 protected:
-    /** Used to index into `quotas_`, `max_quotas_`, and `quota_requester_queues_`. */
+    /** Used to index into `buckets_` and `quota_requester_queues_`. */
     enum channel
     {
         download,
         upload
     };
 
-    // The available bandwidth quota until it is refilled.
-    int quotas_[2] = {unlimited, unlimited};
+    struct token_bucket
+    {
+        // The number of bytes added to the bucket each second.
+        int rate = unlimited;
+
+        // We need a maximum quota, as otherwise, if not much traffic is exchanged,
+        // the quota would accumulate indefinitely, and when data starts to be
+        // exchanged then possibly more data may be transferred than the desired per
+        // second cap. This is a tenth of `rate`, but at least a full block.
+        int capacity = unlimited;
+
+        // The available bandwidth quota. Always 0 if `rate` is unlimited.
+        int64_t tokens = 0;
 
-    // We need a maximum quota, as otherwise, if not much traffic is exchanged,
-    // the quota would accumulate indefinitely, and when data starts to be
-    // exchanged then possibly more data may be transferred than the desired per
-    // second cap.
-    int max_quotas_[2] = {unlimited, unlimited};
+        time_point last_refill_time = clock::now();
+
+        bool is_unlimited() const noexcept { return rate == unlimited; }
+
+        /** Adds the tokens accumulated since the last refill. */
+        void refill();
+    };
+
+    token_bucket buckets_[2];
+
+    // Quota granted through this rate limiter is also charged to all its ancestors.
+    // This is nullptr for the root of the hierarchy.
+    rate_limiter* parent_ = nullptr;
+
+    // Subscribers are always queued in this rate limiter, which must be
+    // periodically told to distribute quota. It is the root of the hierarchy or
+    // `this` if it is the root.
+    rate_limiter* scheduler_ = this;
 
     /**
      * It's possible that an entity requesting bandwidth quota will not receive
@@ -46,41 +110,75 @@ protected:
     struct quota_requester
     {
         token_type token;
+        // The rate limiter through which quota was requested. This and its
+        // ancestors are charged for the quota granted to this requester.
+        rate_limiter* limiter;
         int num_desired_bytes;
+        // The number of bytes this requester may be granted in the current round
+        // of deficit round robin.
+        int deficit = 0;
+        int num_granted_bytes = 0;
+        // When the requester was queued, to measure how long it waits for quota.
+        time_point subscription_time;
         std::function<void(int)> handler;
     };
 
-    // All entities that have subscribed for bandwidth quota.
+    // All entities that have subscribed for bandwidth quota. Only used by the
+    // scheduler.
     std::deque<quota_requester> quota_requester_queues_[2];
 
+    // The number of requesters that were served, and the total time they waited for
+    // quota, for each channel. Only used by the scheduler.
+    int64_t num_quota_waits_[2] = {0, 0};
+    duration total_quota_wait_time_[2] = {duration(0), duration(0)};
+
 public:
-    int download_quota() const noexcept { return quotas_[download]; }
-    int upload_quota() const noexcept { return quotas_[upload]; }
-    int max_download_quota() const noexcept { return max_quotas_[download]; }
-    int max_upload_quota() const noexcept { return max_quotas_[upload]; }
+    rate_limiter() = default;
+
+    /** Creates a rate limiter whose quota is also charged to `parent`. */
+    explicit rate_limiter(rate_limiter& parent)
+        : parent_(&parent), scheduler_(parent.scheduler_)
+    {}
+
+    rate_limiter(const rate_limiter&) = delete;
+    rate_limiter& operator=(const rate_limiter&) = delete;
 
     /**
-     * Increases bandwidth quota by `n` bytes, but will not cause values to
-     * exceed their respective maximums.
-     *
-     * If `n` is `unlimited`, the internal value and its corresponding maximum
-     * values are both set to `unlimited`.
+     * Returns the quota currently available in this rate limiter's own bucket
+     * (not considering its ancestors), or `unlimited`.
+     */
+    int download_quota() const noexcept { return quota(download); }
+    int upload_quota() const noexcept { return quota(upload); }
+    int max_download_quota() const noexcept { return buckets_[download].capacity; }
+    int max_upload_quota() const noexcept { return buckets_[upload].capacity; }
+    int max_download_rate() const noexcept { return buckets_[download].rate; }
+    int max_upload_rate() const noexcept { return buckets_[upload].rate; }
+
+    /**
+     * Returns `n` bytes of unused quota to this rate limiter and its ancestors
+     * (e.g. when an entity that was granted quota no longer needs it). Buckets are
+     * not filled beyond their capacity and unlimited buckets are not affected.
      */
     void add_download_quota(const int n) { add_quota(download, n); }
     void add_upload_quota(const int n) { add_quota(upload, n); }
 
-    /** Subtracts bandwidth quota by `n` bytes. */
+    /** Subtracts `n` bytes of quota from this rate limiter and its ancestors. */
     void subtract_download_quota(const int n) { subtract_quota(download, n); }
     void subtract_upload_quota(const int n) { subtract_quota(upload, n); }
 
     /**
-     * Sets max quota to `n` and if `n` is not `unlimited` and the current quota
-     * exceeds `n`, quota is also set to `n.
+     * Sets the rate at which quota is refilled to `n` bytes/s, which may be
+     * `unlimited`. If the current quota exceeds the new capacity, it is
+     * truncated.
      */
     void set_max_download_rate(const int n) { set_max_rate(download, n); }
     void set_max_upload_rate(const int n) { set_max_rate(upload, n); }
 
-    /** Returns `num_desired_bytes` or less quota. */
+    /**
+     * Returns `num_desired_bytes` or less quota. If there are entities waiting for
+     * quota that this request would compete with, 0 is returned, so that such
+     * requests don't jump the queue.
+     */
     int request_download_quota(const int num_desired_bytes)
     {
         return request_quota(download, num_desired_bytes);
@@ -92,8 +190,9 @@ public:
     }
 
     /**
-     * Invokes `handler` when new quota is added if quota is 0. Does nothing
-     * otherwise.
+     * Registers `handler` with the scheduler, which invokes it once quota is
+     * distributed to this requester. If `token` is already subscribed, only its
+     * desired number of bytes is updated.
      */
     void subscribe_for_download_quota(const token_type token, const int num_desired_bytes,
             std::function<void(int)> handler)
@@ -110,92 +209,137 @@ public:
     /** Attempts to remove all handlers associated with `token`. */
     void unsubscribe(const token_type token);
 
+    /** Returns the number of entities currently waiting for quota. */
+    int num_download_quota_waiters() const noexcept
+    {
+        return scheduler_->quota_requester_queues_[download].size();
+    }
+
+    int num_upload_quota_waiters() const noexcept
+    {
+        return scheduler_->quota_requester_queues_[upload].size();
+    }
+
+    /**
+     * Returns the number of times entities were served after having subscribed for
+     * quota, and the total time they spent waiting, since the scheduler was created.
+     */
+    int64_t num_download_quota_waits() const noexcept
+    {
+        return scheduler_->num_quota_waits_[download];
+    }
+
+    int64_t num_upload_quota_waits() const noexcept
+    {
+        return scheduler_->num_quota_waits_[upload];
+    }
+
+    duration total_download_quota_wait_time() const noexcept
+    {
+        return scheduler_->total_quota_wait_time_[download];
+    }
+
+    duration total_upload_quota_wait_time() const noexcept
+    {
+        return scheduler_->total_quota_wait_time_[upload];
+    }
+
+    /**
+     * Distributes the quota accumulated since the last call among subscribers in
+     * deficit round robin order. Those that were granted quota are removed from
+     * the queue after their handlers are invoked, and have to subscribe again
+     * should they need more, which places them at the back of the queue.
+     *
+     * This must only be called on the scheduler (i.e. the root of the hierarchy),
+     * at regular intervals (currently done by `engine`).
+     */
+    void distribute_quota();
+
+protected:
+    /** Returns true if none of the buckets from `this` to the root limit `channel`. */
+    bool is_unlimited(const int channel) const noexcept;
+
+    /**
+     * Returns `num_desired_bytes` or less, depending on how much quota this rate
+     * limiter and its ancestors have available, but doesn't consume any quota.
+     * If `refill` is set, buckets are first refilled.
+     */
+    int available_quota(
+            const int channel, const int num_desired_bytes, const bool refill = true);
+
+    /** Consumes `n` bytes of quota from this rate limiter and its ancestors. */
+    void charge(const int channel, const int n);
+
+    /**
+     * Removes the requesters that requested quota through this rate limiter, which
+     * must be done before it's destroyed.
+     */
+    void unsubscribe_all();
+
 private:
+    int quota(const int channel) const noexcept;
     void add_quota(const int channel, const int quota);
     void subtract_quota(const int channel, const int quota);
     void set_max_rate(const int channel, const int max);
     int request_quota(const int channel, const int num_desired_bytes);
     void subscribe_for_quota(const int channel, const token_type token,
             const int num_desired_bytes, std::function<void(int)> handler);
+    void distribute_quota(const int channel);
 };
 
 /**
  * The above class acts as a main/global bandwidth quota distributor of which
  * only one is used in engine, while this is per torrent based and distributes
- * quota among its peer sessions and, depending on whether it's detached from
- * the global rate limiter, is refilled with quota by its corresponding torrent
- * and disregards the global rate limiter, or requests quota from the global
- * rate limiter if it's not detached.
+ * quota among its peer sessions. It sits below the global rate limiter in the
+ * hierarchy, so a torrent's own limits apply in addition to the global ones.
+ * Below it are the rate limiters of its peer classes, under which are those of its
+ * peers. Subscribers are still queued in the global rate limiter, so that all
+ * waiting sessions are served in a single round robin.
  */
 class torrent_rate_limiter : public rate_limiter
 {
-    // The global bandwidth controller from which this torrent_rate_limiter
-    // requests and receives its quota.
-    rate_limiter& global_rate_limiter;
-
-    // A torrent may have separate rate limit settings, in which case it no
-    // longer requests quota from the global limiter but instead metes out quota
-    // from its own reserves, which `torrent` has to refill.
-    bool is_detached_ = false;
+    std::array<rate_limiter, num_peer_classes> peer_class_rate_limiters_;
 
 public:
-    torrent_rate_limiter(rate_limiter& grl) : global_rate_limiter(grl) {}
-
-    /**
-     * A torrent may be exempt from being rate limited by the global rate
-     * limiter employed by `engine`. If this is the case, its downlink and
-     * uplink are both detached from the global limiter.
-     */
-    bool is_detached_from_global_rate_limiter() { return is_detached_; }
+    explicit torrent_rate_limiter(rate_limiter& global_rate_limiter)
+        : rate_limiter(global_rate_limiter)
+        , peer_class_rate_limiters_{{rate_limiter(*this), rate_limiter(*this)}}
+    {}
 
-    /**
-     * `torrent_rate_limiter` no longer requests bandwidth quota from the global
-     * rate limiter in `engine` and instead uses its own reserves, which its
-     * `torrent` must periodically refill.
-     */
-    void detach_from_global_rate_limiter() { is_detached_ = true; }
-
-    /**
-     * Attaches this `torrent_rate_limiter` to the global rate limiter which
-     * then requests bandwidth quota from it. `torrent` may not refill its
-     * bandwidth quota from now on.
-     */
-    void attach_to_global_rate_limiter() { is_detached_ = false; }
+    rate_limiter& peer_class_rate_limiter(const peer_class c) noexcept
+    {
+        return peer_class_rate_limiters_[int(c)];
+    }
+};
 
-    /** Only increases this instance's quota if it's detached. */
-    void add_download_quota(const int quota);
-    void add_upload_quota(const int quota);
+/**
+ * The rate limiter of a single peer, through which it requests all its quota.
+ *
+ * It's unknown to which torrent incoming connections belong until their handshake,
+ * so until then they're only limited by the global rate limiter (and their own
+ * limits), after which they're attached to their torrent's rate limiter.
+ */
+class peer_rate_limiter : public rate_limiter
+{
+    torrent_rate_limiter* torrent_ = nullptr;
+    peer_class class_;
 
-    /** Only decreases this instance's quota if it's detached. */
-    void subtract_download_quota(const int quota);
-    void subtract_upload_quota(const int quota);
+public:
+    peer_rate_limiter(rate_limiter& global_rate_limiter, const peer_class c)
+        : rate_limiter(global_rate_limiter), class_(c)
+    {}
 
-    void set_max_download_rate(const int max);
-    void set_max_upload_rate(const int max);
+    peer_rate_limiter(torrent_rate_limiter& torrent, const peer_class c)
+        : rate_limiter(torrent.peer_class_rate_limiter(c)), torrent_(&torrent), class_(c)
+    {}
 
-    /**
-     * If this instance is attached to the global bandwidth quota, this forwards
-     * the request to that, otherwise serves requester from this instance's own
-     * reserves.
-     */
-    int request_download_quota(const int num_desired_bytes);
-    int request_upload_quota(const int num_desired_bytes);
+    ~peer_rate_limiter() { unsubscribe_all(); }
 
-    /**
-     * If this instance is attached to the global bandwidth quota, this hands
-     * over `handler` to that, otherwise saves `handler` in its own wait queue.
-     * If `handler` is not invoked when this instance is attached to the global
-     * rate limiter, the `handler` is transferred to the rate limiter.
-     *
-     * FIXME if we're detached, register a handler, but then detached, the
-     * handler will not be transfered back!
-     */
-    void subscribe_for_download_quota(const token_type token, const int num_desired_bytes,
-            std::function<void(int)> handler);
-    void subscribe_for_upload_quota(const token_type token, const int num_desired_bytes,
-            std::function<void(int)> handler);
+    /** Places this rate limiter below that of its class in `torrent`. */
+    void attach(torrent_rate_limiter& torrent);
 
-    void unsubscribe(const token_type token);
+    /** Moves this rate limiter under `c`, e.g. when a uTP peer falls back to TCP. */
+    void set_peer_class(const peer_class c);
 };
 
 } // tide
@@ -7,6 +7,8 @@
 #include "types.hpp"
 
 #include <array>
+#include <string>
+#include <vector>
 
 namespace tide {
 namespace values {
@@ -98,6 +100,14 @@ struct torrent_settings
     // performance.
     bool download_sequentially = false;
 
+    // If set to n >= 0, pieces that extend a run of adjacent pieces that we have or
+    // are downloading are preferred over rarer pieces, as long as they're at most
+    // n peers more common, which results in longer sequential disk writes. This
+    // helps when the torrent is downloaded to a rotational drive, at the expense of
+    // rarest-first's piece distribution, and increasingly so with larger values.
+    // A value of 0 only breaks ties among the rarest pieces. Disabled by default.
+    int piece_run_affinity = values::none;
+
     // This stops the torrent (though does not remove it) when all files have
     // been fully downloaded. Take everything, give nothing back, eh?
     bool stop_when_downloaded = false;
@@ -116,14 +126,17 @@ struct torrent_settings
     int max_connections = values::none;
 
     // Specified as the maximum number of bytes that should be transferred in
-    // a second.
-    //
-    // NOTE: if any of these fields are set to other than `values::none`, they
-    // overwrite their counterpart in `settings`, meaning the global rate limits
-    // won't include this torrent. This can be useful when a torrent is to be
-    // urgently downloaded.
+    // a second. These apply in addition to the global rate limits in `settings`,
+    // and `values::none` means the torrent has no limits of its own.
     int max_download_rate = values::none;
     int max_upload_rate = values::none;
+
+    // The same limits for the torrent's TCP and uTP peers (see `peer_class`), which
+    // apply in addition to the above.
+    int max_tcp_download_rate = values::none;
+    int max_tcp_upload_rate = values::none;
+    int max_utp_download_rate = values::none;
+    int max_utp_upload_rate = values::none;
 };
 
 #define TIDE_EARLY_ALPHA_CLIENT_ID                                                     \
@@ -141,7 +154,7 @@ struct peer_session_settings
 
     // The extensions this client wishes to support. See tide/flag_set.hpp to
     // see how to set flags.
-    extensions::flags extensions = {extensions::fast};
+    extensions::flags extensions = {extensions::fast, extensions::extension_protocol};
 
     // The number of seconds we should wait for a peer (regardless of the last
     // sent message type) before concluding it to have timed out and closing the
@@ -164,9 +177,28 @@ struct peer_session_settings
     int min_outgoing_request_queue_size = 4;
     int max_outgoing_request_queue_size = 50;
 
+    // Once every block we still need has been requested (i.e. in end-game mode), the
+    // blocks still outstanding are also requested from peers that are likely to
+    // deliver them sooner, and the other requests are cancelled once the first copy
+    // arrives. This is the maximum number of peers from which a single block may be
+    // requested at the same time, which bounds the bytes wasted on duplicates to
+    // (n - 1) times the outstanding bytes. A value of 1 disables duplicate requests.
+    int max_end_game_requests_per_block = 2;
+
+    // A time critical piece (see `torrent_handle::set_piece_deadline`) whose deadline
+    // is closer than this has its outstanding blocks requested redundantly, as in
+    // end-game mode, so that a single slow peer doesn't make us miss the deadline.
+    milliseconds time_critical_redundancy_margin{3000};
+
     // The number of attempts we are allowed to make when connecting to a peer.
     int max_connection_attempts = 5;
 
+    // The maximum number of bytes a single peer may download from us and upload to
+    // us in a second, which apply in addition to its torrent's and the global
+    // limits. `values::none` means peers are not limited individually.
+    int max_download_rate = values::none;
+    int max_upload_rate = values::none;
+
     // Upper bounds for the send and receive buffers, specified in bytes. It
     // should be set to a large value if memory can be spared for better
     // performance (at least 3 blocks (3 * 16KiB)), though note that the receive
@@ -236,6 +268,33 @@ struct settings
     // trackers).
     uint16_t listener_port = values::none;
 
+    // If set, outgoing connections to peers known to support uTP (BEP 29), e.g.
+    // through PEX, are attempted over uTP, and only if that fails over TCP. Other
+    // peers are connected over TCP, so as not to wait for uTP connection attempts
+    // to peers that don't answer them to time out. uTP's delay based congestion
+    // control (LEDBAT) backs off as soon as it detects queuing on the path, so
+    // BitTorrent traffic doesn't degrade other, e.g. interactive, traffic on the
+    // same uplink. Incoming uTP connections are only accepted while this is set.
+    //
+    // NOTE: like `listener_port`, once uTP has been enabled, its UDP socket stays
+    // open for the lifetime of the engine, and disabling uTP only affects new
+    // connections.
+    bool enable_utp = true;
+
+    // If set, we join the Mainline DHT (BEP 5) and torrents look up peers in it as
+    // well as at their trackers, so that they find peers even if all their trackers
+    // are down. The DHT shares the UDP socket used by uTP.
+    bool enable_dht = true;
+
+    // The well-known nodes, as "host:port" pairs, through which we join the DHT.
+    std::vector<std::string> dht_bootstrap_nodes = {"router.bittorrent.com:6881",
+            "dht.transmissionbt.com:6881", "router.utorrent.com:6881"};
+
+    // The maximum number of queries we send to DHT nodes in a second, and also the
+    // maximum number of queries from other nodes that we respond to in a second.
+    // With `values::none` tide chooses a suitable value.
+    int max_dht_queries_per_second = values::none;
+
     // Since UDP is an unreliable protocol, we have to guard against lost or
     // corrupt packets. Thus a number of retries is allowed for each announce
     // and scrape request.
@@ -245,6 +304,19 @@ struct settings
     int max_udp_tracker_timeout_retries = 4;
     int max_http_tracker_timeout_retries = 4;
 
+    // Announces are spread out in time by delaying each by a random amount of up to
+    // this, so that torrents that become due at the same time (e.g. after a restart)
+    // don't all announce at once. Only forced announces and those that stop a torrent
+    // are not delayed.
+    seconds max_announce_jitter{10};
+
+    // The maximum number of announces that may be outstanding to a single tracker,
+    // and the maximum number of announces sent to a single tracker per second, across
+    // all torrents. A value of `values::unlimited` disables the limit, and with
+    // `values::none` tide chooses a suitable value.
+    int max_announces_in_flight_per_tracker = values::none;
+    int max_announces_per_second_per_tracker = values::none;
+
     // The minimum number of peers we should always have (connected and
     // unconnected).  It may be 0 or `values::none`, in which case tide will
     // choose a suitable default value.
@@ -267,15 +339,33 @@ struct settings
     int max_active_leeches = 4;
     int max_active_seeds = 4;
 
-    // The total number of connections that are allowed to upload.
+    // The total number of connections that are allowed to upload. These are shared
+    // among all auto managed torrents in a global unchoke round, in which each
+    // torrent with interested peers is first given `min_upload_slots_per_torrent`
+    // slots, and the rest go to the peers, of any torrent, to which we expect to
+    // upload the fastest.
     int max_upload_slots = 4;
+    int min_upload_slots_per_torrent = 1;
 
     // The total number of active peer connections in all torrents.
     int max_connections = 200;
 
-    // The maximum upload and download speeds of all torrents combined. These
-    // may be overwritten by individual torrents. See comment above `torrent`
-    // below.
+    // The maximum number of outgoing connections, in all torrents, that may be in
+    // the process of being established at any given time. Connection slots are
+    // shared fairly among torrents. A value of `values::unlimited` disables the
+    // limit, and with `values::none` tide chooses a suitable value.
+    int max_half_open_connections = values::none;
+
+    // The upper bound, in bytes, on the memory all peer connections' receive and
+    // send buffers may occupy combined. Sessions are given a share of this in
+    // proportion to their throughput, and once it's used up no more data is read
+    // from sockets and no new requests are issued until memory is released.
+    // A value of `values::unlimited` disables the budget, and with `values::none`
+    // tide chooses a suitable value.
+    int max_buffer_memory = values::none;
+
+    // The maximum upload and download speeds of all torrents combined. Individual
+    // torrents may be limited further, see `torrent_settings`.
     int max_download_rate = values::unlimited;
     int max_upload_rate = values::unlimited;
 
@@ -300,12 +390,15 @@ struct settings
     // torrent or even peer_session at arbitrary intervals.
     seconds stats_aggregation_interval{1};
 
+    // Only alerts in these categories (a combination of `alert::category` flags) are
+    // posted to user, the rest are not even constructed. With `values::none` all
+    // categories but `alert::stats` are posted, as stats alerts are posted for every
+    // torrent every `stats_aggregation_interval`.
+    int alert_mask = values::none;
+
     disk_io_settings disk_io;
     // Global default settings for all torrents, but each individual torrent's
     // settings may be customized.
-    // If `max_download_rate` and/or `max_upload_rate` are other than
-    // `values::none`, the same fields in `settings` are disregarded, as each
-    // torrent will then employ its own upload/download rate limits.
     torrent_settings torrent;
     // Global settings for all `peer_session` instances. It is not possible to
     // customize a torrent's peer_sessions' settings, all of them refer to this
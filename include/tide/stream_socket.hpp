@@ -0,0 +1,147 @@
+#ifndef TIDE_STREAM_SOCKET_HEADER
+#define TIDE_STREAM_SOCKET_HEADER
+
+#include "error_code.hpp"
+#include "socket.hpp"
+
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+#include <asio/buffer.hpp>
+#include <asio/io_context.hpp>
+
+namespace tide {
+
+/**
+ * The interface through which `peer_session` talks to a peer, regardless of the
+ * underlying transport. Its operations mirror those of `tcp::socket` that
+ * `peer_session` needs, with the same semantics, so that a TCP connection can be
+ * swapped for e.g. a uTP connection without the session noticing.
+ *
+ * As with asio's sockets, completion handlers are never invoked from within the
+ * function that initiated the operation.
+ */
+class stream_socket
+{
+public:
+    enum class transport
+    {
+        tcp,
+        utp
+    };
+
+    using connect_handler = std::function<void(const error_code&)>;
+    using io_handler = std::function<void(const error_code&, size_t)>;
+
+    virtual ~stream_socket() = default;
+
+    virtual transport type() const noexcept = 0;
+    virtual asio::io_context& get_io_context() noexcept = 0;
+
+    virtual bool is_open() const noexcept = 0;
+    virtual void open(const tcp& protocol, error_code& error) = 0;
+    virtual void non_blocking(const bool b, error_code& error) = 0;
+    virtual tcp::endpoint local_endpoint(error_code& error) const = 0;
+
+    virtual void async_connect(
+            const tcp::endpoint& endpoint, connect_handler handler) = 0;
+
+    /**
+     * Writes at least one and at most the total size of `buffers` bytes, the number
+     * of which is passed to `handler`.
+     */
+    virtual void async_write_some(
+            const std::vector<asio::const_buffer>& buffers, io_handler handler) = 0;
+
+    /**
+     * Reads at least one and at most `buffer.size()` bytes into `buffer`, the number
+     * of which is passed to `handler`.
+     */
+    virtual void async_read_some(asio::mutable_buffer buffer, io_handler handler) = 0;
+
+    /** Returns the number of bytes that can be read without blocking. */
+    virtual size_t available(error_code& error) const = 0;
+
+    /**
+     * Synchronously reads the bytes that are available, up to `buffer.size()`. If
+     * none are, `error` is set to `asio::error::would_block`.
+     */
+    virtual size_t read_some(asio::mutable_buffer buffer, error_code& error) = 0;
+
+    /** Shuts down both directions of the connection. */
+    virtual void shutdown(error_code& error) = 0;
+    virtual void close(error_code& error) = 0;
+};
+
+/** A thin wrapper that adapts `tcp::socket` to the `stream_socket` interface. */
+class tcp_stream_socket final : public stream_socket
+{
+    asio::io_context& ios_;
+    tcp::socket socket_;
+
+public:
+    explicit tcp_stream_socket(asio::io_context& ios) : ios_(ios), socket_(ios) {}
+
+    /** Takes ownership of an already connected socket (e.g. from an acceptor). */
+    tcp_stream_socket(asio::io_context& ios, tcp::socket socket)
+        : ios_(ios), socket_(std::move(socket))
+    {}
+
+    transport type() const noexcept override { return transport::tcp; }
+    asio::io_context& get_io_context() noexcept override { return ios_; }
+
+    bool is_open() const noexcept override { return socket_.is_open(); }
+
+    void open(const tcp& protocol, error_code& error) override
+    {
+        socket_.open(protocol, error);
+    }
+
+    void non_blocking(const bool b, error_code& error) override
+    {
+        socket_.non_blocking(b, error);
+    }
+
+    tcp::endpoint local_endpoint(error_code& error) const override
+    {
+        return socket_.local_endpoint(error);
+    }
+
+    void async_connect(const tcp::endpoint& endpoint, connect_handler handler) override
+    {
+        socket_.async_connect(endpoint, std::move(handler));
+    }
+
+    void async_write_some(
+            const std::vector<asio::const_buffer>& buffers, io_handler handler) override
+    {
+        socket_.async_write_some(buffers, std::move(handler));
+    }
+
+    void async_read_some(asio::mutable_buffer buffer, io_handler handler) override
+    {
+        socket_.async_read_some(asio::mutable_buffers_1(buffer), std::move(handler));
+    }
+
+    size_t available(error_code& error) const override
+    {
+        return socket_.available(error);
+    }
+
+    size_t read_some(asio::mutable_buffer buffer, error_code& error) override
+    {
+        return socket_.read_some(asio::mutable_buffers_1(buffer), error);
+    }
+
+    void shutdown(error_code& error) override
+    {
+        socket_.shutdown(tcp::socket::shutdown_both, error);
+    }
+
+    void close(error_code& error) override { socket_.close(error); }
+};
+
+} // tide
+
+#endif // TIDE_STREAM_SOCKET_HEADER
@@ -4,6 +4,7 @@
 #include "view.hpp"
 
 #include <algorithm>
+#include <cstring> // strlen
 #include <ostream>
 #include <string>
 
@@ -18,7 +19,7 @@ struct string_view : public const_view<std::string::value_type>
     {}
     string_view(pointer str, size_type length) : view(str, length) {}
     string_view(pointer begin, pointer end) : view(begin, end) {}
-    string_view(const char* s) : string_view(std::string(s)) {}
+    string_view(const char* s) : view(s, std::strlen(s)) {}
     string_view(const std::string& s) : string_view(s.c_str(), s.length()) {}
 
     operator std::string() const { return std::string(begin(), end()); }
@@ -26,21 +26,30 @@ private:
     // holding onto job_queue_mutex_.
     std::condition_variable job_available_;
 
+    struct queued_job
+    {
+        job_type job;
+        // Used to measure how long jobs wait in the queue.
+        time_point queue_time;
+    };
+
     // All jobs are first placed in this queue from which they are retrieved by threads.
     //
     // NOTE: must only be handled after acquiring job_queue_mutex_.
-    std::deque<job_type> job_queue_;
+    std::deque<queued_job> job_queue_;
 
     mutable std::mutex job_queue_mutex_;
 
     std::atomic<bool> is_joining_{false};
 
-    // The total time in milliseonds all threads spent working (executing jobs) and
-    // idling (waiting for jobs). Reaping dead threads is not counted.
-    std::atomic<int> work_time_{0};
-    std::atomic<int> idle_time_{0};
+    // The total time in nanoseconds all threads spent working (executing jobs) and
+    // idling (waiting for jobs), and that jobs spent queued up before a thread could
+    // pick them up. Reaping dead threads is not counted.
+    std::atomic<int64_t> work_time_{0};
+    std::atomic<int64_t> idle_time_{0};
+    std::atomic<int64_t> wait_time_{0};
     std::atomic<int> num_idle_threads_{0};
-    std::atomic<int> num_executed_jobs_{0};
+    std::atomic<int64_t> num_executed_jobs_{0};
 
     // This is the max number of threads that we may have running. It is only accessed
     // on the caller's thread, no mutual exclusion is necessary.
@@ -62,6 +71,15 @@ public:
     int num_pending_jobs() const;
     int concurrency() const noexcept;
 
+    /**
+     * These accumulate over the lifetime of the thread pool, and are updated as each
+     * job is finished.
+     */
+    int64_t num_executed_jobs() const noexcept;
+    duration total_work_time() const noexcept;
+    duration total_idle_time() const noexcept;
+    duration total_wait_time() const noexcept;
+
     /**
      * If the new value is lower than the current number of running threads, threads
      * will be signaled to stop. If all threads are currently executing, the stop signal
@@ -120,6 +138,26 @@ inline int thread_pool::num_idle_threads() const
     return num_idle_threads_.load(std::memory_order_relaxed);
 }
 
+inline int64_t thread_pool::num_executed_jobs() const noexcept
+{
+    return num_executed_jobs_.load(std::memory_order_relaxed);
+}
+
+inline duration thread_pool::total_work_time() const noexcept
+{
+    return nanoseconds(work_time_.load(std::memory_order_relaxed));
+}
+
+inline duration thread_pool::total_idle_time() const noexcept
+{
+    return nanoseconds(idle_time_.load(std::memory_order_relaxed));
+}
+
+inline duration thread_pool::total_wait_time() const noexcept
+{
+    return nanoseconds(wait_time_.load(std::memory_order_relaxed));
+}
+
 inline int thread_pool::num_pending_jobs() const
 {
     std::lock_guard<std::mutex> l(job_queue_mutex_);
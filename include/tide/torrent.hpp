@@ -1,12 +1,14 @@
 #ifndef TIDE_TORRENT_HEADER
 #define TIDE_TORRENT_HEADER
 
+#include "announce_scheduler.hpp"
 #include "bdecode.hpp"
 #include "bencode.hpp"
 #include "error_code.hpp"
 #include "interval.hpp"
 #include "log.hpp"
 #include "peer_session.hpp"
+#include "piece_hashes.hpp"
 #include "piece_picker.hpp"
 #include "rate_limiter.hpp"
 #include "socket.hpp"
@@ -26,9 +28,15 @@
 namespace tide {
 
 class torrent_settings;
+class buffer_budget;
+class connection_scheduler;
+class upload_slot_allocator;
+class dht_node;
 class endpoint_filter;
 class piece_download;
+class utp_socket_manager;
 class alert_queue;
+class counters;
 class disk_io;
 struct settings;
 struct engine_info;
@@ -71,6 +79,28 @@ class torrent : public std::enable_shared_from_this<torrent>
     rate_limiter& global_rate_limiter_;
     torrent_rate_limiter local_rate_limiter_;
 
+    // The `engine` wide memory budget out of which our `peer_session`s allocate
+    // their receive and send buffers.
+    buffer_budget& buffer_budget_;
+
+    // Outgoing connections are first attempted over uTP through this, if enabled.
+    utp_socket_manager& utp_socket_manager_;
+
+    // Outgoing connections may only be started with a slot granted by this
+    // `engine` wide scheduler, which bounds the number of half-open connections.
+    connection_scheduler& connection_scheduler_;
+
+    // While auto managed, the number of peers we may unchoke is allotted by this
+    // `engine` wide allocator, which shares the upload slots among all torrents.
+    upload_slot_allocator& upload_slot_allocator_;
+
+    // Tracker announces are sent once this `engine` wide scheduler lets them, which
+    // spreads them out and limits how many are sent to each tracker.
+    announce_scheduler& announce_scheduler_;
+
+    // Peers are looked up in the DHT through this, in addition to `trackers_`.
+    dht_node& dht_node_;
+
     // These are the global settings that are passed to each `peer_session`.
     // Torrent's settings, however, are in info_ (for settings related to
     // a torrent may be customized for each torrent but session settings and
@@ -85,6 +115,10 @@ class torrent : public std::enable_shared_from_this<torrent>
     // not the entire info as we don't need it.
     engine_info& global_info_;
 
+    // Engine-wide performance counters, which are also updated by our
+    // `peer_session`s.
+    counters& counters_;
+
     // User may decide to block certain IPs or ports, and may decide have
     // various policies regarding local networks (TODO), so before registering
     // the availability of a peer, it first must be passed to this filter to see
@@ -115,13 +149,40 @@ class torrent : public std::enable_shared_from_this<torrent>
     // a single list for better memory layout.
     std::vector<tracker_entry> trackers_;
 
+    struct peer_candidate
+    {
+        tcp::endpoint endpoint;
+        // The outcomes of our past attempts to connect to this peer. A connection
+        // that the peer closed shortly after it was established also counts as
+        // a failed attempt.
+        int num_successful_connects = 0;
+        int num_failed_connects = 0;
+        // We only try to connect over uTP to peers that are known to support it
+        // (because they were advertised as such in PEX or because we connected to
+        // them over uTP before), as otherwise each TCP-only peer would only be
+        // connected once all uTP connection attempts time out, which takes seconds.
+        bool supports_utp = false;
+
+        peer_candidate(tcp::endpoint ep, const bool utp = false)
+            : endpoint(std::move(ep)), supports_utp(utp)
+        {}
+    };
+
     // All peer endpoints returned in a tracker announce response are stored
     // here.  When we need to connect to peers, we first check whether there are
     // any available here, and if not, only then do we request more from the
     // tracker. As soon as a connection is being established to peer, its
     // endpoint is removed from this list and a corresponding `peer_session` is
-    // added to `peer_sessions_`.
-    std::vector<tcp::endpoint> available_peers_;
+    // added to `peer_sessions_`. If we fail to connect, the peer is put back
+    // here, so that it may be retried later, up to
+    // `peer_session_settings::max_connection_attempts` times. Peers that we
+    // could connect to in the past are tried first.
+    std::vector<peer_candidate> available_peers_;
+
+    // The candidates to which we have initiated a connection, so that their
+    // connection history is not lost should they need to be put back into
+    // `available_peers_` when their `peer_session` stops.
+    std::vector<peer_candidate> outbound_peers_;
 
     // Passed to every `peer_session`, tracks the availability of every piece in
     // the swarm and decides, using this knowledge, which piece to pick next
@@ -165,6 +226,18 @@ class torrent : public std::enable_shared_from_this<torrent>
     // This is stopped when torrent is stopped.
     deadline_timer update_timer_;
 
+    // When we last looked up the torrent's peers in the DHT (and announced
+    // ourselves to the nodes closest to it).
+    time_point last_dht_announce_time_;
+
+    // When we last sent our connected peers to those of them that support peer
+    // exchange.
+    time_point last_pex_time_;
+
+    // Deadlines of time critical pieces up to this time have been checked and the
+    // missed ones reported to user, see `report_missed_deadlines`.
+    time_point last_deadline_check_time_;
+
     // A function that returns true if the first `peer_session` is favored over
     // the second is used to sort a torrent's peer list such that the peers that
     // we want to unchoke are placed in the front of the list.
@@ -186,8 +259,13 @@ class torrent : public std::enable_shared_from_this<torrent>
     // *
     bool has_state_changed_ = false;
 
-    // TODO don't store this here
-    std::string piece_hashes_;
+    // Resume data is encoded into this buffer, which is kept around (and only
+    // reallocated if the resume data outgrows it) as it's saved periodically.
+    std::string resume_data_buffer_;
+
+    // The expected piece hashes, which are shared with the torrent's storage. They
+    // are only held here until storage is allocated.
+    piece_hashes piece_hashes_;
 
 public:
     /**
@@ -198,10 +276,15 @@ public:
      * paths sanitized etc, so it is crucial that `engine` do this.
      */
     torrent(torrent_id_t id, asio::io_context& ios, disk_io& disk_io,
-            rate_limiter& global_rate_limiter, const settings& global_settings,
-            engine_info& global_info, std::vector<tracker_entry> trackers,
-            endpoint_filter& endpoint_filter, alert_queue& alert_queue,
-            torrent_args args);
+            rate_limiter& global_rate_limiter, buffer_budget& buffer_budget,
+            utp_socket_manager& utp_socket_manager,
+            connection_scheduler& connection_scheduler,
+            upload_slot_allocator& upload_slot_allocator,
+            announce_scheduler& announce_scheduler, dht_node& dht_node,
+            const settings& global_settings, engine_info& global_info,
+            counters& counters, std::vector<tracker_entry> trackers,
+            endpoint_filter& endpoint_filter,
+            alert_queue& alert_queue, torrent_args args);
 
     /**
      * This is called for continued torrents. `engine` retrieves the resume
@@ -210,8 +293,13 @@ public:
      * invoking `start`.
      */
     torrent(torrent_id_t id, asio::io_context& ios, disk_io& disk_io,
-            rate_limiter& global_rate_limiter, const settings& global_settings,
-            engine_info& global_info, std::vector<tracker_entry> trackers,
+            rate_limiter& global_rate_limiter, buffer_budget& buffer_budget,
+            utp_socket_manager& utp_socket_manager,
+            connection_scheduler& connection_scheduler,
+            upload_slot_allocator& upload_slot_allocator,
+            announce_scheduler& announce_scheduler, dht_node& dht_node,
+            const settings& global_settings, engine_info& global_info,
+            counters& counters, std::vector<tracker_entry> trackers,
             endpoint_filter& endpoint_filter, alert_queue& alert_queue, bmap resume_data);
 
     /**
@@ -259,15 +347,21 @@ public:
     void abort();
 
     /**
-     * It's unknown to which torrent incoming connections belong, so at first
-     * they belong to no torrent until peer's `info_hash` is received. After
-     * this, `peer_session` calls the torrent attacher handler provided by
-     * `engine` passing it peer's info_hash, after which `engine` attempts to
-     * match it to an existing torrents' info_hash, and if found, invokes this
-     * function. At this point peer is filtered by `engine`.
-     * TODO this comment is a mess, rewrite.
+     * It's unknown to which torrent incoming connections belong until peer's
+     * handshake, with its info_hash, is received. `engine` then calls this
+     * with the session of the torrent that matches the info_hash. Returns
+     * false if the session may not join the torrent, because the torrent is
+     * stopped, peer is blocked, or there are no more free connection slots, in
+     * which case the session is expected to disconnect.
      */
-    void attach_peer_session(std::shared_ptr<peer_session> session);
+    bool attach_peer_session(std::shared_ptr<peer_session> session);
+
+    /**
+     * Called when the rules of `endpoint_filter_` have changed (e.g. a new blocklist
+     * was installed). Peers that are no longer allowed are disconnected and removed
+     * from `available_peers_`.
+     */
+    void apply_endpoint_filter();
 
     /**
      * `file_index` must be the position of the file in the original .torrent
@@ -279,6 +373,19 @@ public:
     void prioritize_piece(const piece_index_t piece);
     void deprioritize_piece(const piece_index_t piece);
 
+    /**
+     * Makes pieces time critical, i.e. they are downloaded before all other pieces,
+     * in the order of their deadlines (see `piece_picker::set_deadline`), which are
+     * relative to now. Pieces in the byte range [offset, offset + length) of file
+     * `file_index` all get the same deadline, and so are downloaded in order.
+     * A `piece_deadline_missed_alert` is posted for each piece that we don't have by
+     * its deadline.
+     */
+    void set_piece_deadline(const piece_index_t piece, const milliseconds deadline);
+    void set_file_range_deadline(const int file_index, const int64_t offset,
+            const int64_t length, const milliseconds deadline);
+    void clear_piece_deadlines();
+
     /**
      * If torrent is auto managed, it means `engine` will manage its settings
      * (cap its throughput rates and apply other fields using the global
@@ -393,8 +500,13 @@ public:
 private:
     /** Initializes fields common to both constructors. */
     torrent(torrent_id_t id, const int num_pieces, asio::io_context& ios,
-            disk_io& disk_io, rate_limiter& rate_limiter, const settings& global_settings,
-            engine_info& engine_info, std::vector<tracker_entry> trackers,
+            disk_io& disk_io, rate_limiter& rate_limiter, buffer_budget& buffer_budget,
+            utp_socket_manager& utp_socket_manager,
+            connection_scheduler& connection_scheduler,
+            upload_slot_allocator& upload_slot_allocator,
+            announce_scheduler& announce_scheduler, dht_node& dht_node,
+            const settings& global_settings, engine_info& engine_info,
+            counters& counters, std::vector<tracker_entry> trackers,
             endpoint_filter& endpoint_filter, alert_queue& alert_queue);
 
     void apply_torrent_args(torrent_args& args);
@@ -468,8 +580,26 @@ private:
      */
     void on_peer_session_stopped(peer_session& session);
 
+    /**
+     * Concludes the connection attempt with `connection_scheduler_` if it failed,
+     * and puts the peer back into `available_peers_` if it's worth retrying.
+     */
+    void on_outbound_peer_session_stopped(peer_session& session);
+
+    /**
+     * This is invoked by each outbound `peer_session` through its
+     * `torrent_frontend` instance once its connection has been established.
+     */
+    void on_peer_session_connected(peer_session& session);
+
+    /**
+     * Subscribes for as many connection slots with `connection_scheduler_` as we
+     * can use, and once they are granted, `on_connection_slots_granted` connects to
+     * the most promising peers in `available_peers_`.
+     */
     void connect_peers();
-    void connect_peer(tcp::endpoint& peer);
+    void on_connection_slots_granted(const int num_slots);
+    void connect_peer(peer_candidate& peer);
     void close_peer_session(peer_session& session);
 
     // -------
@@ -486,6 +616,16 @@ private:
     tracker_request prepare_tracker_request(const int event) const noexcept;
     int calculate_num_want() const noexcept;
 
+    /**
+     * Announces are not sent right away but are scheduled with `announce_scheduler_`,
+     * which invokes `send_announce` once the announce may be sent. The announce
+     * counts against the tracker's limits until `in_flight` is destroyed.
+     */
+    void schedule_announce(
+            tracker_entry& entry, const int event, const bool force = false);
+    void send_announce(tracker_entry& entry, const int event,
+            announce_scheduler::in_flight_announce in_flight);
+
     void on_announce_response(tracker_entry& tracker, const error_code& error,
             tracker_response response, const int event);
     void on_announce_error(
@@ -496,15 +636,18 @@ private:
      * connected to it, if it's not already in available_peers_, if it's not us,
      * and if endpoint_filter_ allows it.
      */
-    void add_peer(tcp::endpoint peer);
+    void add_peer(tcp::endpoint peer, const bool supports_utp = false);
 
     /**
      * Scraping is done when we just want information about a torrent (how many
-     * seeders, leechers, and received 'completed' events). TODO purpose of
-     * this?
+     * seeders, leechers, and received 'completed' events). Trackers coalesce the
+     * scrapes of all torrents that share them, so this is cheap even with many
+     * torrents.
      */
+    bool should_scrape_tracker() const noexcept;
     void scrape_tracker();
-    void on_scrape_response(const error_code& error, scrape_response response);
+    void on_scrape_response(
+            tracker_entry& tracker, const error_code& error, scrape_response response);
 
     /**
      * Trackers are ordered in tiers, and the first tracker in the first tier is
@@ -517,6 +660,29 @@ private:
     bool can_announce_to(const tracker_entry& t) const noexcept;
     bool can_force_announce_to(const tracker_entry& t) const noexcept;
 
+    // ---------
+    // -- dht --
+    // ---------
+
+    /**
+     * We look up peers in the DHT every 15 minutes, or every minute while we need
+     * more peers, as long as the DHT is enabled and our node has joined the network.
+     */
+    bool should_announce_to_dht() const noexcept;
+    void announce_to_dht();
+    void on_dht_peers(std::vector<tcp::endpoint> peers);
+
+    // ---------
+    // -- pex --
+    // ---------
+
+    /**
+     * Once a minute, tells every connected peer that supports peer exchange about
+     * the other peers we're connected to (whose listen ports we know).
+     */
+    void exchange_peers();
+    void on_pex_peers(std::vector<tcp::endpoint> peers, std::vector<bool> supports_utp);
+
     // -------------
     // -- storage --
     // -------------
@@ -526,10 +692,17 @@ private:
     void check_storage_integrity();
     void on_storage_integrity_checked(const error_code& error);
 
+    /**
+     * Posts a `piece_deadline_missed_alert` for each time critical piece whose
+     * deadline passed since the last check.
+     */
+    void report_missed_deadlines();
+
     bool should_save_resume_data() const noexcept;
     void on_resume_data_saved(const error_code& error);
 
-    bmap_encoder create_resume_data() const;
+    /** Appends the bencoded resume data to `buffer`. */
+    void create_resume_data(std::string& buffer) const;
     void restore_resume_data(const bmap& resume_data);
 
     void lost_pieces(std::vector<piece_index_t> pieces);
@@ -549,9 +722,33 @@ private:
      * a chance to prove their worth. Thus the choking algorithm is run every 10
      * seconds, and unchokes min(settings::max_upload_slots,
      * peer_sessions_.size()) number of peers.
+     *
+     * This is only run by torrents that are not auto managed, the rest are
+     * unchoked in `upload_slot_allocator`'s global rounds (see below).
      */
     void unchoke();
 
+    /**
+     * Unchokes the first n interested peers in `peer_sessions_`, which must have
+     * been sorted with `sort_unchoke_candidates`, and chokes the rest.
+     */
+    void unchoke_first_candidates(const int n);
+
+    /** Takes part in the global unchoke rounds while auto managed and active. */
+    void subscribe_to_upload_slots();
+
+    /**
+     * Ranks our interested peers for `upload_slot_allocator` by their expected
+     * upload rates, and places those of the best n of them in `expected_rates`, in
+     * the order in which we'd unchoke them (fastest first). A peer's expected
+     * upload rate is the rate at which we're uploading to it, or if it's choked,
+     * the best rate we've recorded.
+     */
+    void rank_unchoke_candidates(std::vector<int>& expected_rates, const int n);
+
+    /** Invoked by `upload_slot_allocator` with the number of peers we may unchoke. */
+    void on_upload_slots_allotted(const int num_slots);
+
     /**
      * In order to potentially find peers that have better upload performance
      * (when we're leeching), or better download performance (when we're
@@ -3,19 +3,25 @@
 
 #include "block_source.hpp"
 #include "disk_buffer.hpp"
+#include "socket.hpp"
 
+#include <cstdint>
 #include <functional>
 #include <memory>
 #include <system_error>
+#include <vector>
 
 namespace tide {
 
+class counters;
 class piece_download;
 class piece_picker;
 class peer_session;
 class torrent_info;
 class block_info;
+class dht_node;
 class torrent;
+class torrent_rate_limiter;
 
 /**
  * This class is used by peer_sessions and it represents the torrent to which a
@@ -73,9 +79,27 @@ public:
     torrent_info& info() noexcept;
     const torrent_info& info() const noexcept;
 
+    /** Returns the engine-wide performance counters. */
+    class counters& counters() noexcept;
+
     const sha1_hash& info_hash() const noexcept;
     torrent_id_t id() const noexcept;
 
+    /** Peers request their bandwidth quota below this in the hierarchy. */
+    torrent_rate_limiter& rate_limiter() noexcept;
+
+    /** Peers advertise their DHT nodes (in PORT messages), which we pass on to this. */
+    class dht_node& dht_node() noexcept;
+
+    /** The port on which we accept connections, which is advertised to peers. */
+    uint16_t listener_port() const noexcept;
+
+    /**
+     * Peers received in PEX messages are passed on to torrent's peer list, along
+     * with whether they advertised uTP support.
+     */
+    void on_pex_peers(std::vector<tcp::endpoint> peers, std::vector<bool> supports_utp);
+
     std::vector<std::shared_ptr<piece_download>>& downloads() noexcept;
     const std::vector<std::shared_ptr<piece_download>>& downloads() const noexcept;
 
@@ -99,6 +123,9 @@ public:
      * when peer_session finished the shutdown.
      */
     void on_peer_session_stopped(peer_session& session);
+
+    /** Outbound sessions report here once their connection has been established. */
+    void on_peer_session_connected(peer_session& session);
 };
 
 } // namespace tide
@@ -56,6 +56,20 @@ public:
     void prioritize_piece(const piece_index_t piece);
     void deprioritize_piece(const piece_index_t piece);
 
+    /**
+     * Makes pieces time critical, which are then downloaded before all other pieces,
+     * in the order of their deadlines. This is meant for streaming, where the pieces
+     * just ahead of the playback position are needed by a certain time. `deadline`
+     * is relative to the time of the call. A byte range in a file is mapped to the
+     * pieces it overlaps, which all get the same deadline and so are downloaded in
+     * order. A `piece_deadline_missed_alert` is posted for each piece that is not
+     * downloaded by its deadline.
+     */
+    void set_piece_deadline(const piece_index_t piece, const milliseconds deadline);
+    void set_file_range_deadline(const int file_index, const int64_t offset,
+            const int64_t length, const milliseconds deadline);
+    void clear_piece_deadlines();
+
     void apply_settings(const torrent_settings& settings);
 
     void force_tracker_announce(string_view url);
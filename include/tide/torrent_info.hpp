@@ -62,18 +62,20 @@ struct torrent_info : public stats
     int num_pieces;
     int num_wanted_pieces;
     int num_downloaded_pieces = 0;
-    // TODO comment
+    // The number of downloaded pieces that were adjacent to a piece we already had,
+    // i.e. that were written to disk right before or after another piece. Relative to
+    // num_downloaded_pieces this is a measure of disk write locality.
+    int num_run_extending_pieces = 0;
+    // The number of pieces that are being downloaded. Once this equals the number of
+    // pieces we still need and all their blocks are requested, torrent enters
+    // end-game mode.
     int num_pending_pieces = 0;
 
     // The total number of blocks in this torrent.
     int num_blocks;
     // The number of unserviced requests that all peer_sessions in torrent have issued.
-    // It's decremented if we cancel or drop a request. This is used to determine when
-    // to enter end-game mode. Note that some blocks may be requested by multiple peers,
-    // so if this value reaches num_blocks, it may not mean that we have requested all
-    // blocks in torrent, but it's a close enough approximation.
-    // TODO or, we could enter end game when the number of pending pieces +
-    // num_downloaded_pieces equals num_pieces, which would be another rough approximation
+    // It's decremented if we cancel or drop a request. Note that in end-game mode
+    // some blocks are requested from multiple peers, each of which is counted.
     int num_pending_blocks = 0;
 
     int num_seeders = 0;
@@ -123,8 +125,9 @@ struct torrent_info : public stats
         seeding,
         // When a download is almost complete, there's a tendency for the last few
         // blocks to trickle in slowly. Torrent enters end-game mode when all of its
-        // blocks have been requested, after which it rerequests all missing blocks
-        // from all of its peers that have them.
+        // blocks have been requested, after which the blocks that are slow to arrive
+        // are requested from other peers as well, and the requests that lose the race
+        // are cancelled (see `peer_session_settings::max_end_game_requests_per_block`).
         end_game,
         max
     };
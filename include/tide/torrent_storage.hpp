@@ -8,6 +8,7 @@
 #include "file.hpp"
 #include "interval.hpp"
 #include "iovec.hpp"
+#include "piece_hashes.hpp"
 #include "string_view.hpp"
 #include "torrent_info.hpp"
 #include "types.hpp"
@@ -74,11 +75,13 @@ class torrent_storage
     // This is the file where torrent resume data is stored.
     file resume_data_;
 
-    // The expected hashes of all pieces, represented as a single block of memory for
-    // optimal memory layout. To retrieve a piece's hash:
-    // string_view(piece_hashes_.data() + piece_index * piece_length_, 20)
-    // TODO make this const to semantically ensure thread safety
-    std::string piece_hashes_;
+    // The expected hashes of all pieces. These are shared with (and never modified
+    // by) the torrent, so they're safe to read from any thread.
+    piece_hashes piece_hashes_;
+
+    // The hashes are not saved with the rest of the resume data, which is rewritten
+    // periodically, but in a sidecar file, which needs to be written only once.
+    bool is_piece_hashes_file_written_ = false;
 
     // This is an absolute path to the root directory in which torrent is saved. If
     // torrent is multi-file, the root directory is save path / torrent name, otherwise
@@ -104,7 +107,7 @@ public:
      * Initializes internal file entries, and if torrent is multi-file, establishes
      * the final directory structure (but does not allocate any files).
      */
-    torrent_storage(const torrent_info& info, string_view piece_hashes,
+    torrent_storage(const torrent_info& info, piece_hashes hashes,
             std::filesystem::path resume_data_path);
     torrent_storage(const torrent_storage&) = delete;
     torrent_storage& operator=(const torrent_storage&) = delete;
@@ -136,6 +139,14 @@ public:
      */
     interval pieces_in_file(const file_index_t file_index) const noexcept;
 
+    /**
+     * Returns an interval of piece indices of the pieces that are, even if partially,
+     * in the byte range [offset, offset + length) of file, which is clamped to the
+     * file's bounds.
+     */
+    interval pieces_in_file_range(const file_index_t file_index, const int64_t offset,
+            const int64_t length) const noexcept;
+
     /**
      * The opposite of pieces_in_file: returns the range of files (in the form of file
      * indices into torrent_info::files) that cover part of piece. The range is left
@@ -176,7 +187,16 @@ public:
 
     void move_resume_data(std::filesystem::path path, error_code& error);
     bmap read_resume_data(error_code& error);
-    void write_resume_data(const bmap_encoder& resume_data, error_code& error);
+
+    /**
+     * Writes the resume data, and, the first time around, the piece hashes to their
+     * sidecar file next to it.
+     */
+    void write_resume_data(string_view resume_data, error_code& error);
+
+    /** Returns the path of the piece hashes file that belongs to the resume data. */
+    static std::filesystem::path piece_hashes_path(
+            const std::filesystem::path& resume_data_path);
 
     /**
      * Hashes every downloaded piece and compares them to their expected values, if they
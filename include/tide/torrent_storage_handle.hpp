@@ -44,6 +44,13 @@ public:
         return storage_->pieces_in_file(file_index);
     }
 
+    interval pieces_in_file_range(const file_index_t file_index, const int64_t offset,
+            const int64_t length) const noexcept
+    {
+        assert(*this);
+        return storage_->pieces_in_file_range(file_index, offset, length);
+    }
+
     interval files_containing_piece(const piece_index_t piece) const noexcept
     {
         assert(*this);
@@ -0,0 +1,128 @@
+#ifndef TIDE_TRACE_HEADER
+#define TIDE_TRACE_HEADER
+
+#include "error_code.hpp"
+#include "path.hpp"
+#include "time.hpp"
+
+#include <atomic>
+#include <cstdint>
+
+namespace tide {
+namespace trace {
+
+/**
+ * Opt-in tracing of where time is spent on engine's threads, to be inspected in
+ * a trace viewer (chrome://tracing or https://ui.perfetto.dev).
+ *
+ * Spans are recorded with `TIDE_TRACE_SCOPE`, which compiles to nothing unless
+ * `TIDE_ENABLE_TRACING` is defined, and records nothing unless tracing is started at
+ * runtime. Each thread records its spans in a buffer of its own, so recording a span
+ * costs two clock reads and an uncontended lock. If a thread's buffer is full, its
+ * further spans are dropped until the buffers are saved.
+ *
+ * Category and span names must be string literals (or otherwise outlive the
+ * process), as only their addresses are recorded.
+ */
+
+void start() noexcept;
+void stop() noexcept;
+
+inline bool is_enabled() noexcept;
+
+/** Names the calling thread's track in the trace. `name` must be a string literal. */
+void set_thread_name(const char* name) noexcept;
+
+/**
+ * Writes all spans recorded so far, in Chrome's trace event JSON format, to the file
+ * at `path`, and discards them. Recording may continue during and after saving.
+ */
+void save(const path& path, error_code& error);
+
+/** Returns the number of spans dropped so far because a thread's buffer was full. */
+int num_dropped_spans() noexcept;
+
+namespace detail {
+
+extern std::atomic<bool> is_enabled;
+
+/** Nanoseconds on `tide::clock`, so that `time_point`s may also be recorded. */
+inline int64_t now_ns() noexcept
+{
+    return to_int<nanoseconds>(clock::now());
+}
+
+/** `arg_name` may be null if the span has no argument. */
+void record(const char* category, const char* name, const int64_t start,
+        const int64_t end, const char* arg_name, const int64_t arg);
+
+/**
+ * Records an asynchronous span, which, unlike ordinary spans, may overlap other spans
+ * on the same thread, such as the time a job spent queued up for a thread.
+ */
+void record_async(
+        const char* category, const char* name, const int64_t start, const int64_t end);
+
+} // detail
+
+inline bool is_enabled() noexcept
+{
+#ifdef TIDE_ENABLE_TRACING
+    return detail::is_enabled.load(std::memory_order_relaxed);
+#else
+    return false;
+#endif // TIDE_ENABLE_TRACING
+}
+
+/**
+ * Records the span from its construction to its destruction, provided tracing was
+ * enabled when it was constructed.
+ */
+class scope
+{
+    const char* category_;
+    const char* name_;
+    const char* arg_name_;
+    int64_t arg_;
+    // -1 if tracing was disabled when the span began.
+    int64_t start_;
+
+public:
+    scope(const char* category, const char* name, const char* arg_name = nullptr,
+            const int64_t arg = 0) noexcept
+        : category_(category)
+        , name_(name)
+        , arg_name_(arg_name)
+        , arg_(arg)
+        , start_(is_enabled() ? detail::now_ns() : -1)
+    {}
+
+    scope(const scope&) = delete;
+    scope& operator=(const scope&) = delete;
+
+    ~scope()
+    {
+        if(start_ >= 0) {
+            detail::record(category_, name_, start_, detail::now_ns(), arg_name_, arg_);
+        }
+    }
+};
+
+} // trace
+} // tide
+
+#define TIDE_TRACE_CONCAT_IMPL(a, b) a##b
+#define TIDE_TRACE_CONCAT(a, b) TIDE_TRACE_CONCAT_IMPL(a, b)
+
+#ifdef TIDE_ENABLE_TRACING
+// Records the rest of the enclosing block as a span, optionally with a single
+// integer argument (e.g. a piece index) given as a name and a value.
+#define TIDE_TRACE_SCOPE(category, ...) \
+    tide::trace::scope TIDE_TRACE_CONCAT(trace_scope_, __LINE__)(category, __VA_ARGS__)
+#else
+#define TIDE_TRACE_SCOPE(category, ...) \
+    do {                                \
+    } while(0)
+#endif // TIDE_ENABLE_TRACING
+
+#endif // TIDE_TRACE_HEADER
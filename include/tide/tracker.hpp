@@ -11,6 +11,7 @@
 #include "string_view.hpp"
 #include "time.hpp"
 #include "types.hpp"
+#include "udp_tracker_socket.hpp"
 
 #include <array>
 #include <deque>
@@ -141,14 +142,14 @@ struct tracker_response
     std::string tracker_id;
 
     // The number of seconds the client should wait before recontacting tracker.
-    seconds interval;
+    seconds interval{0};
 
     // If present, the client must not reannounce itself before the end of this
     // interval.
-    seconds min_interval;
+    seconds min_interval{0};
 
-    int32_t num_seeders;
-    int32_t num_leechers;
+    int32_t num_seeders = 0;
+    int32_t num_leechers = 0;
 
     // This is only used when tracker includes the peer ids of a peer. However,
     // virtually all trackers use compact mode nowadays to save bandwidth, so
@@ -181,7 +182,8 @@ enum class tracker_errc
     invalid_response,
     wrong_response_type,
     wrong_response_length,
-    invalid_transaction_id
+    invalid_transaction_id,
+    scrape_not_supported
 };
 
 struct tracker_error_category : public error_category
@@ -296,32 +298,56 @@ protected:
 };
 
 /**
- * There may only be a single outstanding request (which may be a regular one or
- * a scrape) to tracker. However, since multiple torrents may be associated with
- * one tracker, if there is an outstanding request while one or more new
- * requests are issued, they are enqueued and executed in the order they were
- * enqueued, once the outstanding request has been served.
+ * A single keep-alive connection is kept open to tracker and shared by all torrents
+ * that announce to it. Requests are enqueued and written to the connection in the
+ * order they were enqueued, and up to `max_pipelined_requests` of them may be
+ * outstanding at a time (HTTP/1.1 pipelining), so that the responses to all but the
+ * first request don't have to wait a round-trip each. Responses arrive in the order
+ * the requests were written.
+ *
+ * Scrapes are collected for a second (a round of torrent updates) before they're
+ * enqueued, so that the scrapes of all torrents that share tracker are coalesced into
+ * a single multi info-hash request.
  *
  * NOTE: it is NOT thread-safe!
  */
 class http_tracker final : public tracker
 {
+public:
+    // The most requests that may be written to the connection before the response
+    // to the first one arrives.
+    constexpr static int max_pipelined_requests = 8;
+
+    // The most info-hashes scraped in a single request. Each adds about 70 bytes to
+    // the request target, and trackers tend to limit its length.
+    constexpr static int max_scrape_info_hashes = 64;
+
+private:
+    asio::io_context& ios_;
     tcp::socket socket_;
     tcp::resolver resolver_;
 
-    // This is responsible for timing out a request.
+    // This is responsible for timing out the connection attempt and the first
+    // request in `pipeline_`.
     deadline_timer timeout_timer_;
 
-    // Since there may only be a single outstanding request at any given time,
-    // a single request and response objects are used for all operations.
-    // http::request<http::string_body> request_;
+    // Since responses arrive one at a time, a single response object is used for all
+    // requests.
     http::response<http::string_body> response_;
 
-    // Holds the raw response data, which `response_` interprets.
+    // Holds the raw response data, which `response_` interprets. Bytes of pipelined
+    // responses that arrive with the previous one are kept here for the next read.
     http::flat_buffer response_buffer_;
 
     tcp::endpoint endpoint_;
 
+    // The parts of the request targets that are the same for all requests, derived
+    // from the announce URL. `scrape_target_` is empty if tracker does not support
+    // scraping (as per BEP 48).
+    std::string host_;
+    std::string announce_target_;
+    std::string scrape_target_;
+
     // TODO migrate to std::variant + enum to elide heap alloc + vtable
     struct request
     {
@@ -342,30 +368,54 @@ class http_tracker final : public tracker
         void on_error(const error_code& error) override { handler(error, {}); }
     };
 
+    /**
+     * The scrapes of several torrents may be served by a single request, in which
+     * case each of their handlers is invoked with the statuses of the torrents it
+     * asked for.
+     */
     struct scrape_request final : public request
     {
-        // This is the callback to be invoked once our request is served.
-        std::function<void(const error_code&, scrape_response)> handler;
-        void on_error(const error_code& error) override { handler(error, {}); }
+        struct entry
+        {
+            std::vector<sha1_hash> info_hashes;
+            std::function<void(const error_code&, scrape_response)> handler;
+        };
+
+        std::vector<entry> entries;
+        int num_info_hashes = 0;
+
+        void on_error(const error_code& error) override
+        {
+            for(auto& e : entries) {
+                e.handler(error, {});
+            }
+        }
     };
 
-    // All requests are enqueued at the back of this queue, and requests are
-    // popped from the bottom of the queue and executed one at a time. A request
-    // is only removed once it was served by tracker and its completion handler
-    // was invoked. This means that the request currently executed (if any) is
-    // always at the front of the queue.
+    // All requests are enqueued at the back of this queue and are moved to
+    // `pipeline_` once they are written to the connection.
     std::deque<std::unique_ptr<request>> requests_;
 
-    // This is set to signal that there is an outstanding request operation, to
-    // block other attempts.
-    bool is_requesting_ = false;
+    // Scrapes are collected here until `scrape_timer_` expires, after which this is
+    // enqueued as a single request.
+    std::unique_ptr<scrape_request> pending_scrape_;
+    deadline_timer scrape_timer_;
 
-    // The first request launches an async host resolution, during which no
-    // other request may be launched, so execution must halt if this is false.
+    // The requests that were written to the connection (or are being written) but
+    // whose responses haven't been received yet, in the order they were written. The
+    // front request is the one whose response we're reading.
+    std::deque<std::unique_ptr<request>> pipeline_;
+
+    bool is_resolving_ = false;
     bool is_resolved_ = false;
+    bool is_connecting_ = false;
+    bool is_writing_ = false;
+    bool is_reading_ = false;
+    bool is_flush_scheduled_ = false;
+    bool is_scrape_timer_armed_ = false;
 
 public:
-    http_tracker(asio::io_context& ios, std::string host, const settings& settings);
+    http_tracker(asio::io_context& ios, std::string url, const settings& settings);
     void announce(tracker_request parameters,
             std::function<void(const error_code&, tracker_response)> handler) override;
     void scrape(std::vector<sha1_hash> info_hashes,
@@ -373,38 +423,48 @@ public:
     void abort() override;
 
 private:
-    void on_host_resolved(const error_code& error, tcp::resolver::iterator it);
+    /**
+     * Enqueues `r` and schedules the queue to be flushed once control returns to the
+     * event loop.
+     */
+    void enqueue_request(std::unique_ptr<request> r);
+    void schedule_flush();
+    void on_scrape_timer(const error_code& error);
 
     /**
-     * Sending an announce request or a scrape request entails the same sort of
-     * set up procedure, so it is templatized and both are taken care of by this
-     * function.
+     * Resolves tracker's host or connects to it if necessary, otherwise writes the
+     * enqueued requests to the connection as long as the pipeline is not full.
      */
-    template <typename Request, typename Parameters, typename Handler>
-    void execute_request(Parameters parameters, Handler handler);
+    void flush();
 
-    /** Creates a HTTP target string from a tracker_request or announce request. */
-    std::string create_target_string(const tracker_request& r) const;
-    std::string create_target_string(const std::vector<sha1_hash>& r) const;
+    void on_host_resolved(const error_code& error, tcp::resolver::iterator it);
+    void connect();
+    void on_connected(const error_code& error);
 
-    void on_message_sent(const error_code& error, const size_t num_bytes_sent);
+    void write_next_request();
+    void on_request_written(const error_code& error);
 
-    void on_announce_response(const error_code& error, const size_t num_bytes_sent);
-    void on_scrape_response(const error_code& error, const size_t num_bytes_sent);
+    void read_response();
+    void on_response(const error_code& error);
 
+    void handle_announce_response(announce_request& request);
+    void handle_scrape_response(scrape_request& request);
     tracker_response parse_announce_response(error_code& error);
-    scrape_response parse_scrape_response();
+
+    /** Creates a HTTP target string from a tracker_request or scrape request. */
+    std::string create_target_string(const tracker_request& r) const;
+    std::string create_target_string(const scrape_request& r) const;
 
     /**
-     * If there are pending requests in requests_, selects the current one and
-     * executes it.
+     * Closes the connection and puts the requests in `pipeline_` back at the front
+     * of the queue, so that they're retried on a new connection, unless they have
+     * exhausted their retries, in which case they fail with `error`.
      */
-    void try_execute_one_request();
-
-    /** Returns the current pending request. See requests_ comment. */
-    request& current_request() noexcept;
+    void on_connection_error(const error_code& error);
+    void close_connection();
 
-    void on_request_error(const error_code& error);
+    /** Invokes the handlers of all enqueued requests with `error` and removes them. */
+    void fail_requests(const error_code& error);
 
     void start_timeout();
     void on_timeout(const error_code& error);
@@ -430,8 +490,7 @@ class udp_tracker final : public tracker
      * Multiple torrents may be associated with the same tracker so we need to
      * separate each torrent's announce/scrape request. This means each request
      * that torrent makes to tracker needs to have its own send buffer, expected
-     * action in response etc, but still use tracker's socket and receive buffer
-     * for communicating.
+     * action in response etc, but still use the shared socket for communicating.
      */
     struct request
     {
@@ -441,7 +500,8 @@ class udp_tracker final : public tracker
         enum action action = action::connect;
 
         // Each request has its own transaction id so tracker responses can be
-        // properly routed to a specific request. 0 means it is uninitialized.
+        // properly routed to a specific request. It's allocated by the shared socket
+        // so that it's unique across all trackers. 0 means it is uninitialized.
         int32_t transaction_id = 0;
 
         // Since UDP is an unreliable protocol we need to take care of lost or
@@ -468,8 +528,7 @@ class udp_tracker final : public tracker
         // This is the callback to be invoked once our request is served.
         std::function<void(const error_code&, tracker_response)> handler;
 
-        // There is only ever one outstanding datagram, which is stored here
-        // until it's confirmed that it has been sent.
+        // The datagram is assembled here before it's handed to the shared socket.
         // The size is fixed at 98 bytes because that's the largest message
         // we'll ever send (announce), and also the most common, so might as
         // well save ourselves the allocation churn.
@@ -490,8 +549,7 @@ class udp_tracker final : public tracker
         // This is the callback to be invoked once our request is served.
         std::function<void(const error_code&, scrape_response)> handler;
 
-        // There is only ever one outstanding datagram, which is stored here
-        // until it's confirmed that it has been sent.
+        // The datagram is assembled here before it's handed to the shared socket.
         // Size cannot be fixed because info_hashes is of variable size.
         struct payload payload;
 
@@ -504,29 +562,21 @@ class udp_tracker final : public tracker
     // Pending requests are mapped to their transaction ids.
     std::unordered_map<int32_t, std::unique_ptr<request>> requests_;
 
-    // While we may have many requests sent "at the same time", we may only
-    // receive and process a single datagram at a time. The buffer is fixed at
-    // 1500 bytes which is the limit of Ethernet v2 MTU, so this is about the
-    // upper limit to avoid fragmentation. This buffer is lazily allocated on
-    // the first use.
-    std::unique_ptr<std::array<char, 1500>> receive_buffer_;
-
-    // A single UDP socket is used for all tracker connections. That is, if
-    // multiple torrents are assigned the same tracker, they all make their
-    // requests/announcements via this socket.
-    udp::socket socket_;
+    // All UDP trackers send and receive through this `engine` wide socket, which
+    // routes the responses back to us by their transaction ids.
+    udp_tracker_socket& socket_;
     udp::resolver resolver_;
 
-    // After establishing a connection with tracker and receiving
-    // a connection_id, the connection is alive for one minute. This saves some
-    // bandwidth and unnecessary round trip times.
-    time_point last_connect_time_;
+    // The resolved address of tracker. Datagrams from any other endpoint are
+    // ignored.
+    udp::endpoint endpoint_;
 
     // This value we receive from tracker in response to our connect message,
     // which we then have to include in every subsequent message to prove it's
     // still us interacting with tracker. We can use it for one minute after
-    // receiving it.
-    int64_t connection_id_;
+    // receiving it, for which time it's cached by `socket_`, so that it's shared
+    // with other trackers at the same endpoint.
+    int64_t connection_id_ = 0;
 
     /**
      * After establishing a connection with tracker, we remain connected for
@@ -544,11 +594,6 @@ class udp_tracker final : public tracker
 
     enum state state_ = state::disconnected;
 
-    // This is set to signal that we're receiving into receive_buffer_, which is
-    // necessary because we may only receive a single datagram at any given
-    // time, i.e.  only serve a single request.
-    bool is_receiving_ = false;
-
     // The first request launches an async host resolution, during which no
     // other request may be launched, so execution must halt if this is false.
     bool is_resolved_ = false;
@@ -558,7 +603,8 @@ public:
      * `url` may or may not include the "udp://" protocol identifier, but it
      * must include the port number.
      */
-    udp_tracker(asio::io_context& ios, const std::string& url, const settings& settings);
+    udp_tracker(
+            udp_tracker_socket& socket, const std::string& url, const settings& settings);
     ~udp_tracker();
 
     void abort() override;
@@ -589,11 +635,12 @@ private:
     template <typename Request, typename Function>
     void execute_request(Request& request, Function f);
 
-    /** Creates a random transaction id. */
-    static int create_transaction_id();
-
-    /** Determines whether it is time to establish connection to tracker again. */
-    bool must_connect() const noexcept;
+    /**
+     * Determines whether it is time to establish connection to tracker again, i.e.
+     * whether there is no valid connection id in the cache of `socket_`. If there
+     * is, it's loaded into `connection_id_`.
+     */
+    bool must_connect();
 
     /**
      * To avoid spoofing, first we have to "connect" to tracker (even though UDP is a
@@ -608,21 +655,16 @@ private:
     template <typename Request>
     void send_message(Request& request, const size_t num_bytes_to_send);
 
-    /** Checks errors and makes sure the entire send buffer was transmitted. */
-    void on_message_sent(
-            request& request, const error_code& error, const size_t num_bytes_sent);
-
-    void receive_message();
-
     /**
-     * This handles all responses and dispatches the message handling to the response's
-     * matching handler and resets the timeout timer. The first two fields of the
-     * message are always as follows:
+     * This handles all responses (routed to us by `socket_`) and dispatches the
+     * message handling to the response's matching handler and resets the timeout
+     * timer. The first two fields of the message are always as follows:
      * int32_t action
      * int32_t transaction_id
      * And action is used to determine which handler is invoked.
      */
-    void on_message_received(const error_code& error, const size_t num_bytes_received);
+    void on_message_received(
+            const udp::endpoint& endpoint, const char* message, const int size);
 
     /**
      * If multiple torrents announce in quick succession and we have yet to establish
@@ -631,11 +673,15 @@ private:
      * first requester to finish establishing the connection. All connecting/waiting
      * requests are located and continued here.
      */
-    void handle_connect_response(request& request, const size_t num_bytes_received);
+    void handle_connect_response(request& request, const char* message, const int size);
     void handle_announce_response(
-            announce_request& request, const size_t num_bytes_received);
-    void handle_scrape_response(scrape_request& request, const size_t num_bytes_received);
-    void handle_error_response(request& request, const size_t num_bytes_received);
+            announce_request& request, const char* message, const int size);
+    void handle_scrape_response(
+            scrape_request& request, const char* message, const int size);
+    void handle_error_response(request& request, const char* message, const int size);
+
+    /** Removes the request and releases its transaction id. */
+    void remove_request(const int32_t transaction_id);
 
     /**
      * Requests issued during establishing a connection are put on hold until
@@ -648,14 +694,6 @@ private:
     void retry(request& request);
     void retry(announce_request& request);
     void retry(scrape_request& request);
-
-    /**
-     * Each pending request's handler is called with error and all pending requests are
-     * removed. This should be called if the error is not tied to a single request (e.g.
-     * internet connection is down), or it is not clear which request to associate with
-     * this error (e.g. wrong transaction_id -- which request's handler to call?).
-     */
-    void on_global_error(const error_code& error);
 };
 
 /**
@@ -694,6 +732,12 @@ struct tracker_entry
     time_point last_scrape_time;
     time_point last_force_time;
 
+    // The torrent's swarm statistics from the last scrape, or -1 if it hasn't been
+    // scraped yet.
+    int num_scraped_seeders = -1;
+    int num_scraped_leechers = -1;
+    int num_scraped_downloads = -1;
+
     // If there was an error with tracker, it will be kept here.
     error_code last_error;
 
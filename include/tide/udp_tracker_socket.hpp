@@ -0,0 +1,124 @@
+#ifndef TIDE_UDP_TRACKER_SOCKET_HEADER
+#define TIDE_UDP_TRACKER_SOCKET_HEADER
+
+#include "error_code.hpp"
+#include "socket.hpp"
+#include "time.hpp"
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <unordered_map>
+#include <vector>
+
+#include <asio/io_context.hpp>
+
+namespace tide {
+
+class utp_socket_manager;
+
+/**
+ * All UDP trackers (BEP 15) send and receive through `engine`'s single UDP socket,
+ * which is owned by `utp_socket_manager` and shared with uTP and the DHT, instead of
+ * each holding a socket of its own. Responses are routed to the tracker that sent the
+ * request by their transaction id, which is why transaction ids are handed out here,
+ * so that they're unique across all trackers.
+ *
+ * Datagrams are not sent right away, but queued up and sent in a single batch once
+ * control returns to the event loop. On Linux this is done with a single `sendmmsg`
+ * system call per batch, elsewhere the datagrams are sent one by one. Incoming
+ * datagrams are received by `utp_socket_manager`, which drains those that have arrived
+ * each time the socket becomes readable, in batches (with `recvmmsg` on Linux), and
+ * passes on those that aren't uTP packets.
+ *
+ * Connection ids are cached per tracker endpoint, so trackers that share an endpoint
+ * (e.g. those that are announced under several URLs) share their connection ids, and
+ * a connection id is reused for as long as it's valid.
+ */
+class udp_tracker_socket
+{
+public:
+    // The most datagrams that are sent in a single system call.
+    constexpr static int max_batch_size = 32;
+
+    using receive_handler
+            = std::function<void(const udp::endpoint&, const char*, const int)>;
+
+private:
+    // The socket is opened by `engine`. Datagrams sent while it's closed are dropped.
+    utp_socket_manager& socket_;
+
+    // The handlers of the transactions that are waiting for a response, by
+    // transaction id.
+    std::unordered_map<int32_t, receive_handler> transactions_;
+
+    struct connection
+    {
+        int64_t id;
+        time_point receive_time;
+    };
+
+    // The last connection id received from each tracker endpoint. Entries are only
+    // removed when they're looked up after they have expired.
+    std::map<udp::endpoint, connection> connections_;
+
+    struct datagram
+    {
+        udp::endpoint endpoint;
+        std::vector<char> data;
+    };
+
+    // The datagrams that are waiting to be sent in the next batch.
+    std::vector<datagram> send_queue_;
+
+    bool is_flush_scheduled_ = false;
+    bool is_waiting_to_send_ = false;
+
+public:
+    explicit udp_tracker_socket(utp_socket_manager& socket);
+    ~udp_tracker_socket();
+
+    asio::io_context& get_io_context() noexcept;
+    bool is_open() const noexcept;
+    int num_transactions() const noexcept { return transactions_.size(); }
+
+    udp::endpoint local_endpoint(error_code& error) const;
+
+    /**
+     * Picks a random transaction id that is not used by any outstanding transaction,
+     * and registers `handler` to be invoked with every response that carries it, until
+     * the transaction is unregistered.
+     */
+    int32_t register_transaction(receive_handler handler);
+    void unregister_transaction(const int32_t transaction_id);
+
+    /**
+     * Returns true and sets `id` to the connection id received from the tracker at
+     * `endpoint`, if we have one that is still valid (BEP 15 lets us use it for
+     * a minute).
+     */
+    bool find_connection_id(const udp::endpoint& endpoint, int64_t& id);
+    void save_connection_id(const udp::endpoint& endpoint, const int64_t id);
+
+    /**
+     * Queues the datagram to be sent in the next batch. If the datagram can't be
+     * sent it's dropped, as trackers time out and retry their requests anyway.
+     */
+    void send_to(const udp::endpoint& endpoint, const char* data, const int size);
+
+private:
+    void flush_send_queue();
+
+    /**
+     * Sends at most `max_batch_size` of the queued datagrams starting at `first`, as
+     * many as the socket accepts without blocking, and returns the number sent, or
+     * -1 if the socket's send buffer is full.
+     */
+    int send_batch(const int first, error_code& error);
+
+    void handle_datagram(const udp::endpoint& endpoint, const char* data, const int size);
+};
+
+} // tide
+
+#endif // TIDE_UDP_TRACKER_SOCKET_HEADER
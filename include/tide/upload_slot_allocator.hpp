@@ -0,0 +1,101 @@
+#ifndef TIDE_UPLOAD_SLOT_ALLOCATOR_HEADER
+#define TIDE_UPLOAD_SLOT_ALLOCATOR_HEADER
+
+#include "time.hpp"
+
+#include <functional> // function
+#include <vector>
+
+namespace tide {
+
+/**
+ * Upload slots (i.e. the number of peers that may be unchoked at the same time) are
+ * an `engine` wide resource, allotted to the torrents by this in a global unchoke
+ * round. Otherwise, with each torrent observing its own share of the slots, those
+ * of torrents in dead swarms would sit idle while busy swarms are starved.
+ *
+ * Torrents that take part in the global round subscribe with two handlers. The first
+ * ranks the torrent's unchoke candidates (the interested peers) in the order in
+ * which the torrent would unchoke them, and reports their expected upload rates. The
+ * second is invoked with the number of slots allotted to the torrent, which then
+ * unchokes that many of its best ranked candidates and chokes the rest.
+ *
+ * Each torrent that has candidates is first given a minimum number of slots, so
+ * that no swarm is starved entirely, after which the remaining slots go to the
+ * candidates with the highest expected upload rates, regardless of their torrents.
+ */
+class upload_slot_allocator
+{
+public:
+    // A unique value used to identify a subscriber.
+    using token_type = void*;
+
+    // Invoked with a vector to fill with the expected upload rates of at most `n`
+    // of subscriber's unchoke candidates, in the subscriber's order of preference.
+    using rank_handler = std::function<void(std::vector<int>&, int)>;
+
+private:
+    // The total number of peers that may be unchoked across all subscribers.
+    int max_upload_slots_ = 4;
+
+    // The number of slots each subscriber with unchoke candidates is guaranteed,
+    // as long as there are enough slots for all of them.
+    int min_slots_per_torrent_ = 1;
+
+    struct subscriber
+    {
+        token_type token;
+        rank_handler rank_candidates;
+        std::function<void(int)> handler;
+
+        // These are only used during a round.
+        std::vector<int> expected_rates;
+        int num_allotted_slots = 0;
+    };
+
+    std::vector<subscriber> subscribers_;
+
+    // Rounds are run at most this often, as the rates peers are ranked by need time
+    // to adapt to a new unchoke set.
+    duration round_interval_ = seconds(10);
+    time_point last_round_time_;
+
+public:
+    int max_upload_slots() const noexcept { return max_upload_slots_; }
+    int min_slots_per_torrent() const noexcept { return min_slots_per_torrent_; }
+    int num_subscribers() const noexcept { return subscribers_.size(); }
+
+    void set_max_upload_slots(const int n);
+    void set_min_slots_per_torrent(const int n);
+    void set_round_interval(const duration d);
+
+    /**
+     * Registers the handlers of `token`, which then takes part in every subsequent
+     * round until it unsubscribes. If `token` is already subscribed, its handlers
+     * are replaced.
+     */
+    void subscribe(const token_type token, rank_handler rank_candidates,
+            std::function<void(int)> handler);
+
+    /** Removes the handlers associated with `token`, if any. */
+    void unsubscribe(const token_type token);
+
+    /**
+     * Runs an unchoke round if the round interval has elapsed since the last one,
+     * or if `force` is set.
+     *
+     * This must be called at regular intervals (currently done by `engine`).
+     */
+    void allot_slots(const bool force = false);
+
+private:
+    /**
+     * Divides the slots among the subscribers according to the expected rates of
+     * their candidates, setting each subscriber's `num_allotted_slots`.
+     */
+    void divide_slots();
+};
+
+} // tide
+
+#endif // TIDE_UPLOAD_SLOT_ALLOCATOR_HEADER
@@ -0,0 +1,466 @@
+#ifndef TIDE_UTP_SOCKET_HEADER
+#define TIDE_UTP_SOCKET_HEADER
+
+#include "error_code.hpp"
+#include "socket.hpp"
+#include "stream_socket.hpp"
+#include "time.hpp"
+
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <utility> // pair
+#include <vector>
+
+#include <asio/io_context.hpp>
+
+namespace tide {
+
+class utp_socket_manager;
+
+/**
+ * A connection over the Micro Transport Protocol (BEP 29), a reliable, ordered
+ * stream protocol on top of UDP, exposed through the same `stream_socket`
+ * interface as TCP connections.
+ *
+ * Unlike TCP, which only backs off once router buffers overflow and packets are
+ * dropped, uTP uses LEDBAT congestion control: every packet carries a timestamp from
+ * which the receiver measures the one-way delay, and the sender keeps its window
+ * such that the delay added by queuing on the path stays around `target_delay`.
+ * This way BitTorrent traffic yields to other (e.g. interactive) traffic sharing the
+ * uplink while still using the bandwidth that is idle. Lost packets are detected
+ * through duplicate and selective ACKs and are retransmitted, and the window is
+ * halved, as in TCP.
+ *
+ * All connections share the single UDP socket of a `utp_socket_manager`, which
+ * demultiplexes incoming packets and must outlive all its sockets.
+ */
+class utp_socket final : public stream_socket
+{
+    friend class utp_socket_manager;
+
+public:
+    constexpr static int header_size = 20;
+
+    // The most payload put in a single packet, chosen such that a packet along with
+    // its uTP, UDP and IP headers fits in a 1500 byte Ethernet frame.
+    constexpr static int max_payload_size = 1400;
+
+    // LEDBAT aims to keep the queuing delay on the path at this value: when
+    // measured delays are below it the window grows, when above it shrinks.
+    constexpr static int target_delay_us = 100000;
+
+    // The most the congestion window may grow by in a single round trip.
+    constexpr static int max_window_increase_per_rtt = 3000;
+
+    // This is the least the congestion window may shrink to.
+    constexpr static int min_window_size = 2 * max_payload_size;
+
+    // The maximum number of bytes written by the user that we hold onto until they
+    // are acknowledged by peer, and the maximum number of received bytes that we
+    // buffer until they're read by the user (which is what we advertise as our
+    // receive window).
+    constexpr static int send_buffer_capacity = 0x40000;
+    constexpr static int receive_buffer_capacity = 0x100000;
+
+private:
+    enum packet_type : uint8_t
+    {
+        st_data = 0,
+        st_fin = 1,
+        st_state = 2,
+        st_reset = 3,
+        st_syn = 4
+    };
+
+    enum class state
+    {
+        // Not connected or the connection has been torn down.
+        closed,
+        syn_sent,
+        connected,
+        // We've sent (or queued) a FIN so no more data may be written, but we may
+        // still receive data from peer.
+        fin_sent
+    };
+
+    /** The fixed sized part of every uTP packet. */
+    struct packet_header
+    {
+        packet_type type;
+        uint8_t extension;
+        uint16_t connection_id;
+        uint32_t timestamp_us;
+        uint32_t timestamp_difference_us;
+        uint32_t wnd_size;
+        uint16_t seq_nr;
+        uint16_t ack_nr;
+    };
+
+    /** An outgoing data, FIN or SYN packet. */
+    struct packet
+    {
+        // The header followed by the payload. The header is rewritten on each
+        // transmission as it carries the current timestamp and ACK number.
+        std::vector<uint8_t> buffer;
+        packet_type type;
+        uint16_t seq_nr;
+        time_point send_time;
+        int num_transmissions = 0;
+        // Set when a packet was acknowledged through a selective ACK but earlier
+        // packets have not been, so it can't be removed yet.
+        bool is_acked = false;
+        // Whether the packet's payload is counted in `num_bytes_in_flight_`. A lost
+        // packet no longer is until it's retransmitted.
+        bool is_in_flight = false;
+        bool needs_resend = false;
+
+        int payload_size() const noexcept { return buffer.size() - header_size; }
+    };
+
+    utp_socket_manager& manager_;
+
+    udp::endpoint remote_endpoint_;
+    state state_ = state::closed;
+    bool is_open_ = false;
+    bool is_registered_ = false;
+
+    // Set when the connection was reset by peer or timed out. Any further
+    // operation fails with this error.
+    error_code error_;
+
+    // We receive packets whose connection id is `receive_id_`, and send packets
+    // with `send_id_` (except for the SYN, which carries `receive_id_`).
+    uint16_t receive_id_ = 0;
+    uint16_t send_id_ = 0;
+
+    // The sequence number that is assigned to the next data packet we create.
+    uint16_t seq_nr_ = 0;
+
+    // The sequence number of the last packet that we received in order.
+    uint16_t ack_nr_ = 0;
+
+    // The last ACK number peer sent, used to detect duplicate ACKs.
+    uint16_t last_received_ack_nr_ = 0;
+    int num_duplicate_acks_ = 0;
+
+    // Packets written by user but not yet sent because the window is full. The last
+    // packet may not be full yet, in which case subsequent writes are appended to it.
+    std::deque<packet> send_queue_;
+
+    // Packets that have been sent but not yet acknowledged, in the order of their
+    // sequence numbers (which are consecutive).
+    std::deque<packet> in_flight_packets_;
+    int num_packets_needing_resend_ = 0;
+
+    // The total payload in `send_queue_` and `in_flight_packets_`, which may not
+    // exceed `send_buffer_capacity`.
+    int num_buffered_send_bytes_ = 0;
+
+    // The number of payload bytes sent that have not been acknowledged or declared
+    // lost, which may not exceed the lesser of `max_window_` and `peer_window_`.
+    int num_bytes_in_flight_ = 0;
+
+    // The congestion window, in bytes, controlled by LEDBAT.
+    int max_window_ = min_window_size;
+
+    // The receive window advertised by peer.
+    int peer_window_ = max_payload_size;
+
+    // The window may only grow while we're actually using it, so this records when
+    // we were last prevented from sending by it.
+    time_point last_window_full_time_;
+
+    // The window is halved at most once per round trip on packet loss.
+    time_point last_window_decay_time_;
+
+    // The difference between our clock and the timestamp in the last packet
+    // received from peer, which we echo back in each packet we send so that peer
+    // can measure the delay on its uplink.
+    uint32_t reply_micro_ = 0;
+
+    // Peer echoes back the one-way delay it measured on our packets, which includes
+    // the difference between the two clocks. The smallest delay seen in the past two
+    // minutes (tracked in one minute buckets, to adapt to clock drift and route
+    // changes) is assumed to be free of queuing delay, and is the base against which
+    // the queuing delay is measured.
+    std::array<uint32_t, 2> base_delays_;
+    bool has_base_delay_ = false;
+    time_point last_base_delay_rotation_time_;
+
+    // The queuing delays (in microseconds) measured on the last few packets, the
+    // minimum of which is taken as the current delay, to filter out noise.
+    std::array<int, 3> current_delays_{{0, 0, 0}};
+    int current_delay_pos_ = 0;
+
+    // The smoothed round trip time and its variance, in microseconds, and the
+    // retransmission timeout derived from them.
+    int rtt_ = 0;
+    int rtt_var_ = 0;
+    milliseconds timeout_{1000};
+    int num_consecutive_timeouts_ = 0;
+
+    // Received in order payload not yet read by user.
+    std::deque<std::vector<uint8_t>> receive_buffer_;
+    int receive_buffer_offset_ = 0;
+    int num_received_bytes_ = 0;
+
+    // Packets received out of order are stored here, indexed by their sequence
+    // number modulo the buffer's size, until the gap before them is filled.
+    std::vector<std::vector<uint8_t>> reorder_buffer_;
+    int num_reordered_packets_ = 0;
+    int num_reordered_bytes_ = 0;
+
+    // Peer's FIN packet's sequence number. Once all packets up to it have been
+    // received, reads fail with `asio::error::eof`.
+    uint16_t fin_seq_nr_ = 0;
+    bool has_received_fin_ = false;
+
+    // The number of packets we've received but haven't acknowledged yet. ACKs are
+    // sent after the manager has processed all packets that arrived in one batch,
+    // but at least every other data packet is acknowledged right away, so that the
+    // loss of a single ACK doesn't leave the sender waiting for a timeout.
+    int num_unacked_packets_ = 0;
+
+    // The handlers of the pending asynchronous operations, if any.
+    connect_handler connect_handler_;
+    io_handler read_handler_;
+    asio::mutable_buffer read_buffer_;
+    io_handler write_handler_;
+    std::vector<asio::const_buffer> write_buffers_;
+
+public:
+    explicit utp_socket(utp_socket_manager& manager);
+    ~utp_socket();
+
+    utp_socket(const utp_socket&) = delete;
+    utp_socket& operator=(const utp_socket&) = delete;
+
+    transport type() const noexcept override { return transport::utp; }
+    asio::io_context& get_io_context() noexcept override;
+
+    bool is_open() const noexcept override { return is_open_; }
+    void open(const tcp& protocol, error_code& error) override;
+    void non_blocking(const bool b, error_code& error) override;
+    tcp::endpoint local_endpoint(error_code& error) const override;
+
+    /** The endpoint of the peer to which we're connected or that connected to us. */
+    tcp::endpoint remote_endpoint() const
+    {
+        return tcp::endpoint(remote_endpoint_.address(), remote_endpoint_.port());
+    }
+
+    void async_connect(const tcp::endpoint& endpoint, connect_handler handler) override;
+    void async_write_some(
+            const std::vector<asio::const_buffer>& buffers, io_handler handler) override;
+    void async_read_some(asio::mutable_buffer buffer, io_handler handler) override;
+    size_t available(error_code& error) const override;
+    size_t read_some(asio::mutable_buffer buffer, error_code& error) override;
+
+    /**
+     * Queues a FIN after any data that is still to be sent. Peer may continue
+     * sending data until it sends its own FIN.
+     */
+    void shutdown(error_code& error) override;
+
+    /**
+     * Aborts all pending operations and releases the connection. Data that has not
+     * been acknowledged by peer is discarded.
+     */
+    void close(error_code& error) override;
+
+private:
+    static bool parse_header(const uint8_t* data, const int size, packet_header& header);
+
+    /** Initializes an incoming connection from peer's SYN packet. */
+    void accept(const udp::endpoint& endpoint, const packet_header& syn);
+
+    /** Called by the manager for each packet addressed to this connection. */
+    void handle_packet(const packet_header& header, const uint8_t* data, const int size);
+
+    /** Called by the manager periodically to detect timeouts. */
+    void on_tick(const time_point& now);
+
+    /**
+     * Processes peer's cumulative and selective ACKs. Returns the number of payload
+     * bytes that were newly acknowledged.
+     */
+    int handle_ack(const uint16_t ack_nr, const uint8_t* sack, const int sack_size,
+            const bool is_pure_ack, const time_point& now);
+    void handle_payload(const packet_header& header, const uint8_t* payload,
+            const int payload_size);
+
+    /** Records the one-way delay peer measured on one of our packets. */
+    void update_delay(const uint32_t delay_us, const time_point& now);
+    int queuing_delay() const noexcept;
+
+    /** Adjusts the congestion window according to LEDBAT. */
+    void update_window(const int num_acked_bytes, const time_point& now);
+    void update_rtt(const duration& sample);
+    void decay_window(const time_point& now);
+
+    /** Marks a packet lost so that it's retransmitted. */
+    void mark_lost(packet& p);
+
+    /** Copies as much of `buffers` into outgoing packets as there is room for. */
+    int append_to_send_queue(const std::vector<asio::const_buffer>& buffers);
+    packet& create_packet(const packet_type type);
+
+    /** Retransmits lost packets and sends new ones as far as the window allows. */
+    void send_packets();
+    bool has_window_room_for(const int num_bytes) const noexcept;
+    void transmit(packet& p);
+    void send_state();
+    void write_header(uint8_t* buffer, const packet_type type, const uint8_t extension,
+            const uint16_t seq_nr) const;
+
+    int receive_window() const noexcept;
+    bool is_eof() const noexcept;
+    int copy_received_bytes(asio::mutable_buffer buffer);
+
+    /** Completes the pending read or write, if it can be completed. */
+    void try_complete_read();
+    void try_complete_write();
+
+    /** Tears down the connection and fails all pending operations with `error`. */
+    void fail(const error_code& error);
+    void abort_pending_ops(const error_code& error);
+    void reset_state();
+};
+
+/**
+ * Owns the engine's UDP socket, over which all uTP connections are multiplexed, and
+ * routes incoming packets to the `utp_socket` they belong to, identified by the
+ * sender's endpoint and the packet's connection id. It also drives the sockets'
+ * retransmission timers.
+ *
+ * The socket is shared with the other UDP based protocols (the DHT and UDP trackers),
+ * which are passed the datagrams that are not uTP packets.
+ */
+class utp_socket_manager
+{
+    friend class utp_socket;
+
+public:
+    using datagram_handler
+            = std::function<void(const udp::endpoint&, const uint8_t*, int)>;
+
+private:
+    asio::io_context& ios_;
+    udp::socket socket_;
+
+    // The most datagrams that are received in a single system call.
+    constexpr static int max_receive_batch_size = 32;
+
+    // The datagram that wakes us up is received into this buffer.
+    std::array<uint8_t, 4096> receive_buffer_;
+    udp::endpoint sender_endpoint_;
+    bool is_receiving_ = false;
+
+    // The datagrams that queued up while we were woken up are then drained in batches
+    // into these, and their senders and sizes are stored alongside. The buffers are
+    // only allocated once they're first needed.
+    std::vector<std::array<uint8_t, 4096>> batch_buffers_;
+    std::array<udp::endpoint, max_receive_batch_size> batch_endpoints_;
+    std::array<int, max_receive_batch_size> batch_sizes_;
+
+    std::map<std::pair<udp::endpoint, uint16_t>, utp_socket*> sockets_;
+
+    // The sockets that received packets while processing the current batch of
+    // datagrams, and need to acknowledge them once we're done.
+    std::vector<utp_socket*> sockets_needing_ack_;
+
+    // Invoked with each new incoming connection. If not set, incoming connections
+    // are refused.
+    std::function<void(std::unique_ptr<utp_socket>)> accept_handler_;
+
+    // If set, incoming connections from endpoints for which this returns false are
+    // refused before a socket is created for them.
+    std::function<bool(const udp::endpoint&)> accept_filter_;
+
+    // Each incoming datagram that is not a uTP packet is passed to all of these, and
+    // each handler ignores the datagrams that are not meant for it. They're
+    // identified by the token with which they were added.
+    std::vector<std::pair<const void*, datagram_handler>> datagram_handlers_;
+
+    deadline_timer tick_timer_;
+    bool is_ticking_ = false;
+
+public:
+    explicit utp_socket_manager(asio::io_context& ios);
+    ~utp_socket_manager();
+
+    asio::io_context& get_io_context() noexcept { return ios_; }
+
+    bool is_open() const noexcept { return socket_.is_open(); }
+    int num_sockets() const noexcept { return sockets_.size(); }
+
+    /**
+     * Binds the UDP socket to `port` on all IPv4 interfaces (or to an OS chosen port
+     * if it's 0) and starts receiving.
+     */
+    void open(const uint16_t port, error_code& error);
+    void close();
+
+    udp::endpoint local_endpoint(error_code& error) const;
+
+    void set_accept_handler(std::function<void(std::unique_ptr<utp_socket>)> handler)
+    {
+        accept_handler_ = std::move(handler);
+    }
+
+    void set_accept_filter(std::function<bool(const udp::endpoint&)> filter)
+    {
+        accept_filter_ = std::move(filter);
+    }
+
+    /** `token` must be unique to the handler's owner. */
+    void add_datagram_handler(const void* token, datagram_handler handler);
+    void remove_datagram_handler(const void* token);
+
+    /**
+     * The socket itself, for protocols that send enough datagrams at once to be
+     * worth batching them into fewer system calls. Receiving is always done here.
+     */
+    udp::socket& udp_socket() noexcept { return socket_; }
+
+    /**
+     * Sends a datagram without blocking. If the socket's send buffer is full the
+     * datagram is dropped, so this is only suitable for protocols that recover from
+     * lost datagrams (which all protocols on top of UDP have to do anyway).
+     */
+    void send_to(const udp::endpoint& endpoint, const uint8_t* data, const int size);
+
+private:
+    /** Picks a connection id that is not yet used with `endpoint`. */
+    uint16_t allocate_connection_id(const udp::endpoint& endpoint) const;
+    void register_socket(utp_socket& socket);
+    void unregister_socket(utp_socket& socket);
+    void defer_ack(utp_socket& socket);
+
+    void send_reset(const udp::endpoint& endpoint, const uint16_t connection_id,
+            const uint16_t ack_nr);
+
+    void receive();
+    void on_received(const error_code& error, const size_t num_bytes_received);
+
+    /**
+     * Receives as many of the datagrams that have arrived as fit in `batch_buffers_`
+     * without blocking, on Linux with a single `recvmmsg` call, and returns their
+     * number.
+     */
+    int receive_batch();
+    void handle_datagram(
+            const udp::endpoint& sender, const uint8_t* datagram, const int size);
+    void send_deferred_acks();
+
+    void start_ticking();
+    void on_tick(const error_code& error);
+};
+
+} // tide
+
+#endif // TIDE_UTP_SOCKET_HEADER
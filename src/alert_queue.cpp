@@ -0,0 +1,179 @@
+#include "alert_queue.hpp"
+
+#include <cassert>
+
+namespace tide {
+
+inline uint64_t next_queue_id() noexcept
+{
+    static std::atomic<uint64_t> next_id{1};
+    return next_id.fetch_add(1, std::memory_order_relaxed);
+}
+
+inline int round_up_to_power_of_two(const int n) noexcept
+{
+    int capacity = 1;
+    while(capacity < n) {
+        capacity <<= 1;
+    }
+    return capacity;
+}
+
+alert_queue::alert_queue(const int capacity) : id_(next_queue_id())
+{
+    assert(capacity > 0);
+    const int size = round_up_to_power_of_two(capacity);
+    cells_ = std::make_unique<cell[]>(size);
+    for(auto i = 0; i < size; ++i) {
+        cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    capacity_mask_ = size - 1;
+}
+
+alert_queue::~alert_queue()
+{
+    // There may be no producers left at this point, so it's safe to drain the ring
+    // as its consumer.
+    std::vector<alert*> alerts;
+    pop_alerts(alerts);
+    for(auto& a : popped_alerts_) {
+        a.first->~alert();
+        release(a.second);
+    }
+    for(auto& p : producers_) {
+        if(p->current) {
+            release(p->current);
+        }
+        delete p->spare.load(std::memory_order_acquire);
+    }
+}
+
+void alert_queue::pop_alerts(std::vector<alert*>& alerts)
+{
+    // User is done with the previous batch.
+    for(auto& a : popped_alerts_) {
+        a.first->~alert();
+        release(a.second);
+    }
+    popped_alerts_.clear();
+    alerts.clear();
+
+    // This is set before the ring is drained, so that an alert posted after the
+    // last one we drain is guaranteed to trigger a notification.
+    should_notify_.store(true, std::memory_order_seq_cst);
+
+    while(true) {
+        cell& c = cells_[head_ & capacity_mask_];
+        if(c.sequence.load(std::memory_order_acquire) != head_ + 1) {
+            break;
+        }
+        popped_alerts_.emplace_back(c.a, c.c);
+        alerts.push_back(c.a);
+        // Hand the cell back to producers for the next lap around the ring.
+        c.sequence.store(head_ + capacity_mask_ + 1, std::memory_order_release);
+        ++head_;
+    }
+}
+
+void alert_queue::set_notify_handler(std::function<void()> handler)
+{
+    {
+        std::lock_guard<std::mutex> l(notify_handler_mutex_);
+        notify_handler_ = std::move(handler);
+    }
+    should_notify_.store(true, std::memory_order_seq_cst);
+}
+
+alert_queue::producer& alert_queue::local_producer()
+{
+    // A thread may post to several queues (e.g. with several engines), so it keeps
+    // its producer for each of them.
+    thread_local std::vector<std::pair<uint64_t, producer*>> local_producers;
+    for(const auto& lp : local_producers) {
+        if(lp.first == id_) {
+            return *lp.second;
+        }
+    }
+
+    auto p = std::make_unique<producer>();
+    producer& ref = *p;
+    {
+        std::lock_guard<std::mutex> l(producers_mutex_);
+        producers_.emplace_back(std::move(p));
+    }
+    local_producers.emplace_back(id_, &ref);
+    return ref;
+}
+
+void* alert_queue::allocate(producer& p, const int size, const int alignment)
+{
+    if(p.current) {
+        const int offset = (p.current->num_bytes_used + alignment - 1) & ~(alignment - 1);
+        if(offset + size <= chunk_size) {
+            p.current->num_bytes_used = offset + size;
+            return p.current->data + offset;
+        }
+        // The chunk is full, so drop our reference to it. It's recycled once the
+        // consumer is done with the alerts in it.
+        release(p.current);
+    }
+
+    chunk* c = p.spare.exchange(nullptr, std::memory_order_acquire);
+    if(c) {
+        c->num_refs.store(1, std::memory_order_relaxed);
+        c->num_bytes_used = 0;
+    } else {
+        c = new chunk(&p);
+    }
+    p.current = c;
+    c->num_bytes_used = size;
+    return c->data;
+}
+
+void alert_queue::release(chunk* c) noexcept
+{
+    if(c->num_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        chunk* expected = nullptr;
+        if(!c->owner->spare.compare_exchange_strong(
+                   expected, c, std::memory_order_release)) {
+            delete c;
+        }
+    }
+}
+
+bool alert_queue::push(alert* a, chunk* c) noexcept
+{
+    uint64_t pos = tail_.load(std::memory_order_relaxed);
+    cell* target;
+    while(true) {
+        target = &cells_[pos & capacity_mask_];
+        const uint64_t sequence = target->sequence.load(std::memory_order_acquire);
+        const int64_t diff = int64_t(sequence) - int64_t(pos);
+        if(diff == 0) {
+            // The cell is free, try to claim it.
+            if(tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if(diff < 0) {
+            // The consumer hasn't yet freed this cell from the previous lap.
+            return false;
+        } else {
+            // Another producer claimed the cell first.
+            pos = tail_.load(std::memory_order_relaxed);
+        }
+    }
+    target->a = a;
+    target->c = c;
+    target->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+void alert_queue::notify()
+{
+    std::lock_guard<std::mutex> l(notify_handler_mutex_);
+    if(notify_handler_) {
+        notify_handler_();
+    }
+}
+
+} // namespace tide
@@ -0,0 +1,222 @@
+#include "announce_scheduler.hpp"
+#include "random.hpp"
+#include "tracker.hpp"
+
+#include <algorithm> // find_if, remove_if, push_heap, pop_heap, make_heap
+#include <cassert>
+#include <limits>
+
+namespace tide {
+
+/** Orders the `waiting` heap so that the announce that is due first is at the top. */
+struct later_due_time
+{
+    template <typename Announce>
+    bool operator()(const Announce& a, const Announce& b) const noexcept
+    {
+        return a.due_time > b.due_time;
+    }
+};
+
+/**
+ * Orders the `ready` heap so that the most urgent announce is at the top, and of
+ * those with equal priority, the one that has been due the longest.
+ */
+struct lower_priority
+{
+    template <typename Announce>
+    bool operator()(const Announce& a, const Announce& b) const noexcept
+    {
+        if(a.priority == b.priority) {
+            return a.due_time > b.due_time;
+        }
+        return a.priority > b.priority;
+    }
+};
+
+void announce_scheduler::set_max_in_flight_per_tracker(const int n)
+{
+    assert(n == unlimited || n > 0);
+    max_in_flight_per_tracker_ = n;
+}
+
+void announce_scheduler::set_max_announces_per_second_per_tracker(const int n)
+{
+    assert(n == unlimited || n > 0);
+    max_announces_per_second_per_tracker_ = n;
+}
+
+void announce_scheduler::set_max_jitter(const duration d)
+{
+    assert(d >= duration(0));
+    max_jitter_ = d;
+}
+
+int announce_scheduler::num_scheduled_announces() const noexcept
+{
+    int n = 0;
+    for(const auto& entry : trackers_) {
+        n += entry.second.scheduled.size();
+    }
+    return n;
+}
+
+void announce_scheduler::schedule(const token_type token, const int event,
+        const tracker& tracker, const int priority,
+        std::function<void(in_flight_announce)> handler)
+{
+    const auto now = cached_clock::now();
+    tracker_queue& queue = trackers_[tracker.url()];
+    const announce_key key(token, event);
+
+    auto it = queue.scheduled.find(key);
+    if(it != queue.scheduled.end()) {
+        // Torrents reschedule their announces every second for as long as they are
+        // pending, so the scheduled announce is updated in place rather than
+        // superseded by a new entry, lest the heaps fill up with stale entries.
+        if(priority < it->second) {
+            it->second = priority;
+            make_more_urgent(queue, key, priority, now);
+        }
+        return;
+    }
+
+    announce a;
+    a.key = key;
+    a.priority = priority;
+    a.due_time = now;
+    if((priority != urgent) && (max_jitter_ > duration(0))) {
+        a.due_time += milliseconds(
+                util::random_int(0, to_int<milliseconds>(max_jitter_)));
+    }
+    a.handler = std::move(handler);
+    queue.scheduled.emplace(key, priority);
+
+    if(a.due_time <= now) {
+        queue.ready.emplace_back(std::move(a));
+        std::push_heap(queue.ready.begin(), queue.ready.end(), lower_priority());
+    } else {
+        queue.waiting.emplace_back(std::move(a));
+        std::push_heap(queue.waiting.begin(), queue.waiting.end(), later_due_time());
+    }
+}
+
+inline void announce_scheduler::make_more_urgent(tracker_queue& queue,
+        const announce_key& key, const int priority, const time_point now)
+{
+    const auto has_key = [&key](const announce& a) { return a.key == key; };
+    auto it = std::find_if(queue.ready.begin(), queue.ready.end(), has_key);
+    if(it != queue.ready.end()) {
+        it->priority = priority;
+        std::make_heap(queue.ready.begin(), queue.ready.end(), lower_priority());
+        return;
+    }
+
+    it = std::find_if(queue.waiting.begin(), queue.waiting.end(), has_key);
+    assert(it != queue.waiting.end());
+    // `waiting` is not ordered by priority, so unless the announce is no longer to be
+    // delayed, it may stay where it is.
+    it->priority = priority;
+    if(priority == urgent) {
+        it->due_time = now;
+        queue.ready.emplace_back(std::move(*it));
+        queue.waiting.erase(it);
+        std::make_heap(queue.waiting.begin(), queue.waiting.end(), later_due_time());
+        std::push_heap(queue.ready.begin(), queue.ready.end(), lower_priority());
+    }
+}
+
+void announce_scheduler::unsubscribe(const token_type token)
+{
+    const auto has_token = [token](const announce& a) { return a.key.first == token; };
+    for(auto& entry : trackers_) {
+        tracker_queue& queue = entry.second;
+        const auto first = queue.scheduled.lower_bound(
+                {token, std::numeric_limits<int>::min()});
+        const auto last = queue.scheduled.upper_bound(
+                {token, std::numeric_limits<int>::max()});
+        if(first == last) {
+            continue;
+        }
+        queue.scheduled.erase(first, last);
+        queue.ready.erase(
+                std::remove_if(queue.ready.begin(), queue.ready.end(), has_token),
+                queue.ready.end());
+        queue.waiting.erase(
+                std::remove_if(queue.waiting.begin(), queue.waiting.end(), has_token),
+                queue.waiting.end());
+        std::make_heap(queue.ready.begin(), queue.ready.end(), lower_priority());
+        std::make_heap(queue.waiting.begin(), queue.waiting.end(), later_due_time());
+    }
+}
+
+inline void announce_scheduler::refill(tracker_queue& queue, const time_point now)
+{
+    if(max_announces_per_second_per_tracker_ == unlimited) {
+        return;
+    }
+    const double elapsed = to_int<milliseconds>(now - queue.last_refill_time) / 1000.0;
+    queue.num_available_announces = std::min(
+            queue.num_available_announces
+                    + elapsed * max_announces_per_second_per_tracker_,
+            double(max_announces_per_second_per_tracker_));
+    queue.last_refill_time = now;
+}
+
+void announce_scheduler::dispatch()
+{
+    const auto now = cached_clock::now();
+    // Handlers may schedule new announces, so they're only invoked once all queues
+    // have been processed.
+    std::vector<std::pair<std::function<void(in_flight_announce)>, in_flight_announce>>
+            handlers;
+    for(auto it = trackers_.begin(); it != trackers_.end();) {
+        tracker_queue& queue = it->second;
+
+        while(!queue.waiting.empty() && (queue.waiting.front().due_time <= now)) {
+            std::pop_heap(queue.waiting.begin(), queue.waiting.end(), later_due_time());
+            queue.ready.emplace_back(std::move(queue.waiting.back()));
+            queue.waiting.pop_back();
+            std::push_heap(queue.ready.begin(), queue.ready.end(), lower_priority());
+        }
+
+        refill(queue, now);
+        while(!queue.ready.empty()
+                && ((max_in_flight_per_tracker_ == unlimited)
+                        || (*queue.num_in_flight < max_in_flight_per_tracker_))
+                && ((max_announces_per_second_per_tracker_ == unlimited)
+                        || (queue.num_available_announces >= 1.0))) {
+            std::pop_heap(queue.ready.begin(), queue.ready.end(), lower_priority());
+            announce a = std::move(queue.ready.back());
+            queue.ready.pop_back();
+            queue.scheduled.erase(a.key);
+            ++*queue.num_in_flight;
+            queue.num_available_announces -= 1.0;
+            ++num_dispatched_announces_;
+            in_flight_announce in_flight(nullptr,
+                    [num_in_flight = std::weak_ptr<int>(queue.num_in_flight)](void*) {
+                        if(auto n = num_in_flight.lock()) {
+                            --*n;
+                        }
+                    });
+            handlers.emplace_back(std::move(a.handler), std::move(in_flight));
+        }
+
+        // A new queue starts out with a full second's worth of announces, so an idle
+        // queue may only go once it has refilled.
+        const bool is_idle = queue.scheduled.empty() && (*queue.num_in_flight == 0)
+                && ((max_announces_per_second_per_tracker_ == unlimited)
+                        || (queue.num_available_announces
+                                >= max_announces_per_second_per_tracker_));
+        if(is_idle) {
+            it = trackers_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    for(auto& handler : handlers) {
+        handler.first(std::move(handler.second));
+    }
+}
+
+} // tide
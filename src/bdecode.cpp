@@ -1,6 +1,7 @@
 #include "bdecode.hpp"
 
-#include <cctype> // isdigit
+#include <algorithm> // lexicographical_compare, min
+#include <limits>
 
 namespace tide {
 
@@ -19,8 +20,10 @@ std::string bencode_error_category::message(int env) const
     case bencode_errc::bstring_missing_colon: return "Missing colon after bstring header";
     case bencode_errc::bnumber_trailing_zeros: return "Trailing zeros in bnumber";
     case bencode_errc::bnumber_missing_end_token: return "No 'e' end token in bnumber";
+    case bencode_errc::bnumber_invalid: return "Invalid bnumber";
     case bencode_errc::out_of_range: return "Out of range: could not find bencode end";
     case bencode_errc::unknown_type: return "Unknown bencode type";
+    case bencode_errc::too_deeply_nested: return "Containers nested too deeply";
     default: return "Unknown";
     }
 }
@@ -49,66 +52,97 @@ std::error_condition make_error_condition(bencode_errc e)
     return std::error_condition(static_cast<int>(e), bencode_category());
 }
 
+// Bencoded input comes from untrusted peers, trackers and DHT nodes, so containers
+// may only be nested this deep, lest the decoder's recursion overflow the stack.
+constexpr int max_nesting_depth = 128;
+
+inline bool is_digit(const char c) noexcept
+{
+    return static_cast<unsigned char>(c - '0') < 10;
+}
+
+/**
+ * Decodes a bencoded buffer into a flat sequence of btokens in a single pass, which
+ * also validates the buffer. The buffer is never copied, and is never read past its
+ * end, so it need not be NUL terminated.
+ *
+ * The payloads of strings are not scanned at all, they're skipped over using the
+ * length in their header, so the decoder only touches the headers and the structure
+ * of the buffer. This is what makes decoding cheap for e.g. a .torrent file, most
+ * of which is usually the (opaque) concatenation of piece hashes.
+ */
 class bdecoder
 {
-    // Temporary holds the list of tokens, ownership of which will be passed to the
-    // decoded bcontainer. (Unused when the decoded element is a bstring or bnumber.)
-    std::vector<btoken> tokens_;
+    // The tokens are written directly into the buffer that will be shared by the
+    // decoded containers. (Unused when the decoded element is a bstring or bnumber.)
+    std::shared_ptr<detail::decoded_buffer> buffer_;
+    std::vector<btoken>& tokens_;
 
-    // This is the raw bencoded string. Ownership of this string will be handed over to
-    // the belement instance produced after decoding.
-    std::string encoded_;
+    // The bencoded buffer, [begin_, end_).
+    const char* const begin_;
+    const char* const end_;
 
-    // The index of the current character in encoded_.
-    int pos_ = 0;
+    // The current character in the buffer.
+    const char* pos_;
 
-public:
-    explicit bdecoder(std::string s) : encoded_(std::move(s)) {}
+    // The number of containers in which the current element is nested.
+    int depth_ = 0;
 
-    bmap decode_map(std::error_code& error)
+public:
+    explicit bdecoder(std::shared_ptr<detail::decoded_buffer> buffer)
+        : buffer_(std::move(buffer))
+        , tokens_(buffer_->tokens)
+        , begin_(buffer_->source.data())
+        , end_(buffer_->source.data() + buffer_->source.size())
+        , pos_(begin_)
+    {}
+
+    bmap decode_map(error_code& error)
     {
         error.clear();
-        if(encoded_.empty()) {
+        if(pos_ == end_) {
             return {};
-        } else if(encoded_[0] != 'd') {
+        } else if(*pos_ != 'd') {
             error = make_error_code(bencode_errc::bmap_missing_header);
             return {};
         }
-        const int num_tokens = count_tokens(error);
+        reserve_tokens(error);
+        if(!error) {
+            decode_bmap(error);
+        }
         if(error) {
             return {};
         }
-        tokens_.reserve(num_tokens);
-        decode_bmap(error);
-        return bmap(std::move(tokens_), std::move(encoded_));
+        return bmap(std::move(buffer_));
     }
 
-    blist decode_list(std::error_code& error)
+    blist decode_list(error_code& error)
     {
         error.clear();
-        if(encoded_.empty()) {
+        if(pos_ == end_) {
             return {};
-        } else if(encoded_[0] != 'l') {
+        } else if(*pos_ != 'l') {
             error = make_error_code(bencode_errc::blist_missing_header);
             return {};
         }
-        const int num_tokens = count_tokens(error);
+        reserve_tokens(error);
+        if(!error) {
+            decode_blist(error);
+        }
         if(error) {
             return {};
         }
-        tokens_.reserve(num_tokens);
-        decode_blist(error);
-        return blist(std::move(tokens_), std::move(encoded_));
+        return blist(std::move(buffer_));
     }
 
-    std::unique_ptr<belement> decode(std::error_code& error)
+    std::unique_ptr<belement> decode(error_code& error)
     {
         error.clear();
-        if(encoded_.empty()) {
+        if(pos_ == end_) {
             return {};
         }
 
-        const char c = encoded_[0];
+        const char c = *pos_;
         if(c == 'd') {
             bmap map = decode_map(error);
             if(!error) {
@@ -123,282 +157,312 @@ public:
             const auto token = decode_bnumber(error);
             if(!error)
                 return std::make_unique<bnumber>(
-                        detail::make_number_from_token(encoded_, token));
-        } else if(std::isdigit(c)) {
+                        detail::make_number_from_token(buffer_->source, token));
+        } else if(is_digit(c)) {
             const auto token = decode_bstring(error);
             if(!error)
                 return std::make_unique<bstring>(
-                        detail::make_string_from_token(encoded_, token));
+                        detail::make_string_from_token(buffer_->source, token));
+        } else {
+            error = make_error_code(bencode_errc::unknown_type);
         }
         return nullptr;
     }
 
 private:
     /**
-     * Goes over encoded_ and counts the number of btokens that would be constructed by
-     * parsing the entire input string. This is to allocate the tokens buffer in one
-     * instead of incrementally.
+     * Allocates the tokens buffer in one go rather than incrementally, by counting
+     * the tokens that decoding the buffer will produce. This is a quick scan over the
+     * headers only (string payloads are skipped using their lengths), and doesn't
+     * validate anything, so on malformed input the count is merely a guess, which
+     * the decoder then rejects anyway.
      */
-    int count_tokens(std::error_code& error)
+    void reserve_tokens(error_code& error)
     {
-        int count = 0;
-        for(auto i = 0; i < encoded_.length() - 1; ++i) {
-            const char c = encoded_[i];
-            if(std::isdigit(c)) {
-                const int str_length = std::atoi(&encoded_[i]);
-                while((i < encoded_.length()) && (encoded_[i] != ':')) {
-                    ++i;
-                }
-                if(i == encoded_.length()) {
-                    error = make_error_code(bencode_errc::out_of_range);
-                    return count;
+        // btoken offsets are ints.
+        if(end_ - begin_ > std::numeric_limits<int>::max()) {
+            error = make_error_code(bencode_errc::out_of_range);
+            return;
+        }
+        int num_tokens = 0;
+        const char* p = begin_;
+        while(p != end_) {
+            const char c = *p;
+            if(c == 'e') {
+                // the end tokens of containers don't have btokens
+                ++p;
+                continue;
+            }
+            ++num_tokens;
+            if(is_digit(c)) {
+                int64_t str_length = 0;
+                for(; (p != end_) && is_digit(*p) && (str_length <= end_ - begin_); ++p) {
+                    str_length = str_length * 10 + (*p - '0');
                 }
-                i += str_length;
+                // skip the colon and the string
+                p += std::min<int64_t>(str_length + 1, end_ - p);
             } else if(c == 'i') {
-                while((i < encoded_.length()) && (encoded_[i] != 'e')) {
-                    ++i;
-                }
-            } else if(c == 'e') {
-                // don't count the blist's and bmap's 'e' end token as a token
-                continue;
+                p = std::find(p, end_, 'e');
+            } else if((c == 'l') || (c == 'd')) {
+                ++p;
+            } else {
+                break;
             }
-            ++count;
         }
-        return count;
+        tokens_.reserve(num_tokens);
     }
 
-    /**
-     * Dispatches decoding to specialized functions and returns the number of btokens
-     * that were created decoding the current element.
-     */
-    int decode_dispatch(std::error_code& error)
+    /** Decodes the element at pos_, appending its token(s) to tokens_. */
+    void decode_dispatch(error_code& error)
     {
-        assert(pos_ < encoded_.length());
-        const int prev_num_tokens = tokens_.size();
-        // std::cout << "type: " << encoded_[pos_] << '\n';
-        switch(encoded_[pos_]) {
-        case '0':
-        case '1':
-        case '2':
-        case '3':
-        case '4':
-        case '5':
-        case '6':
-        case '7':
-        case '8':
-        case '9': {
-            auto token = decode_bstring(error);
-            if(error) {
-                return 0;
-            }
-            tokens_.emplace_back(std::move(token));
-            return 1;
-        }
-        case 'i': {
-            auto token = decode_bnumber(error);
-            if(error) {
-                return 0;
-            }
-            tokens_.emplace_back(std::move(token));
-            return 1;
-        }
-        case 'l': {
+        assert(pos_ < end_);
+        const char c = *pos_;
+        if(is_digit(c)) {
+            tokens_.emplace_back(decode_bstring(error));
+        } else if(c == 'i') {
+            tokens_.emplace_back(decode_bnumber(error));
+        } else if(c == 'l') {
             decode_blist(error);
-            if(error) {
-                return 0;
-            }
-            return tokens_.size() - prev_num_tokens;
-        }
-        case 'd': {
+        } else if(c == 'd') {
             decode_bmap(error);
-            if(error) {
-                return 0;
-            }
-            return tokens_.size() - prev_num_tokens;
-        }
-        default: {
+        } else {
             error = make_error_code(bencode_errc::unknown_type);
-            return 0;
-        }
         }
     }
 
-    btoken decode_bstring(std::error_code& error)
+    btoken decode_bstring(error_code& error)
     {
-        // check for correct string length
-        if((encoded_[pos_] == '0') && (encoded_[pos_ + 1] != ':')) {
-            error = make_error_code(bencode_errc::bstring_invalid_length);
-            return {};
-        }
-
-        int colon_index = pos_ + 1;
-        while(std::isdigit(encoded_[colon_index])) {
-            ++colon_index;
+        assert(is_digit(*pos_));
+        const char* const header = pos_;
+        const char* colon = header + 1;
+        while((colon != end_) && is_digit(*colon)) {
+            ++colon;
         }
         // the first character after the digits in a string must be a colon
-        if(encoded_[colon_index] != ':') {
+        if((colon == end_) || (*colon != ':')) {
             error = make_error_code(bencode_errc::bstring_missing_colon);
             return {};
         }
 
-        btoken bstring(btype::string, pos_);
-        bstring.length = colon_index - pos_ + 1;
+        // the length must not have leading zeros and the string must fit in the
+        // buffer (checking the number of digits first guards against overflow)
+        const int num_digits = colon - header;
+        if(((*header == '0') && (num_digits > 1)) || (num_digits > 10)) {
+            error = make_error_code(bencode_errc::bstring_invalid_length);
+            return {};
+        }
+        const int64_t str_length = detail::parse_digits(header, colon);
+        if(str_length > end_ - colon - 1) {
+            error = make_error_code(bencode_errc::out_of_range);
+            return {};
+        }
 
+        btoken bstring(btype::string, header - begin_);
+        bstring.length = num_digits + 1;
         // go to the next element
-        const int str_length = std::atoi(&encoded_[pos_]);
-        pos_ = colon_index + 1 + str_length;
-
+        pos_ = colon + 1 + str_length;
         // if there is still an element after this, the offset is 1 (default is 0)
-        if(pos_ < encoded_.length()) {
+        if(pos_ != end_) {
             bstring.next_item_array_offset = 1;
         }
-
         return bstring;
     }
 
-    btoken decode_bnumber(std::error_code& error)
+    btoken decode_bnumber(error_code& error)
     {
-        // don't allow leading zeros
-        if((encoded_[pos_ + 1] == '0') && (encoded_[pos_ + 2] != 'e')) {
-            error = make_error_code(bencode_errc::bnumber_trailing_zeros);
-            return {};
-        }
-
-        int end = pos_ + 1;
-        while(std::isdigit(encoded_[end])) {
+        assert(*pos_ == 'i');
+        const char* const first = pos_ + 1;
+        const char* digits = first;
+        if((digits != end_) && (*digits == '-')) {
+            ++digits;
+        }
+        const char* end = digits;
+        while((end != end_) && is_digit(*end)) {
             ++end;
         }
         // the first character after the digits in number must be the 'e' end token
-        if(encoded_[end] != 'e') {
+        if((end == end_) || (*end != 'e')) {
             error = make_error_code(bencode_errc::bnumber_missing_end_token);
             return {};
         }
 
-        btoken bnumber(btype::number, pos_);
-        bnumber.length = end - pos_ + 1;
+        const int num_digits = end - digits;
+        if(num_digits == 0) {
+            error = make_error_code(bencode_errc::bnumber_invalid);
+            return {};
+        } else if((*digits == '0') && ((num_digits > 1) || (digits != first))) {
+            // don't allow leading zeros or negative zero
+            error = make_error_code(bencode_errc::bnumber_trailing_zeros);
+            return {};
+        } else if((num_digits > 19)
+                || ((num_digits == 19)
+                           && (std::lexicographical_compare(
+                                      "9223372036854775807",
+                                      "9223372036854775807" + 19, digits, end)))) {
+            // the number must fit in an int64_t
+            error = make_error_code(bencode_errc::bnumber_invalid);
+            return {};
+        }
 
+        btoken bnumber(btype::number, pos_ - begin_);
+        bnumber.length = end - pos_ + 1;
         // got to the next element
         pos_ = end + 1;
         // if there is still an element after this, the offset is 1 (default is 0)
-        if(pos_ < encoded_.length()) {
+        if(pos_ != end_) {
             bnumber.next_item_array_offset = 1;
         }
-
         return bnumber;
     }
 
-    void decode_blist(std::error_code& error)
+    void decode_blist(error_code& error)
     {
-        tokens_.emplace_back(btype::list, pos_);
+        if(++depth_ > max_nesting_depth) {
+            error = make_error_code(bencode_errc::too_deeply_nested);
+            return;
+        }
+        tokens_.emplace_back(btype::list, pos_ - begin_);
         // save the position of list header so we can refer to it later (cannot use
         // reference as tokens_ may reallocate)
         const int list_pos = tokens_.size() - 1;
         // go to first element in list
         ++pos_;
-        while((pos_ < encoded_.length()) && (encoded_[pos_] != 'e')) {
-            // add the number of tokens that were parsed while decoding value; this is
-            // necessary to determine where the list ends
-            tokens_[list_pos].next_item_array_offset += decode_dispatch(error);
-            ++tokens_[list_pos].length;
+        while((pos_ != end_) && (*pos_ != 'e')) {
+            decode_dispatch(error);
             if(error) {
                 return;
             }
+            ++tokens_[list_pos].length;
         }
 
-        if(encoded_[pos_] != 'e') {
+        if(pos_ == end_) {
             error = make_error_code(bencode_errc::blist_missing_end_token);
             return;
         }
+        // the list spans all tokens that were added since its header
+        tokens_[list_pos].next_item_array_offset = tokens_.size() - list_pos;
         // got past the 'e' end token to the next element
         ++pos_;
+        --depth_;
     }
 
-    void decode_bmap(std::error_code& error)
+    void decode_bmap(error_code& error)
     {
-        tokens_.emplace_back(btype::map, pos_);
+        if(++depth_ > max_nesting_depth) {
+            error = make_error_code(bencode_errc::too_deeply_nested);
+            return;
+        }
+        tokens_.emplace_back(btype::map, pos_ - begin_);
         // save the position of map header so we can refer to it later (cannot use
         // reference as tokens_ may reallocate)
         const int map_pos = tokens_.size() - 1;
         // go to first element in map
         ++pos_;
-        while((pos_ < encoded_.length()) && (encoded_[pos_] != 'e')) {
-            if(!std::isdigit(encoded_[pos_])) {
+        while((pos_ != end_) && (*pos_ != 'e')) {
+            if(!is_digit(*pos_)) {
                 // keys must be strings
                 error = make_error_code(bencode_errc::bmap_key_not_string);
                 return;
             }
             // decode key
             tokens_.emplace_back(decode_bstring(error));
-            ++tokens_[map_pos].next_item_array_offset;
             if(error) {
                 return;
             }
             // TODO validate key
 
-            if(pos_ >= encoded_.length()) {
+            if((pos_ == end_) || (*pos_ == 'e')) {
                 error = make_error_code(bencode_errc::bmap_missing_value);
                 return;
             }
-
-            // decode value and add the number of tokens that were parsed while decoding
-            // value to array offset accumulator
-            // this is necessary to determine where the map ends
-            tokens_[map_pos].next_item_array_offset += decode_dispatch(error);
-            // a map's length is its number of key-value pairs
-            ++tokens_[map_pos].length;
+            decode_dispatch(error);
             if(error) {
                 return;
             }
+            // a map's length is its number of key-value pairs
+            ++tokens_[map_pos].length;
         }
 
-        if(encoded_[pos_] != 'e') {
+        if(pos_ == end_) {
             error = make_error_code(bencode_errc::bmap_missing_end_token);
             return;
         }
+        // the map spans all tokens that were added since its header
+        tokens_[map_pos].next_item_array_offset = tokens_.size() - map_pos;
         // got past the 'e' end token to the next element
         ++pos_;
+        --depth_;
     }
 };
 
-bmap decode_bmap(std::string s, std::error_code& error)
+inline std::shared_ptr<detail::decoded_buffer> make_owned_buffer(std::string s)
+{
+    auto buffer = std::make_shared<detail::decoded_buffer>();
+    buffer->owned_source = std::move(s);
+    buffer->source = buffer->owned_source;
+    return buffer;
+}
+
+inline std::shared_ptr<detail::decoded_buffer> make_borrowed_buffer(
+        string_view s, std::shared_ptr<const void> owner)
+{
+    auto buffer = std::make_shared<detail::decoded_buffer>();
+    buffer->owner = std::move(owner);
+    buffer->source = s;
+    return buffer;
+}
+
+bmap decode_bmap(std::string s, error_code& error)
 {
-    return bdecoder(std::move(s)).decode_map(error);
+    return bdecoder(make_owned_buffer(std::move(s))).decode_map(error);
 }
 
 bmap decode_bmap(std::string s)
 {
-    std::error_code error;
-    auto bmap = bdecoder(std::move(s)).decode_map(error);
+    error_code error;
+    auto bmap = bdecoder(make_owned_buffer(std::move(s))).decode_map(error);
     if(error) {
         throw error;
     }
     return bmap;
 }
 
-blist decode_blist(std::string s, std::error_code& error)
+bmap decode_bmap(string_view buffer, std::shared_ptr<const void> owner,
+        error_code& error)
+{
+    return bdecoder(make_borrowed_buffer(buffer, std::move(owner))).decode_map(error);
+}
+
+blist decode_blist(std::string s, error_code& error)
 {
-    return bdecoder(std::move(s)).decode_list(error);
+    return bdecoder(make_owned_buffer(std::move(s))).decode_list(error);
 }
 
 blist decode_blist(std::string s)
 {
-    std::error_code error;
-    auto blist = bdecoder(std::move(s)).decode_list(error);
+    error_code error;
+    auto blist = bdecoder(make_owned_buffer(std::move(s))).decode_list(error);
     if(error) {
         throw error;
     }
     return blist;
 }
 
-std::unique_ptr<belement> decode(std::string s, std::error_code& error)
+blist decode_blist(string_view buffer, std::shared_ptr<const void> owner,
+        error_code& error)
 {
-    return bdecoder(std::move(s)).decode(error);
+    return bdecoder(make_borrowed_buffer(buffer, std::move(owner))).decode_list(error);
+}
+
+std::unique_ptr<belement> decode(std::string s, error_code& error)
+{
+    return bdecoder(make_owned_buffer(std::move(s))).decode(error);
 }
 
 std::unique_ptr<belement> decode(std::string s)
 {
-    std::error_code error;
-    auto b = bdecoder(std::move(s)).decode(error);
+    error_code error;
+    auto b = bdecoder(make_owned_buffer(std::move(s))).decode(error);
     if(error) {
         throw error;
     }
@@ -406,32 +470,40 @@ std::unique_ptr<belement> decode(std::string s)
 }
 
 namespace detail {
+
+/** Returns the offset one past the last character of the element at `token`. */
+inline int end_offset(const string_view encoded, const btoken* token)
+{
+    if(token->type == btype::string) {
+        return token->offset + token->length
+                + make_string_view_from_token(encoded, *token).length();
+    } else if(token->type == btype::number) {
+        return token->offset + token->length;
+    }
+    const btoken* const end = token + token->next_item_array_offset;
+    const btoken* last = token + 1;
+    if(last == end) {
+        // an empty container only has the header tag ('l' or 'd') and the end tag
+        return token->offset + 2;
+    }
+    while(last + last->next_item_array_offset != end) {
+        last += last->next_item_array_offset;
+    }
+    // the container ends with the end tag right after its last element
+    return end_offset(encoded, last) + 1;
+}
+
 string_view bcontainer::encode() const
 {
-    // TODO verify this
     if(!head()) {
         return string_view();
     }
-    if(head() == tokens_->data()) {
+    if(head() == buffer_->tokens.data()) {
         // this is the root container, just return the whole encoded string
         return source();
     }
-    const btoken* last_element = tail() - 1;
-    int last_element_offset = last_element->offset;
-    if(last_element->type == btype::string) {
-        const auto str_header = source().c_str() + last_element_offset;
-        const auto str_length = std::atoi(str_header);
-        last_element_offset += last_element->length + str_length;
-    } else if(last_element->type == btype::number) {
-        last_element_offset += last_element->length;
-    } else if((last_element->type == btype::list) && (last_element->type == btype::map)) {
-        // if last element is a blist or bmap header token, it means they are
-        // empty, so they only have 2 characters: the header tag ('l') and the end
-        // tag ('e')
-        last_element_offset += 2;
-    }
-    return string_view(source().c_str() + head()->offset,
-            source().c_str() + last_element_offset + 1);
+    return string_view(source().data() + head()->offset,
+            source().data() + end_offset(source(), head()));
 }
 
 void format_map(std::stringstream& ss, const bcontainer& map, const btoken* head,
@@ -544,22 +616,12 @@ const btoken* bmap::find_token(const std::string& key, const btoken* start_pos)
     // it's either the first key or map_end, if map is empty)
     ++token;
 
-    while(token != map_end)
-    // stop looping if the distance till the end of the encoded string from
-    // the current token is less than key's length (to avoid SIGSEGV in
-    // std::equal())
-    // TODO
-    //&& source().length() - token->offset - token->length >= key.length())
-    {
-        assert(token->type == btype::string);
-        const auto encoded_key_header = source().c_str() + token->offset;
-        const auto encoded_key_length = std::atoi(encoded_key_header);
-        const auto encoded_key_start = encoded_key_header + token->length;
+    while(token != map_end) {
+        const auto encoded_key = detail::make_string_view_from_token(source(), *token);
         // advance to value
         token += token->next_item_array_offset;
         // compare search key to key token
-        if(std::equal(key.c_str(), key.c_str() + key.length(), encoded_key_start,
-                   encoded_key_start + encoded_key_length)) {
+        if(std::equal(key.begin(), key.end(), encoded_key.begin(), encoded_key.end())) {
             return token;
         } else if(token->type == btype::map) {
             // recursively search nested map
@@ -1,45 +1,123 @@
 #include "bencode.hpp"
 
 #include <cassert>
-#include <iostream>
-#include <stdexcept>
+#include <iterator> // end
 
 namespace tide {
 namespace util {
 
+// The most digits (and sign) an int64_t may have.
+constexpr int max_decimal_length = 20;
+
+/**
+ * Writes the decimal representation of n backwards, ending right before `end`, and
+ * returns its first character. This avoids the allocation of std::to_string.
+ */
+inline char* format_decimal(const int64_t n, char* end)
+{
+    // Negating in unsigned arithmetic so that the minimum int64_t works as well.
+    uint64_t u = n < 0 ? 0 - uint64_t(n) : uint64_t(n);
+    do {
+        *--end = '0' + u % 10;
+        u /= 10;
+    } while(u > 0);
+    if(n < 0) {
+        *--end = '-';
+    }
+    return end;
+}
+
+inline int decimal_length(int64_t n)
+{
+    char digits[max_decimal_length];
+    return std::end(digits) - format_decimal(n, std::end(digits));
+}
+
 inline int bencoded_string_length(string_view s)
 {
-    return s.length() + std::to_string(s.length()).length() + 1; /* + 1 for : */
+    return s.length() + decimal_length(s.length()) + 1; /* + 1 for : */
+}
+
+} // namespace util
+
+// --------------
+// -- bencoder --
+// --------------
+
+bencoder& bencoder::number(const int64_t n)
+{
+    char digits[util::max_decimal_length];
+    const char* first = util::format_decimal(n, std::end(digits));
+    buffer_ += 'i';
+    buffer_.append(first, std::end(digits) - first);
+    buffer_ += 'e';
+    return *this;
 }
 
-inline int bencoded_number_length(const int64_t n)
+bencoder& bencoder::string(string_view s)
 {
-    return 2 + std::to_string(n).length();
+    char digits[util::max_decimal_length];
+    const char* first = util::format_decimal(s.length(), std::end(digits));
+    buffer_.append(first, std::end(digits) - first);
+    buffer_ += ':';
+    buffer_.append(s.data(), s.length());
+    return *this;
 }
 
-template <typename OutputIt>
-int bencode_string(string_view s, OutputIt begin)
+bencoder& bencoder::begin_list()
 {
-    std::string len_str = std::to_string(s.length());
-    const int encoded_len = s.length() + len_str.length() + 1; /* + 1 for : */
-    std::copy(len_str.begin(), len_str.end(), begin);
-    begin += len_str.length();
-    *begin++ = ':';
-    std::copy(s.begin(), s.end(), begin);
-    return encoded_len;
+    buffer_ += 'l';
+    return *this;
 }
 
-} // namespace util
+bencoder& bencoder::end_list()
+{
+    buffer_ += 'e';
+    return *this;
+}
+
+bencoder& bencoder::begin_map()
+{
+#ifndef NDEBUG
+    last_keys_.emplace_back();
+#endif // NDEBUG
+    buffer_ += 'd';
+    return *this;
+}
+
+bencoder& bencoder::end_map()
+{
+#ifndef NDEBUG
+    assert(!last_keys_.empty());
+    last_keys_.pop_back();
+#endif // NDEBUG
+    buffer_ += 'e';
+    return *this;
+}
+
+bencoder& bencoder::key(string_view k)
+{
+#ifndef NDEBUG
+    assert(!last_keys_.empty());
+    std::string& last_key = last_keys_.back();
+    assert(last_key.empty() || (last_key < std::string(k)));
+    last_key = k;
+#endif // NDEBUG
+    return string(k);
+}
 
 std::string bencode_number(const int64_t n)
 {
-    return 'i' + std::to_string(n) + 'e';
+    std::string result;
+    bencoder(result).number(n);
+    return result;
 }
 
 std::string bencode_string(string_view s)
 {
-    std::string result(util::bencoded_string_length(s), 0);
-    util::bencode_string(s, result.begin());
+    std::string result;
+    result.reserve(util::bencoded_string_length(s));
+    bencoder(result).string(s);
     return result;
 }
 
@@ -84,17 +162,15 @@ bmap_encoder::proxy& bmap_encoder::proxy::operator=(const blist_encoder& b)
 
 std::string bmap_encoder::encode() const
 {
-    std::string result(encoded_length(), 0);
-    assert(result.length() >= 2);
-    auto it = result.begin();
-    *it++ = 'd';
+    std::string result;
+    result.reserve(encoded_length());
+    result += 'd';
+    bencoder encoder(result);
     for(const auto& entry : map_) {
-        it += util::bencode_string(entry.first, it);
-        const std::string& value = entry.second.value_;
-        std::copy(value.begin(), value.end(), it);
-        it += value.length();
+        encoder.string(entry.first);
+        result += entry.second.value_;
     }
-    *it = 'e';
+    result += 'e';
     return result;
 }
 
@@ -0,0 +1,93 @@
+#include "buffer_budget.hpp"
+
+#include <algorithm> // find_if, max
+#include <cassert>
+
+namespace tide {
+
+int buffer_budget::num_available_bytes() const noexcept
+{
+    if(capacity_ == unlimited) {
+        return unlimited;
+    }
+    return std::max(capacity_ - num_reserved_bytes_, 0);
+}
+
+bool buffer_budget::is_exhausted() const noexcept
+{
+    return num_available_bytes() == 0;
+}
+
+void buffer_budget::set_capacity(const int n)
+{
+    assert(n == unlimited || n > 0);
+    capacity_ = n;
+    // Raising the capacity may have freed up memory for those waiting.
+    release(0);
+}
+
+int buffer_budget::reserve(const int num_desired_bytes)
+{
+    assert(num_desired_bytes >= 0);
+    const int available = num_available_bytes();
+    const int n = available == unlimited ? num_desired_bytes
+                                         : std::min(num_desired_bytes, available);
+    num_reserved_bytes_ += n;
+    return n;
+}
+
+void buffer_budget::force_reserve(const int n)
+{
+    assert(n >= 0);
+    num_reserved_bytes_ += n;
+}
+
+void buffer_budget::release(const int n)
+{
+    assert(n >= 0);
+    assert(n <= num_reserved_bytes_);
+    num_reserved_bytes_ -= n;
+    // Handlers may subscribe again if they still can't get enough memory, so only
+    // process those that were waiting before this call.
+    int num_to_resume = subscribers_.size();
+    while(num_to_resume-- > 0 && !subscribers_.empty() && !is_exhausted()) {
+        auto handler = std::move(subscribers_.front().handler);
+        subscribers_.pop_front();
+        handler();
+    }
+}
+
+int buffer_budget::fair_share(
+        const throughput_rate& total_rate, const int session_rate) const
+{
+    // Until half of the budget is used up there is no contention, so there is no
+    // need to restrict sessions.
+    if((capacity_ == unlimited) || (num_reserved_bytes_ < capacity_ / 2)) {
+        return unlimited;
+    }
+    // The receive and send directions each get half of the budget.
+    const int64_t channel_capacity = capacity_ / 2;
+    const int total = std::max(total_rate.rate(), 1);
+    const int64_t share = channel_capacity * std::min(session_rate, total) / total;
+    return std::max(int(share), min_session_share);
+}
+
+void buffer_budget::subscribe(const token_type token, std::function<void()> handler)
+{
+    auto it = std::find_if(subscribers_.begin(), subscribers_.end(),
+            [&token](const auto& s) { return s.token == token; });
+    if(it == subscribers_.end()) {
+        subscribers_.push_back({token, std::move(handler)});
+    }
+}
+
+void buffer_budget::unsubscribe(const token_type token)
+{
+    auto it = std::find_if(subscribers_.begin(), subscribers_.end(),
+            [&token](const auto& s) { return s.token == token; });
+    if(it != subscribers_.end()) {
+        subscribers_.erase(it);
+    }
+}
+
+} // tide
@@ -0,0 +1,116 @@
+#include "connection_scheduler.hpp"
+
+#include <algorithm> // find_if, max, stable_partition
+#include <cassert>
+#include <iterator> // back_inserter
+
+namespace tide {
+
+int connection_scheduler::num_available_slots() const noexcept
+{
+    if(max_half_open_connections_ == unlimited) {
+        return unlimited;
+    }
+    return std::max(max_half_open_connections_ - num_half_open_connections_, 0);
+}
+
+void connection_scheduler::set_max_half_open_connections(const int n)
+{
+    assert(n == unlimited || n > 0);
+    max_half_open_connections_ = n;
+}
+
+void connection_scheduler::subscribe(const token_type token, const int num_desired_slots,
+        std::function<void(int)> handler)
+{
+    assert(num_desired_slots > 0);
+    auto it = std::find_if(subscribers_.begin(), subscribers_.end(),
+            [&token](const auto& s) { return s.token == token; });
+    if(it == subscribers_.end()) {
+        subscriber s;
+        s.token = token;
+        s.num_desired_slots = num_desired_slots;
+        s.handler = std::move(handler);
+        subscribers_.emplace_back(std::move(s));
+    } else {
+        it->num_desired_slots = num_desired_slots;
+    }
+}
+
+void connection_scheduler::unsubscribe(const token_type token)
+{
+    auto it = std::find_if(subscribers_.begin(), subscribers_.end(),
+            [&token](const auto& s) { return s.token == token; });
+    if(it != subscribers_.end()) {
+        subscribers_.erase(it);
+    }
+}
+
+void connection_scheduler::distribute_slots()
+{
+    if(subscribers_.empty()) {
+        return;
+    }
+
+    int num_slots = num_available_slots();
+    if(num_slots == 0) {
+        return;
+    }
+
+    // Hand out a single slot to each subscriber in a round, so that a torrent that
+    // wants many connections can't crowd out those that want only a few.
+    bool has_granted_slots = true;
+    while(has_granted_slots && (num_slots != 0)) {
+        has_granted_slots = false;
+        for(auto& s : subscribers_) {
+            if(num_slots == 0) {
+                break;
+            }
+            if(s.num_granted_slots < s.num_desired_slots) {
+                ++s.num_granted_slots;
+                has_granted_slots = true;
+                if(num_slots != unlimited) {
+                    --num_slots;
+                }
+            }
+        }
+    }
+
+    // Remove the subscribers that were granted slots before invoking their
+    // handlers, as those may subscribe again, in which case they're placed at the
+    // back of the queue. Those that received nothing keep their place.
+    std::deque<subscriber> served;
+    auto it = std::stable_partition(subscribers_.begin(), subscribers_.end(),
+            [](const auto& s) { return s.num_granted_slots == 0; });
+    std::move(it, subscribers_.end(), std::back_inserter(served));
+    subscribers_.erase(it, subscribers_.end());
+    for(auto& s : served) {
+        s.handler(s.num_granted_slots);
+    }
+}
+
+void connection_scheduler::on_connect_succeeded(const duration latency)
+{
+    assert(num_half_open_connections_ > 0);
+    --num_half_open_connections_;
+    ++num_successful_connects_;
+    avg_connect_latency_.update(to_int<milliseconds>(latency));
+}
+
+void connection_scheduler::on_connect_failed()
+{
+    assert(num_half_open_connections_ > 0);
+    --num_half_open_connections_;
+    ++num_failed_connects_;
+}
+
+double connection_scheduler::connect_success_ratio() const noexcept
+{
+    const int64_t num_attempts = num_successful_connects_ + num_failed_connects_;
+    if(num_attempts == 0) {
+        return 0.0;
+    }
+    return double(num_successful_connects_) / num_attempts;
+}
+
+} // tide
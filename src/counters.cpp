@@ -0,0 +1,58 @@
+#include "counters.hpp"
+
+namespace tide {
+
+// Must be in the same order as `counters::id`.
+static const char* const counter_names[] = {
+    "num_disk_jobs",
+    "disk_job_queue_time",
+    "disk_job_execution_time",
+    "disk_write_time",
+    "disk_read_time",
+    "disk_hash_time",
+    "num_disk_write_ops",
+    "num_disk_read_ops",
+    "num_blocks_written",
+    "num_blocks_read",
+    "num_read_cache_hits",
+    "num_read_cache_misses",
+    "num_disk_buffer_allocations",
+    "num_bytes_sent",
+    "num_bytes_received",
+    "num_incoming_connections",
+    "num_successful_connects",
+    "num_failed_connects",
+    "num_blocked_connections",
+    "num_download_quota_waits",
+    "num_upload_quota_waits",
+    "download_quota_wait_time",
+    "upload_quota_wait_time",
+    "num_piece_picks",
+    "num_failed_piece_picks",
+    "piece_pick_time",
+    "num_dropped_alerts",
+    "num_dropped_log_entries",
+    "num_connections",
+    "num_half_open_connections",
+    "num_active_leeches",
+    "num_active_seeds",
+    "num_disk_threads",
+    "num_active_disk_threads",
+    "disk_job_queue_size",
+    "num_partial_pieces",
+    "num_buffered_blocks",
+    "read_cache_size",
+    "read_cache_capacity",
+    "num_download_quota_waiters",
+    "num_upload_quota_waiters",
+};
+
+static_assert(sizeof(counter_names) / sizeof(counter_names[0]) == counters::num_counters,
+        "every counter must have a name");
+
+const char* counters::name(const id c) noexcept
+{
+    return c >= 0 && c < num_counters ? counter_names[c] : "unknown";
+}
+
+} // namespace tide
@@ -0,0 +1,1096 @@
+#include "dht.hpp"
+#include "address.hpp"
+#include "endian.hpp"
+#include "log.hpp"
+#include "random.hpp"
+#include "settings.hpp"
+#include "sha1_hasher.hpp"
+#include "string_utils.hpp"
+#include "utp_socket.hpp"
+
+#include <algorithm> // any_of, find_if, min_element, partial_sort, remove_if, stable_sort
+#include <cassert>
+#include <stdexcept> // invalid_argument
+
+namespace tide {
+
+// Peers that announced to us are forgotten unless they announce again within this
+// time.
+constexpr auto stored_peer_ttl = minutes(30);
+
+// Buckets in which nothing changed for this long are refreshed.
+constexpr auto bucket_refresh_interval = minutes(15);
+
+// A query that's not answered within this time is considered slow, and the lookup
+// it's part of goes on without it.
+constexpr auto slow_query_timeout = seconds(2);
+
+// A query that's not answered within this time has failed.
+constexpr auto query_timeout = seconds(10);
+
+constexpr auto token_secret_rotation_interval = minutes(5);
+
+// While the routing table is empty, we try to bootstrap at this interval.
+constexpr auto bootstrap_interval = seconds(30);
+
+constexpr auto tick_interval = seconds(1);
+
+// A node's 20 byte id followed by its compact endpoint.
+constexpr int compact_node_info_size = 26;
+
+// An IPv4 address and port, both in network byte order.
+constexpr int compact_endpoint_size = 6;
+
+// KRPC error codes.
+constexpr int protocol_error = 203;
+constexpr int method_unknown = 204;
+
+/** Returns whether the id `a` is closer to `target` than `b`, by XOR distance. */
+inline bool is_closer(
+        const sha1_hash& target, const sha1_hash& a, const sha1_hash& b) noexcept
+{
+    for(auto i = 0; i < int(target.size()); ++i) {
+        const uint8_t da = a[i] ^ target[i];
+        const uint8_t db = b[i] ^ target[i];
+        if(da != db) {
+            return da < db;
+        }
+    }
+    return false;
+}
+
+/** Returns the number of leading bits `a` and `b` have in common. */
+inline int common_prefix_length(const sha1_hash& a, const sha1_hash& b) noexcept
+{
+    for(auto i = 0; i < int(a.size()); ++i) {
+        const uint8_t x = a[i] ^ b[i];
+        if(x != 0) {
+            int n = i * 8;
+            for(uint8_t mask = 0x80; (x & mask) == 0; mask >>= 1) {
+                ++n;
+            }
+            return n;
+        }
+    }
+    return a.size() * 8;
+}
+
+inline bool bit_at(const sha1_hash& h, const int i) noexcept
+{
+    return h[i / 8] & (0x80 >> (i % 8));
+}
+
+inline void set_bit_at(sha1_hash& h, const int i, const bool b) noexcept
+{
+    if(b) {
+        h[i / 8] |= 0x80 >> (i % 8);
+    } else {
+        h[i / 8] &= ~(0x80 >> (i % 8));
+    }
+}
+
+inline sha1_hash random_id()
+{
+    sha1_hash id;
+    for(auto& b : id) {
+        b = util::random_int(0xff);
+    }
+    return id;
+}
+
+inline sha1_hash to_hash(string_view s)
+{
+    assert(s.length() == 20);
+    sha1_hash h;
+    std::copy(s.begin(), s.end(), h.begin());
+    return h;
+}
+
+inline std::string to_string(const sha1_hash& h)
+{
+    return std::string(h.begin(), h.end());
+}
+
+inline void append_compact_endpoint(
+        std::string& s, const address& ip, const uint16_t port)
+{
+    const auto bytes = ip.to_v4().to_bytes();
+    s.append(bytes.begin(), bytes.end());
+    s.push_back(port >> 8);
+    s.push_back(port & 0xff);
+}
+
+inline udp::endpoint parse_compact_endpoint(const char* p)
+{
+    return udp::endpoint(address_v4(endian::read_network<uint32_t>(p)),
+            endian::read_network<uint16_t>(p + 4));
+}
+
+// -----------------
+// dht routing table
+// -----------------
+
+/**
+ * Adds `node` to the end of `replacements` (or moves it there, if it's already there),
+ * evicting the oldest entry if the cache is full.
+ */
+inline void add_replacement(std::vector<dht_routing_table::node_entry>& replacements,
+        const dht_routing_table::node_entry& node)
+{
+    auto it = std::find_if(replacements.begin(), replacements.end(),
+            [&node](const auto& n) { return n.id == node.id; });
+    if(it != replacements.end()) {
+        replacements.erase(it);
+    } else if(replacements.size() >= dht_routing_table::bucket_size) {
+        replacements.erase(replacements.begin());
+    }
+    replacements.push_back(node);
+}
+
+dht_routing_table::dht_routing_table(const sha1_hash& own_id)
+    : own_id_(own_id), buckets_(1)
+{
+    buckets_.front().last_changed_time = cached_clock::now();
+}
+
+int dht_routing_table::num_nodes() const noexcept
+{
+    int n = 0;
+    for(const auto& b : buckets_) {
+        n += b.nodes.size();
+    }
+    return n;
+}
+
+void dht_routing_table::add_node(
+        const sha1_hash& id, const udp::endpoint& endpoint, const bool has_responded)
+{
+    if(id == own_id_) {
+        return;
+    }
+
+    const auto now = cached_clock::now();
+    auto& b = buckets_[bucket_index(id)];
+    auto it = std::find_if(b.nodes.begin(), b.nodes.end(),
+            [&id](const auto& n) { return n.id == id; });
+    if(it != b.nodes.end()) {
+        // Don't let another endpoint take over a node's id.
+        if(has_responded && (it->endpoint == endpoint)) {
+            it->last_seen_time = now;
+            it->num_failures = 0;
+            b.last_changed_time = now;
+        }
+        return;
+    }
+
+    node_entry node;
+    node.id = id;
+    node.endpoint = endpoint;
+    if(!has_responded) {
+        add_replacement(b.replacements, node);
+        return;
+    }
+    node.last_seen_time = now;
+
+    auto replacement = std::find_if(b.replacements.begin(), b.replacements.end(),
+            [&id](const auto& n) { return n.id == id; });
+    if(replacement != b.replacements.end()) {
+        b.replacements.erase(replacement);
+    }
+
+    if(b.nodes.size() < bucket_size) {
+        b.nodes.push_back(node);
+        b.last_changed_time = now;
+        return;
+    }
+
+    // Only the last bucket covers our own id, so only that may be split. Ids are
+    // 160 bits long, so there can't be more buckets than that.
+    if((&b == &buckets_.back()) && (num_buckets() < 160)) {
+        split_last_bucket();
+        add_node(id, endpoint, true);
+        return;
+    }
+
+    auto bad = std::find_if(
+            b.nodes.begin(), b.nodes.end(), [](const auto& n) { return n.is_bad(); });
+    if(bad != b.nodes.end()) {
+        *bad = node;
+        b.last_changed_time = now;
+    } else {
+        add_replacement(b.replacements, node);
+    }
+}
+
+bool dht_routing_table::would_add_node(const sha1_hash& id) const noexcept
+{
+    if(id == own_id_) {
+        return false;
+    }
+    const auto& b = buckets_[bucket_index(id)];
+    if(std::find_if(b.nodes.begin(), b.nodes.end(),
+               [&id](const auto& n) { return n.id == id; })
+            != b.nodes.end()) {
+        return false;
+    }
+    return (b.nodes.size() < bucket_size)
+            || ((&b == &buckets_.back()) && (num_buckets() < 160))
+            || std::any_of(b.nodes.begin(), b.nodes.end(),
+                    [](const auto& n) { return n.is_bad(); });
+}
+
+void dht_routing_table::node_failed(const udp::endpoint& endpoint)
+{
+    for(auto& b : buckets_) {
+        auto it = std::find_if(b.nodes.begin(), b.nodes.end(),
+                [&endpoint](const auto& n) { return n.endpoint == endpoint; });
+        if(it != b.nodes.end()) {
+            ++it->num_failures;
+            if(it->is_bad() && !b.replacements.empty()) {
+                *it = b.replacements.back();
+                b.replacements.pop_back();
+                b.last_changed_time = cached_clock::now();
+            }
+            return;
+        }
+        auto replacement = std::find_if(b.replacements.begin(), b.replacements.end(),
+                [&endpoint](const auto& n) { return n.endpoint == endpoint; });
+        if(replacement != b.replacements.end()) {
+            b.replacements.erase(replacement);
+            return;
+        }
+    }
+}
+
+std::vector<dht_routing_table::node_entry> dht_routing_table::find_closest_nodes(
+        const sha1_hash& target, const int n) const
+{
+    std::vector<node_entry> nodes;
+    for(const auto& b : buckets_) {
+        for(const auto& node : b.nodes) {
+            if(!node.is_bad()) {
+                nodes.push_back(node);
+            }
+        }
+    }
+    const int num_results = std::min(n, int(nodes.size()));
+    std::partial_sort(nodes.begin(), nodes.begin() + num_results, nodes.end(),
+            [&target](const auto& a, const auto& b) {
+                return is_closer(target, a.id, b.id);
+            });
+    nodes.resize(num_results);
+    return nodes;
+}
+
+int dht_routing_table::pick_bucket_to_refresh(const duration interval)
+{
+    const auto now = cached_clock::now();
+    for(auto i = 0; i < num_buckets(); ++i) {
+        if(now - buckets_[i].last_changed_time >= interval) {
+            buckets_[i].last_changed_time = now;
+            return i;
+        }
+    }
+    return -1;
+}
+
+sha1_hash dht_routing_table::random_id_in_bucket(const int index) const
+{
+    assert(index >= 0 && index < num_buckets());
+    sha1_hash id = random_id();
+    for(auto i = 0; i < index; ++i) {
+        set_bit_at(id, i, bit_at(own_id_, i));
+    }
+    // All but the last bucket hold the nodes that differ from us in the bit after
+    // the common prefix.
+    if(index < num_buckets() - 1) {
+        set_bit_at(id, index, !bit_at(own_id_, index));
+    }
+    return id;
+}
+
+int dht_routing_table::bucket_index(const sha1_hash& id) const noexcept
+{
+    return std::min(common_prefix_length(own_id_, id), num_buckets() - 1);
+}
+
+void dht_routing_table::split_last_bucket()
+{
+    const int index = num_buckets() - 1;
+    buckets_.emplace_back();
+    auto& old_bucket = buckets_[index];
+    auto& new_bucket = buckets_.back();
+    new_bucket.last_changed_time = old_bucket.last_changed_time;
+
+    const auto moves = [this, index](const auto& n) {
+        return common_prefix_length(own_id_, n.id) > index;
+    };
+    for(const auto& n : old_bucket.nodes) {
+        if(moves(n)) {
+            new_bucket.nodes.push_back(n);
+        }
+    }
+    for(const auto& n : old_bucket.replacements) {
+        if(moves(n)) {
+            new_bucket.replacements.push_back(n);
+        }
+    }
+    old_bucket.nodes.erase(std::remove_if(old_bucket.nodes.begin(),
+                                   old_bucket.nodes.end(), moves),
+            old_bucket.nodes.end());
+    old_bucket.replacements.erase(std::remove_if(old_bucket.replacements.begin(),
+                                          old_bucket.replacements.end(), moves),
+            old_bucket.replacements.end());
+}
+
+// --------
+// dht node
+// --------
+
+template <typename... Args>
+void dht_node::log(const char* format, Args&&... args) const
+{
+    log::log_engine("DHT", log::priority::normal, format, args...);
+}
+
+bool dht_node::query_budget::consume(const int max_queries_per_second)
+{
+    const auto now = cached_clock::now();
+    const double elapsed_s = to_int<milliseconds>(now - last_refill_time) / 1000.0;
+    num_queries = std::min(
+            num_queries + elapsed_s * max_queries_per_second,
+            double(max_queries_per_second));
+    last_refill_time = now;
+    if(num_queries < 1) {
+        return false;
+    }
+    num_queries -= 1;
+    return true;
+}
+
+dht_node::dht_node(asio::io_context& ios, utp_socket_manager& socket, const settings& s)
+    : ios_(ios)
+    , socket_(socket)
+    , settings_(s)
+    , routing_table_(random_id())
+    , next_transaction_id_(util::random_int(0xffff))
+    , resolver_(ios)
+    , tick_timer_(ios)
+{
+    for(auto& secret : token_secrets_) {
+        for(auto& b : secret) {
+            b = util::random_int(0xff);
+        }
+    }
+}
+
+void dht_node::start()
+{
+    if(is_running_) {
+        return;
+    }
+    assert(socket_.is_open());
+    is_running_ = true;
+    socket_.add_datagram_handler(this,
+            [this](const udp::endpoint& endpoint, const uint8_t* data, int size) {
+                on_datagram(endpoint, data, size);
+            });
+    last_secret_rotation_time_ = cached_clock::now();
+    log("starting on port %i", port());
+    bootstrap();
+    start_ticking();
+}
+
+void dht_node::stop()
+{
+    if(!is_running_) {
+        return;
+    }
+    is_running_ = false;
+    socket_.remove_datagram_handler(this);
+    error_code ec;
+    tick_timer_.cancel(ec);
+    resolver_.cancel();
+    // The routing table is kept so that we can rejoin quickly if restarted.
+    for(auto& l : lookups_) {
+        l->is_done = true;
+    }
+    lookups_.clear();
+    transactions_.clear();
+    log("stopped");
+}
+
+uint16_t dht_node::port() const
+{
+    if(!is_running_) {
+        return 0;
+    }
+    error_code ec;
+    const auto endpoint = socket_.local_endpoint(ec);
+    return ec ? 0 : endpoint.port();
+}
+
+void dht_node::add_node(const udp::endpoint& endpoint)
+{
+    if(!is_running_ || !endpoint.address().is_v4() || (endpoint.port() == 0)) {
+        return;
+    }
+    if(outgoing_query_budget_.consume(settings_.max_dht_queries_per_second)) {
+        send_query(endpoint, "ping", bmap_encoder());
+    }
+}
+
+void dht_node::get_peers(const sha1_hash& info_hash, const uint16_t port,
+        std::function<void(std::vector<tcp::endpoint>)> handler)
+{
+    if(!is_running_) {
+        return;
+    }
+    auto l = std::make_shared<lookup>();
+    l->type = lookup::type::get_peers;
+    l->target = info_hash;
+    l->announce_port = port;
+    l->handler = std::move(handler);
+    start_lookup(std::move(l));
+}
+
+void dht_node::bootstrap()
+{
+    last_bootstrap_time_ = cached_clock::now();
+    if(!bootstrap_endpoints_.empty()) {
+        auto l = std::make_shared<lookup>();
+        l->type = lookup::type::find_node;
+        l->target = id();
+        start_lookup(std::move(l));
+        return;
+    }
+
+    for(const auto& node : settings_.dht_bootstrap_nodes) {
+        uint16_t port;
+        try {
+            port = util::extract_port(node);
+        } catch(const std::invalid_argument&) {
+            log("invalid bootstrap node: %s", node.c_str());
+            continue;
+        }
+        resolver_.async_resolve(
+                udp::resolver::query(udp::v4(), util::extract_host(node), ""),
+                [this, port](const error_code& error, udp::resolver::iterator it) {
+                    on_bootstrap_nodes_resolved(error, it, port);
+                });
+    }
+}
+
+void dht_node::on_bootstrap_nodes_resolved(
+        const error_code& error, udp::resolver::iterator it, const uint16_t port)
+{
+    if((error == asio::error::operation_aborted) || !is_running_) {
+        return;
+    } else if(error) {
+        log("couldn't resolve bootstrap node: %s", error.message().c_str());
+        return;
+    }
+
+    // Bootstrap nodes are not added to the routing table, so they are only ever
+    // contacted while joining the network.
+    auto l = std::make_shared<lookup>();
+    l->type = lookup::type::find_node;
+    l->target = id();
+    for(; it != udp::resolver::iterator(); ++it) {
+        udp::endpoint endpoint(*it);
+        endpoint.port(port);
+        if(!is_bootstrap_endpoint(endpoint)) {
+            bootstrap_endpoints_.push_back(endpoint);
+            add_lookup_candidate(*l, id(), endpoint);
+        }
+    }
+    if(!l->candidates.empty()) {
+        l->start_time = cached_clock::now();
+        lookups_.push_back(l);
+        continue_lookup(l);
+    }
+}
+
+void dht_node::start_lookup(std::shared_ptr<lookup> l)
+{
+    l->start_time = cached_clock::now();
+    for(const auto& node : routing_table_.find_closest_nodes(
+                l->target, 2 * dht_routing_table::bucket_size)) {
+        add_lookup_candidate(*l, node.id, node.endpoint);
+    }
+    // The bootstrap nodes' ids are not known until they respond, so they're placed
+    // in front of all other candidates until then.
+    if(l->candidates.empty()) {
+        for(const auto& endpoint : bootstrap_endpoints_) {
+            add_lookup_candidate(*l, l->target, endpoint);
+        }
+    }
+    if(l->candidates.empty()) {
+        log("no nodes to start lookup with");
+        return;
+    }
+    lookups_.push_back(l);
+    continue_lookup(l);
+}
+
+void dht_node::continue_lookup(const std::shared_ptr<lookup>& l)
+{
+    assert(!l->is_done);
+    // Query the closest candidates that haven't been queried, but only among the
+    // `bucket_size` closest that haven't failed, as the lookup is done once all
+    // of those have responded.
+    int num_viable = 0;
+    for(auto& c : l->candidates) {
+        if((l->num_in_flight >= alpha)
+                || (num_viable >= dht_routing_table::bucket_size)) {
+            break;
+        }
+        if(c.state == lookup::candidate::state::failed) {
+            continue;
+        }
+        ++num_viable;
+        if(c.state != lookup::candidate::state::fresh) {
+            continue;
+        }
+        if(!outgoing_query_budget_.consume(settings_.max_dht_queries_per_second)) {
+            // We'll be back on the next tick.
+            return;
+        }
+        c.state = lookup::candidate::state::queried;
+        ++l->num_in_flight;
+        bmap_encoder arguments;
+        if(l->type == lookup::type::find_node) {
+            arguments["target"] = to_string(l->target);
+            send_query(c.endpoint, "find_node", std::move(arguments), l);
+        } else {
+            arguments["info_hash"] = to_string(l->target);
+            send_query(c.endpoint, "get_peers", std::move(arguments), l);
+        }
+    }
+
+    if(l->num_in_flight == 0) {
+        finish_lookup(l);
+    }
+}
+
+void dht_node::finish_lookup(const std::shared_ptr<lookup>& l)
+{
+    l->is_done = true;
+    auto it = std::find(lookups_.begin(), lookups_.end(), l);
+    if(it != lookups_.end()) {
+        lookups_.erase(it);
+    }
+
+    int num_responded = 0;
+    for(const auto& c : l->candidates) {
+        if(c.state == lookup::candidate::state::responded) {
+            ++num_responded;
+        }
+    }
+    log("%s lookup done in %lims, %i nodes responded, %i peers found",
+            l->type == lookup::type::find_node ? "find_node" : "get_peers",
+            to_int<milliseconds>(cached_clock::now() - l->start_time), num_responded,
+            l->num_peers_found);
+
+    if((l->type != lookup::type::get_peers) || (l->announce_port == 0)) {
+        return;
+    }
+
+    int num_announces = 0;
+    for(const auto& c : l->candidates) {
+        if(num_announces == dht_routing_table::bucket_size) {
+            break;
+        }
+        if((c.state != lookup::candidate::state::responded) || c.token.empty()) {
+            continue;
+        }
+        if(!outgoing_query_budget_.consume(settings_.max_dht_queries_per_second)) {
+            break;
+        }
+        bmap_encoder arguments;
+        arguments["info_hash"] = to_string(l->target);
+        arguments["port"] = int64_t(l->announce_port);
+        arguments["token"] = c.token;
+        send_query(c.endpoint, "announce_peer", std::move(arguments));
+        ++num_announces;
+    }
+}
+
+void dht_node::add_lookup_candidate(
+        lookup& l, const sha1_hash& id, const udp::endpoint& endpoint)
+{
+    auto it = std::find_if(l.candidates.begin(), l.candidates.end(),
+            [&endpoint](const auto& c) { return c.endpoint == endpoint; });
+    if(it != l.candidates.end()) {
+        return;
+    }
+
+    lookup::candidate c;
+    c.id = id;
+    c.endpoint = endpoint;
+    auto pos = std::find_if(l.candidates.begin(), l.candidates.end(),
+            [&l, &id](const auto& c) { return is_closer(l.target, id, c.id); });
+    l.candidates.insert(pos, std::move(c));
+    if(l.candidates.size() > max_lookup_candidates) {
+        l.candidates.pop_back();
+    }
+}
+
+void dht_node::handle_lookup_response(const std::shared_ptr<lookup>& l,
+        const udp::endpoint& endpoint, const sha1_hash& id, const bmap& response)
+{
+    auto it = std::find_if(l->candidates.begin(), l->candidates.end(),
+            [&endpoint](const auto& c) { return c.endpoint == endpoint; });
+    if(it != l->candidates.end()) {
+        it->state = lookup::candidate::state::responded;
+        string_view token;
+        if(response.try_find_string_view("token", token)) {
+            it->token = token;
+        }
+        if(it->id != id) {
+            it->id = id;
+            std::stable_sort(l->candidates.begin(), l->candidates.end(),
+                    [&l](const auto& a, const auto& b) {
+                        return is_closer(l->target, a.id, b.id);
+                    });
+        }
+    }
+
+    string_view nodes;
+    if(response.try_find_string_view("nodes", nodes)) {
+        for(auto i = 0; i + compact_node_info_size <= int(nodes.length());
+                i += compact_node_info_size) {
+            const auto node_id = to_hash(string_view(&nodes[i], 20));
+            const auto node_endpoint = parse_compact_endpoint(&nodes[i + 20]);
+            if((node_id != this->id()) && (node_endpoint.port() != 0)) {
+                add_lookup_candidate(*l, node_id, node_endpoint);
+            }
+        }
+    }
+
+    blist values;
+    if((l->type == lookup::type::get_peers)
+            && response.try_find_blist("values", values)) {
+        std::vector<tcp::endpoint> peers;
+        for(const auto value : values.all_string_views()) {
+            if(value.length() == compact_endpoint_size) {
+                const auto peer = parse_compact_endpoint(value.data());
+                peers.emplace_back(peer.address(), peer.port());
+            }
+        }
+        if(!peers.empty()) {
+            if(l->num_peers_found == 0) {
+                log("first peer found after %lims",
+                        to_int<milliseconds>(cached_clock::now() - l->start_time));
+            }
+            l->num_peers_found += peers.size();
+            l->handler(std::move(peers));
+        }
+    }
+
+    if(!l->is_done) {
+        continue_lookup(l);
+    }
+}
+
+void dht_node::handle_lookup_failure(
+        const std::shared_ptr<lookup>& l, const udp::endpoint& endpoint)
+{
+    --l->num_in_flight;
+    auto it = std::find_if(l->candidates.begin(), l->candidates.end(),
+            [&endpoint](const auto& c) { return c.endpoint == endpoint; });
+    if(it != l->candidates.end()) {
+        it->state = lookup::candidate::state::failed;
+    }
+    if(!l->is_done) {
+        continue_lookup(l);
+    }
+}
+
+void dht_node::send_query(const udp::endpoint& endpoint, const std::string& method,
+        bmap_encoder arguments, std::shared_ptr<lookup> l)
+{
+    uint16_t tid = next_transaction_id_++;
+    while(transactions_.count(tid)) {
+        tid = next_transaction_id_++;
+    }
+    std::string tid_string(2, 0);
+    endian::write_network<uint16_t>(&tid_string[0], tid);
+
+    arguments["id"] = to_string(id());
+    bmap_encoder query;
+    query["t"] = tid_string;
+    query["y"] = std::string("q");
+    query["q"] = method;
+    query["a"] = arguments;
+
+    transaction t;
+    t.endpoint = endpoint;
+    t.send_time = cached_clock::now();
+    t.parent = std::move(l);
+    transactions_.emplace(tid, std::move(t));
+    send_message(endpoint, query.encode());
+}
+
+void dht_node::send_message(const udp::endpoint& endpoint, const std::string& message)
+{
+    socket_.send_to(endpoint, reinterpret_cast<const uint8_t*>(message.data()),
+            message.length());
+}
+
+void dht_node::on_datagram(
+        const udp::endpoint& endpoint, const uint8_t* data, const int size)
+{
+    // All KRPC messages are bencoded dictionaries, anything else is not for us.
+    if(!is_running_ || (size == 0) || (data[0] != 'd')) {
+        return;
+    }
+
+    error_code ec;
+    // The message doesn't outlive this call, so it's decoded in the receive buffer.
+    const bmap message = decode_bmap(
+            string_view(reinterpret_cast<const char*>(data), size), nullptr, ec);
+    if(ec) {
+        return;
+    }
+
+    string_view tid;
+    std::string type;
+    if(!message.try_find_string_view("t", tid) || !message.try_find_string("y", type)) {
+        return;
+    }
+    if(type == "r") {
+        handle_response(endpoint, tid, message);
+    } else if(type == "e") {
+        handle_error(endpoint, tid);
+    } else if(type == "q") {
+        handle_query(endpoint, tid, message);
+    }
+}
+
+void dht_node::handle_response(
+        const udp::endpoint& endpoint, const string_view tid, const bmap& message)
+{
+    if(tid.length() != 2) {
+        return;
+    }
+    auto it = transactions_.find(endian::read_network<uint16_t>(tid.data()));
+    if((it == transactions_.end()) || (it->second.endpoint != endpoint)) {
+        return;
+    }
+    const transaction t = std::move(it->second);
+    transactions_.erase(it);
+
+    bmap response;
+    string_view node_id;
+    if(!message.try_find_bmap("r", response)
+            || !response.try_find_string_view("id", node_id)
+            || (node_id.length() != 20)) {
+        if(t.parent && !t.is_slow) {
+            handle_lookup_failure(t.parent, endpoint);
+        }
+        return;
+    }
+
+    const auto id = to_hash(node_id);
+    if(!is_bootstrap_endpoint(endpoint)) {
+        routing_table_.add_node(id, endpoint, true);
+    }
+    if(t.parent) {
+        if(!t.is_slow) {
+            --t.parent->num_in_flight;
+        }
+        if(!t.parent->is_done) {
+            handle_lookup_response(t.parent, endpoint, id, response);
+        }
+    }
+}
+
+void dht_node::handle_error(const udp::endpoint& endpoint, const string_view tid)
+{
+    if(tid.length() != 2) {
+        return;
+    }
+    auto it = transactions_.find(endian::read_network<uint16_t>(tid.data()));
+    if((it == transactions_.end()) || (it->second.endpoint != endpoint)) {
+        return;
+    }
+    const transaction t = std::move(it->second);
+    transactions_.erase(it);
+    if(t.parent && !t.is_slow) {
+        handle_lookup_failure(t.parent, endpoint);
+    }
+}
+
+void dht_node::handle_query(
+        const udp::endpoint& endpoint, const string_view tid, const bmap& message)
+{
+    if(!incoming_query_budget_.consume(settings_.max_dht_queries_per_second)) {
+        return;
+    }
+
+    std::string method;
+    bmap arguments;
+    string_view node_id;
+    if(!message.try_find_string("q", method) || !message.try_find_bmap("a", arguments)
+            || !arguments.try_find_string_view("id", node_id)
+            || (node_id.length() != 20)) {
+        send_error(endpoint, tid, protocol_error, "Protocol Error");
+        return;
+    }
+    if(!is_bootstrap_endpoint(endpoint)) {
+        // Nodes only make it into the routing table by responding to our queries, so
+        // ping those that we'd have room for.
+        const auto id = to_hash(node_id);
+        if(routing_table_.would_add_node(id)
+                && outgoing_query_budget_.consume(settings_.max_dht_queries_per_second)) {
+            send_query(endpoint, "ping", bmap_encoder());
+        }
+        routing_table_.add_node(id, endpoint, false);
+    }
+
+    bmap_encoder values;
+    if(method == "ping") {
+        // Only our id is sent back.
+    } else if(method == "find_node") {
+        string_view target;
+        if(!arguments.try_find_string_view("target", target) || (target.length() != 20)) {
+            send_error(endpoint, tid, protocol_error, "Protocol Error");
+            return;
+        }
+        values["nodes"] = closest_nodes_to(to_hash(target));
+    } else if(method == "get_peers") {
+        string_view info_hash;
+        if(!arguments.try_find_string_view("info_hash", info_hash)
+                || (info_hash.length() != 20)) {
+            send_error(endpoint, tid, protocol_error, "Protocol Error");
+            return;
+        }
+        values["token"] = make_token(endpoint, 0);
+        auto it = peer_store_.find(to_hash(info_hash));
+        if(it != peer_store_.end() && !it->second.empty()) {
+            blist_encoder peers;
+            for(const auto& peer : it->second) {
+                std::string compact_peer;
+                append_compact_endpoint(compact_peer, peer.endpoint.address(),
+                        peer.endpoint.port());
+                peers.push_back(compact_peer);
+            }
+            values["values"] = peers;
+        } else {
+            values["nodes"] = closest_nodes_to(to_hash(info_hash));
+        }
+    } else if(method == "announce_peer") {
+        string_view info_hash;
+        string_view token;
+        int64_t port = 0;
+        int64_t implied_port = 0;
+        arguments.try_find_number("implied_port", implied_port);
+        if(!arguments.try_find_string_view("info_hash", info_hash)
+                || (info_hash.length() != 20)
+                || !arguments.try_find_string_view("token", token)
+                || (!implied_port && !arguments.try_find_number("port", port))) {
+            send_error(endpoint, tid, protocol_error, "Protocol Error");
+            return;
+        }
+        if(implied_port) {
+            port = endpoint.port();
+        }
+        if((port <= 0) || (port > 0xffff)) {
+            send_error(endpoint, tid, protocol_error, "Invalid port");
+            return;
+        }
+        if(!is_token_valid(endpoint, token)) {
+            send_error(endpoint, tid, protocol_error, "Invalid token");
+            return;
+        }
+        store_peer(to_hash(info_hash), tcp::endpoint(endpoint.address(), port));
+    } else {
+        send_error(endpoint, tid, method_unknown, "Method Unknown");
+        return;
+    }
+    send_response(endpoint, tid, std::move(values));
+}
+
+void dht_node::send_response(
+        const udp::endpoint& endpoint, const string_view tid, bmap_encoder values)
+{
+    values["id"] = to_string(id());
+    bmap_encoder response;
+    response["t"] = std::string(tid);
+    response["y"] = std::string("r");
+    response["r"] = values;
+    send_message(endpoint, response.encode());
+}
+
+void dht_node::send_error(const udp::endpoint& endpoint, const string_view tid,
+        const int code, const std::string& message)
+{
+    blist_encoder error;
+    error.push_back(int64_t(code));
+    error.push_back(message);
+    bmap_encoder response;
+    response["t"] = std::string(tid);
+    response["y"] = std::string("e");
+    response["e"] = error;
+    send_message(endpoint, response.encode());
+}
+
+std::string dht_node::make_token(
+        const udp::endpoint& endpoint, const int secret_index) const
+{
+    const auto ip = endpoint.address().to_v4().to_bytes();
+    const auto digest
+            = sha1_hasher().update(ip).update(token_secrets_[secret_index]).finish();
+    return std::string(digest.begin(), digest.begin() + 8);
+}
+
+bool dht_node::is_token_valid(const udp::endpoint& endpoint, string_view token) const
+{
+    return (token == make_token(endpoint, 0)) || (token == make_token(endpoint, 1));
+}
+
+void dht_node::store_peer(const sha1_hash& info_hash, const tcp::endpoint& peer)
+{
+    const auto now = cached_clock::now();
+    auto it = peer_store_.find(info_hash);
+    if(it == peer_store_.end()) {
+        if(peer_store_.size() >= max_stored_torrents) {
+            return;
+        }
+        it = peer_store_.emplace(info_hash, std::vector<stored_peer>()).first;
+    }
+
+    auto& peers = it->second;
+    auto p = std::find_if(peers.begin(), peers.end(),
+            [&peer](const auto& p) { return p.endpoint == peer; });
+    if(p != peers.end()) {
+        p->announce_time = now;
+    } else if(peers.size() < max_stored_peers_per_torrent) {
+        peers.push_back({peer, now});
+    } else {
+        auto oldest = std::min_element(
+                peers.begin(), peers.end(), [](const auto& a, const auto& b) {
+                    return a.announce_time < b.announce_time;
+                });
+        *oldest = {peer, now};
+    }
+}
+
+std::string dht_node::closest_nodes_to(const sha1_hash& target) const
+{
+    const auto nodes
+            = routing_table_.find_closest_nodes(target, dht_routing_table::bucket_size);
+    std::string s;
+    s.reserve(nodes.size() * compact_node_info_size);
+    for(const auto& node : nodes) {
+        s.append(node.id.begin(), node.id.end());
+        append_compact_endpoint(s, node.endpoint.address(), node.endpoint.port());
+    }
+    return s;
+}
+
+bool dht_node::is_bootstrap_endpoint(const udp::endpoint& endpoint) const noexcept
+{
+    return std::find(bootstrap_endpoints_.begin(), bootstrap_endpoints_.end(), endpoint)
+            != bootstrap_endpoints_.end();
+}
+
+void dht_node::start_ticking()
+{
+    start_timer(tick_timer_, tick_interval,
+            [this](const error_code& error) { on_tick(error); });
+}
+
+void dht_node::on_tick(const error_code& error)
+{
+    if((error == asio::error::operation_aborted) || !is_running_) {
+        return;
+    }
+
+    const auto now = cached_clock::now();
+    time_out_transactions(now);
+
+    // Resume the lookups that ran out of query budget. They may conclude and remove
+    // themselves from `lookups_`, so work on a copy.
+    const auto lookups = lookups_;
+    for(const auto& l : lookups) {
+        if(!l->is_done && (l->num_in_flight < alpha)) {
+            continue_lookup(l);
+        }
+    }
+
+    expire_stored_peers(now);
+
+    if(now - last_secret_rotation_time_ >= token_secret_rotation_interval) {
+        token_secrets_[1] = token_secrets_[0];
+        for(auto& b : token_secrets_[0]) {
+            b = util::random_int(0xff);
+        }
+        last_secret_rotation_time_ = now;
+    }
+
+    if(routing_table_.num_nodes() == 0) {
+        if(now - last_bootstrap_time_ >= bootstrap_interval) {
+            bootstrap();
+        }
+    } else {
+        const int index = routing_table_.pick_bucket_to_refresh(bucket_refresh_interval);
+        if(index != -1) {
+            auto l = std::make_shared<lookup>();
+            l->type = lookup::type::find_node;
+            l->target = routing_table_.random_id_in_bucket(index);
+            start_lookup(std::move(l));
+        }
+    }
+
+    start_ticking();
+}
+
+void dht_node::time_out_transactions(const time_point now)
+{
+    // Lookups may send new queries when notified of a failure, so first collect the
+    // failures and only notify lookups once we're done iterating `transactions_`.
+    std::vector<std::pair<std::shared_ptr<lookup>, udp::endpoint>> failures;
+    for(auto it = transactions_.begin(); it != transactions_.end();) {
+        auto& t = it->second;
+        const auto elapsed = now - t.send_time;
+        if(elapsed >= query_timeout) {
+            routing_table_.node_failed(t.endpoint);
+            if(t.parent && !t.is_slow) {
+                failures.emplace_back(t.parent, t.endpoint);
+            }
+            it = transactions_.erase(it);
+            continue;
+        }
+        if(t.parent && !t.is_slow && (elapsed >= slow_query_timeout)) {
+            // Free up the query's slot in the lookup, but keep the transaction
+            // around in case the response does arrive.
+            t.is_slow = true;
+            failures.emplace_back(t.parent, t.endpoint);
+        }
+        ++it;
+    }
+    for(const auto& f : failures) {
+        handle_lookup_failure(f.first, f.second);
+    }
+}
+
+void dht_node::expire_stored_peers(const time_point now)
+{
+    for(auto it = peer_store_.begin(); it != peer_store_.end();) {
+        auto& peers = it->second;
+        peers.erase(std::remove_if(peers.begin(), peers.end(),
+                            [now](const auto& p) {
+                                return now - p.announce_time >= stored_peer_ttl;
+                            }),
+                peers.end());
+        if(peers.empty()) {
+            it = peer_store_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+} // tide
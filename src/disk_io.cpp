@@ -5,6 +5,7 @@
 #include "settings.hpp"
 #include "string_utils.hpp"
 #include "torrent_info.hpp"
+#include "trace.hpp"
 
 #include <cmath>
 #include <fstream>
@@ -24,6 +25,13 @@ constexpr int block_index(const int offset) noexcept
     return offset / 0x4000;
 }
 
+/** Adds the time elapsed since `start` to `counter`. */
+inline void add_elapsed_time(
+        counters& counters, const counters::id counter, const time_point start) noexcept
+{
+    counters.increment(counter, to_int<nanoseconds>(clock::now() - start));
+}
+
 // -------------
 // partial_piece
 // -------------
@@ -137,8 +145,8 @@ inline void disk_io::partial_piece::restore_buffer()
 // -------------
 
 disk_io::torrent_entry::torrent_entry(
-        const torrent_info& info, string_view piece_hashes, path resume_data_path)
-    : id(info.id), storage(info, piece_hashes, std::move(resume_data_path))
+        const torrent_info& info, piece_hashes hashes, path resume_data_path)
+    : id(info.id), storage(info, std::move(hashes), std::move(resume_data_path))
 {}
 
 inline bool disk_io::torrent_entry::is_block_valid(const block_info& block)
@@ -151,9 +159,11 @@ inline bool disk_io::torrent_entry::is_block_valid(const block_info& block)
 // disk_io
 // -------
 
-disk_io::disk_io(asio::io_context& network_ios, const disk_io_settings& settings)
+disk_io::disk_io(asio::io_context& network_ios, const disk_io_settings& settings,
+        counters& counters)
     : network_ios_(network_ios)
     , settings_(settings)
+    , counters_(counters)
     , read_cache_(std::max(settings.read_cache_capacity, 0))
     , disk_buffer_pool_(0x4000)
     , retry_timer_(network_ios)
@@ -165,6 +175,22 @@ disk_io::~disk_io()
     // TODO make sure we don't destruct while there are jobs etc.
 }
 
+void disk_io::update_counters()
+{
+    counters_.set(counters::num_disk_jobs, thread_pool_.num_executed_jobs());
+    counters_.set(counters::disk_job_queue_time,
+            to_int<nanoseconds>(thread_pool_.total_wait_time()));
+    counters_.set(counters::disk_job_execution_time,
+            to_int<nanoseconds>(thread_pool_.total_work_time()));
+    counters_.set(counters::num_disk_threads, thread_pool_.num_threads());
+    counters_.set(counters::num_active_disk_threads, thread_pool_.num_active_threads());
+    counters_.set(counters::disk_job_queue_size, thread_pool_.num_pending_jobs());
+    counters_.set(counters::num_partial_pieces, stats_.num_partial_pieces);
+    counters_.set(counters::num_buffered_blocks, stats_.num_buffered_blocks);
+    counters_.set(counters::read_cache_size, read_cache_.size());
+    counters_.set(counters::read_cache_capacity, read_cache_.capacity());
+}
+
 void disk_io::set_concurrency(const int n)
 {
     const int old_concurrency = thread_pool_.concurrency();
@@ -202,18 +228,24 @@ void disk_io::read_metainfo(
         const path& path, std::function<void(const std::error_code&, metainfo)> handler)
 {
     thread_pool_.post([this, path, handler = std::move(handler)] {
-        std::ifstream source(path);
+        std::ifstream source(path, std::ios::binary);
         std::error_code error;
         if(!source) {
             error = system::last_error();
             network_ios_.post(
                     [error, handler = std::move(handler)] { handler(error, {}); });
+            return;
         }
-        std::stringstream ss;
-        ss << source.rdbuf();
+        // Read the file straight into the string that is handed over to the decoded
+        // metainfo, rather than copying it through a stringstream.
+        std::string encoded;
+        source.seekg(0, std::ios::end);
+        encoded.resize(source.tellg());
+        source.seekg(0, std::ios::beg);
+        source.read(&encoded[0], encoded.size());
         metainfo metainfo;
         try {
-            bmap metainfo_map = decode_bmap(ss.str());
+            bmap metainfo_map = decode_bmap(std::move(encoded));
             metainfo = parse_and_sanitize_metainfo(std::move(metainfo_map));
         } catch(const std::error_code& e) {
             error = e;
@@ -226,7 +258,7 @@ void disk_io::read_metainfo(
 }
 
 torrent_storage_handle disk_io::allocate_torrent(
-        const torrent_info& info, std::string piece_hashes, std::error_code& error)
+        const torrent_info& info, piece_hashes hashes, std::error_code& error)
 {
     // TODO investigate whether this can potentially be so expensive an operation as to
     // justify sending it to thread pool.
@@ -238,9 +270,9 @@ torrent_storage_handle disk_io::allocate_torrent(
         // Insert new torrent before the first torrent that has a larger id than this
         // one.
         torrent_storage_handle handle;
-        const auto make_torrent = [this, &info, piece_hashes = std::move(piece_hashes)] {
-            return std::make_unique<torrent_entry>(info, std::move(piece_hashes),
-                    settings_.resume_data_path.string() + std::to_string(info.id));
+        const auto make_torrent = [this, &info, &hashes] {
+            return std::make_unique<torrent_entry>(
+                    info, std::move(hashes), resume_data_path(info.id));
         };
         if(torrents_.empty() || (torrents_.back()->id < info.id)) {
             torrents_.emplace_back(make_torrent());
@@ -267,6 +299,12 @@ torrent_storage_handle disk_io::allocate_torrent(
     }
 }
 
+piece_hashes disk_io::map_piece_hashes(const torrent_id_t id, std::error_code& error)
+{
+    return piece_hashes::map_file(
+            torrent_storage::piece_hashes_path(resume_data_path(id)), error);
+}
+
 // The following are a bit tricky, I think, because we need to ensure that no
 // concurrent ops are run on file, but the kernel may provide some guarantees.
 // TODO check..
@@ -286,14 +324,18 @@ void disk_io::erase_torrent_resume_data(
         const torrent_id_t id, std::function<void(const std::error_code&)> handler)
 {}
 
-void disk_io::save_torrent_resume_data(const torrent_id_t id, bmap_encoder resume_data,
-        std::function<void(const std::error_code&)> handler)
+void disk_io::save_torrent_resume_data(const torrent_id_t id, std::string resume_data,
+        std::function<void(const std::error_code&, std::string)> handler)
 {
-    thread_pool_.post([resume_data = std::move(resume_data), handler = std::move(handler),
-                              &torrent = find_torrent_entry(id)] {
+    thread_pool_.post([this, resume_data = std::move(resume_data),
+                              handler = std::move(handler),
+                              &torrent = find_torrent_entry(id)]() mutable {
         std::error_code error;
         torrent.storage.write_resume_data(resume_data, error);
-        handler(error);
+        network_ios_.post([error, resume_data = std::move(resume_data),
+                                  handler = std::move(handler)]() mutable {
+            handler(error, std::move(resume_data));
+        });
     });
 }
 
@@ -321,6 +363,7 @@ void disk_io::create_sha1_digest(
 
 disk_buffer disk_io::get_disk_buffer(const int length)
 {
+    counters_.increment(counters::num_disk_buffer_allocations);
     return disk_buffer(reinterpret_cast<uint8_t*>(disk_buffer_pool_.malloc()), length,
             disk_buffer_pool_);
 }
@@ -553,6 +596,7 @@ inline void disk_io::dispatch_write(torrent_entry& torrent, partial_piece& piece
 TIDE_WORKER_THREAD
 void disk_io::handle_complete_piece(torrent_entry& torrent, partial_piece& piece)
 {
+    TIDE_TRACE_SCOPE("disk", "handle_complete_piece", "piece", piece.index);
     // TODO ensure torrent_entry thread safety
     ++torrent.num_pending_ops;
     // We should have all blocks by now.
@@ -565,7 +609,10 @@ void disk_io::handle_complete_piece(torrent_entry& torrent, partial_piece& piece
     // are discarded, hence the true default value).
     bool is_piece_good = true;
     if(piece.unhashed_offset < piece.length) {
+        // This includes reading back the blocks that were saved unhashed.
+        const time_point hash_start = clock::now();
         const sha1_hash hash = finish_hashing(torrent, piece, error);
+        add_elapsed_time(counters_, counters::disk_hash_time, hash_start);
         if(error) {
             const auto reason = error.message();
             log(invoked_on::thread_pool, log_event::write,
@@ -651,7 +698,8 @@ void disk_io::handle_complete_piece(torrent_entry& torrent, partial_piece& piece
                 log(log_event::write, "saved %i blocks, piece(%i) fully saved",
                         piece.work_buffer.size(), piece.index);
                 stats_.num_buffered_blocks -= piece.work_buffer.size();
-                stats_.num_blocks_written += piece.work_buffer.size();
+                counters_.increment(
+                        counters::num_blocks_written, piece.work_buffer.size());
                 // Otherwise piece was saved so we can remove it from write buffer.
                 torrent.write_buffer.erase(std::find_if(torrent.write_buffer.begin(),
                         torrent.write_buffer.end(), [index = piece.index](const auto& p) {
@@ -672,6 +720,7 @@ inline sha1_hash disk_io::finish_hashing(
 {
     assert(piece.unhashed_offset < piece.length);
     assert(!piece.work_buffer.empty());
+    TIDE_TRACE_SCOPE("disk", "finish_hashing", "piece", piece.index);
 
     error.clear();
 
@@ -719,6 +768,7 @@ inline sha1_hash disk_io::finish_hashing(
             log(invoked_on::thread_pool, log_event::write,
                     "reading back %i contiguous blocks for hashing in piece(%i)",
                     num_contiguous, piece.index);
+            TIDE_TRACE_SCOPE("disk", "read_back", "num_blocks", num_contiguous);
 
             const block_info info(piece.index, piece.unhashed_offset, length);
             const std::vector<mmap_source> mmaps
@@ -740,6 +790,7 @@ inline sha1_hash disk_io::finish_hashing(
 TIDE_WORKER_THREAD
 void disk_io::hash_and_save_blocks(torrent_entry& torrent, partial_piece& piece)
 {
+    TIDE_TRACE_SCOPE("disk", "hash_and_save_blocks", "piece", piece.index);
     ++torrent.num_pending_ops;
     assert(!piece.work_buffer.empty());
 
@@ -747,12 +798,14 @@ void disk_io::hash_and_save_blocks(torrent_entry& torrent, partial_piece& piece)
     auto block = std::find_if(piece.work_buffer.begin(), piece.work_buffer.end(),
             [&piece](const auto& b) { return b.offset == piece.unhashed_offset; });
     assert(block != piece.work_buffer.end());
+    const time_point hash_start = clock::now();
     while(block != piece.work_buffer.end()) {
         assert(!block->buffer.empty());
         piece.hasher.update(block->buffer);
         piece.unhashed_offset += block->buffer.size();
         ++block;
     }
+    add_elapsed_time(counters_, counters::disk_hash_time, hash_start);
 
     std::error_code error;
     save_contiguous_blocks(torrent.storage, piece.index, piece.work_buffer, error);
@@ -765,6 +818,7 @@ void disk_io::hash_and_save_blocks(torrent_entry& torrent, partial_piece& piece)
 TIDE_WORKER_THREAD
 void disk_io::flush_buffer(torrent_entry& torrent, partial_piece& piece)
 {
+    TIDE_TRACE_SCOPE("disk", "flush_buffer", "piece", piece.index);
     ++torrent.num_pending_ops;
     assert(!piece.work_buffer.empty());
 
@@ -778,12 +832,14 @@ void disk_io::flush_buffer(torrent_entry& torrent, partial_piece& piece)
         if(block != piece.work_buffer.end()) {
             const int num_contiguous = count_contiguous_blocks(piece.work_buffer);
             const auto end = piece.work_buffer.begin() + num_contiguous;
+            const time_point hash_start = clock::now();
             while(block != end) {
                 assert(!block->buffer.empty());
                 piece.hasher.update(block->buffer);
                 piece.unhashed_offset += block->buffer.size();
                 ++block;
             }
+            add_elapsed_time(counters_, counters::disk_hash_time, hash_start);
             log(invoked_on::thread_pool, log_event::write,
                     "hashed %i blocks in piece(%i) in non-hash job", num_contiguous,
                     piece.index);
@@ -827,7 +883,7 @@ void disk_io::on_blocks_saved(
         }
         piece.num_saved_blocks += piece.work_buffer.size();
         stats_.num_buffered_blocks -= piece.work_buffer.size();
-        stats_.num_blocks_written += piece.work_buffer.size();
+        counters_.increment(counters::num_blocks_written, piece.work_buffer.size());
         // Blocks were saved, safe to remove them.
         piece.work_buffer.clear();
         // We may have received new blocks for this piece while this thread was
@@ -864,8 +920,10 @@ inline void disk_io::save_contiguous_blocks(torrent_storage& storage,
         std::error_code& error)
 {
     assert(!blocks.empty());
+    TIDE_TRACE_SCOPE("disk", "write", "num_blocks", blocks.size());
     log(invoked_on::thread_pool, log_event::write, log::priority::low,
             "saving %i contiguous blocks", blocks.size());
+    const time_point write_start = clock::now();
     // Don't allocate an iovec vector if there is only a single buffer.
     if(blocks.size() == 1) {
         auto& block = blocks[0];
@@ -883,6 +941,8 @@ inline void disk_io::save_contiguous_blocks(torrent_storage& storage,
         const block_info info(piece_index, blocks[0].offset, num_bytes);
         storage.write(std::move(buffers), info, error);
     }
+    add_elapsed_time(counters_, counters::disk_write_time, write_start);
+    counters_.increment(counters::num_disk_write_ops);
 }
 
 // -------
@@ -904,16 +964,18 @@ void disk_io::fetch_block(const torrent_id_t id, const block_info& block_info,
 
     block_source block = read_cache_[{id, block_info.index, block_info.offset}];
     if(block) {
-        ++stats_.num_read_cache_hits;
+        counters_.increment(counters::num_read_cache_hits);
         network_ios_.post([block = std::move(block), handler = std::move(handler)] {
             handler({}, std::move(block));
         });
-        log(log_event::cache, "%ith cache HIT", stats_.num_read_cache_hits);
+        log(log_event::cache, "%llith cache HIT",
+                counters_[counters::num_read_cache_hits]);
         return;
     }
 
-    ++stats_.num_read_cache_misses;
-    log(log_event::cache, "%ith cache MISS", stats_.num_read_cache_misses);
+    counters_.increment(counters::num_read_cache_misses);
+    log(log_event::cache, "%llith cache MISS",
+            counters_[counters::num_read_cache_misses]);
     auto it = std::find_if(torrent.block_fetches.begin(), torrent.block_fetches.end(),
             [&block_info, num_read_ahead = settings_.read_cache_line_size](
                     const auto& entry) {
@@ -973,16 +1035,20 @@ TIDE_WORKER_THREAD
 inline void disk_io::read_single_block(torrent_entry& torrent, const block_info& info,
         std::function<void(const std::error_code&, block_source)> handler)
 {
+    TIDE_TRACE_SCOPE("disk", "read_single_block", "piece", info.index);
     std::error_code error;
     // For single blocks we use a simple disk_buffer rather than mmapping.
     auto buffer = std::make_shared<disk_buffer>(get_disk_buffer(info.length));
+    const time_point read_start = clock::now();
     torrent.storage.read(iovec{buffer->data(), size_t(buffer->size())}, info, error);
+    add_elapsed_time(counters_, counters::disk_read_time, read_start);
+    counters_.increment(counters::num_disk_read_ops);
     block_source block(info, source_buffer(std::move(buffer)));
     network_ios_.post(
             [this, error, block, handler = std::move(handler), torrent_id = torrent.id] {
                 handler(error, block);
                 if(!error) {
-                    ++stats_.num_blocks_read;
+                    counters_.increment(counters::num_blocks_read);
                     read_cache_.insert({torrent_id, block.index, block.offset}, block);
                 }
             });
@@ -992,6 +1058,7 @@ TIDE_WORKER_THREAD
 inline void disk_io::read_ahead(torrent_entry& torrent, const block_info& first_block,
         std::function<void(const std::error_code&, block_source)> handler)
 {
+    TIDE_TRACE_SCOPE("disk", "read_ahead", "piece", first_block.index);
     // We may not have read_cache_line_size number of blocks left in piece (we only
     // read ahead within the boundaries of a single piece).
     const int piece_length = torrent.storage.piece_length(first_block.index);
@@ -1018,7 +1085,10 @@ inline void disk_io::read_ahead(torrent_entry& torrent, const block_info& first_
     read_ahead_info.length = std::min(num_blocks * 0x4000, num_bytes_left);
 
     std::error_code error;
+    const time_point read_start = clock::now();
     torrent.storage.read(std::move(iovecs), read_ahead_info, error);
+    add_elapsed_time(counters_, counters::disk_read_time, read_start);
+    counters_.increment(counters::num_disk_read_ops);
 
     if(error) {
         network_ios_.post(
@@ -1075,7 +1145,7 @@ inline void disk_io::on_blocks_read_ahead(torrent_entry& torrent,
     for(auto& block : blocks) {
         read_cache_.insert({torrent.id, block.index, block.offset}, block);
     }
-    stats_.num_blocks_read += blocks.size();
+    counters_.increment(counters::num_blocks_read, blocks.size());
 }
 
 // -----
@@ -1123,6 +1193,11 @@ inline disk_io::torrent_entry& disk_io::find_torrent_entry(const torrent_id_t id
     return **it;
 }
 
+inline path disk_io::resume_data_path(const torrent_id_t id) const
+{
+    return settings_.resume_data_path.string() + std::to_string(id);
+}
+
 template <typename... Args>
 void disk_io::log(const log_event event, const char* format, Args&&... args) const
 {
@@ -1148,7 +1223,7 @@ void disk_io::log(const invoked_on thread, const log_event event,
         const log::priority priority, const char* format, Args&&... args) const
 {
 #ifdef TIDE_ENABLE_LOGGING
-    const auto header = [event]() -> std::string {
+    const char* header = [event] {
         switch(event) {
         case log_event::cache: return "CACHE";
         case log_event::metainfo: return "METAINFO";
@@ -1160,8 +1235,7 @@ void disk_io::log(const invoked_on thread, const log_event event,
         default: return "";
         }
     }();
-    log::log_disk_io(header, util::format(format, std::forward<Args>(args)...),
-            thread == invoked_on::thread_pool, priority);
+    log::log_disk_io(header, priority, format, args...);
 #endif // TIDE_ENABLE_LOGGING
 }
 
@@ -0,0 +1,550 @@
+#include "endpoint_filter.hpp"
+#include "error_code.hpp"
+
+#include <algorithm> // sort, upper_bound, lower_bound, find, max
+#include <cassert>
+#include <cctype> // isspace, isdigit, isxdigit
+#include <cstring> // memchr
+#include <iterator> // prev
+#include <string>
+
+namespace tide {
+
+using uint128 = std::pair<uint64_t, uint64_t>;
+
+inline uint128 to_uint128(const address_v6& ip) noexcept
+{
+    const auto bytes = ip.to_bytes();
+    uint128 n(0, 0);
+    for(auto i = 0; i < 8; ++i) {
+        n.first = (n.first << 8) | bytes[i];
+        n.second = (n.second << 8) | bytes[i + 8];
+    }
+    return n;
+}
+
+/** Returns `n + 1` and sets `overflow` if `n` was the largest 128 bit integer. */
+inline uint128 successor(const uint128& n, bool& overflow) noexcept
+{
+    overflow = false;
+    if(n.second != uint64_t(-1)) {
+        return {n.first, n.second + 1};
+    } else if(n.first != uint64_t(-1)) {
+        return {n.first + 1, 0};
+    }
+    overflow = true;
+    return n;
+}
+
+inline uint128 predecessor(const uint128& n) noexcept
+{
+    assert(n != uint128(0, 0));
+    if(n.second != 0) {
+        return {n.first, n.second - 1};
+    }
+    return {n.first - 1, uint64_t(-1)};
+}
+
+inline void trim(const char*& begin, const char*& end) noexcept
+{
+    while((begin != end) && std::isspace(static_cast<unsigned char>(*begin))) {
+        ++begin;
+    }
+    while((end != begin) && std::isspace(static_cast<unsigned char>(end[-1]))) {
+        --end;
+    }
+}
+
+inline const char* find_last(const char* begin, const char* end, const char c) noexcept
+{
+    for(auto it = end; it != begin; --it) {
+        if(it[-1] == c) {
+            return it - 1;
+        }
+    }
+    return end;
+}
+
+/**
+ * Parses a dotted decimal IPv4 address (octets may be zero padded, as they are in
+ * DAT lists) without allocating, which matters when loading millions of them.
+ */
+inline bool parse_v4(const char* begin, const char* end, uint32_t& ip) noexcept
+{
+    ip = 0;
+    for(auto i = 0; i < 4; ++i) {
+        if(i > 0) {
+            if((begin == end) || (*begin != '.')) {
+                return false;
+            }
+            ++begin;
+        }
+        int octet = 0;
+        int num_digits = 0;
+        while((begin != end) && std::isdigit(static_cast<unsigned char>(*begin))) {
+            octet = octet * 10 + (*begin - '0');
+            ++begin;
+            if(++num_digits > 3) {
+                return false;
+            }
+        }
+        if((num_digits == 0) || (octet > 255)) {
+            return false;
+        }
+        ip = (ip << 8) | octet;
+    }
+    return begin == end;
+}
+
+inline bool parse_address(const char* begin, const char* end, address& ip)
+{
+    trim(begin, end);
+    uint32_t v4;
+    if(parse_v4(begin, end, v4)) {
+        ip = address_v4(v4);
+        return true;
+    }
+    // Only what may be an IPv6 address is handed to asio, and it's copied onto the
+    // stack rather than into a string.
+    char buffer[64];
+    if((end - begin >= int(sizeof buffer))
+            || (std::memchr(begin, ':', end - begin) == nullptr)) {
+        return false;
+    }
+    for(auto it = begin; it != end; ++it) {
+        if(!std::isxdigit(static_cast<unsigned char>(*it)) && (*it != ':')
+                && (*it != '.')) {
+            return false;
+        }
+    }
+    std::copy(begin, end, buffer);
+    buffer[end - begin] = '\0';
+    error_code error;
+    ip = asio::ip::make_address_v6(buffer, error);
+    return !error;
+}
+
+inline bool parse_int(const char* begin, const char* end, int& n) noexcept
+{
+    trim(begin, end);
+    if((begin == end) || (end - begin > 9)) {
+        return false;
+    }
+    n = 0;
+    for(; begin != end; ++begin) {
+        if(!std::isdigit(static_cast<unsigned char>(*begin))) {
+            return false;
+        }
+        n = n * 10 + (*begin - '0');
+    }
+    return true;
+}
+
+/** Parses `ip/prefix` into the range of addresses it denotes. */
+inline bool parse_cidr(const char* begin, const char* end, const char* slash,
+        address& first, address& last)
+{
+    address ip;
+    int prefix;
+    if(!parse_address(begin, slash, ip) || !parse_int(slash + 1, end, prefix)) {
+        return false;
+    }
+    if(ip.is_v4()) {
+        if(prefix > 32) {
+            return false;
+        }
+        const uint32_t mask = prefix == 0 ? 0 : ~uint32_t(0) << (32 - prefix);
+        const uint32_t n = ip.to_v4().to_uint();
+        first = address_v4(n & mask);
+        last = address_v4(n | ~mask);
+    } else {
+        if(prefix > 128) {
+            return false;
+        }
+        auto low = ip.to_v6().to_bytes();
+        auto high = low;
+        for(auto i = 0; i < 16; ++i) {
+            const int num_bits = std::max(0, std::min(8, prefix - i * 8));
+            const uint8_t mask = num_bits == 0 ? 0 : uint8_t(0xff << (8 - num_bits));
+            low[i] &= mask;
+            high[i] |= uint8_t(~mask);
+        }
+        first = address_v6(low);
+        last = address_v6(high);
+    }
+    return true;
+}
+
+/**
+ * Merges `ranges`, which must be sorted by their first address, into disjoint and
+ * non-adjacent ranges in place.
+ */
+template <typename Ranges, typename First, typename Last, typename Next>
+inline void merge_ranges(Ranges& ranges, First first, Last last, Next next)
+{
+    if(ranges.empty()) {
+        return;
+    }
+    int n = 0;
+    for(auto i = 1; i < int(ranges.size()); ++i) {
+        auto& curr = ranges[n];
+        const auto& r = ranges[i];
+        bool overflow;
+        const auto after_curr = next(last(curr), overflow);
+        if(overflow || (first(r) <= after_curr)) {
+            if(last(r) > last(curr)) {
+                last(curr) = last(r);
+            }
+        } else {
+            ranges[++n] = r;
+        }
+    }
+    ranges.resize(n + 1);
+}
+
+void ip_filter::add_rule(const address& first, const address& last)
+{
+    if(first.is_v4() && last.is_v4()) {
+        const uint32_t f = first.to_v4().to_uint();
+        const uint32_t l = last.to_v4().to_uint();
+        if(f <= l) {
+            pending_v4_ranges_.emplace_back(f, l);
+        }
+    } else if(first.is_v6() && last.is_v6()) {
+        const auto f = to_uint128(first.to_v6());
+        const auto l = to_uint128(last.to_v6());
+        if(f <= l) {
+            pending_v6_ranges_.push_back({f, l});
+        }
+    }
+}
+
+void ip_filter::remove_rule(const address& first, const address& last)
+{
+    build();
+    if(first.is_v4() && last.is_v4()) {
+        const uint32_t f = first.to_v4().to_uint();
+        const uint32_t l = last.to_v4().to_uint();
+        if(f > l) {
+            return;
+        }
+        std::vector<uint32_t> firsts;
+        std::vector<uint32_t> lasts;
+        firsts.reserve(v4_firsts_.size() + 1);
+        lasts.reserve(v4_lasts_.size() + 1);
+        for(auto i = 0; i < int(v4_firsts_.size()); ++i) {
+            const auto rf = v4_firsts_[i];
+            const auto rl = v4_lasts_[i];
+            if((rl < f) || (rf > l)) {
+                firsts.push_back(rf);
+                lasts.push_back(rl);
+                continue;
+            }
+            // The removed range overlaps this one, so only its parts on either side
+            // of the removed range, if any, remain.
+            if(rf < f) {
+                firsts.push_back(rf);
+                lasts.push_back(f - 1);
+            }
+            if(rl > l) {
+                firsts.push_back(l + 1);
+                lasts.push_back(rl);
+            }
+        }
+        v4_firsts_ = std::move(firsts);
+        v4_lasts_ = std::move(lasts);
+        build_v4_index();
+    } else if(first.is_v6() && last.is_v6()) {
+        const auto f = to_uint128(first.to_v6());
+        const auto l = to_uint128(last.to_v6());
+        if(f > l) {
+            return;
+        }
+        std::vector<v6_range> ranges;
+        ranges.reserve(v6_ranges_.size() + 1);
+        for(const auto& r : v6_ranges_) {
+            if((r.last < f) || (r.first > l)) {
+                ranges.push_back(r);
+                continue;
+            }
+            if(r.first < f) {
+                ranges.push_back({r.first, predecessor(f)});
+            }
+            if(r.last > l) {
+                bool overflow;
+                ranges.push_back({successor(l, overflow), r.last});
+            }
+        }
+        v6_ranges_ = std::move(ranges);
+    }
+}
+
+/**
+ * Parses a `first - last` range, which in the P2P format is preceded by a
+ * description and a colon, an `ip/prefix` range, or a single address.
+ */
+inline bool parse_range(
+        const char* begin, const char* end, address& first, address& last)
+{
+    const char* dash = find_last(begin, end, '-');
+    if(dash != end) {
+        if(!parse_address(dash + 1, end, last)) {
+            return false;
+        }
+        // P2P ranges are IPv4 only, so if the address after the last colon is a
+        // dotted quad, what precedes the colon is the description (unlike in an
+        // IPv6 address, which is only tried otherwise).
+        const char* colon = find_last(begin, dash, ':');
+        if(last.is_v4() && (colon != dash)) {
+            uint32_t v4;
+            const char* first_begin = colon + 1;
+            const char* first_end = dash;
+            trim(first_begin, first_end);
+            if(parse_v4(first_begin, first_end, v4)) {
+                first = address_v4(v4);
+                return true;
+            }
+        }
+        return parse_address(begin, dash, first);
+    } else if(const char* slash = find_last(begin, end, '/'); slash != end) {
+        return parse_cidr(begin, end, slash, first, last);
+    } else if(parse_address(begin, end, first)) {
+        last = first;
+        return true;
+    }
+    return false;
+}
+
+int ip_filter::parse(string_view blocklist)
+{
+    int num_invalid_lines = 0;
+    const char* it = blocklist.data();
+    const char* const end = it + blocklist.size();
+    while(it != end) {
+        const char* line_end = static_cast<const char*>(std::memchr(it, '\n', end - it));
+        if(line_end == nullptr) {
+            line_end = end;
+        }
+        if(!parse_line(it, line_end)) {
+            ++num_invalid_lines;
+        }
+        it = line_end == end ? end : line_end + 1;
+    }
+    build();
+    return num_invalid_lines;
+}
+
+inline bool ip_filter::parse_line(const char* begin, const char* end)
+{
+    trim(begin, end);
+    if((begin == end) || (*begin == '#')
+            || ((end - begin >= 2) && (begin[0] == '/') && (begin[1] == '/'))) {
+        return true;
+    }
+
+    address first;
+    address last;
+    // DAT format: `first - last , level , description`. A comma may also be part of
+    // a P2P description, so the line is only taken to be in the DAT format if what
+    // precedes the comma is a range.
+    const char* comma = static_cast<const char*>(std::memchr(begin, ',', end - begin));
+    if((comma != nullptr) && parse_range(begin, comma, first, last)) {
+        const char* level_end = static_cast<const char*>(
+                std::memchr(comma + 1, ',', end - comma - 1));
+        int level;
+        if(parse_int(comma + 1, level_end ? level_end : end, level) && (level > 127)) {
+            return true;
+        }
+    } else if(!parse_range(begin, end, first, last)) {
+        return false;
+    }
+
+    if((first.is_v4() != last.is_v4()) || (first > last)) {
+        return false;
+    }
+    add_rule(first, last);
+    return true;
+}
+
+void ip_filter::build()
+{
+    if(!pending_v4_ranges_.empty()) {
+        auto& ranges = pending_v4_ranges_;
+        ranges.reserve(ranges.size() + v4_firsts_.size());
+        for(auto i = 0; i < int(v4_firsts_.size()); ++i) {
+            ranges.emplace_back(v4_firsts_[i], v4_lasts_[i]);
+        }
+        std::sort(ranges.begin(), ranges.end());
+        merge_ranges(ranges, [](auto& r) -> auto& { return r.first; },
+                [](auto& r) -> auto& { return r.second; },
+                [](const uint32_t n, bool& overflow) {
+                    overflow = n == uint32_t(-1);
+                    return n + 1;
+                });
+        v4_firsts_.resize(ranges.size());
+        v4_lasts_.resize(ranges.size());
+        for(auto i = 0; i < int(ranges.size()); ++i) {
+            v4_firsts_[i] = ranges[i].first;
+            v4_lasts_[i] = ranges[i].second;
+        }
+        v4_firsts_.shrink_to_fit();
+        v4_lasts_.shrink_to_fit();
+        ranges.clear();
+        ranges.shrink_to_fit();
+        build_v4_index();
+    }
+
+    if(!pending_v6_ranges_.empty()) {
+        auto& ranges = pending_v6_ranges_;
+        ranges.insert(ranges.end(), v6_ranges_.begin(), v6_ranges_.end());
+        std::sort(ranges.begin(), ranges.end(),
+                [](const auto& a, const auto& b) { return a.first < b.first; });
+        merge_ranges(ranges, [](auto& r) -> auto& { return r.first; },
+                [](auto& r) -> auto& { return r.last; },
+                [](const uint128& n, bool& overflow) { return successor(n, overflow); });
+        v6_ranges_ = std::move(ranges);
+        v6_ranges_.shrink_to_fit();
+        pending_v6_ranges_.clear();
+    }
+}
+
+void ip_filter::build_v4_index()
+{
+    v4_index_.clear();
+    if(v4_firsts_.empty()) {
+        return;
+    }
+    v4_index_.resize(65537);
+    uint32_t n = 0;
+    for(uint64_t block = 0; block < 65536; ++block) {
+        while((n < v4_firsts_.size()) && (v4_firsts_[n] < (block << 16))) {
+            ++n;
+        }
+        v4_index_[block] = n;
+    }
+    v4_index_[65536] = v4_firsts_.size();
+}
+
+bool ip_filter::is_blocked(const address& ip) const noexcept
+{
+    if(ip.is_v4()) {
+        return is_blocked(ip.to_v4().to_uint());
+    }
+    const auto v6 = ip.to_v6();
+    if(v6.is_v4_mapped()) {
+        return is_blocked(asio::ip::make_address_v4(asio::ip::v4_mapped, v6).to_uint());
+    }
+    return is_blocked(to_uint128(v6));
+}
+
+bool ip_filter::is_blocked(const uint32_t ip) const noexcept
+{
+    assert(is_built());
+    if(v4_firsts_.empty()) {
+        return false;
+    }
+    // Only the last interval starting before the address's /16 block and those
+    // starting within it may contain the address.
+    const auto block = ip >> 16;
+    const auto lo = std::max(v4_index_[block], uint32_t(1)) - 1;
+    const auto hi = v4_index_[block + 1];
+    const auto begin = v4_firsts_.data();
+    const auto it = std::upper_bound(begin + lo, begin + hi, ip);
+    if(it == begin) {
+        return false;
+    }
+    return ip <= v4_lasts_[it - begin - 1];
+}
+
+inline bool ip_filter::is_blocked(const uint128& ip) const noexcept
+{
+    assert(is_built());
+    const auto it = std::upper_bound(v6_ranges_.begin(), v6_ranges_.end(), ip,
+            [](const uint128& ip, const v6_range& r) { return ip < r.first; });
+    if(it == v6_ranges_.begin()) {
+        return false;
+    }
+    return ip <= std::prev(it)->last;
+}
+
+// ---------------
+// endpoint_filter
+// ---------------
+
+bool endpoint_filter::is_allowed(const address& ip, const uint16_t port) const noexcept
+{
+    if(!blocked_ports_.empty()
+            && std::binary_search(blocked_ports_.begin(), blocked_ports_.end(), port)) {
+        return false;
+    }
+    if(!blocked_endpoints_.empty()
+            && std::binary_search(blocked_endpoints_.begin(), blocked_endpoints_.end(),
+                    tcp::endpoint(ip, port))) {
+        return false;
+    }
+    if(!ip_rules_.empty() && ip_rules_.is_blocked(ip)) {
+        return false;
+    }
+    return !blocklist_ || !blocklist_->is_blocked(ip);
+}
+
+void endpoint_filter::block_ip(const address& ip)
+{
+    block_ip_range(ip, ip);
+}
+
+void endpoint_filter::block_ip_range(const address& first, const address& last)
+{
+    ip_rules_.add_rule(first, last);
+    ip_rules_.build();
+}
+
+void endpoint_filter::block_port(const uint16_t port)
+{
+    auto it = std::lower_bound(blocked_ports_.begin(), blocked_ports_.end(), port);
+    if((it == blocked_ports_.end()) || (*it != port)) {
+        blocked_ports_.insert(it, port);
+    }
+}
+
+void endpoint_filter::block_endpoint(const tcp::endpoint& ep)
+{
+    auto it = std::lower_bound(blocked_endpoints_.begin(), blocked_endpoints_.end(), ep);
+    if((it == blocked_endpoints_.end()) || (*it != ep)) {
+        blocked_endpoints_.insert(it, ep);
+    }
+}
+
+void endpoint_filter::unblock_ip(const address& ip)
+{
+    unblock_ip_range(ip, ip);
+}
+
+void endpoint_filter::unblock_ip_range(const address& first, const address& last)
+{
+    ip_rules_.remove_rule(first, last);
+}
+
+void endpoint_filter::unblock_port(const uint16_t port)
+{
+    auto it = std::lower_bound(blocked_ports_.begin(), blocked_ports_.end(), port);
+    if((it != blocked_ports_.end()) && (*it == port)) {
+        blocked_ports_.erase(it);
+    }
+}
+
+void endpoint_filter::unblock_endpoint(const tcp::endpoint& ep)
+{
+    auto it = std::lower_bound(blocked_endpoints_.begin(), blocked_endpoints_.end(), ep);
+    if((it != blocked_endpoints_.end()) && (*it == ep)) {
+        blocked_endpoints_.erase(it);
+    }
+}
+
+void endpoint_filter::set_blocklist(std::shared_ptr<const ip_filter> blocklist)
+{
+    assert(!blocklist || blocklist->is_built());
+    blocklist_ = std::move(blocklist);
+}
+
+} // namespace tide
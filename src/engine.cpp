@@ -1,6 +1,7 @@
 #include "engine.hpp"
 #include "string_utils.hpp"
 #include "system.hpp"
+#include "trace.hpp"
 
 #include <algorithm>
 #include <cassert>
@@ -17,12 +18,30 @@
 namespace tide {
 
 engine::engine(settings s)
-    : disk_io_(network_ios_, settings_.disk_io)
+    : disk_io_(network_ios_, settings_.disk_io, counters_)
+    , utp_socket_manager_(network_ios_)
+    , udp_tracker_socket_(utp_socket_manager_)
+    , dht_node_(network_ios_, utp_socket_manager_, settings_)
     , work_(asio::make_work_guard(network_ios_))
     , acceptor_(network_ios_)
     , update_timer_(network_ios_)
 {
+    utp_socket_manager_.set_accept_filter([this](const udp::endpoint& ep) {
+        if(!settings_.enable_utp) {
+            return false;
+        }
+        if(endpoint_filter_.is_allowed(ep.address(), ep.port())) {
+            return true;
+        }
+        counters_.increment(counters::num_blocked_connections);
+        return false;
+    });
+    utp_socket_manager_.set_accept_handler([this](std::unique_ptr<utp_socket> socket) {
+        const auto endpoint = socket->remote_endpoint();
+        accept_peer_connection(endpoint, std::move(socket));
+    });
     network_thread_ = std::thread([this] {
+        trace::set_thread_name("network");
         update();
         network_ios_.run();
     });
@@ -162,8 +181,22 @@ void engine::verify(const settings& s) const
             s.max_active_seeds, 1, "settings::max_active_seeds must be none or above 0");
     throw_if_below(
             s.max_upload_slots, 1, "settings::max_upload_slots must be none or above 0");
+    throw_if_below(s.min_upload_slots_per_torrent, 0,
+            "settings::min_upload_slots_per_torrent must be none, 0 or more");
     throw_if_below(
             s.max_connections, 1, "settings::max_connections must be none or above 0");
+    throw_if_below_allow_unlimited(s.max_half_open_connections, 1,
+            "settings::max_half_open_connections must be unlimited, none or above 0");
+    throw_if_below_allow_unlimited(s.max_announces_in_flight_per_tracker, 1,
+            "settings::max_announces_in_flight_per_tracker must be unlimited, none or"
+            " above 0");
+    throw_if_below_allow_unlimited(s.max_announces_per_second_per_tracker, 1,
+            "settings::max_announces_per_second_per_tracker must be unlimited, none or"
+            " above 0");
+    throw_if_below(s.max_dht_queries_per_second, 1,
+            "settings::max_dht_queries_per_second must be none or above 0");
+    throw_if_below_allow_unlimited(s.max_buffer_memory, 0x100000,
+            "settings::max_buffer_memory must be unlimited, none or at least 1MiB");
     throw_if_below_allow_unlimited(s.max_download_rate, 1,
             "settings::max_download_rate must be unlimited, none or above 0");
     throw_if_below_allow_unlimited(s.max_upload_rate, 1,
@@ -200,6 +233,14 @@ void engine::verify(const torrent_settings& s) const
             "torrent_settings::max_download_rate must be unlimited, none or above 0");
     throw_if_below_allow_unlimited(s.max_upload_rate, 1,
             "torrent_settings::max_upload_rate must be unlimited, none or above 0");
+    throw_if_below_allow_unlimited(s.max_tcp_download_rate, 1,
+            "torrent_settings::max_tcp_download_rate must be unlimited, none or above 0");
+    throw_if_below_allow_unlimited(s.max_tcp_upload_rate, 1,
+            "torrent_settings::max_tcp_upload_rate must be unlimited, none or above 0");
+    throw_if_below_allow_unlimited(s.max_utp_download_rate, 1,
+            "torrent_settings::max_utp_download_rate must be unlimited, none or above 0");
+    throw_if_below_allow_unlimited(s.max_utp_upload_rate, 1,
+            "torrent_settings::max_utp_upload_rate must be unlimited, none or above 0");
 }
 
 void engine::verify(const peer_session_settings& s, const int write_cache_line_size) const
@@ -217,6 +258,11 @@ void engine::verify(const peer_session_settings& s, const int write_cache_line_s
             " peer_session_settings::min_outgoing_request_queue_size");
     throw_if_below(s.max_connection_attempts, 1,
             "peer_session_settings::max_connection_attempts must be above 0");
+    throw_if_below_allow_unlimited(s.max_download_rate, 1,
+            "peer_session_settings::max_download_rate must be unlimited, none or"
+            " above 0");
+    throw_if_below_allow_unlimited(s.max_upload_rate, 1,
+            "peer_session_settings::max_upload_rate must be unlimited, none or above 0");
     throw_if_below(s.max_receive_buffer_size, 0x4000 * std::max(1, write_cache_line_size),
             "peer_session_settings::max_connection_attempts must be above"
             " disk_io_settings::write_cache_line_size * 16KiB (0x4000 bytes)");
@@ -254,13 +300,21 @@ void engine::fill_in_defaults(settings& s)
     set_if_none(s.max_active_leeches, 4);
     set_if_none(s.max_active_seeds, 4);
     set_if_none(s.max_upload_slots, 4);
+    set_if_none(s.min_upload_slots_per_torrent, 1);
     set_if_none(s.max_connections, 200);
+    set_if_none(s.max_half_open_connections, 100);
+    set_if_none(s.max_announces_in_flight_per_tracker, 8);
+    set_if_none(s.max_announces_per_second_per_tracker, 20);
+    set_if_none(s.max_dht_queries_per_second, 50);
+    set_if_none(s.max_buffer_memory, 256 * 1024 * 1024);
 
     set_if_none(s.max_download_rate, unlimited);
     set_if_none(s.max_upload_rate, unlimited);
 
     set_if_none(s.share_ratio_limit, unlimited);
     set_if_none(s.share_time_ratio_limit, unlimited);
+
+    set_if_none(s.alert_mask, ~alert::stats);
 }
 
 /** Attempts to query the system for RAM info and if it fails it returns an estimate. */
@@ -363,14 +417,52 @@ void engine::apply_settings(settings s)
         }
         COPY_FIELD(discard_piece_picker_on_completion);
         COPY_FIELD(prefer_udp_trackers);
+        COPY_FIELD(enable_utp);
+        COPY_FIELD(enable_dht);
+        COPY_FIELD(dht_bootstrap_nodes);
+        COPY_FIELD(max_dht_queries_per_second);
+        // UDP trackers send through the same socket as uTP and the DHT, so it's
+        // opened even if neither of those is enabled.
+        if(!utp_socket_manager_.is_open()) {
+            error_code ec;
+            utp_socket_manager_.open(s.listener_port, ec);
+            if(ec) {
+                // Fall back to an OS chosen port. If that fails as well, uTP, the DHT
+                // and UDP trackers simply aren't used.
+                utp_socket_manager_.open(0, ec);
+            }
+        }
+        if(settings_.enable_dht && utp_socket_manager_.is_open()) {
+            dht_node_.start();
+        } else {
+            dht_node_.stop();
+        }
+        // The peer session settings above were applied with the previous value.
+        settings_.peer_session.extensions[extensions::dht] = settings_.enable_dht;
         COPY_FIELD(max_udp_tracker_timeout_retries);
+        COPY_FIELD(max_announce_jitter);
+        announce_scheduler_.set_max_jitter(s.max_announce_jitter);
+        COPY_FIELD(max_announces_in_flight_per_tracker);
+        announce_scheduler_.set_max_in_flight_per_tracker(
+                s.max_announces_in_flight_per_tracker);
+        COPY_FIELD(max_announces_per_second_per_tracker);
+        announce_scheduler_.set_max_announces_per_second_per_tracker(
+                s.max_announces_per_second_per_tracker);
         COPY_FIELD(slow_torrent_download_rate_threshold);
         COPY_FIELD(slow_torrent_upload_rate_threshold);
 
         apply_max_connections_setting(s.max_connections);
+        COPY_FIELD(max_half_open_connections);
+        connection_scheduler_.set_max_half_open_connections(s.max_half_open_connections);
         apply_max_active_leeches_setting(s.max_active_leeches);
         apply_max_active_seeds_setting(s.max_active_seeds);
         apply_max_upload_slots_setting(s.max_upload_slots);
+        COPY_FIELD(min_upload_slots_per_torrent);
+        upload_slot_allocator_.set_min_slots_per_torrent(s.min_upload_slots_per_torrent);
+
+        // Sessions adapt their buffers to the new budget as they're next adjusted.
+        COPY_FIELD(max_buffer_memory);
+        buffer_budget_.set_capacity(s.max_buffer_memory);
 
         // At this point these values should be verified.
         assert(s.max_download_rate > 0 || s.max_download_rate == values::none
@@ -392,6 +484,8 @@ void engine::apply_settings(settings s)
         COPY_FIELD(stats_aggregation_interval);
         if(settings_.stats_aggregation_interval == seconds(0))
             settings_.stats_aggregation_interval = seconds(1);
+        COPY_FIELD(alert_mask);
+        alert_queue_.set_category_mask(s.alert_mask);
 #undef COPY_FIELD
     });
 }
@@ -471,8 +565,8 @@ int engine::apply_max_active_torrents_setting(
 TIDE_NETWORK_THREAD
 void engine::apply_max_upload_slots_setting(const int max_upload_slots)
 {
-    // TODO how to distribute upload slots? prefer priority torrents (those at the front
-    // of leeches_), or distribute equally?
+    settings_.max_upload_slots = max_upload_slots;
+    upload_slot_allocator_.set_max_upload_slots(max_upload_slots);
 }
 
 void engine::apply_disk_io_settings(disk_io_settings s)
@@ -518,6 +612,8 @@ TIDE_NETWORK_THREAD
 inline void engine::apply_peer_session_settings_impl(peer_session_settings s)
 {
     settings_.peer_session = std::move(s);
+    // Whether we advertise the DHT extension depends on whether we run a DHT node.
+    settings_.peer_session.extensions[extensions::dht] = settings_.enable_dht;
     int receive_buffer_size_in_blocks
             = settings_.peer_session.max_receive_buffer_size / 0x4000;
     if(receive_buffer_size_in_blocks == 0) {
@@ -545,28 +641,130 @@ void engine::update(const error_code& error)
     if(error) {
         // TODO not much we can do about these sorts of errors, can we? log, continue
     }
+    TIDE_TRACE_SCOPE("engine", "update");
+
+    // Rate limiters refill their quota continuously, but sessions waiting for quota
+    // are only served here, so this must be done on every tick.
+    rate_limiter_.distribute_quota();
+    // Likewise, torrents waiting to connect to peers are served here, so that the
+    // slots freed up by concluded connection attempts are reused promptly.
+    connection_scheduler_.distribute_slots();
+    // And so are due tracker announces.
+    announce_scheduler_.dispatch();
+    remove_stopped_incoming_connections();
+    // The global unchoke round only runs every so often, which the allocator keeps
+    // track of.
+    upload_slot_allocator_.allot_slots();
 
     // Only run the main update procedure every second, while update is invoked every
     // tenth of a second.
     if(++info_.update_counter % 10) {
-        // Refill our bandwidth quota (even if it's unlimited, `rate_limiter_`
-        // handles this).
-        rate_limiter_.add_download_quota(settings_.max_download_rate);
-        rate_limiter_.add_upload_quota(settings_.max_upload_rate);
-
         relocate_new_seeds();
         update_leeches();
         update_seeds();
 
+        info_.num_half_open_connections
+                = connection_scheduler_.num_half_open_connections();
+        info_.num_successful_connects = connection_scheduler_.num_successful_connects();
+        info_.num_failed_connects = connection_scheduler_.num_failed_connects();
+        info_.avg_connect_latency = connection_scheduler_.avg_connect_latency();
+
         // TODO post engine_info stats if required.
     }
 
+    if(alert_queue_.should_post<counters_alert>()
+            && cached_clock::now() - last_counters_alert_time_
+                    >= settings_.stats_aggregation_interval) {
+        update_counters();
+        alert_queue_.emplace<counters_alert>(counters_.snapshot());
+        last_counters_alert_time_ = cached_clock::now();
+    }
+
     cached_clock::update();
     ts_cached_clock::set(cached_clock::now());
     start_timer(update_timer_, milliseconds(100),
             [this](const error_code& error) { update(error); });
 }
 
+TIDE_NETWORK_THREAD
+TIDE_NETWORK_THREAD
+void engine::accept_peer_connection(
+        tcp::endpoint endpoint, std::unique_ptr<stream_socket> socket)
+{
+    counters_.increment(counters::num_incoming_connections);
+    auto session = std::make_shared<peer_session>(network_ios_, endpoint, rate_limiter_,
+            buffer_budget_, settings_.peer_session, std::move(socket),
+            [this, endpoint](const sha1_hash& info_hash) {
+                return attach_incoming_connection(endpoint, info_hash);
+            });
+    incoming_connections_.emplace_back(session);
+    session->start();
+}
+
+TIDE_NETWORK_THREAD
+torrent_frontend engine::attach_incoming_connection(
+        const tcp::endpoint& endpoint, const sha1_hash& info_hash)
+{
+    auto it = std::find_if(incoming_connections_.begin(), incoming_connections_.end(),
+            [&endpoint](const auto& s) { return s->remote_endpoint() == endpoint; });
+    if(it == incoming_connections_.end()) {
+        return {};
+    }
+    // Whether or not a torrent takes over the session, it's no longer ours: a
+    // refused session is kept alive by its pending operations until it disconnects.
+    auto session = std::move(*it);
+    incoming_connections_.erase(it);
+    for(auto* torrents : {&leeches_, &seeds_}) {
+        for(auto& torrent : *torrents) {
+            if(torrent->info_hash() == info_hash) {
+                if(torrent->attach_peer_session(std::move(session))) {
+                    return torrent_frontend(*torrent);
+                }
+                return {};
+            }
+        }
+    }
+    return {};
+}
+
+TIDE_NETWORK_THREAD
+void engine::remove_stopped_incoming_connections()
+{
+    incoming_connections_.erase(std::remove_if(incoming_connections_.begin(),
+                                        incoming_connections_.end(),
+                                        [](const auto& s) { return s->is_stopped(); }),
+            incoming_connections_.end());
+}
+
+void engine::update_counters()
+{
+    counters_.set(counters::num_successful_connects,
+            connection_scheduler_.num_successful_connects());
+    counters_.set(counters::num_failed_connects,
+            connection_scheduler_.num_failed_connects());
+    counters_.set(counters::num_download_quota_waits,
+            rate_limiter_.num_download_quota_waits());
+    counters_.set(counters::num_upload_quota_waits,
+            rate_limiter_.num_upload_quota_waits());
+    counters_.set(counters::download_quota_wait_time,
+            to_int<nanoseconds>(rate_limiter_.total_download_quota_wait_time()));
+    counters_.set(counters::upload_quota_wait_time,
+            to_int<nanoseconds>(rate_limiter_.total_upload_quota_wait_time()));
+    counters_.set(counters::num_dropped_alerts, alert_queue_.num_dropped_alerts());
+    counters_.set(counters::num_dropped_log_entries, log::num_dropped_entries());
+
+    counters_.set(counters::num_connections, info_.num_connections);
+    counters_.set(counters::num_half_open_connections,
+            connection_scheduler_.num_half_open_connections());
+    counters_.set(counters::num_active_leeches, info_.num_active_leeches);
+    counters_.set(counters::num_active_seeds, info_.num_active_seeds);
+    counters_.set(counters::num_download_quota_waiters,
+            rate_limiter_.num_download_quota_waiters());
+    counters_.set(counters::num_upload_quota_waiters,
+            rate_limiter_.num_upload_quota_waiters());
+    disk_io_.update_counters();
+}
+
 TIDE_NETWORK_THREAD
 void engine::relocate_new_seeds()
 {
@@ -690,9 +888,27 @@ void engine::resume()
     asio::post(network_ios_, [this] { for_each_torrent([](torrent& t) { t.start(); }); });
 }
 
-std::deque<std::unique_ptr<alert>> engine::alerts()
+void engine::set_ip_blocklist(ip_filter blocklist)
 {
-    return alert_queue_.extract_alerts();
+    blocklist.build();
+    std::shared_ptr<const ip_filter> b;
+    if(!blocklist.empty()) {
+        b = std::make_shared<const ip_filter>(std::move(blocklist));
+    }
+    asio::post(network_ios_, [this, b = std::move(b)]() mutable {
+        endpoint_filter_.set_blocklist(std::move(b));
+        for_each_torrent([](torrent& t) { t.apply_endpoint_filter(); });
+    });
+}
+
+void engine::pop_alerts(std::vector<alert*>& alerts)
+{
+    alert_queue_.pop_alerts(alerts);
+}
+
+void engine::set_alert_notify_handler(std::function<void()> handler)
+{
+    alert_queue_.set_notify_handler(std::move(handler));
 }
 
 void engine::parse_metainfo(const path& path)
@@ -716,8 +932,10 @@ void engine::add_torrent(torrent_args args)
         const torrent_id_t torrent_id = next_torrent_id();
         // `torrent` calls `disk_io::allocate_torrent` so we don't have to here.
         auto torrent = std::make_shared<tide::torrent>(torrent_id, network_ios_, disk_io_,
-                rate_limiter_, settings_, info_, get_trackers(args.metainfo),
-                endpoint_filter_, alert_queue_, std::move(args));
+                rate_limiter_, buffer_budget_, utp_socket_manager_, connection_scheduler_,
+                upload_slot_allocator_, announce_scheduler_, dht_node_, settings_, info_,
+                counters_, get_trackers(args.metainfo), endpoint_filter_, alert_queue_,
+                std::move(args));
         if(settings_.enqueue_new_torrents_at_top) {
             leeches_.insert(leeches_.begin(), torrent);
             if(!start_in_paused) {
@@ -806,7 +1024,7 @@ std::vector<tracker_entry> engine::get_trackers(const metainfo& metainfo)
             // At this point tracker urls must be valid.
             if(util::is_udp_tracker(tracker.url)) {
                 entry.tracker = std::make_shared<udp_tracker>(
-                        network_ios_, tracker.url, settings_);
+                        udp_tracker_socket_, tracker.url, settings_);
                 trackers.emplace_back(std::move(entry));
             } else if(util::is_http_tracker(tracker.url)) {
                 entry.tracker = std::make_shared<http_tracker>(
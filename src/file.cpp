@@ -136,8 +136,8 @@ void file::open(error_code& error)
 void file::open(open_mode_flags open_mode, error_code& error)
 {
 #ifdef TIDE_ENABLE_DEBUGGING
-    log::log_disk_io("{FILE}", util::format("opening file %s", absolute_path().c_str()),
-            true, log::priority::high);
+    log::log_disk_io("{FILE}", log::priority::high, "opening file %s",
+            absolute_path().c_str());
 #endif // TIDE_ENABLE_DEBUGGING
     error.clear();
     if(is_open()) {
@@ -215,9 +215,8 @@ void file::allocate(error_code& error)
 void file::allocate(const size_type length, error_code& error)
 {
 #ifdef TIDE_ENABLE_DEBUGGING
-    log::log_disk_io("{FILE}",
-            util::format("allocating file %s", absolute_path().c_str()), true,
-            log::priority::high);
+    log::log_disk_io("{FILE}", log::priority::high, "allocating file %s",
+            absolute_path().c_str());
 #endif // TIDE_ENABLE_DEBUGGING
     error.clear();
     verify_handle(error);
@@ -542,18 +541,15 @@ file::size_type file::positional_vector_io(
     // the requested bytes so we have to call it again until all requested bytes are
     // transferred
 #ifdef TIDE_ENABLE_DEBUGGING
-    log::log_disk_io("{FILE}",
-            util::format("buffers.size() = %i, file_length_left = %lli", buffers.size(),
-                    file_length_left),
-            false, log::priority::high);
+    log::log_disk_io("{FILE}", log::priority::high,
+            "buffers.size() = %i, file_length_left = %lli", buffers.size(),
+            file_length_left);
 #endif // TIDE_ENABLE_DEBUGGING
     int loop_counter = 0;
     while(!buffers.empty() && (file_length_left > 0)) {
 #ifdef TIDE_ENABLE_DEBUGGING
-        log::log_disk_io("{FILE}",
-                util::format("%ith loop in trying to transfer data from/to file",
-                        loop_counter),
-                false, log::priority::high);
+        log::log_disk_io("{FILE}", log::priority::high,
+                "%ith loop in trying to transfer data from/to file", loop_counter);
 #endif // TIDE_ENABLE_DEBUGGING
         const size_type num_transferred = fn(buffers, file_offset);
         if(num_transferred < 0) {
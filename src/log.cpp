@@ -1,7 +1,18 @@
 #include "log.hpp"
+#include "address.hpp"
 
-#include <cassert>
-#include <sstream>
+#include <algorithm> // remove_if, min
+#include <chrono>
+#include <condition_variable>
+#include <cstdio> // snprintf
+#include <cstring> // memcpy, strchr
+#include <ctime> // localtime_r, strftime
+#include <fstream>
+#include <map>
+#include <memory> // unique_ptr, shared_ptr
+#include <mutex>
+#include <thread>
+#include <vector>
 #ifdef TIDE_ENABLE_STREAM_DEBUGGING
 #include <iostream>
 #endif // TIDE_ENABLE_STREAM_DEBUGGING
@@ -10,82 +21,109 @@ namespace tide {
 namespace log {
 namespace detail {
 
-#define TIDE_FLUSH(f)   \
-    do                  \
-        if(f.is_open()) \
-            f.flush();  \
-    while(0)
+#ifndef TIDE_MIN_LOG_PRIORITY
+#define TIDE_MIN_LOG_PRIORITY priority::low
+#endif
 
-class engine_logger
-{
-    std::ofstream file_;
+std::atomic<int> min_priorities[num_subsystems] = {{int(TIDE_MIN_LOG_PRIORITY)},
+        {int(TIDE_MIN_LOG_PRIORITY)}, {int(TIDE_MIN_LOG_PRIORITY)},
+        {int(TIDE_MIN_LOG_PRIORITY)}};
 
-public:
-    void log(const std::string& header, const std::string& log,
-            const priority priority = priority::normal);
-    void flush() { TIDE_FLUSH(file_); }
-};
+std::atomic<int> num_dropped_entries{0};
 
-/** disk_io runs on muliple threads so this logger is thread-safe. */
-class disk_io_logger
-{
-    std::ofstream file_;
-    std::mutex file_mutex_;
+// Each thread's ring is this large.
+constexpr int ring_size = 1024 * 1024;
 
-public:
-    void log(const std::string& header, const std::string& log, const bool concurrent,
-            const priority priority);
-    void flush() { TIDE_FLUSH(file_); }
-};
+// The background thread drains the rings at least this often.
+constexpr auto drain_interval = std::chrono::milliseconds(10);
 
-class torrent_logger
+/**
+ * A single-producer single-consumer ring of variable sized entries. An entry never
+ * wraps around the end of the buffer: if it doesn't fit, the rest of the buffer is
+ * skipped, which is marked by setting `padding_flag` in the first 4 bytes (where an
+ * entry's size would be).
+ */
+class ring
 {
-    std::map<torrent_id_t, std::ofstream> files_;
+    static constexpr uint32_t padding_flag = 1u << 31;
+
+    std::unique_ptr<uint8_t[]> buffer_;
+    // Only ever increased, positions in the buffer are these modulo `ring_size`.
+    alignas(64) std::atomic<uint64_t> head_{0};
+    alignas(64) std::atomic<uint64_t> tail_{0};
 
 public:
-    void log(const torrent_id_t torrent, const std::string& header,
-            const std::string& log, const priority priority);
-    void flush()
+    // Set when the producer thread exits, after which the ring is removed once
+    // it's drained.
+    std::atomic<bool> is_orphaned{false};
+
+    ring() : buffer_(new uint8_t[ring_size]) {}
+
+    uint8_t* begin_entry(const int size) noexcept
     {
-        for(auto& e : files_) {
-            TIDE_FLUSH(e.second);
+        if(size > ring_size / 4) {
+            return nullptr;
+        }
+        const uint64_t tail = tail_.load(std::memory_order_relaxed);
+        const uint64_t head = head_.load(std::memory_order_acquire);
+        const int offset = tail % ring_size;
+        const int num_contiguous = ring_size - offset;
+        const int num_needed = size <= num_contiguous ? size : num_contiguous + size;
+        if(ring_size - int(tail - head) < num_needed) {
+            return nullptr;
+        }
+        if(size > num_contiguous) {
+            const uint32_t padding = num_contiguous | padding_flag;
+            std::memcpy(&buffer_[offset], &padding, 4);
+            tail_.store(tail + num_contiguous, std::memory_order_release);
+            return &buffer_[0];
         }
+        return &buffer_[offset];
     }
-};
-
-class peer_session_logger
-{
-#ifdef TIDE_LOG_PEERS_SEPARATELY
-    std::map<tcp::endpoint, std::ofstream> files_;
-#endif
-    std::ofstream incoming_connections_;
 
-public:
-    void log(const torrent_id_t torrent, const tcp::endpoint& endpoint,
-            const std::string& header, const std::string& log, const priority priority);
-    void flush()
+    void commit_entry(const int size) noexcept
     {
-#ifdef TIDE_LOG_PEERS_SEPARATELY
-        for(auto& e : files_) {
-            TIDE_FLUSH(e.second);
-        }
-#endif // TIDE_LOG_PEERS_SEPARATELY
-        TIDE_FLUSH(incoming_connections_);
+        tail_.store(tail_.load(std::memory_order_relaxed) + size,
+                std::memory_order_release);
     }
-};
 
-// global logger instances
+    /** Returns whether more than half of the ring is in use. Only for the producer. */
+    bool is_filling_up() const noexcept
+    {
+        return tail_.load(std::memory_order_relaxed)
+                - head_.load(std::memory_order_relaxed)
+                > ring_size / 2;
+    }
 
-engine_logger engine_logger;
-disk_io_logger disk_io_logger;
-peer_session_logger peer_session_logger;
-torrent_logger torrent_logger;
+    /** Returns the oldest entry, or null if the ring is empty. */
+    const entry_header* front() noexcept
+    {
+        while(true) {
+            const uint64_t head = head_.load(std::memory_order_relaxed);
+            if(head == tail_.load(std::memory_order_acquire)) {
+                return nullptr;
+            }
+            uint32_t size;
+            std::memcpy(&size, &buffer_[head % ring_size], 4);
+            if(!(size & padding_flag)) {
+                return reinterpret_cast<const entry_header*>(&buffer_[head % ring_size]);
+            }
+            head_.store(head + (size & ~padding_flag), std::memory_order_release);
+        }
+    }
 
-#ifndef TIDE_MIN_LOG_PRIORITY
-#define TIDE_MIN_LOG_PRIORITY priority::low
-#endif
+    void pop() noexcept
+    {
+        const uint64_t head = head_.load(std::memory_order_relaxed);
+        uint32_t size;
+        std::memcpy(&size, &buffer_[head % ring_size], 4);
+        head_.store(head + size, std::memory_order_release);
+    }
+};
 
-constexpr auto g_open_mode = std::ios::app | std::ios::out;
+// Every thread's entry must be 8 byte aligned, and thus so must the padding.
+static_assert(sizeof(entry_header) % 8 == 0, "entry_header must be 8 byte aligned");
+static_assert(ring_size % 8 == 0, "ring size must be 8 byte aligned");
 
 template <typename String>
 std::string make_log_path(const String& name)
@@ -97,151 +135,451 @@ std::string make_log_path(const String& name)
 #endif
 }
 
-#ifdef TIDE_ENABLE_LOGGING
-# define TIDE_PRIORITY_CHAR(p) \
-    char(p == priority::low ? 'l' : p == priority::normal ? 'n' : 'h')
-# define TIDE_LOG(priority, stream, header, log) \
-    stream << '[' << TIDE_PRIORITY_CHAR(priority) << '|' << header << "] " << log << std::endl;
-# ifdef TIDE_ENABLE_STREAM_DEBUGGING
-#  define TIDE_STREAM std::clog
-#  define TIDE_CLOG(priority, file, header, log)        \
-    do {                                              \
-        assert(file.is_open());                       \
-        TIDE_LOG(priority, file, header, log);        \
-        TIDE_LOG(priority, TIDE_STREAM, header, log); \
-    } while(0)
-# else // TIDE_ENABLE_STREAM_DEBUGGING
-#  define TIDE_CLOG(p, f, h, l) TIDE_LOG(p, f, h, l)
-# endif // TIDE_ENABLE_STREAM_DEBUGGING
-#endif // TIDE_ENABLE_LOGGING
+constexpr auto g_open_mode = std::ios::app | std::ios::out;
 
-// FIXME does not work
-void engine_logger::log(
-        const std::string& header, const std::string& log, const priority priority)
+inline char priority_char(const int p) noexcept
 {
-#ifdef TIDE_ENABLE_LOGGING
-    if(priority < TIDE_MIN_LOG_PRIORITY) {
-        return;
-    }
-    if(!file_.is_open()) {
-        file_.open(make_log_path("engine"), g_open_mode);
+    return p == int(priority::low) ? 'l' : p == int(priority::normal) ? 'n' : 'h';
+}
+
+inline const char* format_string_arg(const uint8_t*& in, std::string& storage)
+{
+    uint16_t length;
+    std::memcpy(&length, in, 2);
+    storage.assign(reinterpret_cast<const char*>(in + 2), length);
+    in += 2 + length;
+    return storage.c_str();
+}
+
+/**
+ * Formats the entry's message by substituting its arguments in its format string one
+ * at a time. Length modifiers in the format string are replaced with those matching
+ * the recorded argument types (e.g. all integers are recorded as 64 bit integers), so
+ * that arguments are formatted the same as they would be by a direct printf.
+ */
+inline void format_message(const entry_header& entry, const uint8_t* args,
+        int num_args, std::string& out)
+{
+    const char* f = entry.format;
+    std::string spec;
+    std::string string_arg_storage;
+    char buffer[128];
+    while(*f) {
+        if(*f != '%') {
+            out += *f++;
+            continue;
+        }
+        if(f[1] == '%') {
+            out += '%';
+            f += 2;
+            continue;
+        }
+
+        // Copy the flags, width, and precision, and skip the length modifiers.
+        spec.assign(1, '%');
+        ++f;
+        while(*f && std::strchr("-+ #0123456789.", *f)) {
+            spec += *f++;
+        }
+        while(*f && std::strchr("hljztL", *f)) {
+            ++f;
+        }
+        const char conversion = *f ? *f++ : 'd';
+
+        if(num_args == 0) {
+            out += "(missing)";
+            continue;
+        }
+        --num_args;
+        const uint8_t type = *args++;
+        int64_t i = 0;
+        uint64_t u = 0;
+        double d = 0;
+        const char* s = nullptr;
+        switch(type) {
+        case int_arg: std::memcpy(&i, args, 8); u = i; d = i; args += 8; break;
+        case uint_arg: std::memcpy(&u, args, 8); i = u; d = u; args += 8; break;
+        case float_arg: std::memcpy(&d, args, 8); i = d; u = d; args += 8; break;
+        case pointer_arg: std::memcpy(&u, args, 8); i = u; args += 8; break;
+        case string_arg: s = format_string_arg(args, string_arg_storage); break;
+        }
+
+        int length = 0;
+        if(conversion == 's') {
+            if(s) {
+                // Strings may be longer than the buffer.
+                out += s;
+                continue;
+            }
+            length = std::snprintf(buffer, sizeof buffer, "%lli", (long long)i);
+        } else if(s) {
+            out += s;
+            continue;
+        } else if(std::strchr("di", conversion)) {
+            spec += "ll";
+            spec += conversion;
+            length = std::snprintf(buffer, sizeof buffer, spec.c_str(), (long long)i);
+        } else if(std::strchr("ouxX", conversion)) {
+            spec += "ll";
+            spec += conversion;
+            length = std::snprintf(
+                    buffer, sizeof buffer, spec.c_str(), (unsigned long long)u);
+        } else if(std::strchr("eEfFgGaA", conversion)) {
+            spec += conversion;
+            length = std::snprintf(buffer, sizeof buffer, spec.c_str(), d);
+        } else if(conversion == 'c') {
+            spec += 'c';
+            length = std::snprintf(buffer, sizeof buffer, spec.c_str(), int(i));
+        } else {
+            length = std::snprintf(
+                    buffer, sizeof buffer, "%p", reinterpret_cast<void*>(uintptr_t(u)));
+        }
+        out.append(buffer, std::min(length, int(sizeof buffer) - 1));
     }
-    TIDE_CLOG(priority, file_, header, log);
-#endif // TIDE_ENABLE_LOGGING
 }
 
-void disk_io_logger::log(const std::string& header, const std::string& log,
-        const bool concurrent, const priority priority)
+/**
+ * Owns the rings of all threads and the background thread that drains them and
+ * writes the entries to the log files, which are laid out as before: one file for
+ * the engine (which includes trackers and the DHT), one for disk IO, one for each
+ * torrent (which includes its peers), one for incoming connections, and if
+ * `TIDE_LOG_PEERS_SEPARATELY` is defined, one for each peer.
+ */
+class logger
 {
-#ifdef TIDE_ENABLE_LOGGING
-    if(priority < TIDE_MIN_LOG_PRIORITY) {
-        return;
+    std::vector<std::shared_ptr<ring>> rings_;
+    std::mutex rings_mutex_;
+
+    // Only one thread may drain the rings at a time (the background thread, or a
+    // thread calling `flush`).
+    std::mutex drain_mutex_;
+
+    std::ofstream engine_file_;
+    std::ofstream disk_io_file_;
+    std::ofstream incoming_connections_file_;
+    std::map<torrent_id_t, std::ofstream> torrent_files_;
+#ifdef TIDE_LOG_PEERS_SEPARATELY
+    std::map<tcp::endpoint, std::ofstream> peer_files_;
+#endif // TIDE_LOG_PEERS_SEPARATELY
+
+    // Used to convert the steady clock timestamps of entries to wall clock time.
+    const std::chrono::system_clock::time_point system_epoch_;
+    const int64_t steady_epoch_;
+
+    std::thread thread_;
+    std::mutex thread_mutex_;
+    std::condition_variable cv_;
+    bool is_stopped_ = false;
+
+    // Set by the first producer whose ring fills up between two drains, so that
+    // only that one wakes up the background thread.
+    std::atomic<bool> is_drain_requested_{false};
+
+    // Reused across entries to avoid allocations.
+    std::string line_;
+
+public:
+    logger()
+        : system_epoch_(std::chrono::system_clock::now()), steady_epoch_(now_ns())
+    {}
+
+    ~logger()
+    {
+        if(thread_.joinable()) {
+            {
+                std::lock_guard<std::mutex> l(thread_mutex_);
+                is_stopped_ = true;
+            }
+            cv_.notify_one();
+            thread_.join();
+        }
+        flush();
     }
-    // if this is invoked from the network thread, we can write to stdout as well,
-    // otherwise we can't use stream debugging/clog with disk_io when concurrent logging
-    // is requested, as we'd need to mutually exclude clog each time some entity wanted
-    // to do some logging, which is too expensive
-#ifdef TIDE_ENABLE_STREAM_DEBUGGING
-    if(!concurrent) {
-        TIDE_LOG(priority, TIDE_STREAM, header, log);
+
+    std::shared_ptr<ring> add_ring()
+    {
+        auto r = std::make_shared<ring>();
+        std::lock_guard<std::mutex> l(rings_mutex_);
+        rings_.push_back(r);
+        if(!thread_.joinable()) {
+            thread_ = std::thread([this] { run(); });
+        }
+        return r;
     }
-#endif // TIDE_ENABLE_STREAM_DEBUGGING
-    std::lock_guard<std::mutex> l(file_mutex_);
-    if(!file_.is_open()) {
-        file_.open(make_log_path("diskIO"), g_open_mode);
+
+    void flush()
+    {
+        std::lock_guard<std::mutex> l(drain_mutex_);
+        drain();
+        engine_file_.flush();
+        disk_io_file_.flush();
+        incoming_connections_file_.flush();
+        for(auto& f : torrent_files_) {
+            f.second.flush();
+        }
+#ifdef TIDE_LOG_PEERS_SEPARATELY
+        for(auto& f : peer_files_) {
+            f.second.flush();
+        }
+#endif // TIDE_LOG_PEERS_SEPARATELY
     }
-    TIDE_LOG(priority, file_, header, log);
-#endif // TIDE_ENABLE_LOGGING
-}
 
-void torrent_logger::log(const torrent_id_t torrent, const std::string& header,
-        const std::string& log, const priority priority)
-{
-#ifdef TIDE_ENABLE_LOGGING
-    if(priority < TIDE_MIN_LOG_PRIORITY) {
-        return;
+    /**
+     * Wakes up the background thread before its next scheduled drain. Called by
+     * producers whose rings are filling up, so that bursts of entries are less
+     * likely to be dropped.
+     */
+    void request_drain() noexcept
+    {
+        if(!is_drain_requested_.load(std::memory_order_relaxed)
+                && !is_drain_requested_.exchange(true, std::memory_order_relaxed)) {
+            cv_.notify_one();
+        }
+    }
+
+private:
+    void run()
+    {
+        std::unique_lock<std::mutex> l(thread_mutex_);
+        while(!is_stopped_) {
+            cv_.wait_for(l, drain_interval);
+            is_drain_requested_.store(false, std::memory_order_relaxed);
+            l.unlock();
+            {
+                std::lock_guard<std::mutex> dl(drain_mutex_);
+                drain();
+            }
+            l.lock();
+        }
+    }
+
+    /**
+     * Writes all entries recorded so far, merging the entries of the rings in the
+     * order of their timestamps.
+     */
+    void drain()
+    {
+        std::vector<std::shared_ptr<ring>> rings;
+        {
+            std::lock_guard<std::mutex> l(rings_mutex_);
+            // Orphaned rings won't receive new entries, so they can be removed once
+            // they've been drained.
+            rings_.erase(std::remove_if(rings_.begin(), rings_.end(),
+                                 [](const auto& r) {
+                                     return r->is_orphaned.load() && !r->front();
+                                 }),
+                    rings_.end());
+            rings = rings_;
+        }
+        while(true) {
+            ring* oldest = nullptr;
+            const entry_header* oldest_entry = nullptr;
+            for(auto& r : rings) {
+                const auto* entry = r->front();
+                if(entry
+                        && (!oldest_entry
+                                   || (entry->timestamp < oldest_entry->timestamp))) {
+                    oldest = r.get();
+                    oldest_entry = entry;
+                }
+            }
+            if(oldest == nullptr) {
+                break;
+            }
+            write(*oldest_entry);
+            oldest->pop();
+        }
     }
-    auto it = files_.find(torrent);
-    if(it == files_.end()) {
-        const auto path = make_log_path("torrent#" + std::to_string(torrent));
-        it = files_.emplace(torrent, std::ofstream(path.c_str(), g_open_mode)).first;
+
+    void write(const entry_header& entry)
+    {
+        const auto* args = reinterpret_cast<const uint8_t*>(&entry + 1);
+        int num_args = entry.num_args;
+
+        // The header: priority, wall clock time, [peer endpoint,] [tag,] event.
+        line_.clear();
+        line_ += '[';
+        line_ += priority_char(entry.priority);
+        line_ += '|';
+        append_time(entry.timestamp);
+        line_ += '|';
+
+        tcp::endpoint endpoint;
+        std::string ep_str;
+        if(entry.has_endpoint) {
+            address_v6::bytes_type bytes;
+            std::memcpy(bytes.data(), entry.address, 16);
+            const address_v6 v6(bytes);
+            const address ip = v6.is_v4_mapped()
+                    ? address(asio::ip::make_address_v4(asio::ip::v4_mapped, v6))
+                    : address(v6);
+            endpoint = tcp::endpoint(ip, entry.port);
+            ep_str = ip.to_string() + ':' + std::to_string(entry.port);
+            line_ += ep_str;
+            line_ += '|';
+            if(entry.connection_age >= 0) {
+                line_ += '+';
+                line_ += std::to_string(entry.connection_age);
+                line_ += "s|";
+            }
+        }
+        if(entry.has_tag) {
+            std::string tag;
+            ++args;
+            line_ += format_string_arg(args, tag);
+            line_ += '|';
+            --num_args;
+        }
+        const auto header_length = line_.size();
+        if(entry.event) {
+            line_ += entry.event;
+        }
+        line_ += "] ";
+        format_message(entry, args, num_args, line_);
+        line_ += '\n';
+
+        switch(subsystem(entry.subsystem)) {
+        case subsystem::engine: write(open(engine_file_, "engine")); break;
+        case subsystem::disk_io: write(open(disk_io_file_, "diskIO")); break;
+        case subsystem::torrent: write_torrent(entry.torrent, header_length); break;
+        case subsystem::peer_session:
+#ifdef TIDE_LOG_PEERS_SEPARATELY
+        {
+            auto it = peer_files_.find(endpoint);
+            if(it == peer_files_.end()) {
+                const auto path = make_log_path("peer(" + ep_str + ")");
+                it = peer_files_.emplace(endpoint, std::ofstream(path, g_open_mode))
+                             .first;
+            }
+            write(it->second);
+        }
+#endif // TIDE_LOG_PEERS_SEPARATELY
+            if(entry.torrent == -1) {
+                // An incoming and as yet unattached peer, so this can't go in any
+                // specific torrent's log file.
+                write(open(incoming_connections_file_, "incoming_peers"));
+            } else {
+                write_torrent(entry.torrent, header_length);
+            }
+            break;
+        }
     }
-    TIDE_CLOG(priority, it->second, header, log);
+
+    std::ofstream& open(std::ofstream& file, const char* name)
+    {
+        if(!file.is_open()) {
+            file.open(make_log_path(name), g_open_mode);
+        }
+        return file;
+    }
+
+    void write(std::ofstream& file)
+    {
+        file << line_;
+#ifdef TIDE_ENABLE_STREAM_DEBUGGING
+        std::clog << line_;
+#endif // TIDE_ENABLE_STREAM_DEBUGGING
+    }
+
+    void write_torrent(const torrent_id_t torrent, const int header_length)
+    {
+        auto it = torrent_files_.find(torrent);
+        if(it == torrent_files_.end()) {
+            const auto path = make_log_path("torrent#" + std::to_string(torrent));
+            it = torrent_files_.emplace(torrent, std::ofstream(path, g_open_mode)).first;
+        }
+        write(it->second);
 #ifdef TIDE_MERGE_TORRENT_LOGS
-    const std::string new_header = "(torrent#" + std::to_string(torrent) + ')' + header;
-    engine_logger.log(new_header, log, priority);
+        line_.insert(header_length, "(torrent#" + std::to_string(torrent) + ')');
+        write(open(engine_file_, "engine"));
 #endif // TIDE_MERGE_TORRENT_LOGS
-#endif // TIDE_ENABLE_LOGGING
+    }
+
+    void append_time(const int64_t timestamp)
+    {
+        using namespace std::chrono;
+        const auto t = system_epoch_ + duration_cast<system_clock::duration>(
+                nanoseconds(timestamp - steady_epoch_));
+        const std::time_t secs = system_clock::to_time_t(t);
+        std::tm tm;
+        localtime_r(&secs, &tm);
+        char buffer[32];
+        const int n = std::strftime(buffer, sizeof buffer, "%H:%M:%S", &tm);
+        const int micros
+                = duration_cast<microseconds>(t.time_since_epoch()).count() % 1000000;
+        std::snprintf(buffer + n, sizeof buffer - n, ".%06i", micros);
+        line_ += buffer;
+    }
+};
+
+logger& get_logger()
+{
+    static logger instance;
+    return instance;
 }
 
-void peer_session_logger::log(const torrent_id_t torrent, const tcp::endpoint& endpoint,
-        const std::string& header, const std::string& log, const priority priority)
+/** Registers the calling thread's ring, and marks it orphaned when the thread exits. */
+struct ring_handle
 {
-#ifdef TIDE_ENABLE_LOGGING
-    if(priority < TIDE_MIN_LOG_PRIORITY) {
-        return;
-    }
+    std::shared_ptr<ring> r;
+    ring_handle() : r(get_logger().add_ring()) {}
+    ~ring_handle() { r->is_orphaned.store(true); }
+};
 
-    const std::string ep_str = [&endpoint] {
-        std::stringstream ss;
-        ss << endpoint.address().to_string() << ':' << endpoint.port();
-        return ss.str();
-    }();
-    const auto new_header = ep_str + '|' + header;
+inline ring& local_ring()
+{
+    thread_local ring_handle handle;
+    return *handle.r;
+}
 
-#ifdef TIDE_LOG_PEERS_SEPARATELY
-    auto it = files_.find(endpoint);
-    if(it == files_.end()) {
-        const auto path = make_log_path("peer(" + ep_str + ")");
-        it = files_.emplace(endpoint, std::ofstream(path.c_str(), g_open_mode)).first;
+uint8_t* begin_entry(const int size)
+{
+    ring& r = local_ring();
+    uint8_t* out = r.begin_entry(size);
+    if(out == nullptr) {
+        num_dropped_entries.fetch_add(1, std::memory_order_relaxed);
     }
-    TIDE_LOG(priority, it->second, new_header, log);
-#endif // TIDE_LOG_PEERS_SEPARATELY
-
-    if(torrent == -1) {
-        // An incoming and as yet unattached peer requested logging, so can't put this
-        // in any specific torrent log file, so put it in the incomming connections file.
-        if(!incoming_connections_.is_open())
-            incoming_connections_.open(make_log_path("incoming_peers"), g_open_mode);
-        TIDE_CLOG(priority, incoming_connections_, new_header, log);
-    } else {
-        torrent_logger.log(torrent, new_header, log, priority);
+    if(r.is_filling_up()) {
+        get_logger().request_drain();
     }
-#endif // TIDE_ENABLE_LOGGING
+    return out;
 }
 
-} // detail
+void commit_entry(const int size) noexcept
+{
+    local_ring().commit_entry(size);
+}
 
-void log_torrent(const torrent_id_t torrent, const std::string& header,
-        const std::string& log, const priority priority)
+int64_t now_ns() noexcept
 {
-    detail::torrent_logger.log(torrent, header, log, priority);
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch())
+            .count();
 }
 
-void log_peer_session(const torrent_id_t torrent, const tcp::endpoint& endpoint,
-        const std::string& header, const std::string& log, const priority priority)
+} // detail
+
+void set_min_priority(const subsystem s, const priority p) noexcept
 {
-    detail::peer_session_logger.log(torrent, endpoint, header, log, priority);
+    detail::min_priorities[int(s)].store(int(p), std::memory_order_relaxed);
 }
 
-void log_engine(
-        const std::string& header, const std::string& log, const priority priority)
+void disable(const subsystem s) noexcept
 {
-    detail::engine_logger.log(header, log, priority);
+    detail::min_priorities[int(s)].store(
+            int(priority::high) + 1, std::memory_order_relaxed);
 }
 
-void log_disk_io(const std::string& header, const std::string& log, const bool concurrent,
-        const priority priority)
+int num_dropped_entries() noexcept
 {
-    detail::disk_io_logger.log(header, log, concurrent, priority);
+    return detail::num_dropped_entries.load(std::memory_order_relaxed);
 }
 
 void flush()
 {
-    detail::torrent_logger.flush();
-    detail::peer_session_logger.flush();
-    detail::engine_logger.flush();
-    detail::disk_io_logger.flush();
+#ifdef TIDE_ENABLE_LOGGING
+    detail::get_logger().flush();
+#endif // TIDE_ENABLE_LOGGING
 }
 
 } // log
@@ -31,6 +31,8 @@ void message_parser::shrink_to_fit(const int n)
     }
     // Make sure not to delete unparsed messages.
     buffer_.resize(std::max(n, size()));
+    // Resizing alone would keep the memory around, so give it back to the system.
+    buffer_.shrink_to_fit();
 }
 
 view<uint8_t> message_parser::get_receive_buffer(const int n)
@@ -1,5 +1,10 @@
 #include "peer_session.hpp"
 #include "address.hpp"
+#include "bdecode.hpp"
+#include "bencode.hpp"
+#include "buffer_budget.hpp"
+#include "counters.hpp"
+#include "dht.hpp"
 #include "disk_io_error.hpp"
 #include "endian.hpp"
 #include "num_utils.hpp"
@@ -11,11 +16,13 @@
 #include "sha1_hasher.hpp"
 #include "string_utils.hpp"
 #include "torrent_info.hpp"
+#include "trace.hpp"
 #include "view.hpp"
 
 #include <algorithm>
 #include <cassert>
 #include <cmath> // min, max
+#include <iterator> // back_inserter
 #include <stdexcept>
 #include <string>
 #ifdef TIDE_ENABLE_LOGGING
@@ -35,6 +42,38 @@ using namespace std::placeholders;
 template <typename Bytes>
 block_info parse_block_info(const Bytes& data);
 
+// The extended message ids (BEP 10) we assign to the extensions we support. Peer
+// uses these when sending us extended messages, while we use the ones peer assigned
+// in its extended handshake.
+constexpr int extended_handshake_id = 0;
+constexpr int ut_pex_id = 1;
+
+// The most peers that may be added and dropped in a single PEX message (BEP 11).
+constexpr int max_pex_peers = 50;
+
+// Peers in PEX messages are represented by their IPv4 address and port.
+constexpr int compact_endpoint_size = 6;
+
+// The flag set in a PEX message's `added.f` for each added peer that supports uTP.
+constexpr uint8_t pex_supports_utp_flag = 0x04;
+
+// A peer from whom a whole piece would be downloaded in at most this many seconds at
+// its current download rate is fast, and one from whom it would take longer than
+// `slow_peer_piece_seconds` is slow. Peers we haven't downloaded from yet are slow.
+constexpr int fast_peer_piece_seconds = 4;
+constexpr int slow_peer_piece_seconds = 30;
+
+inline enum piece_download::speed_class speed_class_of(
+        const int download_rate, const int piece_length) noexcept
+{
+    if(download_rate * int64_t(fast_peer_piece_seconds) >= piece_length) {
+        return piece_download::speed_class::fast;
+    } else if(download_rate * int64_t(slow_peer_piece_seconds) >= piece_length) {
+        return piece_download::speed_class::medium;
+    }
+    return piece_download::speed_class::slow;
+}
+
 /**
  * Used when we expect successive writes to socket to amortize the overhead of context
  * switches by blocking (corking) the socket until we're done and writing the accrued
@@ -69,10 +108,18 @@ public:
     }
 };
 
+inline peer_class peer_class_of(const stream_socket& socket) noexcept
+{
+    return socket.type() == stream_socket::transport::utp ? peer_class::utp
+                                                          : peer_class::tcp;
+}
+
 peer_session::peer_session(asio::io_context& ios, tcp::endpoint peer_endpoint,
-        torrent_rate_limiter& rate_limiter, const peer_session_settings& settings)
-    : socket_(std::make_unique<tcp::socket>(ios))
-    , rate_limiter_(rate_limiter)
+        rate_limiter& rate_limiter, buffer_budget& buffer_budget,
+        const peer_session_settings& settings, std::unique_ptr<stream_socket> socket)
+    : socket_(std::move(socket))
+    , rate_limiter_(rate_limiter, peer_class_of(*socket_))
+    , buffer_budget_(buffer_budget)
     , settings_(settings)
     , timeout_timer_(ios)
     , keep_alive_timer_(ios)
@@ -83,19 +130,30 @@ peer_session::peer_session(asio::io_context& ios, tcp::endpoint peer_endpoint,
     assert(settings_.max_send_buffer_size >= 0x4000);
     assert(settings_.peer_connect_timeout > seconds(0));
     assert(settings_.peer_timeout > minutes(2));
+    assert(socket_);
 
     info_.remote_endpoint = std::move(peer_endpoint);
     info_.max_outgoing_request_queue_size = settings.max_outgoing_request_queue_size;
     op_state_.set(op::slow_start);
+
+    if(settings_.max_download_rate != values::none) {
+        rate_limiter_.set_max_download_rate(settings_.max_download_rate);
+    }
+    if(settings_.max_upload_rate != values::none) {
+        rate_limiter_.set_max_upload_rate(settings_.max_upload_rate);
+    }
 }
 
 peer_session::peer_session(asio::io_context& ios, tcp::endpoint peer_endpoint,
-        torrent_rate_limiter& rate_limiter, const peer_session_settings& settings,
+        torrent_rate_limiter& rate_limiter, buffer_budget& buffer_budget,
+        const peer_session_settings& settings, std::unique_ptr<stream_socket> socket,
         torrent_frontend torrent)
-    : peer_session(ios, std::move(peer_endpoint), rate_limiter, settings)
+    : peer_session(ios, std::move(peer_endpoint), rate_limiter, buffer_budget, settings,
+              std::move(socket))
 {
     torrent_ = torrent;
     assert(torrent_);
+    rate_limiter_.attach(rate_limiter);
 
     // Initialize peer's bitfield.
     info_.available_pieces = bitfield(torrent_.piece_picker().num_pieces());
@@ -103,17 +161,16 @@ peer_session::peer_session(asio::io_context& ios, tcp::endpoint peer_endpoint,
 }
 
 peer_session::peer_session(asio::io_context& ios, tcp::endpoint peer_endpoint,
-        torrent_rate_limiter& rate_limiter, const peer_session_settings& settings,
-        std::unique_ptr<tcp::socket> socket,
+        rate_limiter& global_rate_limiter, buffer_budget& buffer_budget,
+        const peer_session_settings& settings, std::unique_ptr<stream_socket> socket,
         std::function<torrent_frontend(const sha1_hash&)> torrent_attacher)
-    : peer_session(ios, std::move(peer_endpoint), rate_limiter, settings)
+    : peer_session(ios, std::move(peer_endpoint), global_rate_limiter, buffer_budget,
+              settings, std::move(socket))
 {
     torrent_attacher_ = std::move(torrent_attacher);
-    socket_ = std::move(socket);
     info_.is_outbound = false;
 
     assert(torrent_attacher_);
-    assert(socket_);
 }
 
 peer_session::~peer_session()
@@ -180,8 +237,12 @@ inline void peer_session::connect()
     log(log_event::connecting, log::priority::low, "opening socket");
     socket_->open(info_.remote_endpoint.protocol(), ec);
     if(ec) {
-        // TODO can we disconnect if we haven't even connected?
-        disconnect(ec);
+        if(socket_->type() == stream_socket::transport::utp) {
+            fall_back_to_tcp(ec);
+        } else {
+            // TODO can we disconnect if we haven't even connected?
+            disconnect(ec);
+        }
         return;
     }
 
@@ -190,6 +251,8 @@ inline void peer_session::connect()
 
     info_.state = state::connecting;
     info_.connection_started_time = cached_clock::now();
+    // This may be a reconnect, in which case this belongs to the previous connection.
+    info_.connection_established_time = time_point();
     if(torrent_) {
         ++torrent_.info().num_connecting_sessions;
     }
@@ -212,7 +275,10 @@ void peer_session::on_connected(const error_code& error)
     error_code ec;
     timeout_timer_.cancel(ec);
 
-    if(error || !socket_->is_open()) {
+    if(error && (socket_->type() == stream_socket::transport::utp)) {
+        fall_back_to_tcp(error);
+        return;
+    } else if(error || !socket_->is_open()) {
         // TODO can we disconnect if we haven't even connected?
         disconnect(error ? error : std::make_error_code(std::errc::bad_file_descriptor));
         return;
@@ -229,6 +295,9 @@ void peer_session::on_connected(const error_code& error)
     log(log_event::connecting, "connected in %lims",
             to_int<milliseconds>(
                     info_.connection_established_time - info_.connection_started_time));
+    if(info_.is_outbound && torrent_) {
+        torrent_.on_peer_session_connected(*this);
+    }
     info_.local_endpoint = socket_->local_endpoint(ec);
     if(ec) {
         disconnect(ec);
@@ -250,6 +319,19 @@ void peer_session::on_connected(const error_code& error)
             [SHARED_THIS](const error_code& error) { on_inactivity_timeout(error); });
 }
 
+void peer_session::fall_back_to_tcp(const error_code& error)
+{
+#ifdef TIDE_ENABLE_LOGGING
+    const auto reason = error.message();
+    log(log_event::connecting, "uTP connection failed (%s), trying TCP", reason.c_str());
+#endif // TIDE_ENABLE_LOGGING
+    error_code ec;
+    socket_->close(ec);
+    socket_ = std::make_unique<tcp_stream_socket>(socket_->get_io_context());
+    rate_limiter_.set_peer_class(peer_class::tcp);
+    connect();
+}
+
 inline bool peer_session::should_abort(const error_code& error) const noexcept
 {
     return (error == asio::error::operation_aborted) || is_stopped();
@@ -272,7 +354,7 @@ void peer_session::disconnect(const error_code& error)
     request_timeout_timer_.cancel(ec);
     keep_alive_timer_.cancel(ec);
 
-    socket_->shutdown(tcp::socket::shutdown_both, ec);
+    socket_->shutdown(ec);
     socket_->close(ec);
     log(log_event::disconnecting, "closed socket");
 
@@ -281,6 +363,12 @@ void peer_session::disconnect(const error_code& error)
     rate_limiter_.add_upload_quota(info_.send_quota);
     rate_limiter_.unsubscribe(this);
 
+    // Give back our share of the buffer budget as well, since whatever is left in
+    // our buffers won't be used anymore.
+    buffer_budget_.unsubscribe(this);
+    buffer_budget_.release(num_reserved_receive_bytes_ + num_reserved_send_bytes_);
+    num_reserved_receive_bytes_ = num_reserved_send_bytes_ = 0;
+
     abort_outgoing_requests();
     if(parole_download_) {
         detach_parole_download();
@@ -426,6 +514,80 @@ void peer_session::suggest_piece(const piece_index_t piece)
     }
 }
 
+void peer_session::send_pex(const std::vector<tcp::endpoint>& peers)
+{
+    if(!is_connected() || (peer_pex_id_ == 0)
+            || (cached_clock::now() - last_pex_send_time_ < minutes(1))) {
+        return;
+    }
+
+    // Only IPv4 peers fit into the compact format, and there is no point in telling
+    // peer about itself.
+    const auto own_endpoint = listen_endpoint();
+    std::vector<tcp::endpoint> current;
+    current.reserve(peers.size());
+    for(const auto& peer : peers) {
+        if(peer.address().is_v4() && (peer != own_endpoint)
+                && (peer != remote_endpoint())) {
+            current.emplace_back(peer);
+        }
+    }
+    std::sort(current.begin(), current.end());
+    current.erase(std::unique(current.begin(), current.end()), current.end());
+
+    std::vector<tcp::endpoint> added;
+    std::vector<tcp::endpoint> dropped;
+    std::set_difference(current.begin(), current.end(), advertised_pex_peers_.begin(),
+            advertised_pex_peers_.end(), std::back_inserter(added));
+    std::set_difference(advertised_pex_peers_.begin(), advertised_pex_peers_.end(),
+            current.begin(), current.end(), std::back_inserter(dropped));
+    // Whatever doesn't fit into this message is sent in the next one.
+    if(int(added.size()) > max_pex_peers) {
+        added.resize(max_pex_peers);
+    }
+    if(int(dropped.size()) > max_pex_peers) {
+        dropped.resize(max_pex_peers);
+    }
+    if(added.empty() && dropped.empty()) {
+        return;
+    }
+
+    std::vector<tcp::endpoint> advertised;
+    std::set_difference(advertised_pex_peers_.begin(), advertised_pex_peers_.end(),
+            dropped.begin(), dropped.end(), std::back_inserter(advertised));
+    advertised_pex_peers_.clear();
+    std::set_union(advertised.begin(), advertised.end(), added.begin(), added.end(),
+            std::back_inserter(advertised_pex_peers_));
+
+    const auto to_compact = [](const std::vector<tcp::endpoint>& endpoints) {
+        std::string s;
+        s.reserve(endpoints.size() * compact_endpoint_size);
+        for(const auto& ep : endpoints) {
+            const auto bytes = ep.address().to_v4().to_bytes();
+            s.append(bytes.begin(), bytes.end());
+            s.push_back(ep.port() >> 8);
+            s.push_back(ep.port() & 0xff);
+        }
+        return s;
+    };
+    std::string msg;
+    bencoder(msg)
+            .begin_map()
+            .key("added")
+            .string(to_compact(added))
+            // We know nothing about the peers' capabilities, so all their flags are
+            // unset.
+            .key("added.f")
+            .string(std::string(added.size(), '\0'))
+            .key("dropped")
+            .string(to_compact(dropped))
+            .end_map();
+    send_extended(peer_pex_id_, msg);
+    last_pex_send_time_ = cached_clock::now();
+    log(log_event::outgoing, "PEX (added: %i, dropped: %i)", added.size(),
+            dropped.size());
+}
+
 void peer_session::announce_new_piece(const piece_index_t piece)
 {
     // No need to send a have message if we're shutting down, otherwise we're
@@ -496,6 +658,8 @@ void peer_session::update_interest()
 
 void peer_session::send()
 {
+    // Messages may have been appended to the send buffer since we last checked.
+    update_buffer_reservations();
     request_upload_quota();
     if(!can_send()) {
         return;
@@ -561,6 +725,7 @@ void peer_session::on_sent(const error_code& error, size_t num_bytes_sent)
 
     update_send_stats(num_bytes_sent);
     send_buffer_.consume(num_bytes_sent);
+    update_buffer_reservations();
 
     log(log_event::outgoing,
             "sent: %i; quota: %i; send buffer size: %i; total sent: %lli", num_bytes_sent,
@@ -581,6 +746,17 @@ inline void peer_session::update_send_stats(const int num_bytes_sent) noexcept
     info_.last_send_time = cached_clock::now();
     info_.total_uploaded_bytes += num_bytes_sent;
     torrent_.info().total_uploaded_bytes += num_bytes_sent;
+    torrent_.counters().increment(counters::num_bytes_sent, num_bytes_sent);
+    buffer_budget_.record_sent_bytes(num_bytes_sent);
+}
+
+inline int peer_session::send_buffer_capacity() const
+{
+    const int fair_share = buffer_budget_.fair_send_share(info_.upload_rate.rate());
+    if(fair_share == buffer_budget::unlimited) {
+        return settings_.max_send_buffer_size;
+    }
+    return std::min(fair_share, settings_.max_send_buffer_size);
 }
 
 // ---------
@@ -599,7 +775,11 @@ void peer_session::receive()
     prepare_to_receive();
     const int num_to_receive
             = std::min(info_.receive_quota, message_parser_.free_space_size());
-    if(num_to_receive == 0) // { return; }
+    if((num_to_receive == 0) && (info_.receive_quota > 0)) {
+        // We have bandwidth quota but couldn't get memory to receive into.
+        subscribe_for_buffer_memory();
+        return;
+    } else if(num_to_receive == 0) // { return; }
     {
         // TODO remove after bug is found
         log(log_event::incoming, log::priority::high,
@@ -640,8 +820,14 @@ void peer_session::prepare_to_receive()
     if(info_.receive_quota == 0) {
         return;
     }
-    // Only reserve as much as we have quota for.
-    message_parser_.reserve_free_space(std::min(num_to_receive, info_.receive_quota));
+    // Only reserve as much as we have quota and buffer memory for.
+    int num_to_reserve = std::min(num_to_receive, info_.receive_quota);
+    const int num_missing_bytes = num_to_reserve - message_parser_.free_space_size();
+    if(num_missing_bytes > 0) {
+        num_to_reserve -= num_missing_bytes
+                - reserve_receive_buffer_space(num_missing_bytes);
+    }
+    message_parser_.reserve_free_space(num_to_reserve);
 }
 
 inline int peer_session::num_expected_bytes_to_receive() const noexcept
@@ -670,8 +856,14 @@ inline int peer_session::effective_receive_buffer_capacity() const
     // The maximum number of bytes receive buffer is able to accommodate (with resizing).
     // Pending bytes written to disk are also counted as part of the receive buffer
     // until they are flushed to disk; this is used to throttle the download rate if
-    // we're disk bound (so as not to further overwhelm disk).
-    int buffer_capacity = settings_.max_receive_buffer_size - message_parser_.size()
+    // we're disk bound (so as not to further overwhelm disk). If the buffer budget
+    // is under pressure, we may not grow beyond our fair share of it either.
+    int max_buffer_size = settings_.max_receive_buffer_size;
+    const int fair_share = buffer_budget_.fair_receive_share(info_.download_rate.rate());
+    if(fair_share != buffer_budget::unlimited) {
+        max_buffer_size = std::min(max_buffer_size, fair_share);
+    }
+    int buffer_capacity = max_buffer_size - message_parser_.size()
             - info_.num_pending_disk_write_bytes;
     if((buffer_capacity <= 0) && (info_.num_pending_disk_read_bytes > 0)) {
         // If we're stalled on the disk we still allow to receive one block as
@@ -710,6 +902,64 @@ inline void peer_session::request_receive_quota(const int num_bytes)
     }
 }
 
+inline int peer_session::reserve_receive_buffer_space(const int num_bytes)
+{
+    assert(num_bytes > 0);
+    // Memory up to the minimum share is granted even if the budget is exhausted.
+    const int num_guaranteed_bytes = std::min(num_bytes,
+            std::max(buffer_budget::min_session_share - num_reserved_receive_bytes_, 0));
+    buffer_budget_.force_reserve(num_guaranteed_bytes);
+    int num_reserved_bytes = num_guaranteed_bytes;
+    if(num_reserved_bytes < num_bytes) {
+        num_reserved_bytes += buffer_budget_.reserve(num_bytes - num_reserved_bytes);
+    }
+    num_reserved_receive_bytes_ += num_reserved_bytes;
+    if(num_reserved_bytes < num_bytes) {
+        log(log_event::incoming, log::priority::high,
+                "buffer budget exhausted, requested: %i, reserved: %i", num_bytes,
+                num_reserved_bytes);
+    }
+    return num_reserved_bytes;
+}
+
+inline void peer_session::subscribe_for_buffer_memory()
+{
+    log(log_event::incoming, log::priority::high,
+            "CAN'T RECEIVE, buffer budget exhausted, subscribing for memory");
+    // Like with rate limiter subscriptions, the handler is removed once we
+    // disconnect, so regular `this` may be passed.
+    buffer_budget_.subscribe(this, [this] {
+        if(is_stopped()) {
+            return;
+        }
+        send_cork _cork(*this);
+        receive();
+        if(can_make_requests()) {
+            make_requests();
+        }
+    });
+}
+
+void peer_session::update_buffer_reservations()
+{
+    if(is_disconnected()) {
+        return;
+    }
+    const auto reconcile = [this](int& num_reserved_bytes, const int buffer_size) {
+        const int diff = buffer_size - num_reserved_bytes;
+        num_reserved_bytes = buffer_size;
+        if(diff > 0) {
+            // The buffer has already grown so this memory is in use regardless of
+            // whether the budget allows it.
+            buffer_budget_.force_reserve(diff);
+        } else if(diff < 0) {
+            buffer_budget_.release(-diff);
+        }
+    };
+    reconcile(num_reserved_receive_bytes_, message_parser_.buffer_size());
+    reconcile(num_reserved_send_bytes_, send_buffer_.size());
+}
+
 inline void peer_session::try_finish_disconnecting()
 {
     // We are gracefully stopping and if there are no other pending async ops,
@@ -721,6 +971,7 @@ inline void peer_session::try_finish_disconnecting()
 
 void peer_session::on_received(const error_code& error, size_t num_bytes_received)
 {
+    TIDE_TRACE_SCOPE("peer_session", "on_received", "num_bytes", num_bytes_received);
     error_code ec;
     timeout_timer_.cancel(ec);
     op_state_.unset(op::receive);
@@ -783,9 +1034,20 @@ inline int peer_session::flush_socket()
     if(ec) {
         disconnect(ec);
     } else if(num_available_bytes > 0) {
-        view<uint8_t> buffer = message_parser_.get_receive_buffer(num_available_bytes);
-        const auto num_bytes_read = socket_->read_some(
-                asio::mutable_buffers_1(buffer.data(), buffer.size()), ec);
+        // Don't let the socket's backlog grow the receive buffer beyond what the
+        // buffer budget allows, the rest is read in the next receive cycle.
+        int num_to_read = num_available_bytes;
+        const int num_missing_bytes = num_to_read - message_parser_.free_space_size();
+        if(num_missing_bytes > 0) {
+            num_to_read -= num_missing_bytes
+                    - reserve_receive_buffer_space(num_missing_bytes);
+        }
+        if(num_to_read == 0) {
+            return 0;
+        }
+        view<uint8_t> buffer = message_parser_.get_receive_buffer(num_to_read);
+        const auto num_bytes_read
+                = socket_->read_some(asio::buffer(buffer.data(), buffer.size()), ec);
         if((ec == asio::error::would_block) || (ec == asio::error::try_again)) {
             // This is not an error, just ignore.
             log(log_event::incoming, log::priority::low,
@@ -809,6 +1071,8 @@ inline void peer_session::update_receive_stats(const int num_bytes_received) noe
     info_.last_receive_time = cached_clock::now();
     info_.total_downloaded_bytes += num_bytes_received;
     torrent_.info().total_downloaded_bytes += num_bytes_received;
+    torrent_.counters().increment(counters::num_bytes_received, num_bytes_received);
+    buffer_budget_.record_received_bytes(num_bytes_received);
 }
 
 inline void peer_session::adjust_receive_buffer(
@@ -818,18 +1082,16 @@ inline void peer_session::adjust_receive_buffer(
     if(old_buffer_size != message_parser_.buffer_size())
         log(log_event::incoming, log::priority::low, "grew receive buffer from %i to %i",
                 old_buffer_size, message_parser_.buffer_size());
-    /* this is experimental
-    if(!am_choked()
-       && (float(num_bytes_received) < message_parser_.buffer_size() * 0.10f
-           && info_.num_outstanding_bytes < message_parser_.buffer_size()))
-    {
-        // We're not choked but we received so little and we're not expecting to
-        // receive a lot of data, so decrease buffer size.
-        // TODO verify that we're not too agressively shrinkign buffer here
-        message_parser_.shrink_to_fit(info_.num_outstanding_bytes);
-    }
-    else */
-    if(!was_choked && am_choked() && old_buffer_size > 1024) {
+    const int fair_share = buffer_budget_.fair_receive_share(info_.download_rate.rate());
+    if((fair_share != buffer_budget::unlimited) && (old_buffer_size > fair_share)) {
+        // The buffer budget is under pressure and we hold more of it than our
+        // throughput warrants, so give back what we're not expecting to need (the
+        // buffer will not shrink below the last valid message byte).
+        message_parser_.shrink_to_fit(fair_share);
+        log(log_event::incoming, log::priority::low,
+                "shrunk receive buffer from %i to %i (fair share: %i)", old_buffer_size,
+                message_parser_.buffer_size(), fair_share);
+    } else if(!was_choked && am_choked() && old_buffer_size > 1024) {
         // If we went from unchoked to choked (and if buffer is large enough,
         // otherwise don't bother), ~100 bytes should suffice to receive further
         // protocol chatter (if we have unfinished messages in receive buffer it
@@ -839,6 +1101,7 @@ inline void peer_session::adjust_receive_buffer(
                 "shrunk receive buffer from %i to %i", old_buffer_size,
                 message_parser_.buffer_size());
     }
+    update_buffer_reservations();
 }
 
 inline bool peer_session::am_expecting_block() const noexcept
@@ -852,6 +1115,7 @@ inline bool peer_session::am_expecting_block() const noexcept
 
 inline void peer_session::handle_messages()
 {
+    TIDE_TRACE_SCOPE("peer_session", "handle_messages");
     if(info_.state == state::handshaking) {
         handshake_stage();
         // We're still in the handshake stage, meaning don't have the full handshake
@@ -860,7 +1124,9 @@ inline void peer_session::handle_messages()
             return;
         }
     }
-    if(info_.state == state::piece_availability_exchange
+    // Extended messages may precede the piece availability message, in which case
+    // we remain in this stage.
+    while(info_.state == state::piece_availability_exchange
             && message_parser_.has_message()) {
         piece_availability_exchange_stage();
         if(is_disconnected()) {
@@ -868,7 +1134,7 @@ inline void peer_session::handle_messages()
         }
     }
     while(!is_disconnected() && message_parser_.has_message()
-            && send_buffer_.size() <= settings_.max_send_buffer_size) {
+            && send_buffer_.size() <= send_buffer_capacity()) {
 #define NOT_AFTER_HANDSHAKE(str)                                               \
     do {                                                                       \
         log(log_event::invalid_message, str " not after handshake");           \
@@ -888,6 +1154,7 @@ inline void peer_session::handle_messages()
         case message::block: handle_block(); break;
         case message::cancel: handle_cancel(); break;
         // -- DHT extension messages --
+        case message::port: handle_port(); break;
         // -- Fast extension messages --
         case message::suggest_piece: handle_suggest_piece(); break;
         // Like bitfield, these messages may only be exchanged after the handshake.
@@ -895,6 +1162,8 @@ inline void peer_session::handle_messages()
         case message::have_none: NOT_AFTER_HANDSHAKE("HAVE NONE"); break;
         case message::reject_request: handle_reject_request(); break;
         case message::allowed_fast: handle_allowed_fast(); break;
+        // -- Extension protocol messages --
+        case message::extended: handle_extended(); break;
         default: handle_unknown_message();
         }
 #undef NOT_AFTER_HANDSHAKE
@@ -910,6 +1179,17 @@ inline void peer_session::handshake_stage()
         handle_handshake();
         if(!is_disconnected()) {
             send_piece_availability();
+            // Let peer know where our DHT node is, so that it may add it to its
+            // routing table.
+            if(is_extension_enabled(extensions::dht)) {
+                const uint16_t dht_port = torrent_.dht_node().port();
+                if(dht_port != 0) {
+                    send_port(dht_port);
+                }
+            }
+            if(is_extension_enabled(extensions::extension_protocol)) {
+                send_extended_handshake();
+            }
         }
     }
 }
@@ -918,7 +1198,10 @@ inline void peer_session::piece_availability_exchange_stage()
 {
     // TODO are we sending our piece availability?
     const auto msg_type = message_parser_.type();
-    if(msg_type == message::bitfield) {
+    if(msg_type == message::extended) {
+        handle_extended();
+        return;
+    } else if(msg_type == message::bitfield) {
         handle_bitfield();
         if(is_disconnected()) {
             return;
@@ -986,14 +1269,15 @@ void peer_session::handle_handshake()
     } else {
         // Otherwise peer started the connection, so try to locate the torrent to which
         // this peer belongs with the `torrent_attacher_` callback.
-        torrent_frontend torrent = torrent_attacher_(peer_info_hash);
+        torrent_ = torrent_attacher_(peer_info_hash);
         torrent_attacher_ = decltype(torrent_attacher_)(); // no longer need it
-        if(!torrent) {
+        if(!torrent_) {
             // This means we couldn't find a torrent to which we could be attached
             // due to peer's invalid info_hash.
             disconnect(peer_session_errc::invalid_info_hash);
             return;
         }
+        rate_limiter_.attach(torrent_.rate_limiter());
         // Initialize peer's bitfield now that we know the number of pieces this
         // torrent has.
         info_.available_pieces = bitfield(torrent_.piece_picker().num_pieces());
@@ -1047,6 +1331,8 @@ inline void peer_session::handle_bitfield()
 
     info_.available_pieces = bitfield(msg.data, num_pieces);
     info_.is_peer_seed = info_.available_pieces.are_all_set();
+    // This is undone when we disconnect.
+    torrent_.piece_picker().increase_frequency(info_.available_pieces);
 
     log(log_event::incoming, "BITFIELD (%s:%i)", is_peer_seed() ? "seed" : "leech",
             info_.available_pieces.count());
@@ -1371,12 +1657,21 @@ void peer_session::handle_block()
         // meaning we expect this block, so its corresponding download instance
         // must also be present.
         piece_download& download = find_download(block_info.index);
-        download.got_block(remote_endpoint(), block_info);
-        disk_buffer block = torrent_.get_disk_buffer(block_info.length);
-        assert(block);
-        // Exclude the block header (index and offset, both 4 bytes).
-        std::copy(msg.data.begin() + 8, msg.data.end(), block.data());
-        save_block(block_info, std::move(block), download);
+        if(download.has_block(block_info)) {
+            // In end-game mode the block may have been requested from several peers,
+            // and another peer's copy beat this one (which was already in transit
+            // when we tried to cancel it).
+            log(log_event::incoming, "received redundant block");
+            info_.total_wasted_bytes += block_info.length;
+            torrent_.info().total_wasted_bytes += block_info.length;
+        } else {
+            download.got_block(remote_endpoint(), block_info);
+            disk_buffer block = torrent_.get_disk_buffer(block_info.length);
+            assert(block);
+            // Exclude the block header (index and offset, both 4 bytes).
+            std::copy(msg.data.begin() + 8, msg.data.end(), block.data());
+            save_block(block_info, std::move(block), download);
+        }
     }
 
     if(can_make_requests())
@@ -1547,6 +1842,22 @@ inline void peer_session::handle_suggest_piece()
 // -----------------------
 // HAVE ALL <len=1><id=14>
 // -----------------------
+inline void peer_session::handle_port()
+{
+    message msg = message_parser_.extract_message();
+    if(msg.data.size() != 2) {
+        log(log_event::invalid_message, "wrong PORT message length");
+        return;
+    }
+    const uint16_t port = endian::read_network<uint16_t>(msg.data.data());
+    log(log_event::incoming, "PORT (%i)", port);
+    // Some clients send this even if we didn't advertise DHT support, in which case
+    // it's simply ignored.
+    if(is_extension_enabled(extensions::dht) && (port != 0)) {
+        torrent_.dht_node().add_node(udp::endpoint(remote_endpoint().address(), port));
+    }
+}
+
 inline void peer_session::handle_have_all()
 {
     assert(info_.state == state::piece_availability_exchange);
@@ -1566,6 +1877,7 @@ inline void peer_session::handle_have_all()
     assert(info_.available_pieces.size() == torrent_.piece_picker().num_pieces());
     info_.available_pieces.fill();
     info_.is_peer_seed = true;
+    torrent_.piece_picker().increase_frequency(info_.available_pieces);
 
     log(log_event::incoming, "HAVE ALL");
 
@@ -1692,6 +2004,116 @@ inline void peer_session::handle_allowed_fast()
     }
 }
 
+// ---------------------------------------------------
+// EXTENDED <len=2+X><id=20><extended id><payload(X)>
+// ---------------------------------------------------
+inline void peer_session::handle_extended()
+{
+    if(!is_extension_enabled(extensions::extension_protocol)) {
+        log(log_event::invalid_message, "EXTENDED message not supported");
+        disconnect(peer_session_errc::unsupported_extension);
+        return;
+    }
+
+    message msg = message_parser_.extract_message();
+    if(msg.data.empty()) {
+        log(log_event::invalid_message, "wrong EXTENDED message length");
+        disconnect(peer_session_errc::invalid_extended_message);
+        return;
+    }
+
+    const int extended_id = msg.data[0];
+    switch(extended_id) {
+    case extended_handshake_id: handle_extended_handshake(msg.data.subview(1)); break;
+    case ut_pex_id: handle_pex(msg.data.subview(1)); break;
+    default:
+        // We never assigned this id, but it's no reason to drop peer.
+        log(log_event::invalid_message, "unknown EXTENDED message (id: %i)",
+                extended_id);
+    }
+}
+
+inline void peer_session::handle_extended_handshake(const_view<uint8_t> data)
+{
+    error_code ec;
+    // The message is only inspected here, so it's decoded in the receive buffer.
+    const auto handshake = decode_bmap(
+            string_view(reinterpret_cast<const char*>(data.data()), data.size()),
+            nullptr, ec);
+    if(ec) {
+        log(log_event::invalid_message, "couldn't decode EXTENDED HANDSHAKE");
+        disconnect(peer_session_errc::invalid_extended_message);
+        return;
+    }
+
+    // The handshake may be sent again to update some of its values, and an id of
+    // 0 means that peer disabled the extension.
+    bmap m;
+    if(handshake.try_find_bmap("m", m)) {
+        int64_t pex_id = 0;
+        m.try_find_number("ut_pex", pex_id);
+        peer_pex_id_ = (pex_id > 0) && (pex_id < 256) ? pex_id : 0;
+        if(peer_pex_id_ == 0) {
+            advertised_pex_peers_.clear();
+        }
+    }
+    int64_t port;
+    if(handshake.try_find_number("p", port) && (port > 0) && (port <= 0xffff)) {
+        peer_listen_port_ = port;
+    }
+
+    log(log_event::incoming, "EXTENDED HANDSHAKE (ut_pex: %i, port: %i)",
+            peer_pex_id_, peer_listen_port_);
+}
+
+inline void peer_session::handle_pex(const_view<uint8_t> data)
+{
+    error_code ec;
+    const auto msg = decode_bmap(
+            string_view(reinterpret_cast<const char*>(data.data()), data.size()),
+            nullptr, ec);
+    if(ec) {
+        log(log_event::invalid_message, "couldn't decode PEX");
+        disconnect(peer_session_errc::invalid_extended_message);
+        return;
+    }
+
+    // Dropped peers are of no interest to us, as we find out on our own when a peer
+    // goes away. Note that we only support IPv4 peers.
+    string_view added;
+    if(!msg.try_find_string_view("added", added)) {
+        log(log_event::incoming, "PEX (added: 0)");
+        return;
+    }
+
+    // Peer is not supposed to send more than this many, and we don't want it to
+    // flood our peer list either.
+    const int num_peers = std::min(
+            int(added.length()) / compact_endpoint_size, max_pex_peers);
+    // Each added peer may have a byte of flags, which tell us whether we may connect
+    // to it over uTP.
+    string_view flags;
+    msg.try_find_string_view("added.f", flags);
+    std::vector<tcp::endpoint> peers;
+    std::vector<bool> supports_utp;
+    peers.reserve(num_peers);
+    supports_utp.reserve(num_peers);
+    for(auto i = 0; i < num_peers; ++i) {
+        const char* p = &added[i * compact_endpoint_size];
+        const uint16_t port = endian::read_network<uint16_t>(p + 4);
+        if(port != 0) {
+            peers.emplace_back(address_v4(endian::read_network<uint32_t>(p)), port);
+            supports_utp.push_back((i < int(flags.length()))
+                    && (uint8_t(flags[i]) & pex_supports_utp_flag));
+        }
+    }
+    log(log_event::incoming, "PEX (added: %i)", peers.size());
+
+    if(!peers.empty()) {
+        torrent_.on_pex_peers(std::move(peers), std::move(supports_utp));
+    }
+}
+
 inline void peer_session::handle_illicit_block(const block_info& block)
 {
     // We don't want this block (give 2 second slack as it may be an old request).
@@ -2158,6 +2580,8 @@ void peer_session::send_cancel(const block_info& block)
         auto it = std::find(outgoing_requests_.begin(), outgoing_requests_.end(), block);
         if(it != outgoing_requests_.end()) {
             outgoing_requests_.erase(it);
+            info_.num_outstanding_bytes -= block.length;
+            torrent_.info().num_outstanding_bytes -= block.length;
         }
         log(log_event::outgoing, "CANCEL (piece: %i, offset: %i, length: %i)",
                 block.index, block.offset, block.length);
@@ -2242,6 +2666,36 @@ void peer_session::send_allowed_fast_set()
     }
 }
 
+// ---------------------------------------------------
+// EXTENDED <len=2+X><id=20><extended id><payload(X)>
+// ---------------------------------------------------
+void peer_session::send_extended(const int extended_id, const std::string& data)
+{
+    const int msg_size = 2 + data.length();
+    send_buffer_.append(payload(4 + msg_size)
+                                .i32(msg_size)
+                                .i8(message::extended)
+                                .u8(extended_id)
+                                .buffer(data));
+    send();
+}
+
+void peer_session::send_extended_handshake()
+{
+    std::string handshake;
+    bencoder encoder(handshake);
+    encoder.begin_map().key("m").begin_map().key("ut_pex").number(ut_pex_id).end_map();
+    // Inbound peers have no way of knowing where we accept connections otherwise.
+    const uint16_t port = torrent_.listener_port();
+    if(port != 0) {
+        encoder.key("p").number(port);
+    }
+    encoder.end_map();
+    send_extended(extended_handshake_id, handshake);
+    log(log_event::outgoing, "EXTENDED HANDSHAKE (ut_pex: %i, port: %i)", ut_pex_id,
+            port);
+}
+
 inline void peer_session::send_piece_availability()
 {
     info_.state = state::piece_availability_exchange;
@@ -2268,8 +2722,12 @@ inline void peer_session::send_piece_availability()
 inline bool peer_session::can_make_requests() const noexcept
 {
     // TODO restrict requests if disk is overwhelmed...I think.?
+    // If the buffer budget is exhausted we hold off on further requests until
+    // memory is released, unless we have no requests in flight at all, as
+    // otherwise this session would starve.
     return am_interested() && num_blocks_to_request() > 0
-            && (!am_choked() || !incoming_allowed_set_.empty());
+            && (!am_choked() || !incoming_allowed_set_.empty())
+            && (outgoing_requests_.empty() || !buffer_budget_.is_exhausted());
 }
 
 void peer_session::make_requests()
@@ -2324,10 +2782,6 @@ void peer_session::make_requests()
     send_buffer_.append(std::move(payload));
     send();
 
-    if(torrent_info.num_pending_blocks >= torrent_info.num_blocks) {
-        // TODO enter end game mode? or should we do this elsewhere?
-    }
-
     info_.last_outgoing_request_time = cached_clock::now();
     start_timer(request_timeout_timer_, request_timeout_value(),
             [SHARED_THIS](const error_code& error) { on_request_timeout(error); });
@@ -2335,21 +2789,103 @@ void peer_session::make_requests()
 
 inline view<pending_block> peer_session::distpach_make_requests()
 {
-    // TODO if we're on parole and it's also end-game mode, we should probably not
-    // request from this peer (so as not to slow down the download), unless they are
-    // the only ones that have some of the pieces.
-    if(torrent_.info().state[torrent_info::end_game])
-        return make_requests_in_endgame_mode();
-    else if(is_peer_on_parole())
+    // A peer on parole is not trusted with the blocks of other downloads, which in
+    // end-game mode would also slow down their completion.
+    if(is_peer_on_parole()) {
         return make_requests_in_parole_mode();
-    else
-        return make_requests_in_normal_mode();
+    } else if(torrent_.info().state[torrent_info::end_game]) {
+        return make_requests_in_endgame_mode();
+    }
+
+    int num_new_requests = 0;
+    // The blocks of time critical pieces that are about to miss their deadlines take
+    // precedence over new pieces.
+    if(!torrent_.piece_picker().time_critical_pieces().empty()) {
+        num_new_requests += make_redundant_requests(true);
+    }
+    num_new_requests += make_requests_in_normal_mode().size();
+    if((num_blocks_to_request() > 0) && is_every_block_requested()) {
+        torrent_.info().state[torrent_info::end_game] = true;
+        log(log_event::info, log::priority::high, "entered end-game mode");
+        num_new_requests += make_redundant_requests();
+    }
+    return view_of_new_requests(num_new_requests);
 }
 
 inline view<pending_block> peer_session::make_requests_in_endgame_mode()
 {
-    // TODO for now.
-    return make_requests_in_normal_mode();
+    // Blocks that have become free (e.g. because a peer disconnected or a piece
+    // failed its hash test) are requested the normal way first.
+    const int num_new_requests = make_requests_in_normal_mode().size();
+    return view_of_new_requests(num_new_requests + make_redundant_requests());
+}
+
+inline bool peer_session::is_every_block_requested() const noexcept
+{
+    const auto& info = torrent_.info();
+    if(info.num_pending_pieces < torrent_.piece_picker().num_pieces_left()) {
+        return false;
+    }
+    for(const auto& download : torrent_.downloads()) {
+        if(download->can_request()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline int peer_session::make_redundant_requests(const bool only_time_critical)
+{
+    const int max_requests_per_block = settings_.max_end_game_requests_per_block;
+    // Only a peer that has proven to be responsive is asked for blocks that are
+    // already on their way from another peer.
+    if((max_requests_per_block < 2) || has_peer_timed_out()
+            || (info_.total_downloaded_piece_bytes == 0)) {
+        return 0;
+    }
+
+    // A block is only requested from this peer as well if it has been outstanding
+    // for longer than this peer usually takes to deliver one, i.e. if this peer is
+    // likely to be faster than the one(s) it was requested from.
+    const milliseconds min_request_age(avg_request_rtt_.mean());
+    const time_point deadline_horizon
+            = cached_clock::now() + settings_.time_critical_redundancy_margin;
+    const auto& piece_picker = torrent_.piece_picker();
+    int num_new_requests = 0;
+    for(auto& download : torrent_.downloads()) {
+        if(num_blocks_to_request() == 0) {
+            break;
+        } else if(!info_.available_pieces[download->piece_index()]) {
+            continue;
+        } else if(only_time_critical
+                && (piece_picker.deadline(download->piece_index()) > deadline_horizon)) {
+            continue;
+        }
+        const bool is_participant
+                = std::find(downloads_.begin(), downloads_.end(), download)
+                != downloads_.end();
+        if(!is_participant) {
+            // It's safe to pass only this instead of SHARED_THIS because we remove
+            // our callback from download when we destruct.
+            download->register_peer(remote_endpoint(),
+                    [this, &download = *download](
+                            bool is_piece_good, int num_bytes_downloaded) {
+                        on_piece_hashed(download, is_piece_good, num_bytes_downloaded);
+                    },
+                    [this](const block_info& block) { send_cancel(block); });
+            downloads_.emplace_back(download);
+        }
+        const int n = download->pick_redundant_blocks(outgoing_requests_,
+                remote_endpoint(), num_blocks_to_request(), min_request_age,
+                max_requests_per_block);
+        if(n > 0) {
+            log(log_event::request, log::priority::high,
+                    "requesting %i outstanding block(s) of piece(%i) redundantly", n,
+                    download->piece_index());
+            num_new_requests += n;
+        }
+    }
+    return num_new_requests;
 }
 
 inline view<pending_block> peer_session::make_requests_in_parole_mode()
@@ -2419,6 +2955,17 @@ inline view<pending_block> peer_session::make_requests_in_normal_mode()
         num_new_requests += num_blocks;
     }
 
+    // If there are no more pieces to pick, the speed class is only a preference:
+    // rather than idle (and keep end-game mode from starting), we help with any
+    // download that still has unrequested blocks.
+    while(outgoing_requests_.size() < info_.best_request_queue_size) {
+        const int num_blocks = join_download(true);
+        if(num_blocks == 0) {
+            break;
+        }
+        num_new_requests += num_blocks;
+    }
+
     log(log_event::request, log::priority::high, "%i new requests", num_new_requests);
     return view_of_new_requests(num_new_requests);
 }
@@ -2449,13 +2996,17 @@ inline int peer_session::continue_downloads()
     return num_new_requests;
 }
 
-inline int peer_session::join_download()
+inline int peer_session::join_download(const bool ignore_speed_class)
 {
     int num_new_requests = 0;
-    auto download = find_shared_download();
+    auto download = find_shared_download(ignore_speed_class);
     if(download) {
         log(log_event::request, log::priority::high, "joining piece(%i) download",
                 download->piece_index());
+        if(download->peers().empty()) {
+            download->set_speed_class(
+                    speed_class_of(download_rate(), torrent_.info().piece_length));
+        }
         // It's safe to pass only this instead of SHARED_THIS because we remove
         // our callback from download when we destruct.
         download->register_peer(remote_endpoint(),
@@ -2472,23 +3023,64 @@ inline int peer_session::join_download()
     return num_new_requests;
 }
 
-inline std::shared_ptr<piece_download> peer_session::find_shared_download()
-{
+inline std::shared_ptr<piece_download> peer_session::find_shared_download(
+        const bool ignore_speed_class)
+{
+    // Downloads of time critical pieces are joined first, and regardless of the
+    // speed classes of their participants, so that they're spread over as many
+    // peers as possible.
+    const bool has_time_critical_pieces
+            = !torrent_.piece_picker().time_critical_pieces().empty();
+    // Peers only share pieces with peers of their own speed class, except for fast
+    // peers, which download whole pieces on their own. This keeps the number of
+    // partially downloaded pieces (and their write buffers) low, as slow peers pool
+    // their blocks in a few pieces rather than in a new piece each. A download whose
+    // participants have all left is free for anyone to take over, as it is already
+    // partially downloaded.
+    const auto my_speed_class
+            = speed_class_of(download_rate(), torrent_.info().piece_length);
+    const auto is_joinable = [my_speed_class, ignore_speed_class](
+                                     const piece_download& download) {
+        if(ignore_speed_class || download.peers().empty()) {
+            return true;
+        }
+        return (my_speed_class != piece_download::speed_class::fast)
+                && (download.speed_class() == my_speed_class);
+    };
+    std::shared_ptr<piece_download> result;
     for(auto& download : torrent_.downloads()) {
         if(info_.available_pieces[download->piece_index()]
                 && std::find(downloads_.begin(), downloads_.end(), download)
                         == downloads_.end()
                 && download->can_request()) {
-            return download;
+            if(has_time_critical_pieces
+                    && (torrent_.piece_picker().deadline(download->piece_index())
+                            != time_point::max())) {
+                return download;
+            } else if(!is_joinable(*download)) {
+                continue;
+            } else if(!has_time_critical_pieces) {
+                return download;
+            } else if(result == nullptr) {
+                result = download;
+            }
         }
     }
-    return nullptr;
+    return result;
 }
 
 inline int peer_session::start_download()
 {
     int num_new_requests = 0;
+    const time_point pick_start = clock::now();
     const auto piece = torrent_.piece_picker().pick(info_.available_pieces);
+    auto& perf_counters = torrent_.counters();
+    perf_counters.increment(
+            counters::piece_pick_time, to_int<nanoseconds>(clock::now() - pick_start));
+    perf_counters.increment(counters::num_piece_picks);
+    if(piece == invalid_piece_index) {
+        perf_counters.increment(counters::num_failed_piece_picks);
+    }
 
 #ifdef TIDE_ENABLE_EXPENSIVE_ASSERTS
     // Test whether piece picker returned a unique piece.
@@ -2513,16 +3105,13 @@ inline int peer_session::start_download()
 
     if(piece != invalid_piece_index) {
         auto& info = torrent_.info();
-        // We might need to enter end-game mode.
-        if(++info.num_pending_pieces + info.num_downloaded_pieces == info.num_pieces) {
-            info.state[torrent_info::end_game] = true;
-            log(log_event::info, log::priority::high, "entered end-game mode");
-        }
+        ++info.num_pending_pieces;
 
         log(log_event::request, log::priority::high, "picked piece(%i)", piece);
 
         auto download
                 = std::make_shared<piece_download>(piece, get_piece_length(info, piece));
+        download->set_speed_class(speed_class_of(download_rate(), info.piece_length));
         // It's safe to pass only this instead of SHARED_THIS because we remove
         // these callbacks from download when we destruct.
         download->register_peer(remote_endpoint(),
@@ -2668,15 +3257,11 @@ void peer_session::on_connect_timeout(const error_code& error)
     if(should_abort(error)) {
         return;
     } else if(error) {
-        // TODO verify this and below
-        if(torrent_) {
-            --torrent_.info().num_connecting_sessions;
-        }
+        // NOTE: `num_connecting_sessions` is not decremented here (nor below), as
+        // `on_connected` is always invoked, at the latest with
+        // `operation_aborted` once the socket is closed in `disconnect`.
         disconnect(error);
     } else {
-        if(torrent_) {
-            --torrent_.info().num_connecting_sessions;
-        }
         const auto elapsed
                 = to_int<seconds>(cached_clock::now() - info_.connection_started_time);
         assert(elapsed > 0);
@@ -2755,29 +3340,30 @@ void peer_session::log(const log_event event, const log::priority priority,
         const char* format, Args&&... args) const
 {
 #ifdef TIDE_ENABLE_LOGGING
-    std::stringstream header;
-    if(is_connected() || is_disconnecting()) {
-        header << '+';
-        header << to_int<seconds>(
-                cached_clock::now() - info_.connection_established_time);
-        header << "s|";
+    // This is on the hot path, so bail before doing any work if it's not logged.
+    if(!log::is_enabled(log::subsystem::peer_session, priority)) {
+        return;
     }
+    const int connection_age = is_connected() || is_disconnecting()
+            ? to_int<seconds>(cached_clock::now() - info_.connection_established_time)
+            : -1;
+    const char* header = "";
     switch(event) {
-    case log_event::connecting: header << "CONNECTING"; break;
-    case log_event::disconnecting: header << "DISCONNECTING"; break;
-    case log_event::incoming: header << "IN"; break;
-    case log_event::outgoing: header << "OUT"; break;
-    case log_event::disk: header << "DISK"; break;
-    case log_event::invalid_message: header << "INVALID MESSAGE"; break;
-    case log_event::parole: header << "PAROLE"; break;
-    case log_event::timeout: header << "TIMEOUT"; break;
-    case log_event::request: header << "REQUEST"; break;
-    case log_event::info: header << "INFO"; break;
+    case log_event::connecting: header = "CONNECTING"; break;
+    case log_event::disconnecting: header = "DISCONNECTING"; break;
+    case log_event::incoming: header = "IN"; break;
+    case log_event::outgoing: header = "OUT"; break;
+    case log_event::disk: header = "DISK"; break;
+    case log_event::invalid_message: header = "INVALID MESSAGE"; break;
+    case log_event::parole: header = "PAROLE"; break;
+    case log_event::timeout: header = "TIMEOUT"; break;
+    case log_event::request: header = "REQUEST"; break;
+    case log_event::info: header = "INFO"; break;
     }
     // We're not attached to any torrent yet.
     const torrent_id_t id = torrent_ ? torrent_.id() : -1;
-    log::log_peer_session(id, remote_endpoint(), header.str(),
-            util::format(format, std::forward<Args>(args)...), priority);
+    log::log_peer_session(id, remote_endpoint(), connection_age, header, priority,
+            format, args...);
 #endif // TIDE_ENABLE_LOGGING
 }
 
@@ -54,6 +54,8 @@ std::string peer_session_error_category::message(int env) const
         return "Invalid 'reject' message";
     case peer_session_errc::invalid_allow_fast_message:
         return "Invalid 'allow fast' message";
+    case peer_session_errc::invalid_extended_message:
+        return "Invalid 'extended' message";
     case peer_session_errc::unknown_message: return "Could not identify message";
     case peer_session_errc::no_piece_availability_message:
         return "No piece availability message after handshake";
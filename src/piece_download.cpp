@@ -214,10 +214,14 @@ void piece_download::abort_request(const peer_id_type& id, const block_info& blo
         block.remove_peer(id);
         // remove block from peer's registry
         find_peer(id).remove_block(block);
-        // TODO is this correct/needed?
-        block.request_time = time_point();
-        block.status = block::status::free;
-        ++num_pickable_blocks_;
+        // In end-game mode the block may also be requested from other peers, in which
+        // case it's still on its way.
+        if(block.peers.empty()) {
+            // TODO is this correct/needed?
+            block.request_time = time_point();
+            block.status = block::status::free;
+            ++num_pickable_blocks_;
+        }
     }
 }
 
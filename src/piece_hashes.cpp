@@ -0,0 +1,57 @@
+#include "piece_hashes.hpp"
+#include "mmap.hpp"
+#include "system.hpp"
+
+#include <fstream>
+
+namespace tide {
+
+piece_hashes::piece_hashes(string_view hashes)
+{
+    assert(hashes.size() % 20 == 0);
+    auto buffer = std::make_shared<const std::string>(hashes);
+    data_ = buffer->data();
+    num_pieces_ = buffer->size() / 20;
+    owner_ = std::move(buffer);
+}
+
+piece_hashes piece_hashes::map_file(const path& path, error_code& error)
+{
+    error.clear();
+    auto mmap = std::make_shared<mmap_source>();
+    mmap->map(path.string(), error);
+    if(error) {
+        return {};
+    } else if(mmap->size() == 0 || (mmap->size() % 20 != 0)) {
+        error = std::make_error_code(std::errc::invalid_argument);
+        return {};
+    }
+    piece_hashes hashes;
+    hashes.data_ = reinterpret_cast<const char*>(mmap->data());
+    hashes.num_pieces_ = mmap->size() / 20;
+    hashes.owner_ = std::move(mmap);
+    return hashes;
+}
+
+void piece_hashes::write(const path& path, error_code& error) const
+{
+    error.clear();
+    // The file may be mapped by another instance, so rather than overwriting it in
+    // place (which would pull the rug from under the mapping), a new file is written
+    // and moved over the old one.
+    auto tmp_path = path;
+    tmp_path += ".tmp";
+    {
+        std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+        if(file) {
+            file.write(data_, data().size());
+        }
+        if(!file) {
+            error = system::last_error();
+            return;
+        }
+    }
+    std::filesystem::rename(tmp_path, path, error);
+}
+
+} // tide
@@ -4,12 +4,23 @@
 #include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <cstdint>
+#include <limits>
 #include <sstream>
 
 namespace tide {
 
+// Picking first walks the frequency buckets, which usually turns up a piece that
+// peer has within a few positions. If it doesn't within this many, peer has few of the
+// pieces we can pick, and these are instead found by scanning the bitfields.
+constexpr int max_bucket_scan_length = 1024;
+
 piece_picker::piece_picker(const int num_pieces)
-    : my_pieces_(num_pieces), pieces_(num_pieces), piece_pos_map_(num_pieces)
+    : my_pieces_(num_pieces)
+    , reserved_pieces_(num_pieces)
+    , pieces_(num_pieces)
+    , bucket_begins_{0, num_pieces}
+    , piece_pos_map_(num_pieces)
 {
     for(auto i = 0; i < num_pieces; ++i) {
         pieces_[i].index = i;
@@ -19,59 +30,27 @@ piece_picker::piece_picker(const int num_pieces)
 
 piece_picker::piece_picker(bitfield downloaded_pieces)
     : my_pieces_(std::move(downloaded_pieces))
-    , pieces_([this] {
-        int num_missing = 0;
-        for(bool have : my_pieces_) {
-            if(!have) {
-                ++num_missing;
-            }
-        }
-        return num_missing;
-    }())
+    , reserved_pieces_(my_pieces_.size())
+    , pieces_(my_pieces_.size())
     , piece_pos_map_(my_pieces_.size())
 {
-    for(auto piece = 0, pos = 0; piece < num_pieces(); ++piece) {
-        if(my_pieces_[piece]) {
-            // if we have the piece, we don't need it, so don't create an pieces_ entry
-            piece_pos_map_[piece] = invalid_pos;
-        } else {
-            pieces_[pos].index = piece;
-            piece_pos_map_[piece] = pos;
-            ++pos;
-        }
+    // The pieces we need go to the front, the ones we have to the back.
+    int needed_pos = 0;
+    int have_pos = num_pieces();
+    for(auto piece = 0; piece < num_pieces(); ++piece) {
+        const int pos = my_pieces_[piece] ? --have_pos : needed_pos++;
+        pieces_[pos].index = piece;
+        piece_pos_map_[piece] = pos;
     }
+    assert(needed_pos == have_pos);
+    bucket_begins_ = {0, needed_pos};
 }
 
 void piece_picker::set_strategy(const enum strategy s) noexcept
 {
-    if(strategy_ == s) {
-        return;
-    }
-
+    // Each strategy works off the same frequency buckets, so nothing needs to be
+    // rebuilt.
     strategy_ = s;
-    switch(s) {
-    case strategy::random:
-        // Should we shuffle `pieces_`?
-        break; 
-    case strategy::sequential: {
-        // We need to rebuild the piece map to be ordered by piece indices.
-        std::sort(pieces_.begin(), pieces_.end(),
-                [](const piece& a, const piece& b) { return a.index < b.index; });
-        int pos = 0;
-        for(const auto& piece : pieces_) {
-            piece_pos_map_[piece.index] = pos;
-            ++pos;
-        }
-        break;
-    }
-    case strategy::rarest_first: {
-        // Since we're coming from another strategy, we need to rebuild the
-        // frequency map.
-        rebuild_frequency_map();
-        break;
-    }
-    default: assert(0);
-    }
 }
 
 bool piece_picker::am_interested_in(const bitfield& available_pieces) const noexcept
@@ -79,8 +58,8 @@ bool piece_picker::am_interested_in(const bitfield& available_pieces) const noex
     // We're interested in peer if it has at least one piece that we don't have
     // but want.
     assert(available_pieces.size() == my_pieces_.size());
-    for(const auto& piece : pieces_) {
-        if(available_pieces[piece.index]) {
+    for(size_t i = 0; i < my_pieces_.num_words(); ++i) {
+        if((available_pieces.word(i) & ~my_pieces_.word(i)) != 0) {
             return true;
         }
     }
@@ -102,10 +81,10 @@ void piece_picker::piece_availability(std::vector<int>& frequency_map) const
     }
     for(auto i = 0; i < num_pieces(); ++i) {
         const auto pos = piece_pos_map_[i];
-        if(pos != invalid_pos) {
+        if(is_needed(pos)) {
             frequency_map[i] = pieces_[pos].frequency;
         } else {
-            frequency_map[i] = invalid_pos;
+            frequency_map[i] = -1;
         }
     }
 }
@@ -113,127 +92,342 @@ void piece_picker::piece_availability(std::vector<int>& frequency_map) const
 int piece_picker::frequency(const piece_index_t piece) const noexcept
 {
     assert(piece < num_pieces());
-    const auto pos = piece_pos_map_[piece];
-    if(pos != invalid_pos) {
-        return pieces_[pos].frequency;
-    }
-    return 0;
+    return pieces_[piece_pos_map_[piece]].frequency;
 }
 
 void piece_picker::increase_frequency(const piece_index_t piece)
 {
     assert(piece < num_pieces());
-    const auto pos = piece_pos_map_[piece];
-    if(pos != invalid_pos) {
-        ++pieces_[pos].frequency;
-        is_dirty_ = true;
+    int pos = piece_pos_map_[piece];
+    const int frequency = pieces_[pos].frequency;
+    assert(frequency < 0xffff);
+    if(is_needed(pos)) {
+        if(frequency + 1 == num_buckets()) {
+            bucket_begins_.push_back(bucket_begins_.back());
+        }
+        // Move the piece to the end of its bucket and then make that slot the first
+        // one of the next bucket.
+        const int last = bucket_begins_[frequency + 1] - 1;
+        swap_pieces(pos, last);
+        pos = last;
+        --bucket_begins_[frequency + 1];
     }
+    ++pieces_[pos].frequency;
 }
 
 void piece_picker::increase_frequency(const bitfield& available_pieces)
 {
-    for(piece_index_t piece = 0; piece < num_pieces(); ++piece) {
-        if(available_pieces[piece]) {
+    assert(int(available_pieces.size()) == num_pieces());
+    // Moving pieces between buckets one by one costs a few swaps all over `pieces_`
+    // per piece, whereas adjusting the frequencies in place and then rebuilding the
+    // buckets costs a single pass over all pieces, which is cheaper if peer has more
+    // than about a quarter of them.
+    if(int(available_pieces.count()) < num_pieces() / 4) {
+        for(const piece_index_t piece : available_pieces.set_bits()) {
             increase_frequency(piece);
         }
+        return;
+    }
+    for(const piece_index_t index : available_pieces.set_bits()) {
+        auto& piece = pieces_[piece_pos_map_[index]];
+        assert(piece.frequency < 0xffff);
+        ++piece.frequency;
     }
+    rebuild_buckets();
 }
 
 void piece_picker::decrease_frequency(const piece_index_t piece)
 {
     assert(piece < num_pieces());
-    const auto pos = piece_pos_map_[piece];
-    if(pos != invalid_pos) {
-        --pieces_[pos].frequency;
-        is_dirty_ = true;
+    int pos = piece_pos_map_[piece];
+    const int frequency = pieces_[pos].frequency;
+    assert(frequency > 0);
+    if(is_needed(pos)) {
+        // Move the piece to the front of its bucket and then make that slot the last
+        // one of the previous bucket.
+        const int first = bucket_begins_[frequency];
+        swap_pieces(pos, first);
+        pos = first;
+        ++bucket_begins_[frequency];
     }
+    --pieces_[pos].frequency;
 }
 
 void piece_picker::decrease_frequency(const bitfield& available_pieces)
 {
     assert(int(available_pieces.size()) == num_pieces());
-    for(piece_index_t piece = 0; piece < num_pieces(); ++piece) {
-        if(available_pieces[piece]) {
+    // See the comment in increase_frequency.
+    if(int(available_pieces.count()) < num_pieces() / 4) {
+        for(const piece_index_t piece : available_pieces.set_bits()) {
             decrease_frequency(piece);
         }
+        return;
+    }
+    for(const piece_index_t index : available_pieces.set_bits()) {
+        auto& piece = pieces_[piece_pos_map_[index]];
+        assert(piece.frequency > 0);
+        --piece.frequency;
     }
+    rebuild_buckets();
 }
 
 piece_index_t piece_picker::pick(const bitfield& available_pieces)
 {
+    assert(int(available_pieces.size()) == num_pieces());
     if(num_pieces_left() == 0) {
         return invalid_piece_index;
     }
 
-    if((strategy_ == strategy::rarest_first) && is_dirty_) {
-        rebuild_frequency_map();
-    } else if(strategy_ == strategy::random) {
-        return pieces_[util::random_int(0, pieces_.size() - 1)].index;
+    for(const auto& p : time_critical_pieces_) {
+        if(available_pieces[p.index] && !reserved_pieces_[p.index]) {
+            reserve(p.index);
+            return p.index;
+        }
     }
 
-    const auto can_pick = [&available_pieces](const auto& piece) {
-        return !piece.is_reserved && available_pieces[piece.index];
-    };
+    piece_index_t piece = invalid_piece_index;
+    int scan_length = max_bucket_scan_length;
+    switch(strategy_) {
+    case strategy::random: {
+        const int pos = find_pickable(0, num_pieces_left(), available_pieces,
+                scan_length);
+        if(pos != invalid_piece_index) {
+            piece = pieces_[pos].index;
+        } else if(scan_length == 0) {
+            piece = pick_candidate(available_pieces,
+                    util::random_int(0, my_pieces_.num_words() - 1), false);
+        }
+        break;
+    }
+    case strategy::rarest_first:
+        // The protocol suggests that of the pieces that are equally rare, a random one
+        // be picked, which is done by starting the search within a bucket at a random
+        // position.
+        for(auto f = 0; (f < num_buckets()) && (scan_length > 0); ++f) {
+            const int pos = find_pickable(bucket_begins_[f], bucket_begins_[f + 1],
+                    available_pieces, scan_length);
+            if(pos != invalid_piece_index) {
+                piece = pieces_[pos].index;
+                break;
+            }
+        }
+        if((piece == invalid_piece_index) && (scan_length == 0)) {
+            // Here the search starts at a random word for the same reason.
+            piece = pick_candidate(available_pieces,
+                    util::random_int(0, my_pieces_.num_words() - 1), true);
+        }
+        if((piece != invalid_piece_index) && (run_affinity_ >= 0)) {
+            // The piece found above is the rarest we can pick from peer, so no piece
+            // extending a run can be rarer.
+            const int frequency = pieces_[piece_pos_map_[piece]].frequency;
+            const piece_index_t run_extension = pick_run_extension(
+                    available_pieces, frequency, frequency + run_affinity_);
+            if(run_extension != invalid_piece_index) {
+                piece = run_extension;
+            }
+        }
+        break;
+    case strategy::sequential:
+        piece = pick_candidate(available_pieces, 0, false);
+        break;
+    default: assert(0);
+    }
+
+    if(piece != invalid_piece_index) {
+        reserved_pieces_.set(piece);
+    }
+    return piece;
+}
 
-    const auto piece = std::find_if(pieces_.begin(), pieces_.end(),
-            [&can_pick](const auto& piece) { return can_pick(piece); });
+inline piece_index_t piece_picker::pick_candidate(const bitfield& available_pieces,
+        const int first_word, const bool is_rarest_first) const noexcept
+{
+    // No piece we need is rarer than those in the lowest non-empty bucket, so once
+    // such a piece is found, the search is over.
+    int min_frequency = 0;
+    while(bucket_begins_[min_frequency] == bucket_begins_[min_frequency + 1]) {
+        ++min_frequency;
+    }
 
-    // TODO the protocol suggests that given several pieces with the same frequency, we
-    // should randomize our choice; std::sort (in rebuild_frequency_map) does not
-    // guarantee stable sorting, i.e. pieces in a group may get reordered--is this
-    // sufficient for the purposes described in the protocol?
-    if(piece == pieces_.end()) {
-        return invalid_piece_index;
-    } else {
-        piece->is_reserved = true;
-        return piece->index;
+    piece_index_t best_piece = invalid_piece_index;
+    int best_frequency = std::numeric_limits<int>::max();
+    const int n = my_pieces_.num_words();
+    for(auto i = 0, word = first_word; i < n; ++i, ++word) {
+        if(word == n) {
+            word = 0;
+        }
+        // The first piece of a word is in its most significant bit.
+        uint64_t candidates = available_pieces.word(word) & ~my_pieces_.word(word)
+                & ~reserved_pieces_.word(word);
+        while(candidates != 0) {
+            const int bit = __builtin_clzll(candidates);
+            candidates &= ~(uint64_t(1) << (63 - bit));
+            const piece_index_t piece = word * 64 + bit;
+            if(!is_rarest_first) {
+                return piece;
+            }
+            const int frequency = pieces_[piece_pos_map_[piece]].frequency;
+            if(frequency < best_frequency) {
+                best_piece = piece;
+                best_frequency = frequency;
+                if(frequency == min_frequency) {
+                    return piece;
+                }
+            }
+        }
+    }
+    return best_piece;
+}
+
+inline piece_index_t piece_picker::pick_run_extension(const bitfield& available_pieces,
+        const int min_frequency, const int max_frequency) const noexcept
+{
+    piece_index_t best_piece = invalid_piece_index;
+    int best_frequency = max_frequency + 1;
+    const int n = my_pieces_.num_words();
+    // The pieces that are or will soon be on disk.
+    const auto taken = [this](const int word) {
+        return my_pieces_.word(word) | reserved_pieces_.word(word);
+    };
+    uint64_t prev = 0;
+    uint64_t curr = taken(0);
+    for(auto word = 0; word < n; ++word) {
+        const uint64_t next = word + 1 < n ? taken(word + 1) : 0;
+        // The first piece of a word is in its most significant bit, so a piece's
+        // predecessor is one bit to the left, and its successor one bit to the right,
+        // which for the first and last pieces of a word are in the adjacent words.
+        const uint64_t neighbors
+                = (curr >> 1) | (prev << 63) | (curr << 1) | (next >> 63);
+        uint64_t candidates = neighbors & available_pieces.word(word) & ~curr;
+        while(candidates != 0) {
+            const int bit = __builtin_clzll(candidates);
+            candidates &= ~(uint64_t(1) << (63 - bit));
+            const piece_index_t piece = word * 64 + bit;
+            const int frequency = pieces_[piece_pos_map_[piece]].frequency;
+            if(frequency < best_frequency) {
+                best_piece = piece;
+                best_frequency = frequency;
+                if(frequency <= min_frequency) {
+                    return piece;
+                }
+            }
+        }
+        prev = curr;
+        curr = next;
     }
+    return best_piece;
 }
 
-inline void piece_picker::rebuild_frequency_map() noexcept
+inline int piece_picker::find_pickable(const int begin, const int end,
+        const bitfield& available_pieces, int& scan_length) const noexcept
 {
-    if(priority_groups_.empty()) {
-        rebuild_group(pieces_.begin(), pieces_.end());
-    } else {
-        for(const interval& group : priority_groups_) {
-            rebuild_group(pieces_.begin() + group.begin, pieces_.begin() + group.end);
+    if(begin == end) {
+        return invalid_piece_index;
+    }
+    const auto can_pick = [this, &available_pieces](const int pos) {
+        const piece_index_t piece = pieces_[pos].index;
+        return !reserved_pieces_[piece] && available_pieces[piece];
+    };
+    const int start = util::random_int(begin, end - 1);
+    for(auto pos = start; (pos < end) && (scan_length > 0); ++pos, --scan_length) {
+        if(can_pick(pos)) {
+            return pos;
+        }
+    }
+    for(auto pos = begin; (pos < start) && (scan_length > 0); ++pos, --scan_length) {
+        if(can_pick(pos)) {
+            return pos;
         }
-        const int last_group_end = priority_groups_.back().end;
-        rebuild_group(pieces_.begin() + last_group_end, pieces_.end());
     }
-    is_dirty_ = false;
+    return invalid_piece_index;
+}
+
+inline void piece_picker::swap_pieces(const int a, const int b) noexcept
+{
+    assert(a >= 0 && a < int(pieces_.size()));
+    assert(b >= 0 && b < int(pieces_.size()));
+    std::swap(pieces_[a], pieces_[b]);
+    piece_pos_map_[pieces_[a].index] = a;
+    piece_pos_map_[pieces_[b].index] = b;
+}
+
+void piece_picker::rebuild_buckets()
+{
+    // This is a counting sort of the needed pieces by their frequencies.
+    const int num_needed = num_pieces_left();
+    int max_frequency = 0;
+    for(auto pos = 0; pos < num_needed; ++pos) {
+        max_frequency = std::max(max_frequency, int(pieces_[pos].frequency));
+    }
+    bucket_begins_.resize(std::max(num_buckets(), max_frequency + 1) + 1);
+    std::fill(bucket_begins_.begin(), bucket_begins_.end(), 0);
+    for(auto pos = 0; pos < num_needed; ++pos) {
+        ++bucket_begins_[pieces_[pos].frequency + 1];
+    }
+    for(auto f = 1; f <= num_buckets(); ++f) {
+        bucket_begins_[f] += bucket_begins_[f - 1];
+    }
+    assert(bucket_begins_.back() == num_needed);
+
+    std::vector<piece> needed(pieces_.begin(), pieces_.begin() + num_needed);
+    std::vector<int> next_pos(bucket_begins_.begin(), bucket_begins_.end() - 1);
+    for(const auto& piece : needed) {
+        const int pos = next_pos[piece.frequency]++;
+        pieces_[pos] = piece;
+        piece_pos_map_[piece.index] = pos;
+    }
 }
 
-inline void piece_picker::rebuild_group(
-        std::vector<piece>::iterator begin, std::vector<piece>::iterator end) noexcept
+inline void piece_picker::remove_from_buckets(int pos) noexcept
 {
-    std::sort(begin, end, [](const piece& a, const piece& b)
-            { return a.frequency < b.frequency; });
-    while(begin != end) {
-        const int pos = begin - pieces_.begin();
-        assert(pos >= 0);
-        assert(pos < int(pieces_.size()));
-        piece_pos_map_[begin->index] = pos;
-        ++begin;
+    assert(is_needed(pos));
+    // Each step moves the piece to the end of a bucket and then moves the start of
+    // the next bucket back by one, so that the piece becomes its first element. The
+    // last boundary is the end of the needed pieces, so after the last bucket the
+    // piece is just past them.
+    for(auto f = int(pieces_[pos].frequency); f < num_buckets(); ++f) {
+        const int last = bucket_begins_[f + 1] - 1;
+        swap_pieces(pos, last);
+        pos = last;
+        --bucket_begins_[f + 1];
     }
+    assert(!is_needed(pos));
+}
+
+inline void piece_picker::add_to_buckets(int pos)
+{
+    assert(!is_needed(pos));
+    const int frequency = pieces_[pos].frequency;
+    while(frequency >= num_buckets()) {
+        bucket_begins_.push_back(bucket_begins_.back());
+    }
+    // Make the piece the last element of the last bucket, then move it down by
+    // swapping it with the first element of each bucket above its own.
+    const int end = bucket_begins_.back();
+    swap_pieces(pos, end);
+    pos = end;
+    ++bucket_begins_.back();
+    for(auto f = num_buckets() - 1; f > frequency; --f) {
+        const int first = bucket_begins_[f];
+        swap_pieces(pos, first);
+        pos = first;
+        ++bucket_begins_[f];
+    }
+    assert(is_needed(pos));
 }
 
 void piece_picker::reserve(const piece_index_t piece)
 {
     assert(piece < num_pieces());
-    const auto pos = piece_pos_map_[piece];
-    if(pos != invalid_pos) {
-        pieces_[pos].is_reserved = true;
+    if(!my_pieces_[piece]) {
+        reserved_pieces_.set(piece);
     }
 }
 
 void piece_picker::unreserve(const piece_index_t piece)
 {
     assert(piece < num_pieces());
-    const auto pos = piece_pos_map_[piece];
-    if(pos != invalid_pos) {
-        pieces_[pos].is_reserved = false;
-    }
+    reserved_pieces_.reset(piece);
 }
 
 void piece_picker::got(const piece_index_t piece)
@@ -245,48 +439,11 @@ void piece_picker::got(const piece_index_t piece)
     }
 
     my_pieces_[piece] = true;
-    const int pos = piece_pos_map_[piece];
-    assert(pos != invalid_pos);
-    assert(pos < int(pieces_.size()));
-    assert(!pieces_.empty());
-
-    // We no longer need to download this piece.
-    pieces_.erase(pieces_.begin() + pos);
-    piece_pos_map_[piece] = invalid_pos;
-
-    // Now we need to go through all piece entries that came after the now
-    // removed piece, and decrement their position value in `piece_pos_map_` by
-    // one to adjust to the new size.
-    // (Note that where piece used to be now the next piece resides, so don't add 1 to
-    // begin() + pos to get the next piece!)
-    //
-    // TODO OPT since we likely pick the rarest pieces most of the time, that is, those
-    // that are at the front, it means that we have to iterate a lot here; whereas if
-    // rarest pieces started at the back of pieces_, we'd have to iterate very little
-    for(auto it = pieces_.begin() + pos; it != pieces_.end(); ++it) {
-        --piece_pos_map_[it->index];
-        assert(piece_pos_map_[it->index] >= 0);
-        assert(piece_pos_map_[it->index] < int(pieces_.size()));
-    }
-
-    if(priority_groups_.empty()) {
-        return;
-    }
-
-    // We need to adjust the group boundaries.
-    const auto group = std::find_if(priority_groups_.begin(), priority_groups_.end(),
-            [pos](const auto& group) { return group.end > pos; });
-    for(auto it = group; it != priority_groups_.end(); ++it) {
-        it->end -= 1;
-    }
-
-    // This piece may have completed a few groups (a single piece may be in
-    // multiple priority groups if the piece overlaps files).
-    const auto empty_group = std::find_if(group, priority_groups_.end(),
-            [pos](const auto& group) { return group.empty(); });
-    if(empty_group != priority_groups_.end()) {
-        priority_groups_.erase(empty_group);
-    }
+    // We no longer need to download this piece. This costs as many swaps as there
+    // are buckets above the piece's, i.e. it's bounded by the number of peers.
+    reserved_pieces_.reset(piece);
+    remove_from_buckets(piece_pos_map_[piece]);
+    clear_deadline(piece);
 }
 
 void piece_picker::lost(const piece_index_t piece)
@@ -297,12 +454,8 @@ void piece_picker::lost(const piece_index_t piece)
     }
 
     my_pieces_[piece] = false;
-    const int pos = piece_pos_map_[piece];
     // We need to download this piece again.
-    if(pos != invalid_pos) {
-        pieces_.emplace_back(piece);
-        piece_pos_map_[piece] = pieces_.size() - 1;
-    }
+    add_to_buckets(piece_pos_map_[piece]);
 }
 
 /*
@@ -313,6 +466,44 @@ void dont_want_piece(const piece_index_t piece);
 void dont_want_pieces(const interval pieces);
 */
 
+void piece_picker::set_deadline(const piece_index_t piece, const time_point deadline)
+{
+    assert(piece != invalid_piece_index);
+    assert(piece < num_pieces());
+    if(my_pieces_[piece]) {
+        return;
+    }
+    clear_deadline(piece);
+    auto it = std::upper_bound(time_critical_pieces_.begin(),
+            time_critical_pieces_.end(), deadline,
+            [](const time_point& d, const auto& p) { return d < p.deadline; });
+    time_critical_pieces_.insert(it, {piece, deadline});
+}
+
+void piece_picker::clear_deadline(const piece_index_t piece)
+{
+    auto it = std::find_if(time_critical_pieces_.begin(), time_critical_pieces_.end(),
+            [piece](const auto& p) { return p.index == piece; });
+    if(it != time_critical_pieces_.end()) {
+        time_critical_pieces_.erase(it);
+    }
+}
+
+void piece_picker::clear_deadlines()
+{
+    time_critical_pieces_.clear();
+}
+
+time_point piece_picker::deadline(const piece_index_t piece) const noexcept
+{
+    for(const auto& p : time_critical_pieces_) {
+        if(p.index == piece) {
+            return p.deadline;
+        }
+    }
+    return time_point::max();
+}
+
 void piece_picker::make_top_priority(interval pieces) {}
 
 void piece_picker::make_priority(interval pieces) {}
@@ -321,29 +512,22 @@ void piece_picker::clear_priority(interval pieces) {}
 
 std::string piece_picker::to_string() const
 {
-#define PRINT_PIECE(piece)                                                          \
-    do                                                                              \
-        ss << "p(" << piece.index << "|" << piece.frequency << "|"                  \
-           << (piece.is_reserved ? 'R' : '0') << "|" << piece_pos_map_[piece.index] \
-           << ") ";                                                                 \
-    while(0)
     std::ostringstream ss;
-    if(priority_groups_.empty()) {
-        for(const auto& piece : pieces_) {
-            PRINT_PIECE(piece);
+    for(auto f = 0; f < num_buckets(); ++f) {
+        if(bucket_begins_[f] == bucket_begins_[f + 1]) {
+            continue;
         }
-    } else {
-        int pos = 0;
-        for(const auto& group : priority_groups_) {
-            ss << "group#1[" << group.begin << ", " << group.end << "]: ";
-            for(; pos != group.end; ++pos) {
-                PRINT_PIECE(pieces_[pos]);
-            }
-            ss << '\n';
+        ss << "frequency#" << f << "[" << bucket_begins_[f] << ", "
+           << bucket_begins_[f + 1] << "): ";
+        for(auto pos = bucket_begins_[f]; pos < bucket_begins_[f + 1]; ++pos) {
+            const auto& piece = pieces_[pos];
+            ss << "p(" << piece.index << "|" << piece.frequency << "|"
+               << (reserved_pieces_[piece.index] ? 'R' : '0') << "|"
+               << piece_pos_map_[piece.index] << ") ";
         }
+        ss << '\n';
     }
     return ss.str();
-#undef PRINT_PIECE
 }
 
 } // namespace tide
@@ -1,84 +1,170 @@
 #include "rate_limiter.hpp"
 
-#include <algorithm> // min
+#include <algorithm> // min, find_if, remove_if, stable_partition
 #include <cassert>
+#include <iterator> // back_inserter
 
 namespace tide {
 
+// -- token_bucket --
+
+void rate_limiter::token_bucket::refill()
+{
+    const auto now = clock::now();
+    if(!is_unlimited()) {
+        const int64_t elapsed_us = to_int<microseconds>(now - last_refill_time);
+        // Only advance the refill time by as much as was actually turned into
+        // tokens, so that no fractions of a byte are lost to rounding when this is
+        // called in quick succession.
+        const int64_t n = int64_t(rate) * elapsed_us / 1000000;
+        if(n == 0) {
+            return;
+        }
+        if(tokens + n >= capacity) {
+            tokens = capacity;
+            last_refill_time = now;
+        } else {
+            tokens += n;
+            // Round up so that we never credit more tokens than time has passed.
+            last_refill_time += duration_cast<duration>(
+                    std::chrono::nanoseconds((n * 1000000000 + rate - 1) / rate));
+        }
+    } else {
+        last_refill_time = now;
+    }
+}
+
 // -- rate_limiter --
 
+int rate_limiter::quota(const int channel) const noexcept
+{
+    const auto& bucket = buckets_[channel];
+    if(bucket.is_unlimited()) {
+        return unlimited;
+    }
+    // Don't refill here (this is a const method), but account for the tokens that
+    // would be added if we did.
+    const int64_t elapsed_us
+            = to_int<microseconds>(clock::now() - bucket.last_refill_time);
+    const int64_t n = int64_t(bucket.rate) * elapsed_us / 1000000;
+    return std::min(bucket.tokens + n, int64_t(bucket.capacity));
+}
+
+bool rate_limiter::is_unlimited(const int channel) const noexcept
+{
+    for(auto l = this; l; l = l->parent_) {
+        if(!l->buckets_[channel].is_unlimited()) {
+            return false;
+        }
+    }
+    return true;
+}
+
 void rate_limiter::set_max_rate(const int channel, const int n)
 {
     assert(n == unlimited || n > 0);
-    max_quotas_[channel] = n;
-    if((n != unlimited) || (quotas_[channel] > n))
-        quotas_[channel] = n;
+    auto& bucket = buckets_[channel];
+    bucket.refill();
+    bucket.rate = n;
+    if(n == unlimited) {
+        bucket.capacity = unlimited;
+        bucket.tokens = 0;
+    } else {
+        // Allow bursts of up to a tenth of a second's worth of quota, but always
+        // make room for at least a full block.
+        bucket.capacity = std::max(n / 10, 0x4000);
+        bucket.tokens = std::min(bucket.tokens, int64_t(bucket.capacity));
+    }
+    bucket.last_refill_time = clock::now();
 }
 
 void rate_limiter::add_quota(const int channel, const int n)
 {
-    // TODO does it make sense to set quota to 0, effectively blocking all traffic?
-    assert(n == unlimited || n > 0);
-    auto& quota = quotas_[channel];
-    auto& max_quota = max_quotas_[channel];
-    if(n == unlimited) {
-        quota = unlimited;
-        max_quota = unlimited;
-    } else if(quota != unlimited) {
-        quota += n;
-        if((max_quota != unlimited) && (quota > max_quota)) {
-            quota = max_quota;
-        }
+    if(n <= 0) {
+        return;
     }
-    // There may be entities waiting for quota. Since the quota has been increased,
-    // distribute it.
-    while(!quota_requester_queues_[channel].empty()
-            && ((quota == unlimited) || (quota > 0))) {
-        auto& requester = quota_requester_queues_[channel].front();
-        if(quota == unlimited) {
-            requester.handler(requester.num_desired_bytes);
-        } else {
-            const int q = std::min(quota, requester.num_desired_bytes);
-            quota -= q;
-            requester.handler(q);
+    for(auto l = this; l; l = l->parent_) {
+        auto& bucket = l->buckets_[channel];
+        if(!bucket.is_unlimited()) {
+            bucket.tokens = std::min(bucket.tokens + n, int64_t(bucket.capacity));
         }
-        quota_requester_queues_[channel].pop_front();
     }
 }
 
 void rate_limiter::subtract_quota(const int channel, const int n)
 {
     assert(n == unlimited || n > 0);
-    if(quotas_[channel] != unlimited) {
-        if(n == unlimited)
-            quotas_[channel] = 0;
-        else
-            quotas_[channel] -= n;
+    for(auto l = this; l; l = l->parent_) {
+        auto& bucket = l->buckets_[channel];
+        if(!bucket.is_unlimited()) {
+            if(n == unlimited)
+                bucket.tokens = 0;
+            else
+                bucket.tokens -= n;
+        }
+    }
+}
+
+int rate_limiter::available_quota(
+        const int channel, const int num_desired_bytes, const bool refill)
+{
+    int64_t n = num_desired_bytes;
+    for(auto l = this; l && (n > 0); l = l->parent_) {
+        auto& bucket = l->buckets_[channel];
+        if(!bucket.is_unlimited()) {
+            if(refill) {
+                bucket.refill();
+            }
+            n = std::min(n, std::max(bucket.tokens, int64_t(0)));
+        }
+    }
+    return n;
+}
+
+void rate_limiter::charge(const int channel, const int n)
+{
+    for(auto l = this; l; l = l->parent_) {
+        auto& bucket = l->buckets_[channel];
+        if(!bucket.is_unlimited()) {
+            bucket.tokens -= n;
+        }
     }
 }
 
 int rate_limiter::request_quota(const int channel, const int num_desired_bytes)
 {
-    int& quota = quotas_[channel];
-    if(quota == unlimited) {
+    if(is_unlimited(channel)) {
         return num_desired_bytes;
     }
-    const int r = std::min(num_desired_bytes, quota);
-    quota -= r;
-    return r;
+    // Requests that are limited must not jump ahead of those already waiting for
+    // quota, as otherwise those could be starved by entities that happen to request
+    // quota right after it has been refilled.
+    if(!scheduler_->quota_requester_queues_[channel].empty()) {
+        return 0;
+    }
+    const int n = available_quota(channel, num_desired_bytes);
+    // Handing out quota in slivers of a few bytes would have entities issue
+    // a syscall for each, so wait until a more meaningful amount accumulates.
+    if(n < std::min(num_desired_bytes, min_quota_grant)) {
+        return 0;
+    }
+    charge(channel, n);
+    return n;
 }
 
 void rate_limiter::subscribe_for_quota(const int channel, const token_type token,
         const int num_desired_bytes, std::function<void(int)> handler)
 {
-    auto& requester_queue = quota_requester_queues_[channel];
+    auto& requester_queue = scheduler_->quota_requester_queues_[channel];
     // TODO maybe switch to a map based structure for the requester queues
     auto requester = std::find_if(requester_queue.begin(), requester_queue.end(),
             [&token](const auto& r) { return r.token == token; });
     if(requester == requester_queue.end()) {
         quota_requester requester;
         requester.token = token;
+        requester.limiter = this;
         requester.num_desired_bytes = num_desired_bytes;
+        requester.subscription_time = clock::now();
         requester.handler = std::move(handler);
         requester_queue.emplace_back(std::move(requester));
     } else {
@@ -88,7 +174,7 @@ void rate_limiter::subscribe_for_quota(const int channel, const token_type token
 
 void rate_limiter::unsubscribe(const token_type token)
 {
-    for(auto& queue : quota_requester_queues_) {
+    for(auto& queue : scheduler_->quota_requester_queues_) {
         auto it = std::find_if(queue.begin(), queue.end(),
                 [&token](const auto& r) { return r.token == token; });
         if(it != queue.end()) {
@@ -97,92 +183,97 @@ void rate_limiter::unsubscribe(const token_type token)
     }
 }
 
-// -- torrent_rate_limiter --
-
-void torrent_rate_limiter::add_download_quota(const int quota)
+void rate_limiter::unsubscribe_all()
 {
-    if(is_detached_) {
-        rate_limiter::add_download_quota(quota);
+    for(auto& queue : scheduler_->quota_requester_queues_) {
+        queue.erase(std::remove_if(queue.begin(), queue.end(),
+                            [this](const auto& r) { return r.limiter == this; }),
+                queue.end());
     }
 }
 
-void torrent_rate_limiter::add_upload_quota(const int quota)
+void rate_limiter::distribute_quota()
 {
-    if(is_detached_) {
-        rate_limiter::add_upload_quota(quota);
-    }
+    assert(scheduler_ == this);
+    distribute_quota(download);
+    distribute_quota(upload);
 }
 
-void torrent_rate_limiter::subtract_download_quota(const int quota)
+void rate_limiter::distribute_quota(const int channel)
 {
-    if(is_detached_) {
-        rate_limiter::subtract_download_quota(quota);
+    auto& queue = quota_requester_queues_[channel];
+    if(queue.empty()) {
+        return;
     }
-}
 
-void torrent_rate_limiter::subtract_upload_quota(const int quota)
-{
-    if(is_detached_) {
-        rate_limiter::subtract_upload_quota(quota);
+    int quantum = max_quantum;
+    if(!buckets_[channel].is_unlimited()) {
+        quantum = std::max(min_quota_grant,
+                std::min(buckets_[channel].capacity / int(queue.size()), max_quantum));
     }
-}
 
-void torrent_rate_limiter::set_max_download_rate(const int max)
-{
-    if(is_detached_) {
-        rate_limiter::set_max_download_rate(max);
+    // Keep doing rounds until no more quota could be handed out in the last round,
+    // either because buckets ran dry or because everyone's been satisfied. Buckets
+    // are only refilled in the first round, as otherwise the trickle of quota that
+    // accumulates while we're distributing could keep us going indefinitely.
+    bool has_granted_quota = true;
+    for(int round = 0; has_granted_quota; ++round) {
+        has_granted_quota = false;
+        for(auto& r : queue) {
+            const int num_needed_bytes = r.num_desired_bytes - r.num_granted_bytes;
+            if(num_needed_bytes <= 0) {
+                continue;
+            }
+            r.deficit += quantum;
+            const int n = r.limiter->available_quota(
+                    channel, std::min(r.deficit, num_needed_bytes), round == 0);
+            // As in `request_quota`, slivers are not handed out, which here would
+            // also cost the requester its place in the queue.
+            if(n >= std::min(num_needed_bytes, min_quota_grant)) {
+                r.limiter->charge(channel, n);
+                r.deficit -= n;
+                r.num_granted_bytes += n;
+                has_granted_quota = true;
+            } else {
+                // A requester whose buckets are empty must not accumulate a deficit
+                // that it could then use to burst past others later.
+                r.deficit = std::min(r.deficit, quantum);
+            }
+        }
     }
-}
 
-void torrent_rate_limiter::set_max_upload_rate(const int max)
-{
-    if(is_detached_) {
-        rate_limiter::set_max_upload_rate(max);
+    // Remove the requesters that were granted quota before invoking their handlers,
+    // as those may subscribe again, in which case they're placed at the back of the
+    // queue. Requesters that received nothing keep their place.
+    std::deque<quota_requester> served;
+    auto it = std::stable_partition(queue.begin(), queue.end(),
+            [](const auto& r) { return r.num_granted_bytes == 0; });
+    std::move(it, queue.end(), std::back_inserter(served));
+    queue.erase(it, queue.end());
+    const time_point now = clock::now();
+    for(const auto& r : served) {
+        total_quota_wait_time_[channel] += now - r.subscription_time;
+    }
+    num_quota_waits_[channel] += served.size();
+    for(auto& r : served) {
+        r.handler(r.num_granted_bytes);
     }
 }
 
-int torrent_rate_limiter::request_download_quota(const int num_desired_bytes)
-{
-    if(is_detached_)
-        return rate_limiter::request_download_quota(num_desired_bytes);
-    else
-        return global_rate_limiter.request_download_quota(num_desired_bytes);
-}
-
-int torrent_rate_limiter::request_upload_quota(const int num_desired_bytes)
-{
-    if(is_detached_)
-        return rate_limiter::request_upload_quota(num_desired_bytes);
-    else
-        return global_rate_limiter.request_upload_quota(num_desired_bytes);
-}
-
-void torrent_rate_limiter::subscribe_for_download_quota(const token_type token,
-        const int num_desired_bytes, std::function<void(int)> handler)
-{
-    if(is_detached_)
-        rate_limiter::subscribe_for_download_quota(
-                token, num_desired_bytes, std::move(handler));
-    else
-        global_rate_limiter.subscribe_for_download_quota(
-                token, num_desired_bytes, std::move(handler));
-}
+// -- peer_rate_limiter --
 
-void torrent_rate_limiter::subscribe_for_upload_quota(const token_type token,
-        const int num_desired_bytes, std::function<void(int)> handler)
+void peer_rate_limiter::attach(torrent_rate_limiter& torrent)
 {
-    if(is_detached_)
-        rate_limiter::subscribe_for_upload_quota(
-                token, num_desired_bytes, std::move(handler));
-    else
-        global_rate_limiter.subscribe_for_upload_quota(
-                token, num_desired_bytes, std::move(handler));
+    torrent_ = &torrent;
+    parent_ = &torrent.peer_class_rate_limiter(class_);
 }
 
-void torrent_rate_limiter::unsubscribe(const token_type token)
+void peer_rate_limiter::set_peer_class(const peer_class c)
 {
-    rate_limiter::unsubscribe(token);
-    global_rate_limiter.unsubscribe(token);
+    class_ = c;
+    if(torrent_) {
+        parent_ = &torrent_->peer_class_rate_limiter(c);
+    }
 }
 
 } // tide
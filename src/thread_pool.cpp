@@ -1,5 +1,6 @@
 #include "thread_pool.hpp"
 #include "scope_guard.hpp"
+#include "trace.hpp"
 
 namespace tide {
 
@@ -44,7 +45,7 @@ void thread_pool::set_concurrency(const int n)
 void thread_pool::post(job_type job)
 {
     std::unique_lock<std::mutex> l(job_queue_mutex_);
-    job_queue_.emplace_back(std::move(job));
+    job_queue_.push_back({std::move(job), clock::now()});
     l.unlock();
     handle_new_job();
 }
@@ -90,14 +91,15 @@ inline void thread_pool::handle_new_job()
 inline void thread_pool::run(std::thread& thread)
 {
     util::scope_guard termination_guard([this, &thread] { assert(0 && "TODO"); });
+    trace::set_thread_name("thread_pool");
     while(!is_joining_.load(std::memory_order_acquire)) {
-        time_point idle_start = ts_cached_clock::now();
+        const time_point idle_start = clock::now();
         std::unique_lock<std::mutex> job_queue_lock(job_queue_mutex_);
         // wake up if thread pool is beign joined or a new job is available
         job_available_.wait(job_queue_lock, [this, &thread] {
             return is_joining_.load(std::memory_order_acquire) || !job_queue_.empty();
         });
-        idle_time_.fetch_add(to_int<milliseconds>(ts_cached_clock::now() - idle_start),
+        idle_time_.fetch_add(to_int<nanoseconds>(clock::now() - idle_start),
                 std::memory_order_relaxed);
 
         // thread woke up because thread_pool is stopping thread or thread hasn't
@@ -121,10 +123,22 @@ inline void thread_pool::execute_jobs(
         job_queue_.pop_front();
         job_queue_lock.unlock();
 
-        const time_point work_start = ts_cached_clock::now();
-        job(); // TODO exception safety
-        work_time_.fetch_add(to_int<milliseconds>(ts_cached_clock::now() - work_start),
+        // Unlike the cached clocks, this is accurate enough to time short jobs.
+        const time_point work_start = clock::now();
+        wait_time_.fetch_add(to_int<nanoseconds>(work_start - job.queue_time),
                 std::memory_order_relaxed);
+        job.job(); // TODO exception safety
+        const time_point work_end = clock::now();
+        work_time_.fetch_add(to_int<nanoseconds>(work_end - work_start),
+                std::memory_order_relaxed);
+        if(trace::is_enabled()) {
+            // The queueing is recorded as an asynchronous span as it overlaps
+            // whatever this thread was doing while the job was queued.
+            trace::detail::record_async("thread_pool", "queued",
+                    to_int<nanoseconds>(job.queue_time), to_int<nanoseconds>(work_start));
+            trace::detail::record("thread_pool", "job", to_int<nanoseconds>(work_start),
+                    to_int<nanoseconds>(work_end), nullptr, 0);
+        }
         num_executed_jobs_.fetch_add(1, std::memory_order_relaxed);
 
         job_queue_lock.lock();
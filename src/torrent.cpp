@@ -1,5 +1,9 @@
 #include "torrent.hpp"
 #include "alert_queue.hpp"
+#include "announce_scheduler.hpp"
+#include "connection_scheduler.hpp"
+#include "counters.hpp"
+#include "dht.hpp"
 #include "disk_io.hpp"
 #include "endpoint_filter.hpp"
 #include "engine_info.hpp"
@@ -9,10 +13,14 @@
 #include "settings.hpp"
 #include "sha1_hasher.hpp"
 #include "string_utils.hpp"
+#include "trace.hpp"
+#include "upload_slot_allocator.hpp"
+#include "utp_socket.hpp"
 #include "view.hpp"
 
 #include <algorithm>
 #include <cmath> // floor, min, max, pow
+#include <system_error>
 
 namespace tide {
 
@@ -20,18 +28,35 @@ namespace tide {
 // `std::shared_ptr` to the instance to each async op's handler along with `this`.
 #define SHARED_THIS this, self(shared_from_this())
 
+/** Rate limits left to the implementation mean no limit. */
+inline int to_rate_limit(const int n) noexcept
+{
+    return n == values::none ? rate_limiter::unlimited : n;
+}
+
 // Common constructor.
 torrent::torrent(torrent_id_t id, const int num_pieces, asio::io_context& ios,
         disk_io& disk_io, rate_limiter& global_rate_limiter,
+        buffer_budget& buffer_budget, utp_socket_manager& utp_socket_manager,
+        connection_scheduler& connection_scheduler,
+        upload_slot_allocator& upload_slot_allocator,
+        announce_scheduler& announce_scheduler, dht_node& dht_node,
         const settings& global_settings, engine_info& global_info,
-        std::vector<tracker_entry> trackers, endpoint_filter& endpoint_filter,
-        alert_queue& alert_queue)
+        counters& counters, std::vector<tracker_entry> trackers,
+        endpoint_filter& endpoint_filter, alert_queue& alert_queue)
     : ios_(ios)
     , disk_io_(disk_io)
     , global_rate_limiter_(global_rate_limiter)
     , local_rate_limiter_(global_rate_limiter_)
+    , buffer_budget_(buffer_budget)
+    , utp_socket_manager_(utp_socket_manager)
+    , connection_scheduler_(connection_scheduler)
+    , upload_slot_allocator_(upload_slot_allocator)
+    , announce_scheduler_(announce_scheduler)
+    , dht_node_(dht_node)
     , global_settings_(global_settings)
     , global_info_(global_info)
+    , counters_(counters)
     , endpoint_filter_(endpoint_filter)
     , alert_queue_(alert_queue)
     , trackers_(std::move(trackers))
@@ -47,38 +72,54 @@ torrent::torrent(torrent_id_t id, const int num_pieces, asio::io_context& ios,
 
 // For new torrents.
 torrent::torrent(torrent_id_t id, asio::io_context& ios, disk_io& disk_io,
-        rate_limiter& global_rate_limiter, const settings& global_settings,
-        engine_info& global_info, std::vector<tracker_entry> trackers,
+        rate_limiter& global_rate_limiter, buffer_budget& buffer_budget,
+        utp_socket_manager& utp_socket_manager,
+        connection_scheduler& connection_scheduler,
+        upload_slot_allocator& upload_slot_allocator,
+        announce_scheduler& announce_scheduler, dht_node& dht_node,
+        const settings& global_settings, engine_info& global_info,
+        counters& counters, std::vector<tracker_entry> trackers,
         endpoint_filter& endpoint_filter, alert_queue& alert_queue, torrent_args args)
     : torrent(id, args.metainfo.num_pieces, ios, disk_io, global_rate_limiter,
-              global_settings, global_info, std::move(trackers), endpoint_filter,
+              buffer_budget, utp_socket_manager, connection_scheduler,
+              upload_slot_allocator, announce_scheduler, dht_node, global_settings,
+              global_info, counters, std::move(trackers), endpoint_filter,
               alert_queue)
 {
     apply_torrent_args(args);
     if(!info_.settings.download_sequentially && piece_picker_.num_have_pieces() < 4) {
         piece_picker_.set_strategy(piece_picker::strategy::random);
     }
+    piece_picker_.set_run_affinity(info_.settings.piece_run_affinity);
 }
 
 // For resumed torrents.
 // TODO
 torrent::torrent(torrent_id_t id, asio::io_context& ios, disk_io& disk_io,
-        rate_limiter& global_rate_limiter, const settings& global_settings,
-        engine_info& global_info, std::vector<tracker_entry> trackers,
+        rate_limiter& global_rate_limiter, buffer_budget& buffer_budget,
+        utp_socket_manager& utp_socket_manager,
+        connection_scheduler& connection_scheduler,
+        upload_slot_allocator& upload_slot_allocator,
+        announce_scheduler& announce_scheduler, dht_node& dht_node,
+        const settings& global_settings, engine_info& global_info,
+        counters& counters, std::vector<tracker_entry> trackers,
         endpoint_filter& endpoint_filter, alert_queue& alert_queue, bmap resume_data)
     : torrent(id, resume_data.find_number("num_pieces"), ios, disk_io,
-              global_rate_limiter, global_settings, global_info, std::move(trackers),
+              global_rate_limiter, buffer_budget, utp_socket_manager,
+              connection_scheduler, upload_slot_allocator, announce_scheduler, dht_node,
+              global_settings, global_info, counters, std::move(trackers),
               endpoint_filter, alert_queue)
 {
     restore_resume_data(resume_data);
     if(!info_.settings.download_sequentially) {
         piece_picker_.set_strategy(piece_picker::strategy::random);
     }
+    piece_picker_.set_run_affinity(info_.settings.piece_run_affinity);
 }
 
 void torrent::apply_torrent_args(torrent_args& args)
 {
-    piece_hashes_ = args.metainfo.piece_hashes;
+    piece_hashes_ = piece_hashes(args.metainfo.piece_hashes);
 
     info_.info_hash = create_sha1_digest(args.metainfo.source.find_bmap("info").encode());
     info_.save_path = std::move(args.save_path);
@@ -135,12 +176,25 @@ void torrent::start()
     }
 
     announce(tracker_request::started);
+    if(is_auto_managed()) {
+        subscribe_to_upload_slots();
+    }
 
     if(!peer_sessions_.empty()) {
         log(log_event::update, "trying to reconnect %i peers", peer_sessions_.size());
         for(auto& session : peer_sessions_) {
+            // Disconnected sessions are reconnected without waiting for a slot, as
+            // there are at most as many of these as we had connections before.
+            if(session->is_disconnected()) {
+                connection_scheduler_.on_connect_started();
+            }
             session->start();
         }
+    }
+
+    // Even without peers the update cycle must run while the DHT is enabled, as
+    // that's where it looks for peers.
+    if(!peer_sessions_.empty() || global_settings_.enable_dht) {
         update();
     }
 
@@ -161,6 +215,10 @@ void torrent::stop()
 
     log(log_event::update, "stopping torrent");
 
+    connection_scheduler_.unsubscribe(this);
+    upload_slot_allocator_.unsubscribe(this);
+    // Cancel our pending announces, but not the `stopped` event.
+    announce_scheduler_.unsubscribe(this);
     announce(tracker_request::stopped);
     for(auto& session : peer_sessions_) {
         if(!session->is_stopped()) {
@@ -186,6 +244,9 @@ void torrent::abort()
     log(log_event::update, "aborting torrent");
 
     update_timer_.cancel();
+    connection_scheduler_.unsubscribe(this);
+    upload_slot_allocator_.unsubscribe(this);
+    announce_scheduler_.unsubscribe(this);
 
     for(auto& session : peer_sessions_) {
         if(!session->is_disconnected()) {
@@ -219,24 +280,47 @@ void torrent::force_tracker_announce(string_view url)
     }
 }
 
-void torrent::attach_peer_session(std::shared_ptr<peer_session> session)
+bool torrent::attach_peer_session(std::shared_ptr<peer_session> session)
 {
-    if(!session) {
-        return;
-    }
-    if(info_.settings.max_connections != values::unlimited
-            && peer_sessions_.size() < info_.settings.max_connections) {
-        // TODO
-        peer_sessions_.emplace_back(std::move(session));
-    } else {
-#ifdef TIDE_ENABLE_LOGGING
-        const auto& ep = session->remote_endpoint();
-        const auto& ip = ep.address().to_string();
-        log(log_event::peer, "connection limit reached, can't connect to %s:%i",
-                ip.c_str(), ep.port());
-#endif // TIDE_ENABLE_LOGGING
-       // alert_queue_.emplace<torrent_connection_limit_reached_alert>(get_handle());
+    if(!session || is_stopped()) {
+        return false;
+    }
+    const auto& ep = session->remote_endpoint();
+    if(!endpoint_filter_.is_allowed(ep)) {
+        log(log_event::peer, "peer(%s:%i) is blocked, refusing connection",
+                ep.address().to_string().c_str(), ep.port());
+        counters_.increment(counters::num_blocked_connections);
+        return false;
+    }
+    const int num_free_slots
+            = std::min(info_.settings.max_connections - int(peer_sessions_.size()),
+                    global_settings_.max_connections - global_info_.num_connections);
+    if(num_free_slots <= 0) {
+        log(log_event::peer, "connection limit reached, refusing %s:%i",
+                ep.address().to_string().c_str(), ep.port());
+        return false;
+    }
+    peer_sessions_.emplace_back(std::move(session));
+    // Released in `on_peer_session_stopped`, like the slots of outbound sessions.
+    ++global_info_.num_connections;
+    return true;
+}
+
+void torrent::apply_endpoint_filter()
+{
+    for(auto& session : peer_sessions_) {
+        if(!session->is_stopped()
+                && !endpoint_filter_.is_allowed(session->remote_endpoint())) {
+            const auto& ep = session->remote_endpoint();
+            const auto& ip = ep.address().to_string();
+            log(log_event::peer, "peer(%s:%i) is blocked, disconnecting",
+                    ip.c_str(), ep.port());
+            session->stop();
+        }
     }
+    auto it = std::remove_if(available_peers_.begin(), available_peers_.end(),
+            [this](const auto& c) { return !endpoint_filter_.is_allowed(c.endpoint); });
+    available_peers_.erase(it, available_peers_.end());
 }
 
 void torrent::make_file_top_priority(const int file_index)
@@ -273,6 +357,29 @@ void torrent::deprioritize_piece(const piece_index_t piece)
     piece_picker_.clear_priority(interval{piece, piece + 1});
 }
 
+void torrent::set_piece_deadline(const piece_index_t piece, const milliseconds deadline)
+{
+    if((piece < 0) || (piece >= info_.num_pieces)) {
+        return;
+    }
+    piece_picker_.set_deadline(piece, cached_clock::now() + deadline);
+}
+
+void torrent::set_file_range_deadline(const int file_index, const int64_t offset,
+        const int64_t length, const milliseconds deadline)
+{
+    const interval pieces = storage_.pieces_in_file_range(file_index, offset, length);
+    const time_point d = cached_clock::now() + deadline;
+    for(auto piece = pieces.begin; piece < pieces.end; ++piece) {
+        piece_picker_.set_deadline(piece, d);
+    }
+}
+
+void torrent::clear_piece_deadlines()
+{
+    piece_picker_.clear_deadlines();
+}
+
 void torrent::auto_manage() noexcept
 {
     info_.is_auto_managed = true;
@@ -280,7 +387,20 @@ void torrent::auto_manage() noexcept
     info_.settings.max_connections = values::none;
     info_.settings.max_download_rate = values::none;
     info_.settings.max_upload_rate = values::none;
-    local_rate_limiter_.attach_to_global_rate_limiter();
+    info_.settings.max_tcp_download_rate = values::none;
+    info_.settings.max_tcp_upload_rate = values::none;
+    info_.settings.max_utp_download_rate = values::none;
+    info_.settings.max_utp_upload_rate = values::none;
+    local_rate_limiter_.set_max_download_rate(rate_limiter::unlimited);
+    local_rate_limiter_.set_max_upload_rate(rate_limiter::unlimited);
+    for(auto c : {peer_class::tcp, peer_class::utp}) {
+        auto& l = local_rate_limiter_.peer_class_rate_limiter(c);
+        l.set_max_download_rate(rate_limiter::unlimited);
+        l.set_max_upload_rate(rate_limiter::unlimited);
+    }
+    if(is_running()) {
+        subscribe_to_upload_slots();
+    }
 }
 
 void torrent::apply_settings(const torrent_settings& s)
@@ -301,15 +421,23 @@ void torrent::apply_settings(const torrent_settings& s)
     }
     if(!info_.settings.download_sequentially && s.download_sequentially)
         piece_picker_.set_strategy(piece_picker::strategy::sequential);
+    piece_picker_.set_run_affinity(s.piece_run_affinity);
 
     set_max_upload_slots(s.max_upload_slots);
     set_max_connections(s.max_connections);
     set_max_download_rate(s.max_download_rate);
     set_max_upload_rate(s.max_upload_rate);
+    auto& tcp_rate_limiter = local_rate_limiter_.peer_class_rate_limiter(peer_class::tcp);
+    tcp_rate_limiter.set_max_download_rate(to_rate_limit(s.max_tcp_download_rate));
+    tcp_rate_limiter.set_max_upload_rate(to_rate_limit(s.max_tcp_upload_rate));
+    auto& utp_rate_limiter = local_rate_limiter_.peer_class_rate_limiter(peer_class::utp);
+    utp_rate_limiter.set_max_download_rate(to_rate_limit(s.max_utp_download_rate));
+    utp_rate_limiter.set_max_upload_rate(to_rate_limit(s.max_utp_upload_rate));
 
     info_.settings = s;
     // Torrent has its own settings now, so we'll no longer default to the global ones.
     info_.is_auto_managed = false;
+    upload_slot_allocator_.unsubscribe(this);
 }
 
 void torrent::set_max_upload_slots(const int max_upload_slots)
@@ -329,16 +457,16 @@ void torrent::set_max_upload_slots(const int max_upload_slots)
     info_.settings.max_upload_slots = max_upload_slots;
 }
 
+// The torrent's own limits apply in addition to the global ones, as it stays
+// below the global rate limiter.
 void torrent::set_max_download_rate(const int n)
 {
-    local_rate_limiter_.set_max_download_rate(n);
-    local_rate_limiter_.detach_from_global_rate_limiter();
+    local_rate_limiter_.set_max_download_rate(to_rate_limit(n));
 }
 
 void torrent::set_max_upload_rate(const int n)
 {
-    local_rate_limiter_.set_max_upload_rate(n);
-    local_rate_limiter_.detach_from_global_rate_limiter();
+    local_rate_limiter_.set_max_upload_rate(to_rate_limit(n));
 }
 
 void torrent::set_max_connections(const int max_connections)
@@ -402,6 +530,25 @@ inline void torrent::on_torrent_allocated(
     }
 }
 
+inline void torrent::report_missed_deadlines()
+{
+    const time_point now = cached_clock::now();
+    // Deadlines are in ascending order, so we can stop at the first one in the
+    // future.
+    for(const auto& p : piece_picker_.time_critical_pieces()) {
+        if(p.deadline >= now) {
+            break;
+        } else if(p.deadline > last_deadline_check_time_) {
+            log(log_event::download, log::priority::high,
+                    "missed deadline of piece(%i) by %lli ms", p.index,
+                    to_int<milliseconds>(now - p.deadline));
+            alert_queue_.emplace<piece_deadline_missed_alert>(
+                    get_handle(), p.index, p.deadline);
+        }
+    }
+    last_deadline_check_time_ = now;
+}
+
 inline bool torrent::should_save_resume_data() const noexcept
 {
     // Don't save more frequently than this, it would just overwhelm disk.
@@ -415,8 +562,15 @@ inline void torrent::save_resume_data()
         return;
     }
     log(log_event::disk, "saving torrent resume data");
-    disk_io_.save_torrent_resume_data(id(), create_resume_data(),
-            [SHARED_THIS](const error_code& error) { on_resume_data_saved(error); });
+    // The buffer is lent to disk_io and handed back once the data is saved, so that
+    // it can be reused the next time around.
+    resume_data_buffer_.clear();
+    create_resume_data(resume_data_buffer_);
+    disk_io_.save_torrent_resume_data(id(), std::move(resume_data_buffer_),
+            [SHARED_THIS](const error_code& error, std::string buffer) {
+                resume_data_buffer_ = std::move(buffer);
+                on_resume_data_saved(error);
+            });
     has_state_changed_ = false;
     info_.state[torrent_info::saving_state] = true;
     info_.last_resume_data_save_time = cached_clock::now();
@@ -438,96 +592,95 @@ void torrent::on_resume_data_saved(const error_code& error)
     }
 }
 
-bmap_encoder torrent::create_resume_data() const
+void torrent::create_resume_data(std::string& buffer) const
 {
-    // TODO maybe don't use string keys but named constants?
-    // e.g. `resume_data_key::info_hash`
-    // or resume_data_key(const auto& field) => &field - &info
-    bmap_encoder resume_data;
-
-    // info
-    resume_data["info_hash"]
-            = std::string(info_.info_hash.begin(), info_.info_hash.end());
-    resume_data["bitfield"]
-            = is_seed() ? "have_all" : piece_picker_.my_bitfield().to_string();
-    resume_data["save_path"] = info_.save_path.c_str();
-    resume_data["name"] = info_.name;
-    // TODO maybe deduce these by adding together the file lengths when we read them back
-    resume_data["size"] = info_.size;
-    resume_data["wanted_size"] = info_.wanted_size;
-    resume_data["num_pieces"] = info_.num_pieces;
-    resume_data["num_wanted_pieces"] = info_.num_wanted_pieces;
-    resume_data["num_downloaded_pieces"] = info_.num_downloaded_pieces;
-    resume_data["num_pending_pieces"] = info_.num_pending_pieces;
-    resume_data["piece_hashes"] = piece_hashes_.data();
-    resume_data["files"] = [this] {
-        blist_encoder files_list;
-        for(const auto& f : info_.files) {
-            bmap_encoder file_map;
-            file_map["path"] = f.path.c_str();
-            file_map["length"] = f.length;
-            file_map["downloaded_length"] = f.downloaded_length;
-            file_map["is_wanted"] = f.is_wanted ? 1 : 0;
-            files_list.push_back(file_map);
-        }
-        return files_list;
-    }();
-    resume_data["priority_files"] = [this] {
-        blist_encoder priority_files;
-        for(const auto& f : info_.priority_files) {
-            priority_files.push_back(f);
-        }
-        return priority_files;
-    }();
-    resume_data["partial_pieces"] = [this] {
-        blist_encoder partial_pieces;
-        for(const auto& d : downloads_) {
-            bmap_encoder piece;
-            piece["index"] = d->piece_index();
-            blist_encoder blocks;
-            int i = 0;
-            for(const piece_download::block block : d->blocks()) {
-                if(block.status == piece_download::block::status::received) {
-                    // Save the block indices, they are at 0x4000 offsets.
-                    blocks.push_back(i);
-                }
-                ++i;
+    // Bencode requires the keys to be in lexicographical order, so they are written
+    // in that order rather than grouped by meaning (the encoder asserts this). The
+    // piece hashes are not included, they're saved in a sidecar file by storage.
+    bencoder encoder(buffer);
+    encoder.begin_map();
+    encoder.key("bitfield").string(
+            is_seed() ? "have_all" : piece_picker_.my_bitfield().to_string());
+    encoder.key("download_finished_time")
+            .number(to_int<seconds>(info_.download_finished_time));
+    encoder.key("download_sequentially").number(info_.settings.download_sequentially);
+    encoder.key("download_started_time")
+            .number(to_int<seconds>(info_.download_started_time));
+    encoder.key("files").begin_list();
+    for(const auto& f : info_.files) {
+        encoder.begin_map()
+                .key("downloaded_length")
+                .number(f.downloaded_length)
+                .key("is_wanted")
+                .number(f.is_wanted ? 1 : 0)
+                .key("length")
+                .number(f.length)
+                .key("path")
+                .string(f.path.c_str())
+                .end_map();
+    }
+    encoder.end_list();
+    encoder.key("info_hash").string(
+            string_view(reinterpret_cast<const char*>(info_.info_hash.data()),
+                    info_.info_hash.size()));
+    encoder.key("max_connections").number(info_.settings.max_connections);
+    encoder.key("max_download_rate").number(info_.settings.max_download_rate);
+    encoder.key("max_tcp_download_rate").number(info_.settings.max_tcp_download_rate);
+    encoder.key("max_tcp_upload_rate").number(info_.settings.max_tcp_upload_rate);
+    encoder.key("max_upload_rate").number(info_.settings.max_upload_rate);
+    encoder.key("max_upload_slots").number(info_.settings.max_upload_slots);
+    encoder.key("max_utp_download_rate").number(info_.settings.max_utp_download_rate);
+    encoder.key("max_utp_upload_rate").number(info_.settings.max_utp_upload_rate);
+    encoder.key("name").string(info_.name);
+    encoder.key("num_disk_io_failures").number(info_.num_disk_io_failures);
+    encoder.key("num_downloaded_pieces").number(info_.num_downloaded_pieces);
+    encoder.key("num_hash_fails").number(info_.num_hash_fails);
+    encoder.key("num_illicit_requests").number(info_.num_illicit_requests);
+    encoder.key("num_pending_pieces").number(info_.num_pending_pieces);
+    encoder.key("num_pieces").number(info_.num_pieces);
+    encoder.key("num_run_extending_pieces").number(info_.num_run_extending_pieces);
+    encoder.key("num_timed_out_requests").number(info_.num_timed_out_requests);
+    encoder.key("num_unwanted_blocks").number(info_.num_unwanted_blocks);
+    encoder.key("num_wanted_pieces").number(info_.num_wanted_pieces);
+    encoder.key("partial_pieces").begin_list();
+    for(const auto& d : downloads_) {
+        encoder.begin_map().key("blocks").begin_list();
+        int i = 0;
+        for(const piece_download::block block : d->blocks()) {
+            if(block.status == piece_download::block::status::received) {
+                // Save the block indices, they are at 0x4000 offsets.
+                encoder.number(i);
             }
-            piece["blocks"] = blocks;
-            partial_pieces.push_back(piece);
+            ++i;
         }
-        return partial_pieces;
-    }();
-
-    // settings
-    resume_data["download_sequentially"] = info_.settings.download_sequentially;
-    resume_data["stop_when_downloaded"] = info_.settings.stop_when_downloaded;
-    resume_data["max_upload_slots"] = info_.settings.max_upload_slots;
-    resume_data["max_connections"] = info_.settings.max_connections;
-    resume_data["max_upload_rate"] = info_.settings.max_upload_rate;
-    resume_data["max_download_rate"] = info_.settings.max_download_rate;
-
-    // stats
-    resume_data["total_seed_time"] = to_int<seconds>(info_.total_seed_time);
-    resume_data["total_leech_time"] = to_int<seconds>(info_.total_leech_time);
-    resume_data["download_started_time"] = to_int<seconds>(info_.download_started_time);
-    resume_data["download_finished_time"] = to_int<seconds>(info_.download_finished_time);
-    resume_data["total_downloaded_piece_bytes"] = info_.total_downloaded_piece_bytes;
-    resume_data["total_uploaded_piece_bytes"] = info_.total_uploaded_piece_bytes;
-    resume_data["total_downloaded_bytes"] = info_.total_downloaded_bytes;
-    resume_data["total_uploaded_bytes"] = info_.total_uploaded_bytes;
-    resume_data["total_verified_piece_bytes"] = info_.total_verified_piece_bytes;
-    resume_data["total_failed_piece_bytes"] = info_.total_failed_piece_bytes;
-    resume_data["total_wasted_bytes"] = info_.total_wasted_bytes;
-    resume_data["total_bytes_written_to_disk"] = info_.total_bytes_written_to_disk;
-    resume_data["total_bytes_read_from_disk"] = info_.total_bytes_read_from_disk;
-    resume_data["num_hash_fails"] = info_.num_hash_fails;
-    resume_data["num_illicit_requests"] = info_.num_illicit_requests;
-    resume_data["num_unwanted_blocks"] = info_.num_unwanted_blocks;
-    resume_data["num_disk_io_failures"] = info_.num_disk_io_failures;
-    resume_data["num_timed_out_requests"] = info_.num_timed_out_requests;
-
-    return resume_data;
+        encoder.end_list().key("index").number(d->piece_index()).end_map();
+    }
+    encoder.end_list();
+    encoder.key("piece_run_affinity").number(info_.settings.piece_run_affinity);
+    encoder.key("priority_files").begin_list();
+    for(const auto& f : info_.priority_files) {
+        encoder.number(f);
+    }
+    encoder.end_list();
+    encoder.key("save_path").string(info_.save_path.c_str());
+    // TODO maybe deduce these by adding together the file lengths when we read them back
+    encoder.key("size").number(info_.size);
+    encoder.key("stop_when_downloaded").number(info_.settings.stop_when_downloaded);
+    encoder.key("total_bytes_read_from_disk").number(info_.total_bytes_read_from_disk);
+    encoder.key("total_bytes_written_to_disk")
+            .number(info_.total_bytes_written_to_disk);
+    encoder.key("total_downloaded_bytes").number(info_.total_downloaded_bytes);
+    encoder.key("total_downloaded_piece_bytes")
+            .number(info_.total_downloaded_piece_bytes);
+    encoder.key("total_failed_piece_bytes").number(info_.total_failed_piece_bytes);
+    encoder.key("total_leech_time").number(to_int<seconds>(info_.total_leech_time));
+    encoder.key("total_seed_time").number(to_int<seconds>(info_.total_seed_time));
+    encoder.key("total_uploaded_bytes").number(info_.total_uploaded_bytes);
+    encoder.key("total_uploaded_piece_bytes").number(info_.total_uploaded_piece_bytes);
+    encoder.key("total_verified_piece_bytes").number(info_.total_verified_piece_bytes);
+    encoder.key("total_wasted_bytes").number(info_.total_wasted_bytes);
+    encoder.key("wanted_size").number(info_.wanted_size);
+    encoder.end_map();
 }
 
 void torrent::restore_resume_data(const bmap& resume_data)
@@ -563,7 +716,22 @@ void torrent::restore_resume_data(const bmap& resume_data)
     resume_data.try_find_number("num_wanted_pieces", info_.num_wanted_pieces);
     resume_data.try_find_number("num_downloaded_pieces", info_.num_downloaded_pieces);
     resume_data.try_find_number("num_pending_pieces", info_.num_pending_pieces);
-    resume_data.try_find_string("piece_hashes", piece_hashes_);
+    // Resume data saved by older versions has the piece hashes inline, otherwise
+    // they're mapped from their own file.
+    string_view hashes;
+    if(resume_data.try_find_string_view("piece_hashes", hashes)) {
+        piece_hashes_ = piece_hashes(hashes);
+    } else {
+        // There is no metainfo from which to rederive the hashes, so without them
+        // the torrent cannot be restored.
+        error_code ec;
+        piece_hashes_ = disk_io_.map_piece_hashes(info_.id, ec);
+        if(ec) {
+            log(log_event::disk, log::priority::high, "ERROR mapping piece hashes: %s",
+                    ec.message().c_str());
+            throw std::system_error(ec, "could not map piece hashes");
+        }
+    }
 
     blist files;
     resume_data.try_find_blist("files", files);
@@ -613,10 +781,19 @@ void torrent::restore_resume_data(const bmap& resume_data)
             "download_sequentially", info_.settings.download_sequentially);
     resume_data.try_find_number(
             "stop_when_downloaded", info_.settings.stop_when_downloaded);
+    resume_data.try_find_number("piece_run_affinity", info_.settings.piece_run_affinity);
     resume_data.try_find_number("max_upload_slots", info_.settings.max_upload_slots);
     resume_data.try_find_number("max_connections", info_.settings.max_connections);
     resume_data.try_find_number("max_upload_rate", info_.settings.max_upload_rate);
     resume_data.try_find_number("max_download_rate", info_.settings.max_download_rate);
+    resume_data.try_find_number(
+            "max_tcp_download_rate", info_.settings.max_tcp_download_rate);
+    resume_data.try_find_number(
+            "max_tcp_upload_rate", info_.settings.max_tcp_upload_rate);
+    resume_data.try_find_number(
+            "max_utp_download_rate", info_.settings.max_utp_download_rate);
+    resume_data.try_find_number(
+            "max_utp_upload_rate", info_.settings.max_utp_upload_rate);
 
     // stats
     int int_buffer = 0;
@@ -649,6 +826,8 @@ void torrent::restore_resume_data(const bmap& resume_data)
     resume_data.try_find_number("num_unwanted_blocks", info_.num_unwanted_blocks);
     resume_data.try_find_number("num_disk_io_failures", info_.num_disk_io_failures);
     resume_data.try_find_number("num_timed_out_requests", info_.num_timed_out_requests);
+    resume_data.try_find_number(
+            "num_run_extending_pieces", info_.num_run_extending_pieces);
 }
 
 void torrent::announce(const int event, const bool force)
@@ -658,8 +837,6 @@ void torrent::announce(const int event, const bool force)
         return;
     }
 
-    tracker_request request = prepare_tracker_request(event);
-
     // If the event is stopped or completed, we need to send it to all trackers
     // to which we have announced in the past, otherwise just pick the most
     // suitable tracker, as we're just requesting more peers.
@@ -672,22 +849,14 @@ void torrent::announce(const int event, const bool force)
                     || (entry.has_sent_stopped && event == tracker_request::stopped)) {
                 continue;
             } else if(entry.has_sent_started && entry.tracker->is_reachable()) {
-                log(log_event::tracker, log::priority::high,
-                        "sending event(%s) to tracker(%s)",
-                        event == tracker_request::completed ? "completed" : "stopped",
-                        entry.tracker->url().c_str());
-                entry.tracker->announce(request,
-                        [SHARED_THIS, &entry, event](
-                                const error_code& ec, tracker_response r) {
-                            on_announce_response(entry, ec, std::move(r), event);
-                        });
-                info_.state[torrent_info::announcing] = true;
+                schedule_announce(entry, event);
             }
         }
     } else {
         tracker_entry* t = pick_tracker(force);
         if(!t) {
-            if(trackers_.empty() && peer_sessions_.empty() && available_peers_.empty()) {
+            if(trackers_.empty() && peer_sessions_.empty() && available_peers_.empty()
+                    && !global_settings_.enable_dht) {
                 log(log_event::tracker, log::priority::high,
                         "couldn't find tracker to announce to and we don't have"
                         " any peers, stopping torrent");
@@ -696,24 +865,51 @@ void torrent::announce(const int event, const bool force)
             log(log_event::tracker, "cannot announce, no suitable tracker");
             return;
         }
-        tracker_entry& entry = *t;
         // If we haven't sent the `started` event before, this is the first time
         // contacting tracker, in which case we must send a `started` event.
-        if(!entry.has_sent_started) {
-            request.event = tracker_request::started;
-        }
-        log(log_event::tracker, log::priority::high, "sending event(%s) to tracker(%s)",
-                request.event == tracker_request::started ? "started" : "none",
-                entry.tracker->url().c_str());
-        entry.tracker->announce(std::move(request),
-                [SHARED_THIS, &entry, event = request.event](
-                        const error_code& ec, tracker_response r) {
-                    on_announce_response(entry, ec, std::move(r), event);
-                });
-        info_.state[torrent_info::announcing] = true;
+        schedule_announce(
+                *t, t->has_sent_started ? event : tracker_request::started, force);
     }
 }
 
+inline void torrent::schedule_announce(
+        tracker_entry& entry, const int event, const bool force)
+{
+    // Forced and `stopped` announces are sent right away. Then come the rest of the
+    // events and the announces of torrents that have no peers, which are still
+    // jittered, so that e.g. the `started` events of all torrents after a restart
+    // are spread out. The rest are served in the order of their number of peers.
+    const int priority = force || (event == tracker_request::stopped)
+            ? announce_scheduler::urgent
+            : event != tracker_request::none ? 1 : std::max(total_peers(), 1);
+    announce_scheduler_.schedule(this, event, *entry.tracker, priority,
+            [SHARED_THIS, &entry, event](announce_scheduler::in_flight_announce f) {
+                send_announce(entry, event, std::move(f));
+            });
+    info_.state[torrent_info::announcing] = true;
+}
+
+void torrent::send_announce(tracker_entry& entry, const int event,
+        announce_scheduler::in_flight_announce in_flight)
+{
+    log(log_event::tracker, log::priority::high, "sending event(%s) to tracker(%s)",
+            event == tracker_request::started
+                    ? "started"
+                    : event == tracker_request::completed
+                            ? "completed"
+                            : event == tracker_request::stopped ? "stopped" : "none",
+            entry.tracker->url().c_str());
+    // The request is only prepared now so that it reports our current stats.
+    entry.tracker->announce(prepare_tracker_request(event),
+            [SHARED_THIS, &entry, event, in_flight = std::move(in_flight)](
+                    const error_code& ec, tracker_response r) mutable {
+                // Trackers may drop the handler without invoking it, in which case
+                // the announce is concluded when the handler is destroyed.
+                in_flight.reset();
+                on_announce_response(entry, ec, std::move(r), event);
+            });
+}
+
 inline tracker_request torrent::prepare_tracker_request(const int event) const noexcept
 {
     tracker_request request;
@@ -805,8 +1001,8 @@ void torrent::on_announce_response(tracker_entry& tracker, const error_code& err
                 tracker.tracker->url().c_str(),
                 response.peers.size() + response.ipv4_peers.size()
                         + response.ipv6_peers.size(),
-                response.interval, response.num_seeders, response.num_leechers,
-                response.tracker_id.c_str());
+                to_int<seconds>(response.interval), response.num_seeders,
+                response.num_leechers, response.tracker_id.c_str());
     }
     // alert_queue_.emplace<announce_response_alert>(tracker.tracker.url(),
     // response.interval, response.num_seeders, response.num_leechers);
@@ -814,6 +1010,10 @@ void torrent::on_announce_response(tracker_entry& tracker, const error_code& err
     const auto now = cached_clock::now();
     info_.last_announce_time = now;
     tracker.last_announce_time = now;
+    if(response.interval > seconds(0)) {
+        tracker.interval = response.interval;
+    }
+    tracker.min_interval = response.min_interval;
     if(event == tracker_request::started)
         tracker.has_sent_started = true;
     else if(event == tracker_request::completed)
@@ -868,7 +1068,8 @@ inline void torrent::on_announce_error(
         if(++tracker.num_fails > 100) {
             trackers_.erase(std::find_if(trackers_.begin(), trackers_.end(),
                     [&tracker](const auto& t) { return &t == &tracker; }));
-            if(trackers_.empty() && peer_sessions_.empty() && available_peers_.empty()) {
+            if(trackers_.empty() && peer_sessions_.empty() && available_peers_.empty()
+                    && !global_settings_.enable_dht) {
                 stop();
                 return;
             }
@@ -879,7 +1080,46 @@ inline void torrent::on_announce_error(
     }
 }
 
-inline void torrent::add_peer(tcp::endpoint peer)
+inline bool torrent::should_scrape_tracker() const noexcept
+{
+    return !trackers_.empty()
+            && (cached_clock::now() - trackers_.front().last_scrape_time >= minutes(30));
+}
+
+void torrent::scrape_tracker()
+{
+    tracker_entry& entry = trackers_.front();
+    entry.last_scrape_time = cached_clock::now();
+    log(log_event::tracker, "scraping tracker(%s)", entry.tracker->url().c_str());
+    entry.tracker->scrape({info_.info_hash},
+            [SHARED_THIS, &entry](const error_code& ec, scrape_response r) {
+                on_scrape_response(entry, ec, std::move(r));
+            });
+}
+
+void torrent::on_scrape_response(
+        tracker_entry& tracker, const error_code& error, scrape_response response)
+{
+    if(error || !response.failure_reason.empty()) {
+        log(log_event::tracker, "failed to scrape tracker(%s): %s",
+                tracker.tracker->url().c_str(),
+                error ? error.message().c_str() : response.failure_reason.c_str());
+        return;
+    }
+    for(const auto& status : response.torrent_statuses) {
+        if(status.info_hash == info_.info_hash) {
+            tracker.num_scraped_seeders = status.num_seeders;
+            tracker.num_scraped_leechers = status.num_leechers;
+            tracker.num_scraped_downloads = status.num_downloaded;
+            log(log_event::tracker,
+                    "scraped tracker(%s) (seeders: %i; leechers: %i; downloads: %i)",
+                    tracker.tracker->url().c_str(), status.num_seeders,
+                    status.num_leechers, status.num_downloaded);
+        }
+    }
+}
+
+inline void torrent::add_peer(tcp::endpoint peer, const bool supports_utp)
 {
     if(endpoint_filter_.is_allowed(peer)) {
         // Only add peer if it's not already connected or is in `available_peers_`.
@@ -887,36 +1127,102 @@ inline void torrent::add_peer(tcp::endpoint peer)
                 [&peer](const auto& session) {
                     return session->remote_endpoint() == peer;
                 });
-        auto apit = std::find(available_peers_.begin(), available_peers_.end(), peer);
+        auto apit = std::find_if(available_peers_.begin(), available_peers_.end(),
+                [&peer](const auto& candidate) { return candidate.endpoint == peer; });
         if((psit == peer_sessions_.end()) && (apit == available_peers_.end())) {
             const auto address = peer.address().to_string();
             log(log_event::update, "adding peer(%s:%i)", address.c_str(), peer.port());
-            available_peers_.emplace_back(std::move(peer));
+            available_peers_.emplace_back(std::move(peer), supports_utp);
+        } else if((apit != available_peers_.end()) && supports_utp) {
+            apit->supports_utp = true;
         }
     }
 }
 
+inline bool torrent::should_announce_to_dht() const noexcept
+{
+    if(!global_settings_.enable_dht || !dht_node_.is_running()
+            || (dht_node_.num_nodes() == 0)) {
+        return false;
+    }
+    const auto interval = needs_peers() ? minutes(1) : minutes(15);
+    return cached_clock::now() - last_dht_announce_time_ >= interval;
+}
+
+inline void torrent::announce_to_dht()
+{
+    log(log_event::update, "looking up peers in DHT (%i nodes)", dht_node_.num_nodes());
+    last_dht_announce_time_ = cached_clock::now();
+    dht_node_.get_peers(info_.info_hash, global_settings_.listener_port,
+            [SHARED_THIS](std::vector<tcp::endpoint> peers) {
+                on_dht_peers(std::move(peers));
+            });
+}
+
+void torrent::on_dht_peers(std::vector<tcp::endpoint> peers)
+{
+    log(log_event::update, "received %i peers from DHT", peers.size());
+    for(auto& ep : peers) {
+        add_peer(std::move(ep));
+    }
+    // The update cycle is always running while the DHT is enabled, but don't wait
+    // for its next round to connect to the new peers.
+    if(!is_stopped() && should_connect_peers()) {
+        connect_peers();
+    }
+}
+
+inline void torrent::exchange_peers()
+{
+    last_pex_time_ = cached_clock::now();
+    std::vector<tcp::endpoint> peers;
+    peers.reserve(peer_sessions_.size());
+    for(const auto& session : peer_sessions_) {
+        if(session->is_connected()) {
+            const auto endpoint = session->listen_endpoint();
+            if(endpoint.port() != 0) {
+                peers.emplace_back(endpoint);
+            }
+        }
+    }
+    for(auto& session : peer_sessions_) {
+        session->send_pex(peers);
+    }
+}
+
+void torrent::on_pex_peers(
+        std::vector<tcp::endpoint> peers, std::vector<bool> supports_utp)
+{
+    assert(peers.size() == supports_utp.size());
+    log(log_event::update, "received %i peers through PEX", peers.size());
+    for(auto i = 0; i < int(peers.size()); ++i) {
+        add_peer(std::move(peers[i]), supports_utp[i]);
+    }
+    if(!is_stopped() && should_connect_peers()) {
+        connect_peers();
+    }
+}
+
 void torrent::update(const error_code& error)
 {
-    if(error) {
+    // The timer is cancelled when the torrent is aborted, and it's also re-armed
+    // (cancelling the pending wait) when the update cycle is restarted by a new
+    // batch of peers.
+    if(error == asio::error::operation_aborted) {
+        return;
+    } else if(error) {
         log(log_event::update, "error in update cycle: %s", error.message().c_str());
         alert_queue_.emplace<torrent_stopped_alert>(get_handle());
         stop();
         return;
     }
+    TIDE_TRACE_SCOPE("torrent", "update", "torrent", info_.id);
 
     log(log_event::update, "upload rate: %i bytes/s; download rate: %i bytes/s",
             info_.upload_rate.rate(), info_.download_rate.rate());
 
-    if(local_rate_limiter_.is_detached_from_global_rate_limiter()) {
-        assert(!is_auto_managed());
-        assert(info_.settings.max_download_rate == values::unlimited
-                || info_.settings.max_download_rate > 0);
-        assert(info_.settings.max_upload_rate == values::unlimited
-                || info_.settings.max_upload_rate > 0);
-        local_rate_limiter_.add_download_quota(info_.settings.max_download_rate);
-        local_rate_limiter_.add_upload_quota(info_.settings.max_upload_rate);
-    }
+    // NOTE: `local_rate_limiter_` refills its quota on its own as time passes, so
+    // there is no need to do it here.
 
     remove_finished_peer_sessions();
 
@@ -943,9 +1249,22 @@ void torrent::update(const error_code& error)
                         ? info_.settings.max_connections
                         : global_settings_.max_connections);
     }
+    if(should_announce_to_dht()) {
+        announce_to_dht();
+    }
+    if(cached_clock::now() - last_pex_time_ >= minutes(1)) {
+        exchange_peers();
+    }
+    if(should_scrape_tracker()) {
+        scrape_tracker();
+    }
+
+    report_missed_deadlines();
 
-    // Only run the unchoke procedure every 10 seconds.
-    if(cached_clock::now() - info_.last_unchoke_time >= seconds(10)) {
+    // Only run the unchoke procedure every 10 seconds. Auto managed torrents are
+    // unchoked in the global rounds of `upload_slot_allocator_` instead.
+    if(!is_auto_managed()
+            && (cached_clock::now() - info_.last_unchoke_time >= seconds(10))) {
         unchoke();
     }
 
@@ -1004,8 +1323,30 @@ void torrent::connect_peers()
     if(num_to_connect <= 0) {
         return;
     }
+    connection_scheduler_.subscribe(this, num_to_connect,
+            [SHARED_THIS](const int num_slots) { on_connection_slots_granted(num_slots); });
+}
+
+void torrent::on_connection_slots_granted(const int num_slots)
+{
+    if(is_stopped()) {
+        return;
+    }
+    // The number of peers we may connect may have changed since we subscribed.
+    const int num_to_connect = std::min(num_slots, num_connectable_peers());
+    if(num_to_connect <= 0) {
+        return;
+    }
     log(log_event::update, "connecting %i peer%c", num_to_connect,
             num_to_connect == 1 ? 0 : 's');
+    // Try the peers we could connect to in the past first and those we failed to
+    // connect to last. The sort is stable so that otherwise peers are connected in
+    // the order in which we learned about them.
+    std::stable_sort(available_peers_.begin(), available_peers_.end(),
+            [](const auto& a, const auto& b) {
+                return a.num_successful_connects - a.num_failed_connects
+                        > b.num_successful_connects - b.num_failed_connects;
+            });
     for(auto i = 0; i < num_to_connect; ++i) {
         connect_peer(available_peers_[i]);
     }
@@ -1014,12 +1355,26 @@ void torrent::connect_peers()
             available_peers_.begin(), available_peers_.begin() + num_to_connect);
 }
 
-inline void torrent::connect_peer(tcp::endpoint& peer)
+inline void torrent::connect_peer(peer_candidate& peer)
 {
-    const auto address = peer.address().to_string();
-    log(log_event::update, "connecting peer(%s:%i)", address.c_str(), peer.port());
-    peer_sessions_.emplace_back(std::make_shared<peer_session>(ios_, std::move(peer),
-            local_rate_limiter_, global_settings_.peer_session, torrent_frontend(*this)));
+    const auto address = peer.endpoint.address().to_string();
+    log(log_event::update, "connecting peer(%s:%i)", address.c_str(),
+            peer.endpoint.port());
+    // Prefer uTP as it yields to other traffic on congested links, but only with
+    // peers known to support it (see `peer_candidate::supports_utp`). Should the
+    // uTP connection fail nonetheless, `peer_session` falls back to TCP.
+    std::unique_ptr<stream_socket> socket;
+    if(peer.supports_utp && global_settings_.enable_utp
+            && utp_socket_manager_.is_open()) {
+        socket = std::make_unique<utp_socket>(utp_socket_manager_);
+    } else {
+        socket = std::make_unique<tcp_stream_socket>(ios_);
+    }
+    connection_scheduler_.on_connect_started();
+    peer_sessions_.emplace_back(std::make_shared<peer_session>(ios_, peer.endpoint,
+            local_rate_limiter_, buffer_budget_, global_settings_.peer_session,
+            std::move(socket), torrent_frontend(*this)));
+    outbound_peers_.emplace_back(std::move(peer));
     peer_sessions_.back()->start();
     // Even if we're unsuccessful in connecting peer, we still want to reserve a
     // connection slot, i.e. increase this field (it will be decreased when this
@@ -1064,12 +1419,63 @@ void torrent::on_peer_session_stopped(peer_session& session)
 
     --global_info_.num_connections;
 
+    if(session.is_outbound()) {
+        on_outbound_peer_session_stopped(session);
+    }
+
     if(num_connected_peers() == 0) {
         // alert_queue_.emplace<torrent_idle_alert>(get_handle());
         // log(
     }
 }
 
+void torrent::on_peer_session_connected(peer_session& session)
+{
+    connection_scheduler_.on_connect_succeeded(
+            session.connection_established_time() - session.connection_started_time());
+}
+
+inline void torrent::on_outbound_peer_session_stopped(peer_session& session)
+{
+    const bool has_connected = session.connection_established_time() != time_point();
+    if(!has_connected) {
+        connection_scheduler_.on_connect_failed();
+    }
+
+    auto it = std::find_if(outbound_peers_.begin(), outbound_peers_.end(),
+            [&session](const auto& candidate) {
+                return candidate.endpoint == session.remote_endpoint();
+            });
+    if(it == outbound_peers_.end()) {
+        return;
+    }
+    peer_candidate candidate = std::move(*it);
+    outbound_peers_.erase(it);
+
+    if(has_connected) {
+        ++candidate.num_successful_connects;
+        // If we tried uTP but ended up on TCP, peer doesn't support uTP after all.
+        candidate.supports_utp = session.is_utp();
+        // A peer that closes the connection soon after we connected is likely to
+        // do so again (e.g. because it's at its connection limit).
+        if(session.connection_duration() < minutes(1)) {
+            ++candidate.num_failed_connects;
+        }
+    } else {
+        ++candidate.num_failed_connects;
+    }
+
+    // Keep the peer around so that we may try it again later, unless there's no
+    // point in doing so.
+    if(is_stopped() || !endpoint_filter_.is_allowed(candidate.endpoint)
+            || (candidate.num_failed_connects
+                       >= global_settings_.peer_session.max_connection_attempts)
+            || (is_seed() && session.is_peer_seed())) {
+        return;
+    }
+    available_peers_.emplace_back(std::move(candidate));
+}
+
 inline void torrent::update_thread_safe_info()
 {
     std::unique_lock<std::mutex> l(ts_info_mutex_);
@@ -1079,6 +1485,7 @@ inline void torrent::update_thread_safe_info()
     ts_info_.num_pieces = info_.num_pieces;
     ts_info_.num_wanted_pieces = info_.num_wanted_pieces;
     ts_info_.num_downloaded_pieces = info_.num_downloaded_pieces;
+    ts_info_.num_run_extending_pieces = info_.num_run_extending_pieces;
     ts_info_.num_pending_pieces = info_.num_pending_pieces;
     ts_info_.num_blocks = info_.num_blocks;
     ts_info_.num_pending_blocks = info_.num_pending_blocks;
@@ -1134,11 +1541,18 @@ void torrent::unchoke()
 
     // Put the unchoke candidates at the beginning of the peer list.
     sort_unchoke_candidates(num_to_unchoke);
-    // Now go through all the peers and unchoke the first num_to_unchoke ones and
-    // choke the rest if they aren't already.
+    unchoke_first_candidates(num_to_unchoke);
+    if(unchoke_optimistically) { /*optimistic_unchoke();*/
+    }
+}
+
+void torrent::unchoke_first_candidates(const int n)
+{
+    // Go through all the peers and unchoke the first n ones and choke the rest if
+    // they aren't already.
     info_.num_unchoked_peers = 0;
     for(auto& session : peer_sessions_) {
-        if(info_.num_unchoked_peers < num_to_unchoke) {
+        if(info_.num_unchoked_peers < n) {
             if(session->is_peer_choked() && session->is_peer_interested()) {
                 session->unchoke_peer();
 #ifdef TIDE_ENABLE_LOGGING
@@ -1160,10 +1574,59 @@ void torrent::unchoke()
             }
         }
     }
-    if(unchoke_optimistically) { /*optimistic_unchoke();*/
+}
+
+void torrent::subscribe_to_upload_slots()
+{
+    upload_slot_allocator_.subscribe(this,
+            [this](std::vector<int>& expected_rates, const int n) {
+                rank_unchoke_candidates(expected_rates, n);
+            },
+            [this](const int num_slots) { on_upload_slots_allotted(num_slots); });
+}
+
+void torrent::rank_unchoke_candidates(std::vector<int>& expected_rates, const int n)
+{
+    const auto expected_rate = [](const peer_session& session) {
+        return session.is_peer_choked() ? session.peak_upload_rate()
+                                        : session.upload_rate();
+    };
+    // Only interested peers may be unchoked, so they're put first, and of those the
+    // ones with the highest expected rates, as `upload_slot_allocator` expects the
+    // reported rates in non-increasing order. Ties are broken by the torrent's own
+    // choke algorithm.
+    const auto interested_end = std::partition(peer_sessions_.begin(),
+            peer_sessions_.end(),
+            [](const auto& session) { return session->is_peer_interested(); });
+    const int num_candidates
+            = std::min(n, int(interested_end - peer_sessions_.begin()));
+    std::partial_sort(peer_sessions_.begin(), peer_sessions_.begin() + num_candidates,
+            interested_end, [this, &expected_rate](const auto& a, const auto& b) {
+                const int rate_a = expected_rate(*a);
+                const int rate_b = expected_rate(*b);
+                if(rate_a != rate_b) {
+                    return rate_a > rate_b;
+                }
+                return unchoke_comparator_(*a, *b);
+            });
+    for(auto i = 0; i < num_candidates; ++i) {
+        expected_rates.push_back(expected_rate(*peer_sessions_[i]));
     }
 }
 
+void torrent::on_upload_slots_allotted(const int num_slots)
+{
+    info_.last_unchoke_time = cached_clock::now();
+    ++info_.num_choke_cycles;
+    if((num_slots == 0) && (info_.num_unchoked_peers == 0)) {
+        return;
+    }
+    // `peer_sessions_` is still sorted from ranking the candidates earlier in this
+    // round.
+    log(log_event::choke, "allotted %i upload slot(s)", num_slots);
+    unchoke_first_candidates(num_slots);
+}
+
 void torrent::optimistic_unchoke()
 {
     if(peer_sessions_.size() == info_.num_unchoked_peers) {
@@ -1277,7 +1740,20 @@ void torrent::on_new_piece(piece_download& download, const bool is_valid)
 
 inline void torrent::handle_valid_piece(piece_download& download)
 {
-    ++info_.num_downloaded_pieces;
+    // A time critical piece that arrived late, but before its deadline was checked
+    // in the update cycle, would otherwise go unreported, since got() clears it.
+    const time_point deadline = piece_picker_.deadline(download.piece_index());
+    if((deadline > last_deadline_check_time_) && (deadline < cached_clock::now())) {
+        alert_queue_.emplace<piece_deadline_missed_alert>(
+                get_handle(), download.piece_index(), deadline);
+    }
+
+    const piece_index_t piece = download.piece_index();
+    const auto& my_pieces = piece_picker_.my_bitfield();
+    if(((piece > 0) && my_pieces[piece - 1])
+            || ((piece + 1 < info_.num_pieces) && my_pieces[piece + 1])) {
+        ++info_.num_run_extending_pieces;
+    }
 
     // Notify piece piecker that this piece was downloaded.
     piece_picker_.got(download.piece_index());
@@ -1319,6 +1795,8 @@ inline void torrent::handle_valid_piece(piece_download& download)
 inline void torrent::handle_corrupt_piece(piece_download& download)
 {
     piece_picker_.unreserve(download.piece_index());
+    // The piece has to be downloaded again, so not every block is requested anymore.
+    info_.state[torrent_info::end_game] = false;
     const int piece_length = get_piece_length(info_, download.piece_index());
     // We failed to download piece, free it for others to redownload.
     info_.total_wasted_bytes += piece_length;
@@ -1386,7 +1864,7 @@ void torrent::log(const log_event event, const log::priority priority, const cha
         Args&&... args) const
 {
 #ifdef TIDE_ENABLE_LOGGING
-    const auto header = [event]() -> std::string {
+    const char* header = [event] {
         switch(event) {
         case log_event::update: return "UPDATE";
         case log_event::download: return "DOWNLOAD";
@@ -1398,8 +1876,7 @@ void torrent::log(const log_event event, const log::priority priority, const cha
         default: return "";
         }
     }();
-    log::log_torrent(id(), std::move(header),
-            util::format(format, std::forward<Args>(args)...), priority);
+    log::log_torrent(id(), header, priority, format, args...);
 #endif // TIDE_ENABLE_LOGGING
 }
 
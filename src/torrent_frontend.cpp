@@ -1,8 +1,10 @@
 #include "torrent_frontend.hpp"
 #include "block_info.hpp"
+#include "dht.hpp"
 #include "disk_io.hpp"
 #include "piece_download.hpp"
 #include "piece_picker.hpp"
+#include "settings.hpp"
 #include "torrent.hpp"
 #include "torrent_info.hpp"
 
@@ -35,6 +37,11 @@ const torrent_info& torrent_frontend::info() const noexcept
     return torrent_->info_;
 }
 
+class counters& torrent_frontend::counters() noexcept
+{
+    return torrent_->counters_;
+}
+
 const sha1_hash& torrent_frontend::info_hash() const noexcept
 {
     return torrent_->info_.info_hash;
@@ -45,6 +52,27 @@ torrent_id_t torrent_frontend::id() const noexcept
     return torrent_->info_.id;
 }
 
+torrent_rate_limiter& torrent_frontend::rate_limiter() noexcept
+{
+    return torrent_->local_rate_limiter_;
+}
+
+class dht_node& torrent_frontend::dht_node() noexcept
+{
+    return torrent_->dht_node_;
+}
+
+uint16_t torrent_frontend::listener_port() const noexcept
+{
+    return torrent_->global_settings_.listener_port;
+}
+
+void torrent_frontend::on_pex_peers(
+        std::vector<tcp::endpoint> peers, std::vector<bool> supports_utp)
+{
+    torrent_->on_pex_peers(std::move(peers), std::move(supports_utp));
+}
+
 std::vector<std::shared_ptr<piece_download>>& torrent_frontend::downloads() noexcept
 {
     return torrent_->downloads_;
@@ -79,4 +107,9 @@ void torrent_frontend::on_peer_session_stopped(peer_session& session)
     torrent_->on_peer_session_stopped(session);
 }
 
+void torrent_frontend::on_peer_session_connected(peer_session& session)
+{
+    torrent_->on_peer_session_connected(session);
+}
+
 } // namespace tide
@@ -41,6 +41,27 @@ void torrent_handle::deprioritize_piece(const piece_index_t piece)
     thread_safe_execution([this, piece](torrent& t) { t.deprioritize_piece(piece); });
 }
 
+void torrent_handle::set_piece_deadline(
+        const piece_index_t piece, const milliseconds deadline)
+{
+    thread_safe_execution([this, piece, deadline](torrent& t) {
+        t.set_piece_deadline(piece, deadline);
+    });
+}
+
+void torrent_handle::set_file_range_deadline(const int file_index, const int64_t offset,
+        const int64_t length, const milliseconds deadline)
+{
+    thread_safe_execution([this, file_index, offset, length, deadline](torrent& t) {
+        t.set_file_range_deadline(file_index, offset, length, deadline);
+    });
+}
+
+void torrent_handle::clear_piece_deadlines()
+{
+    thread_safe_execution([this](torrent& t) { t.clear_piece_deadlines(); });
+}
+
 void torrent_handle::apply_settings(const torrent_settings& settings)
 {
     thread_safe_execution([this, settings](torrent& t) { t.apply_settings(settings); });
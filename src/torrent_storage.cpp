@@ -6,6 +6,7 @@
 #include "log.hpp"
 #include "string_utils.hpp"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 
@@ -14,12 +15,12 @@
 namespace tide {
 
 // A `shared_ptr` to info is passed in case torrent is removed while this is running.
-torrent_storage::torrent_storage(const torrent_info& info, string_view piece_hashes,
+torrent_storage::torrent_storage(const torrent_info& info, piece_hashes hashes,
         std::filesystem::path resume_data_path)
     : resume_data_(resume_data_path, 0,
               file::open_mode_flags{
                       file::read_write, file::sequential, file::no_os_cache})
-    , piece_hashes_(piece_hashes)
+    , piece_hashes_(std::move(hashes))
     , root_path_(info.files.size() == 1 ? info.save_path : info.save_path / info.name)
     , name_(info.name)
     , piece_length_(info.piece_length)
@@ -36,7 +37,7 @@ torrent_storage::torrent_storage(const torrent_info& info, string_view piece_has
 
 inline bool torrent_storage::is_file_index_valid(const file_index_t index) const noexcept
 {
-    return (index > 0) && (index < files_.size());
+    return (index >= 0) && (index < files_.size());
 }
 
 interval torrent_storage::pieces_in_file(const file_index_t file) const noexcept
@@ -47,6 +48,22 @@ interval torrent_storage::pieces_in_file(const file_index_t file) const noexcept
     return interval(files_[file].first_piece, files_[file].last_piece + 1);
 }
 
+interval torrent_storage::pieces_in_file_range(const file_index_t file,
+        const int64_t offset, const int64_t length) const noexcept
+{
+    if(!is_file_index_valid(file) || (offset < 0) || (length <= 0)) {
+        return {};
+    }
+    const auto& f = files_[file];
+    const int64_t file_length = f.storage.length();
+    const int64_t begin = f.torrent_offset + std::min(offset, file_length);
+    const int64_t end = f.torrent_offset + std::min(offset + length, file_length);
+    if(begin >= end) {
+        return {};
+    }
+    return interval(begin / piece_length_, (end - 1) / piece_length_ + 1);
+}
+
 interval torrent_storage::files_containing_piece(const piece_index_t piece) const noexcept
 {
     auto file = std::find_if(files_.cbegin(), files_.cend(),
@@ -92,11 +109,10 @@ file_slice torrent_storage::get_file_slice(
 
 sha1_hash torrent_storage::expected_piece_hash(const piece_index_t piece) const noexcept
 {
-    if((piece >= 0) && (piece < num_pieces_)) {
-        assert(!piece_hashes_.empty());
+    if((piece >= 0) && (piece < piece_hashes_.num_pieces())) {
         sha1_hash hash;
-        const auto src = piece_hashes_.data() + piece * 20;
-        std::copy(src, src + 20, hash.begin());
+        const auto src = piece_hashes_[piece];
+        std::copy(src.begin(), src.end(), hash.begin());
         return hash;
     }
     assert(false);
@@ -121,7 +137,22 @@ void torrent_storage::dont_want_file(const file_index_t file) noexcept
 
 void torrent_storage::move_resume_data(std::filesystem::path path, error_code& error)
 {
+    const auto old_piece_hashes_path = piece_hashes_path(resume_data_.absolute_path());
     resume_data_.move(path, error);
+    // The hashes file may also have been written in a previous session.
+    error_code ec;
+    if(!error && std::filesystem::exists(old_piece_hashes_path, ec)) {
+        std::filesystem::rename(old_piece_hashes_path,
+                piece_hashes_path(resume_data_.absolute_path()), error);
+    }
+}
+
+std::filesystem::path torrent_storage::piece_hashes_path(
+        const std::filesystem::path& resume_data_path)
+{
+    auto path = resume_data_path;
+    path += ".pieces";
+    return path;
 }
 
 bmap torrent_storage::read_resume_data(error_code& error)
@@ -145,25 +176,33 @@ bmap torrent_storage::read_resume_data(error_code& error)
 }
 
 void torrent_storage::write_resume_data(
-        const bmap_encoder& resume_data, error_code& error)
+        string_view resume_data, error_code& error)
 {
     error.clear();
+    // The piece hashes are written first, as resume data without them could not be
+    // restored.
+    if(!is_piece_hashes_file_written_) {
+        piece_hashes_.write(piece_hashes_path(resume_data_.absolute_path()), error);
+        if(error) {
+            return;
+        }
+        is_piece_hashes_file_written_ = true;
+    }
     if(!resume_data_.is_open()) {
         resume_data_.open(error);
         if(error) {
             return;
         }
     }
-    std::string encoded = resume_data.encode();
-    if(!resume_data_.is_allocated() || (resume_data_.length() < encoded.length())) {
-        resume_data_.allocate(encoded.length(), error);
+    if(!resume_data_.is_allocated() || (resume_data_.length() < resume_data.length())) {
+        resume_data_.allocate(resume_data.length(), error);
         if(error) {
             return;
         }
     }
     iovec buffer;
-    buffer.iov_base = &encoded[0];
-    buffer.iov_len = encoded.length();
+    buffer.iov_base = const_cast<char*>(resume_data.data());
+    buffer.iov_len = resume_data.length();
     resume_data_.write(buffer, 0, error);
 }
 
@@ -403,10 +442,9 @@ void torrent_storage::write(
         // file without enlarging it).
 #ifdef TIDE_ENABLE_DEBUGGING
                 if(num_written != slice.length)
-                    log::log_disk_io("{TORRENT_STORAGE}",
-                            util::format("FATAL! num_written(%i) <> slice.length(%i)",
-                                    num_written, slice.length),
-                            false, log::priority::high);
+                    log::log_disk_io("{TORRENT_STORAGE}", log::priority::high,
+                            "FATAL! num_written(%i) <> slice.length(%i)", num_written,
+                            slice.length);
 #endif // TIDE_ENABLE_DEBUGGING
                 assert(num_written == slice.length);
                 return num_written;
@@ -425,10 +463,9 @@ void torrent_storage::for_each_file(
         return;
     }
 #ifdef TIDE_ENABLE_DEBUGGING
-    log::log_disk_io("{TORRENT_STORAGE}",
-            util::format("writing %i bytes in piece(%i) to %i files", block.length,
-                    block.index, files.size()),
-            false, log::priority::high);
+    log::log_disk_io("{TORRENT_STORAGE}", log::priority::high,
+            "writing %i bytes in piece(%i) to %i files", block.length, block.index,
+            files.size());
 #endif // TIDE_ENABLE_DEBUGGING
 
     int64_t offset = int64_t(block.index) * piece_length_ + block.offset;
@@ -436,10 +473,9 @@ void torrent_storage::for_each_file(
     for(file_entry& file : files) {
         const auto slice = get_file_slice(file, offset, num_left);
 #ifdef TIDE_ENABLE_DEBUGGING
-        log::log_disk_io("{TORRENT_STORAGE}",
-                util::format("writing %i bytes to %s at offset(%lli)", slice.length,
-                        file.storage.absolute_path().c_str(), slice.offset),
-                false, log::priority::high);
+        log::log_disk_io("{TORRENT_STORAGE}", log::priority::high,
+                "writing %i bytes to %s at offset(%lli)", slice.length,
+                file.storage.absolute_path().c_str(), slice.offset);
 #endif // TIDE_ENABLE_DEBUGGING
         const int num_transferred = fn(file, slice, error);
         if(error) {
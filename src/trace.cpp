@@ -0,0 +1,300 @@
+#include "trace.hpp"
+
+#include <algorithm> // min
+#include <cerrno>
+#include <cstdio> // snprintf
+#include <fstream>
+#include <memory> // shared_ptr
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace tide {
+namespace trace {
+namespace detail {
+
+std::atomic<bool> is_enabled{false};
+
+std::atomic<int> num_dropped_spans{0};
+
+// Spans are stored in fixed size chunks so that recording a span never has to move
+// the ones recorded before it.
+constexpr int chunk_size = 4096;
+// Each thread's buffer holds at most this many chunks between two saves.
+constexpr int max_chunks_per_thread = 64;
+
+struct span
+{
+    const char* category;
+    const char* name;
+    const char* arg_name;
+    int64_t arg;
+    int64_t start;
+    int64_t end;
+    bool is_async;
+};
+
+/**
+ * The spans recorded by a single thread. Only that thread adds spans, but they're
+ * taken by whichever thread saves the trace, hence the mutex, which is thus hardly
+ * ever contended.
+ */
+struct thread_buffer
+{
+    using chunk = std::vector<span>;
+
+    std::mutex mutex;
+    std::vector<chunk> chunks;
+    const char* thread_name = nullptr;
+    // The id of the thread's track in the trace.
+    int tid;
+};
+
+/**
+ * Keeps the buffers of all threads that have recorded spans. A thread's buffer
+ * outlives the thread, so that its spans may still be saved, after which it's
+ * removed.
+ */
+class registry
+{
+    std::vector<std::shared_ptr<thread_buffer>> buffers_;
+    std::mutex mutex_;
+    int next_tid_ = 1;
+
+public:
+    std::shared_ptr<thread_buffer> add_buffer(const char* thread_name)
+    {
+        auto b = std::make_shared<thread_buffer>();
+        b->thread_name = thread_name;
+        std::lock_guard<std::mutex> l(mutex_);
+        b->tid = next_tid_++;
+        buffers_.push_back(b);
+        return b;
+    }
+
+    /**
+     * Returns all buffers, and forgets those whose threads have exited (as it's
+     * then only the registry and the caller that refer to them).
+     */
+    std::vector<std::shared_ptr<thread_buffer>> take_buffers()
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        auto buffers = buffers_;
+        buffers_.erase(std::remove_if(buffers_.begin(), buffers_.end(),
+                               [](const auto& b) { return b.use_count() == 2; }),
+                buffers_.end());
+        return buffers;
+    }
+};
+
+inline registry& get_registry()
+{
+    static registry instance;
+    return instance;
+}
+
+thread_local const char* local_thread_name = nullptr;
+thread_local std::shared_ptr<thread_buffer> local_buffer;
+
+inline void add_span(const span& s)
+{
+    if(local_buffer == nullptr) {
+        local_buffer = get_registry().add_buffer(local_thread_name);
+    }
+    std::lock_guard<std::mutex> l(local_buffer->mutex);
+    auto& chunks = local_buffer->chunks;
+    if(chunks.empty() || chunks.back().size() == chunk_size) {
+        if(chunks.size() == max_chunks_per_thread) {
+            num_dropped_spans.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        chunks.emplace_back();
+        chunks.back().reserve(chunk_size);
+    }
+    chunks.back().push_back(s);
+}
+
+void record(const char* category, const char* name, const int64_t start,
+        const int64_t end, const char* arg_name, const int64_t arg)
+{
+    add_span({category, name, arg_name, arg, start, end, false});
+}
+
+void record_async(
+        const char* category, const char* name, const int64_t start, const int64_t end)
+{
+    add_span({category, name, nullptr, 0, start, end, true});
+}
+
+inline void append_json_string(std::string& out, const char* s)
+{
+    out += '"';
+    for(; *s; ++s) {
+        const char c = *s;
+        if(c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if(static_cast<unsigned char>(c) < 0x20) {
+            char buffer[8];
+            std::snprintf(buffer, sizeof buffer, "\\u%04x", c);
+            out += buffer;
+        } else {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+/** Timestamps are in microseconds, relative to `epoch`. */
+inline void append_timestamp(std::string& out, const int64_t t, const int64_t epoch)
+{
+    char buffer[32];
+    std::snprintf(buffer, sizeof buffer, "%.3f", (t - epoch) / 1000.0);
+    out += buffer;
+}
+
+inline void append_event_header(std::string& out, const span& s, const char phase,
+        const int tid, const int64_t ts, const int64_t epoch)
+{
+    out += "{\"name\":";
+    append_json_string(out, s.name);
+    out += ",\"cat\":";
+    append_json_string(out, s.category);
+    out += ",\"ph\":\"";
+    out += phase;
+    out += "\",\"pid\":1,\"tid\":";
+    out += std::to_string(tid);
+    out += ",\"ts\":";
+    append_timestamp(out, ts, epoch);
+}
+
+/**
+ * Asynchronous spans become a pair of begin and end events, matched up by their
+ * ids, and ordinary spans become a single complete event.
+ */
+inline void append_event(std::string& out, const span& s, const int tid,
+        const int64_t epoch, int& next_async_id)
+{
+    if(s.is_async) {
+        const auto id = std::to_string(next_async_id++);
+        append_event_header(out, s, 'b', tid, s.start, epoch);
+        out += ",\"id\":" + id + "},\n";
+        append_event_header(out, s, 'e', tid, s.end, epoch);
+        out += ",\"id\":" + id + '}';
+    } else {
+        append_event_header(out, s, 'X', tid, s.start, epoch);
+        out += ",\"dur\":";
+        append_timestamp(out, s.end, s.start);
+        if(s.arg_name) {
+            out += ",\"args\":{";
+            append_json_string(out, s.arg_name);
+            out += ':';
+            out += std::to_string(s.arg);
+            out += '}';
+        }
+        out += '}';
+    }
+}
+
+} // detail
+
+void start() noexcept
+{
+    detail::is_enabled.store(true, std::memory_order_relaxed);
+}
+
+void stop() noexcept
+{
+    detail::is_enabled.store(false, std::memory_order_relaxed);
+}
+
+void set_thread_name(const char* name) noexcept
+{
+    detail::local_thread_name = name;
+    if(detail::local_buffer) {
+        std::lock_guard<std::mutex> l(detail::local_buffer->mutex);
+        detail::local_buffer->thread_name = name;
+    }
+}
+
+int num_dropped_spans() noexcept
+{
+    return detail::num_dropped_spans.load(std::memory_order_relaxed);
+}
+
+void save(const path& path, error_code& error)
+{
+    using namespace detail;
+    error.clear();
+
+    struct thread_spans
+    {
+        int tid;
+        const char* thread_name;
+        std::vector<thread_buffer::chunk> chunks;
+    };
+    std::vector<thread_spans> threads;
+    int64_t epoch = INT64_MAX;
+    for(auto& b : get_registry().take_buffers()) {
+        thread_spans t;
+        {
+            std::lock_guard<std::mutex> l(b->mutex);
+            t.tid = b->tid;
+            t.thread_name = b->thread_name;
+            t.chunks.swap(b->chunks);
+        }
+        for(const auto& chunk : t.chunks) {
+            for(const auto& s : chunk) {
+                epoch = std::min(epoch, s.start);
+            }
+        }
+        threads.emplace_back(std::move(t));
+    }
+
+    std::ofstream file(path, std::ios::out | std::ios::trunc);
+    if(!file) {
+        error.assign(errno, system_category());
+        return;
+    }
+
+    std::string out = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+    bool is_first = true;
+    const auto begin_event = [&out, &is_first] {
+        if(!is_first) {
+            out += ",\n";
+        }
+        is_first = false;
+    };
+    int next_async_id = 0;
+    for(const auto& t : threads) {
+        if(t.thread_name) {
+            begin_event();
+            out += "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":";
+            out += std::to_string(t.tid);
+            out += ",\"args\":{\"name\":";
+            append_json_string(out, t.thread_name);
+            out += "}}";
+        }
+        for(const auto& chunk : t.chunks) {
+            for(const auto& s : chunk) {
+                begin_event();
+                append_event(out, s, t.tid, epoch, next_async_id);
+            }
+            // Write in parts so as not to hold an entire large trace in memory
+            // twice.
+            if(out.size() >= 1024 * 1024) {
+                file << out;
+                out.clear();
+            }
+        }
+    }
+    out += "\n]}\n";
+    file << out;
+    file.flush();
+    if(!file) {
+        error.assign(errno, system_category());
+    }
+}
+
+} // trace
+} // tide
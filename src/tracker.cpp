@@ -7,16 +7,17 @@
 #include <algorithm>
 #include <cassert>
 #include <cmath> // pow
+#include <iterator> // make_move_iterator
 #include <sstream>
 #include <stdexcept>
 
-#include <cstdio> // printf  TODO remove
+#include <asio/post.hpp>
 
 namespace tide {
 
 std::vector<tcp::endpoint> parse_peers(string_view peers_string)
 {
-    assert(peers_string.length() % 6 == 0);
+    // A trailing partial entry in a malformed list is ignored.
     const int num_peers = peers_string.length() / 6;
     std::vector<tcp::endpoint> peers;
     peers.reserve(num_peers);
@@ -30,6 +31,22 @@ std::vector<tcp::endpoint> parse_peers(string_view peers_string)
     return peers;
 }
 
+std::vector<tcp::endpoint> parse_peers6(string_view peers_string)
+{
+    const int num_peers = peers_string.length() / 18;
+    std::vector<tcp::endpoint> peers;
+    peers.reserve(num_peers);
+    for(auto i = 0, offset = 0; i < num_peers; ++i, offset += 18) {
+        // Endpoints are encoded as the 16 bytes of the IP address and a 16 bit
+        // integer for the port (BEP 7).
+        address_v6::bytes_type bytes;
+        std::copy(&peers_string[offset], &peers_string[offset] + 16, bytes.begin());
+        const uint16_t port = endian::read_network<uint16_t>(&peers_string[offset] + 16);
+        peers.emplace_back(address_v6(bytes), port);
+    }
+    return peers;
+}
+
 std::vector<peer_entry> parse_peers(const blist& peers_list)
 {
     std::vector<peer_entry> peers;
@@ -68,6 +85,7 @@ std::string tracker_error_category::message(int env) const
     case tracker_errc::wrong_response_length: return "Not the expected response length";
     case tracker_errc::invalid_transaction_id: return "Invalid transaction id";
     case tracker_errc::timed_out: return "Tracker timed out";
+    case tracker_errc::scrape_not_supported: return "Tracker does not support scraping";
     default: return "Unknown error";
     }
 }
@@ -106,17 +124,15 @@ template <typename... Args>
 void tracker::log(const log_event event, const log::priority priority, const char* format,
         Args&&... args) const
 {
-    std::stringstream ss;
-    ss << url() << '|';
+    const char* header = "";
     switch(event) {
-    case log_event::connecting: ss << "CONNECTING"; break;
-    case log_event::incoming: ss << "IN"; break;
-    case log_event::outgoing: ss << "OUT"; break;
-    case log_event::invalid_message: ss << "INVALID MESSAGE"; break;
-    case log_event::timeout: ss << "TIMEOUT"; break;
+    case log_event::connecting: header = "CONNECTING"; break;
+    case log_event::incoming: header = "IN"; break;
+    case log_event::outgoing: header = "OUT"; break;
+    case log_event::invalid_message: header = "INVALID MESSAGE"; break;
+    case log_event::timeout: header = "TIMEOUT"; break;
     }
-    log::log_engine(
-            ss.str(), util::format(format, std::forward<Args>(args)...), priority);
+    log::log_tracker(url(), header, priority, format, args...);
 }
 
 // ------------
@@ -124,63 +140,150 @@ void tracker::log(const log_event event, const log::priority priority, const cha
 // ------------
 
 http_tracker::http_tracker(
-        asio::io_context& ios, std::string host, const settings& settings)
-    : tracker(host, settings), socket_(ios), resolver_(ios), timeout_timer_(ios)
-{}
+        asio::io_context& ios, std::string url, const settings& settings)
+    : tracker(std::move(url), settings)
+    , ios_(ios)
+    , socket_(ios)
+    , resolver_(ios)
+    , timeout_timer_(ios)
+    , host_(util::extract_host(url_))
+    , scrape_timer_(ios)
+{
+    const auto host_pos = url_.find("//");
+    const auto path_pos
+            = url_.find('/', host_pos == std::string::npos ? 0 : host_pos + 2);
+    const std::string path = path_pos == std::string::npos ? "/" : url_.substr(path_pos);
+    // The announce URL may already have a query string (e.g. a passkey), to which
+    // our parameters are appended.
+    const auto query_pos = path.find('?');
+    const char separator = query_pos == std::string::npos ? '?' : '&';
+    announce_target_ = path + separator;
+    // As per BEP 48, tracker supports scraping if the last component of the announce
+    // path begins with "announce", and the scrape path is the same with "announce"
+    // replaced by "scrape".
+    const auto last_slash_pos = path.rfind('/', query_pos);
+    if(path.compare(last_slash_pos + 1, 8, "announce") == 0) {
+        scrape_target_ = path;
+        scrape_target_.replace(last_slash_pos + 1, 8, "scrape");
+        scrape_target_ += separator;
+    }
+}
 
-void http_tracker::abort() {}
+void http_tracker::abort()
+{
+    is_aborted_ = true;
+    resolver_.cancel();
+    error_code ec;
+    scrape_timer_.cancel(ec);
+    close_connection();
+    requests_.clear();
+    pending_scrape_.reset();
+    pipeline_.clear();
+}
 
 void http_tracker::announce(tracker_request parameters,
         std::function<void(const error_code&, tracker_response)> handler)
 {
-    std::printf("http announce request dammit");
-    execute_request<announce_request>(std::move(parameters), std::move(handler));
+    if(is_aborted_) {
+        return;
+    }
+    auto r = std::make_unique<announce_request>();
+    r->payload.target(create_target_string(parameters));
+    r->handler = std::move(handler);
+    enqueue_request(std::move(r));
 }
 
 void http_tracker::scrape(std::vector<sha1_hash> info_hashes,
         std::function<void(const error_code&, scrape_response)> handler)
 {
-    execute_request<scrape_request>(std::move(info_hashes), std::move(handler));
+    if(is_aborted_) {
+        return;
+    } else if(scrape_target_.empty()) {
+        asio::post(ios_, [h = std::move(handler)] {
+            h(make_error_code(tracker_errc::scrape_not_supported), {});
+        });
+        return;
+    }
+
+    // The scrapes of other torrents that arrive within a second are added to this
+    // one, unless it would make the request too large.
+    const int num_info_hashes = info_hashes.size();
+    if(pending_scrape_
+            && (pending_scrape_->num_info_hashes + num_info_hashes
+                       > max_scrape_info_hashes)) {
+        enqueue_request(std::move(pending_scrape_));
+    }
+    if(!pending_scrape_) {
+        pending_scrape_ = std::make_unique<scrape_request>();
+        if(!is_scrape_timer_armed_) {
+            is_scrape_timer_armed_ = true;
+            start_timer(scrape_timer_, seconds(1),
+                    [this](const auto& error) { on_scrape_timer(error); });
+        }
+    }
+    pending_scrape_->entries.push_back({std::move(info_hashes), std::move(handler)});
+    pending_scrape_->num_info_hashes += num_info_hashes;
 }
 
-template <typename Request, typename Parameters, typename Handler>
-void http_tracker::execute_request(Parameters parameters, Handler handler)
+void http_tracker::on_scrape_timer(const error_code& error)
 {
-    if(is_aborted_) {
+    is_scrape_timer_armed_ = false;
+    if(is_aborted_ || error) {
         return;
     }
+    if(pending_scrape_) {
+        enqueue_request(std::move(pending_scrape_));
+    }
+}
 
-    auto r = std::make_unique<Request>();
-    // TODO cache host
+inline void http_tracker::enqueue_request(std::unique_ptr<request> r)
+{
     r->payload.method(http::verb::get);
-    r->payload.target(create_target_string(parameters));
-    r->payload.set(http::field::host, util::extract_host(url_));
-    r->payload.prepare_payload();
-    r->handler = std::move(handler);
+    r->payload.version(11);
+    r->payload.set(http::field::host, host_);
+    r->payload.keep_alive(true);
     requests_.emplace_back(std::move(r));
+    schedule_flush();
+}
 
-    if(!is_resolved_) {
-        std::printf("resolving host");
-        resolver_.async_resolve(
-                tcp::resolver::query(tcp::v4(), util::extract_host(url_), ""),
-                [this](const error_code& error, tcp::resolver::iterator it) {
-                    on_host_resolved(error, it);
-                });
-    } else {
-        std::printf("no need to resolve host");
-        try_execute_one_request();
+inline void http_tracker::schedule_flush()
+{
+    if(!is_flush_scheduled_) {
+        is_flush_scheduled_ = true;
+        asio::post(ios_, [this] {
+            is_flush_scheduled_ = false;
+            flush();
+        });
     }
 }
 
-void http_tracker::on_host_resolved(const error_code& error, tcp::resolver::iterator it)
+void http_tracker::flush()
 {
-    if(is_aborted_) {
+    if(is_aborted_ || requests_.empty()) {
         return;
     }
-    if(error) {
-        for(auto& request : requests_) {
-            request->on_error(error);
+    if(!is_resolved_) {
+        if(!is_resolving_) {
+            is_resolving_ = true;
+            resolver_.async_resolve(tcp::resolver::query(tcp::v4(), host_, ""),
+                    [this](const error_code& error, tcp::resolver::iterator it) {
+                        on_host_resolved(error, it);
+                    });
         }
+    } else if(!socket_.is_open()) {
+        connect();
+    } else if(!is_connecting_) {
+        write_next_request();
+    }
+}
+
+void http_tracker::on_host_resolved(const error_code& error, tcp::resolver::iterator it)
+{
+    is_resolving_ = false;
+    if(is_aborted_ || (error == asio::error::operation_aborted)) {
+        return;
+    } else if(error) {
+        fail_requests(error);
         return;
     }
 
@@ -192,140 +295,171 @@ void http_tracker::on_host_resolved(const error_code& error, tcp::resolver::iter
     log(log_event::connecting, "tracker (%s) resolved to: %s:%i", url_.c_str(),
             endpoint_.address().to_string().c_str(), endpoint_.port());
 
-    try_execute_one_request();
+    flush();
+}
+
+inline void http_tracker::connect()
+{
+    log(log_event::connecting, "connecting to %s:%i",
+            endpoint_.address().to_string().c_str(), endpoint_.port());
+    is_connecting_ = true;
+    // Connect also opens socket.
+    socket_.async_connect(
+            endpoint_, [this](const error_code& error) { on_connected(error); });
+    start_timeout();
 }
 
-void http_tracker::try_execute_one_request()
+void http_tracker::on_connected(const error_code& error)
 {
-    if(is_requesting_ || requests_.empty()) {
+    if(is_aborted_ || (error == asio::error::operation_aborted)) {
+        return;
+    }
+    is_connecting_ = false;
+    error_code ec;
+    timeout_timer_.cancel(ec);
+    if(error) {
+        close_connection();
+        fail_requests(error);
         return;
     }
+    // Requests are small and we're waiting for their responses, so don't let them
+    // be delayed by Nagle's algorithm.
+    socket_.set_option(tcp::no_delay(true), ec);
+    write_next_request();
+}
 
-    // We may need to reopen socket if the previous HTTP connection closed it.
-    if(!socket_.is_open()) {
-        std::printf("reconnecting socket");
-        error_code error;
-        // Connect also opens socket.
-        socket_.connect(endpoint_, error);
-        if(error) {
-            for(auto& request : requests_) {
-                request->on_error(error);
-            }
-            return;
-        }
+void http_tracker::write_next_request()
+{
+    if(is_writing_ || requests_.empty()
+            || (int(pipeline_.size()) >= max_pipelined_requests)) {
+        return;
     }
 
-    std::printf("get here?");
-    is_requesting_ = true;
-    auto& request = current_request();
-    if(dynamic_cast<announce_request*>(&request)) {
-        http::async_write(socket_, request.payload,
-                [this](const auto& error, const size_t num_bytes_sent) {
-                    on_message_sent(error, num_bytes_sent);
-                });
-        http::async_read(socket_, response_buffer_, response_,
-                [this](const auto& error, const size_t num_bytes_received) {
-                    on_announce_response(error, num_bytes_received);
-                });
-    } else {
-        http::async_write(socket_, request.payload,
-                [this](const auto& error, const size_t num_bytes_sent) {
-                    on_message_sent(error, num_bytes_sent);
-                });
-        http::async_read(socket_, response_buffer_, response_,
-                [this](const auto& error, const size_t num_bytes_received) {
-                    on_scrape_response(error, num_bytes_received);
-                });
+    pipeline_.emplace_back(std::move(requests_.front()));
+    requests_.pop_front();
+    request& request = *pipeline_.back();
+    // A scrape's target is only assembled now, as other torrents' scrapes may have
+    // been coalesced into it while it was waiting.
+    if(auto scrape = dynamic_cast<scrape_request*>(&request)) {
+        request.payload.target(create_target_string(*scrape));
+    }
+    request.payload.prepare_payload();
+
+    log(log_event::outgoing, "sending %s request (%i in pipeline)",
+            dynamic_cast<const announce_request*>(&request) ? "announce" : "scrape",
+            pipeline_.size());
+    is_writing_ = true;
+    http::async_write(socket_, request.payload,
+            [this](const auto& error, const size_t /*num_bytes_sent*/) {
+                on_request_written(error);
+            });
+    if(pipeline_.size() == 1) {
+        start_timeout();
     }
-    std::printf("get here then?");
-    start_timeout();
 }
 
-inline void http_tracker::start_timeout()
+void http_tracker::on_request_written(const error_code& error)
 {
-    seconds timeout = current_request().num_retries == 0 ? seconds(15)
-                                                         : settings_.tracker_timeout;
-    std::printf("tracker timeout: %llis", timeout.count());
-    start_timer(
-            timeout_timer_, timeout, [this](const auto& error) { on_timeout(error); });
+    if(is_aborted_ || (error == asio::error::operation_aborted)) {
+        return;
+    }
+    is_writing_ = false;
+    if(error) {
+        on_connection_error(error);
+        return;
+    }
+    if(!is_reading_) {
+        read_response();
+    }
+    write_next_request();
 }
 
-inline void http_tracker::on_timeout(const error_code& error)
+inline void http_tracker::read_response()
 {
-    // If the timed out request was removed this is a false alarm.
-    if(requests_.empty()) {
-        return;
-    }
+    assert(!pipeline_.empty());
+    is_reading_ = true;
+    // Beast's parser adds the fields it reads to those already in the message, so
+    // the previous response on a kept-alive connection must be cleared first, lest
+    // e.g. its `Connection` header be mistaken for this one's.
+    response_ = {};
+    http::async_read(socket_, response_buffer_, response_,
+            [this](const auto& error, const size_t /*num_bytes_received*/) {
+                on_response(error);
+            });
+}
 
-    request& request = current_request();
+void http_tracker::on_response(const error_code& error)
+{
     if(is_aborted_ || (error == asio::error::operation_aborted)) {
         return;
-    } else if(error) {
-        request.on_error(error);
+    }
+    is_reading_ = false;
+    if(error) {
+        on_connection_error(error);
         return;
     }
 
-    if(++request.num_retries < settings_.max_http_tracker_timeout_retries) {
-        log(log_event::timeout, "retrying %s request",
-                dynamic_cast<const announce_request*>(&request) ? "announce" : "scrape");
+    error_code ec;
+    timeout_timer_.cancel(ec);
+    is_reachable_ = true;
+
+    assert(!pipeline_.empty());
+    auto request = std::move(pipeline_.front());
+    pipeline_.pop_front();
+    const bool keep_alive = response_.keep_alive();
+    if(auto announce = dynamic_cast<announce_request*>(request.get())) {
+        handle_announce_response(*announce);
     } else {
-        request.on_error(make_error_code(tracker_errc::timed_out));
-        log(log_event::timeout, "%s request timed out after %i seconds of retrying",
-                dynamic_cast<const announce_request*>(&request) ? "announce" : "scrape",
-                15 + request.num_retries * settings_.max_http_tracker_timeout_retries);
-        requests_.pop_front();
+        handle_scrape_response(static_cast<scrape_request&>(*request));
     }
-    // Try to execute either this request again or another one.
-    try_execute_one_request();
-}
 
-inline void http_tracker::on_message_sent(
-        const error_code& error, const size_t num_bytes_sent)
-{
-    if((error != http::error::end_of_stream) && error) {
-        on_request_error(error);
+    // A handler may have aborted tracker.
+    if(is_aborted_) {
+        return;
+    }
+
+    if(!keep_alive) {
+        // Tracker closes the connection after this response, so the requests that
+        // were pipelined behind it are sent again on a new connection.
+        log(log_event::incoming, "tracker closed connection (%i requests pipelined)",
+                pipeline_.size());
+        close_connection();
+        requests_.insert(requests_.begin(), std::make_move_iterator(pipeline_.begin()),
+                std::make_move_iterator(pipeline_.end()));
+        pipeline_.clear();
+        flush();
         return;
     }
+
+    if(!pipeline_.empty()) {
+        start_timeout();
+        read_response();
+    }
+    write_next_request();
 }
 
-inline void http_tracker::on_announce_response(
-        const error_code& error, const size_t num_bytes_received)
+inline void http_tracker::handle_announce_response(announce_request& request)
 {
     error_code ec;
-    timeout_timer_.cancel(ec);
-    ec.clear();
-    // We reached EoS, i.e. the connection died, so we must close the socket.
-    if(error == http::error::end_of_stream) {
-        socket_.shutdown(tcp::socket::shutdown_both, ec);
-        socket_.close(ec);
-        ec.clear();
-        if(response_.body().empty()) {
-            // Response is empty which means that there was an error with our request.
-            on_request_error(make_error_code(tracker_errc::invalid_response));
-            return;
-        }
-    } else if(error) {
-        on_request_error(error);
+    auto response = parse_announce_response(ec);
+    if(ec) {
+        had_protocol_error_ = true;
+        request.handler(make_error_code(tracker_errc::invalid_response), {});
         return;
     }
-
-    assert(!requests_.empty());
-    assert(dynamic_cast<announce_request*>(&current_request()));
-    auto& request = static_cast<announce_request&>(current_request());
-
-    request.handler(ec, parse_announce_response(ec));
-    requests_.pop_front();
-
-    try_execute_one_request();
+    last_announce_time_ = cached_clock::now();
+    request.handler({}, std::move(response));
 }
 
 tracker_response http_tracker::parse_announce_response(error_code& error)
 {
-    auto resp_map = decode_bmap(response_.body(), error);
+    // The body is no longer needed so it's moved rather than copied into the map.
+    const auto resp_map = decode_bmap(std::move(response_.body()), error);
     if(error || resp_map.empty()) {
-        const auto& s = resp_map.to_string();
-        log(log_event::invalid_message, "error decoding response bencode map: %s",
-                s.c_str());
+        log(log_event::invalid_message, "error decoding response bencode map");
+        if(!error) {
+            error = make_error_code(tracker_errc::invalid_response);
+        }
         return {};
     }
 
@@ -335,10 +469,15 @@ tracker_response http_tracker::parse_announce_response(error_code& error)
         resp_map.try_find_string("warning message", response.warning_message);
         resp_map.try_find_string("tracker id", response.tracker_id);
         int64_t buffer = 0;
+        if(resp_map.try_find_number("interval", buffer))
+            response.interval = seconds(buffer);
+        if(resp_map.try_find_number("min interval", buffer))
+            response.min_interval = seconds(buffer);
         if(resp_map.try_find_number("complete", buffer))
             response.num_seeders = buffer;
         if(resp_map.try_find_number("incomplete", buffer))
             response.num_leechers = buffer;
+        // Compact peer lists are parsed straight from the decoded response buffer.
         string_view peers_string;
         blist peers_list;
         if(resp_map.try_find_string_view("peers", peers_string)) {
@@ -346,36 +485,69 @@ tracker_response http_tracker::parse_announce_response(error_code& error)
         } else if(resp_map.try_find_blist("peers", peers_list)) {
             response.peers = parse_peers(peers_list);
         }
+        if(resp_map.try_find_string_view("peers6", peers_string)) {
+            response.ipv6_peers = parse_peers6(peers_string);
+        }
         log(log_event::incoming,
                 "received ANNOUNCE (interval: %i; num_leechers: %i;"
                 " num_seeders: %i; num_peers: %i)",
                 response.interval.count(), response.num_leechers, response.num_seeders,
-                response.ipv4_peers.size() + response.peers.size());
+                response.ipv4_peers.size() + response.ipv6_peers.size()
+                        + response.peers.size());
     }
     return response;
 }
 
-inline void http_tracker::on_scrape_response(
-        const error_code& error, const size_t num_bytes_received)
+void http_tracker::handle_scrape_response(scrape_request& request)
 {
     error_code ec;
-    timeout_timer_.cancel(ec);
-    ec.clear();
-    if(error) {
-        on_request_error(error);
+    const auto resp_map = decode_bmap(std::move(response_.body()), ec);
+    bmap files;
+    std::string failure_reason;
+    if(!ec && resp_map.try_find_string("failure reason", failure_reason)) {
+        for(auto& entry : request.entries) {
+            scrape_response response;
+            response.failure_reason = failure_reason;
+            entry.handler({}, std::move(response));
+        }
+        return;
+    } else if(ec || !resp_map.try_find_bmap("files", files)) {
+        log(log_event::invalid_message, "invalid SCRAPE response");
+        had_protocol_error_ = true;
+        request.on_error(make_error_code(tracker_errc::invalid_response));
         return;
     }
 
-    assert(!requests_.empty());
-    assert(dynamic_cast<scrape_request*>(&current_request()));
-    auto& request = static_cast<scrape_request&>(current_request());
-
-    // TODO
+    last_scrape_time_ = cached_clock::now();
+    log(log_event::incoming, "received SCRAPE (%i torrents, %i requesters)",
+            files.size(), request.entries.size());
+    // Each requester is only given the statuses of the torrents it asked for.
+    for(auto& entry : request.entries) {
+        scrape_response response;
+        response.torrent_statuses.reserve(entry.info_hashes.size());
+        for(const auto& info_hash : entry.info_hashes) {
+            bmap file;
+            if(!files.try_find_bmap(
+                       std::string(info_hash.begin(), info_hash.end()), file)) {
+                continue;
+            }
+            scrape_response::torrent_status status;
+            status.info_hash = info_hash;
+            status.num_seeders = 0;
+            status.num_leechers = 0;
+            status.num_downloaded = 0;
+            file.try_find_number("complete", status.num_seeders);
+            file.try_find_number("incomplete", status.num_leechers);
+            file.try_find_number("downloaded", status.num_downloaded);
+            response.torrent_statuses.emplace_back(status);
+        }
+        entry.handler({}, std::move(response));
+    }
 }
 
 std::string http_tracker::create_target_string(const tracker_request& r) const
 {
-    std::string target("/announce?");
+    std::string target = announce_target_;
     // required fields
     target += "info_hash=" + util::url_encode(r.info_hash.begin(), r.info_hash.end());
     target += "&peer_id=" + util::url_encode(r.peer_id.begin(), r.peer_id.end());
@@ -394,6 +566,12 @@ std::string http_tracker::create_target_string(const tracker_request& r) const
         target += "&no_peer_id=1";
     else
         target += "&no_peer_id=0";
+    if(r.event == tracker_request::started)
+        target += "&event=started";
+    else if(r.event == tracker_request::completed)
+        target += "&event=completed";
+    else if(r.event == tracker_request::stopped)
+        target += "&event=stopped";
     if(!r.ip.empty())
         target += "&ip=" + r.ip;
     if(!r.tracker_id.empty())
@@ -401,24 +579,104 @@ std::string http_tracker::create_target_string(const tracker_request& r) const
     return target;
 }
 
-std::string http_tracker::create_target_string(const std::vector<sha1_hash>& r) const
+std::string http_tracker::create_target_string(const scrape_request& r) const
 {
-    std::string target("/scrape?");
-    // TODO we must extract the scrape url from url, it's not the same as the announce url
+    // Torrents may be scraped by several requesters at once, but each is only
+    // included once.
+    std::vector<sha1_hash> info_hashes;
+    info_hashes.reserve(r.num_info_hashes);
+    for(const auto& entry : r.entries) {
+        info_hashes.insert(
+                info_hashes.end(), entry.info_hashes.begin(), entry.info_hashes.end());
+    }
+    std::sort(info_hashes.begin(), info_hashes.end());
+    info_hashes.erase(std::unique(info_hashes.begin(), info_hashes.end()),
+            info_hashes.end());
+
+    std::string target = scrape_target_;
+    for(const auto& info_hash : info_hashes) {
+        if(&info_hash != &info_hashes.front()) {
+            target += '&';
+        }
+        target += "info_hash=" + util::url_encode(info_hash.begin(), info_hash.end());
+    }
     return target;
 }
 
-inline http_tracker::request& http_tracker::current_request() noexcept
+void http_tracker::on_connection_error(const error_code& error)
+{
+    log(log_event::incoming, "connection error: %s (%i requests pipelined)",
+            error.message().c_str(), pipeline_.size());
+    close_connection();
+    // Handlers may enqueue new requests or abort tracker, so don't operate on
+    // `pipeline_` directly.
+    auto pipeline = std::move(pipeline_);
+    pipeline_.clear();
+    // Requests are put back in reverse order so that their original order is kept.
+    for(auto it = pipeline.rbegin(); it != pipeline.rend(); ++it) {
+        auto& request = *it;
+        if(++request->num_retries < settings_.max_http_tracker_timeout_retries) {
+            requests_.emplace_front(std::move(request));
+        } else {
+            request->on_error(error);
+            if(is_aborted_) {
+                return;
+            }
+        }
+    }
+    flush();
+}
+
+void http_tracker::close_connection()
 {
-    // FIXME this fired
-    assert(!requests_.empty());
-    return *requests_.front();
+    error_code ec;
+    socket_.shutdown(tcp::socket::shutdown_both, ec);
+    socket_.close(ec);
+    timeout_timer_.cancel(ec);
+    // Any bytes of a half received response are useless on a new connection.
+    response_buffer_.consume(response_buffer_.size());
+    is_connecting_ = false;
+    is_writing_ = false;
+    is_reading_ = false;
 }
 
-inline void http_tracker::on_request_error(const error_code& error)
+void http_tracker::fail_requests(const error_code& error)
 {
-    current_request().on_error(error);
-    requests_.pop_front();
+    // Handlers may enqueue new requests, so don't operate on `requests_` directly.
+    auto requests = std::move(requests_);
+    requests_.clear();
+    for(auto& request : requests) {
+        request->on_error(error);
+    }
+}
+
+inline void http_tracker::start_timeout()
+{
+    const int num_retries = pipeline_.empty() ? 0 : pipeline_.front()->num_retries;
+    const seconds timeout = num_retries == 0 ? seconds(15) : settings_.tracker_timeout;
+    start_timer(
+            timeout_timer_, timeout, [this](const auto& error) { on_timeout(error); });
+}
+
+void http_tracker::on_timeout(const error_code& error)
+{
+    if(is_aborted_ || error) {
+        return;
+    }
+    if(is_connecting_) {
+        log(log_event::timeout, "connecting to tracker timed out");
+        close_connection();
+        fail_requests(make_error_code(tracker_errc::timed_out));
+    } else if(!pipeline_.empty()) {
+        // If the timed out request is retried, so are those pipelined behind it, as
+        // the connection is reestablished.
+        log(log_event::timeout, "%s request timed out",
+                dynamic_cast<const announce_request*>(pipeline_.front().get())
+                        ? "announce"
+                        : "scrape");
+        is_reachable_ = false;
+        on_connection_error(make_error_code(tracker_errc::timed_out));
+    }
 }
 
 // -----------
@@ -441,10 +699,10 @@ inline udp_tracker::scrape_request::scrape_request(asio::io_context& ios, int32_
 {}
 
 udp_tracker::udp_tracker(
-        asio::io_context& ios, const std::string& url, const settings& settings)
+        udp_tracker_socket& socket, const std::string& url, const settings& settings)
     : tracker(/*util::strip_protocol_identifier(*/ url /*)*/, settings)
-    , socket_(ios)
-    , resolver_(ios)
+    , socket_(socket)
+    , resolver_(socket.get_io_context())
 {}
 
 udp_tracker::~udp_tracker()
@@ -456,23 +714,23 @@ void udp_tracker::abort()
 {
     is_aborted_ = true;
     error_code ec;
-    for(auto& [_, request] : requests_) {
+    resolver_.cancel();
+    for(auto& [tid, request] : requests_) {
         request->timeout_timer.cancel(ec);
+        socket_.unregister_transaction(tid);
     }
-    socket_.cancel();
-    // It is reasonable to assume that we won't be needing receive buffer for now.
-    receive_buffer_.reset();
     requests_.clear();
 }
 
 udp::endpoint udp_tracker::remote_endpoint() const noexcept
 {
-    return socket_.remote_endpoint();
+    return endpoint_;
 }
 
 udp::endpoint udp_tracker::local_endpoint() const noexcept
 {
-    return socket_.local_endpoint();
+    error_code ec;
+    return socket_.local_endpoint(ec);
 }
 
 void udp_tracker::announce(tracker_request parameters,
@@ -498,7 +756,10 @@ void udp_tracker::scrape(std::vector<sha1_hash> info_hashes,
 template <typename Request, typename Parameters, typename Handler>
 Request& udp_tracker::create_request_entry(Parameters parameters, Handler handler)
 {
-    const auto tid = create_transaction_id();
+    const auto tid = socket_.register_transaction(
+            [this](const udp::endpoint& endpoint, const char* message, const int size) {
+                on_message_received(endpoint, message, size);
+            });
     // Return value is pair<iterator, bool>, and *iterator is pair<int, uptr<request>>.
     request& request
             = *requests_
@@ -509,16 +770,20 @@ Request& udp_tracker::create_request_entry(Parameters parameters, Handler handle
     return static_cast<Request&>(request);
 }
 
-inline int udp_tracker::create_transaction_id()
+inline void udp_tracker::remove_request(const int32_t transaction_id)
 {
-    static int r = 0;
-    return ++r;
+    socket_.unregister_transaction(transaction_id);
+    requests_.erase(transaction_id);
 }
 
 template <typename Request, typename Function>
 void udp_tracker::execute_request(Request& request, Function f)
 {
     if(!is_resolved_) {
+        // Requests started while resolving are continued once it's done.
+        if(requests_.size() > 1) {
+            return;
+        }
         resolver_.async_resolve(
                 udp::resolver::query(udp::v4(), util::extract_host(url_), ""),
                 [this](const error_code& error, udp::resolver::iterator it) {
@@ -532,7 +797,6 @@ void udp_tracker::execute_request(Request& request, Function f)
     if(must_connect()) {
         state_ = state::disconnected;
     }
-    assert(socket_.is_open());
 
     switch(state_) {
     case state::disconnected: send_connect_request(request); break;
@@ -559,8 +823,11 @@ void udp_tracker::on_host_resolved(const error_code& error, udp::resolver::itera
         // Host resolution is done on the first request, though it is possible that
         // other torrents have issued requests while this was working, so let all
         // of them know that we could not resolve host.
-        for(auto& entry : requests_) {
-            entry.second->on_error(error);
+        auto requests = std::move(requests_);
+        requests_.clear();
+        for(auto& [tid, request] : requests) {
+            socket_.unregister_transaction(tid);
+            request->on_error(error);
         }
         return;
     }
@@ -573,23 +840,15 @@ void udp_tracker::on_host_resolved(const error_code& error, udp::resolver::itera
     log(log_event::connecting, "tracker (%s) resolved to: %s:%i", url_.c_str(),
             ep.address().to_string().c_str(), ep.port());
 
-    // Connect also opens socket.
-    error_code ec;
-    socket_.connect(ep, ec);
-    if(ec) {
-        for(auto& [_, request] : requests_) {
-            request->on_error(error);
-        }
-        return;
-    }
+    endpoint_ = ep;
     is_resolved_ = true;
     resume_stalled_requests();
 }
 
-inline bool udp_tracker::must_connect() const noexcept
+inline bool udp_tracker::must_connect()
 {
-    return state_ != state::connecting
-            && cached_clock::now() - last_connect_time_ >= minutes(1);
+    return (state_ != state::connecting)
+            && !socket_.find_connection_id(endpoint_, connection_id_);
 }
 
 /**
@@ -604,9 +863,9 @@ void udp_tracker::send_connect_request(Request& request)
     log(log_event::outgoing, "sending CONNECT (trans_id: %i)", request.transaction_id);
     state_ = state::connecting;
     request.action = action::connect;
+    request.payload.clear();
     request.payload.i64(0x41727101980).i32(action::connect).i32(request.transaction_id);
     send_message(request, 16);
-    receive_message();
 }
 
 /**
@@ -616,22 +875,22 @@ void udp_tracker::send_connect_request(Request& request)
  * int64_t connection_id
  */
 inline void udp_tracker::handle_connect_response(
-        request& request, const size_t num_bytes_received)
+        request& request, const char* message, const int size)
 {
-    if(num_bytes_received < 16) {
+    if(size < 16) {
         if(request.num_retries < settings_.max_udp_tracker_timeout_retries) {
             retry(request);
         } else {
             had_protocol_error_ = true;
             request.on_error(make_error_code(tracker_errc::wrong_response_length));
-            requests_.erase(request.transaction_id);
+            remove_request(request.transaction_id);
         }
         return;
     }
 
     state_ = state::connected;
-    last_connect_time_ = cached_clock::now();
-    connection_id_ = endian::read_network<int64_t>(receive_buffer_->data() + 8);
+    connection_id_ = endian::read_network<int64_t>(message + 8);
+    socket_.save_connection_id(endpoint_, connection_id_);
     log(log_event::incoming, "received CONNECT (trans_id: %i, conn.id: %i)",
             request.transaction_id, connection_id_);
     // Continue requests that were stalled because we were connecting.
@@ -715,7 +974,6 @@ void udp_tracker::send_announce_request(announce_request& request)
             .i32(parameters.num_want)
             .u16(parameters.port);
     send_message(request, 98);
-    receive_message();
 }
 
 /**
@@ -728,15 +986,15 @@ void udp_tracker::send_announce_request(announce_request& request)
  * n * <int32_t IP address, int16_t TCP port>
  */
 inline void udp_tracker::handle_announce_response(
-        announce_request& request, const size_t num_bytes_received)
+        announce_request& request, const char* message, const int size)
 {
-    if((num_bytes_received < 20) || ((num_bytes_received - 20) % 6 != 0)) {
+    if((size < 20) || ((size - 20) % 6 != 0)) {
         if(request.num_retries < settings_.max_udp_tracker_timeout_retries) {
             retry(request);
         } else {
             had_protocol_error_ = true;
             request.on_error(make_error_code(tracker_errc::wrong_response_length));
-            requests_.erase(request.transaction_id);
+            remove_request(request.transaction_id);
         }
         return;
     }
@@ -744,7 +1002,7 @@ inline void udp_tracker::handle_announce_response(
     last_announce_time_ = cached_clock::now();
 
     // Skip the 4 byte action and 4 byte transaction_id fields.
-    const char* buffer = receive_buffer_->data() + 8;
+    const char* buffer = message + 8;
     tracker_response response;
     response.interval = seconds(endian::read_network<int32_t>(buffer));
     response.num_leechers = endian::read_network<int32_t>(buffer += 4);
@@ -752,7 +1010,7 @@ inline void udp_tracker::handle_announce_response(
     buffer += 4;
     // TODO branch here depending on ipv4 or ipv6 request (but currently ipv6
     // isn't sup.)
-    response.ipv4_peers = parse_peers(string_view(buffer, num_bytes_received - 20));
+    response.ipv4_peers = parse_peers(string_view(buffer, size - 20));
 
     log(log_event::incoming,
             "received ANNOUNCE (trans_id: %i; interval: %i; num_leechers: %i;"
@@ -761,7 +1019,7 @@ inline void udp_tracker::handle_announce_response(
             response.num_seeders, response.ipv4_peers.size());
 
     auto handler = std::move(request.handler);
-    requests_.erase(request.transaction_id);
+    remove_request(request.transaction_id);
     handler({}, std::move(response));
 }
 
@@ -774,154 +1032,122 @@ inline void udp_tracker::handle_announce_response(
  */
 inline void udp_tracker::send_scrape_request(scrape_request& request)
 {
-    // TODO
+    request.action = action::scrape_;
+    log(log_event::outgoing, "sending SCRAPE (trans_id: %i; num_torrents: %i)",
+            request.transaction_id, request.info_hashes.size());
+    request.payload.clear();
+    request.payload.i64(connection_id_)
+            .i32(action::scrape_)
+            .i32(static_cast<int>(request.transaction_id));
+    for(const auto& info_hash : request.info_hashes) {
+        request.payload.buffer(info_hash);
+    }
+    send_message(request, request.payload.data.size());
 }
 
 /**
  * Message format (length = 8 + n * 12):
  * int32_t action = 2 // scrape
  * int32_t transaction_id
- * n * int32_t seeders
- * n * int32_t completed
- * n * int32_t leechers
+ * n * <int32_t seeders, int32_t completed, int32_t leechers>
+ *
+ * The n torrents are in the order in which they were requested.
  */
 inline void udp_tracker::handle_scrape_response(
-        scrape_request& request, const size_t num_bytes_received)
-{
-    // TODO
-}
-
-template <typename Request>
-void udp_tracker::send_message(Request& request, const size_t num_bytes_to_send)
-{
-    assert(socket_.is_open());
-    log(log_event::outgoing, "sending %i bytes (trans_id: %i)", num_bytes_to_send,
-            request.transaction_id);
-    socket_.async_send(asio::buffer(request.payload.data, num_bytes_to_send),
-            [this, &request](const error_code& error, size_t num_bytes_sent) {
-                on_message_sent(request, error, num_bytes_sent);
-            });
-    start_timeout(request);
-}
-
-inline void udp_tracker::on_message_sent(
-        request& request, const error_code& error, const size_t num_bytes_sent)
+        scrape_request& request, const char* message, const int size)
 {
-    if(error) {
-        // TODO depending on the error let everyone know
-        request.on_error(error);
-        requests_.erase(request.transaction_id);
+    const int num_torrents = request.info_hashes.size();
+    if(size < 8 + num_torrents * 12) {
+        if(request.num_retries < settings_.max_udp_tracker_timeout_retries) {
+            retry(request);
+        } else {
+            had_protocol_error_ = true;
+            request.on_error(make_error_code(tracker_errc::wrong_response_length));
+            remove_request(request.transaction_id);
+        }
         return;
     }
 
-    log(log_event::outgoing, "sent %i bytes (trans_id: %i)", num_bytes_sent,
-            request.transaction_id);
+    last_scrape_time_ = cached_clock::now();
 
-    switch(request.action) {
-    case action::connect:
-        assert(num_bytes_sent == 16); // TODO check if udp guarantees draining send buffer
-        break;
-    case action::announce_: assert(num_bytes_sent == 98); break;
-    case action::scrape_:
-        assert(num_bytes_sent
-                == 16
-                        + 20
-                                * std::min(int(static_cast<scrape_request&>(request)
-                                                           .info_hashes.size()),
-                                          74));
-        break;
+    scrape_response response;
+    response.torrent_statuses.reserve(num_torrents);
+    // Skip the 4 byte action and 4 byte transaction_id fields.
+    const char* buffer = message + 8;
+    for(const auto& info_hash : request.info_hashes) {
+        scrape_response::torrent_status status;
+        status.info_hash = info_hash;
+        status.num_seeders = endian::read_network<int32_t>(buffer);
+        status.num_downloaded = endian::read_network<int32_t>(buffer + 4);
+        status.num_leechers = endian::read_network<int32_t>(buffer + 8);
+        response.torrent_statuses.emplace_back(status);
+        buffer += 12;
     }
+
+    log(log_event::incoming, "received SCRAPE (trans_id: %i; num_torrents: %i)",
+            request.transaction_id, num_torrents);
+
+    auto handler = std::move(request.handler);
+    remove_request(request.transaction_id);
+    handler({}, std::move(response));
 }
 
-inline void udp_tracker::receive_message()
+template <typename Request>
+void udp_tracker::send_message(Request& request, const size_t num_bytes_to_send)
 {
-    // Don't receive if we're already receiving or there are no requests that expect
-    // a response.
-    if(is_receiving_ || requests_.empty()) {
-        return;
-    }
-
-    log(log_event::incoming, "preparing receive op");
-    if(receive_buffer_ == nullptr) {
-        receive_buffer_ = std::make_unique<std::array<char, 1500>>();
-    }
-    is_receiving_ = true;
-    socket_.async_receive(asio::buffer(*receive_buffer_, receive_buffer_->max_size()),
-            [this](const error_code& error, size_t num_bytes_received) {
-                on_message_received(error, num_bytes_received);
-            });
+    log(log_event::outgoing, "sending %i bytes (trans_id: %i)", num_bytes_to_send,
+            request.transaction_id);
+    // The datagram is copied into the socket's send queue, so `request.payload` may
+    // be reused right away. If it can't be sent, the request simply times out.
+    socket_.send_to(endpoint_, reinterpret_cast<const char*>(request.payload.data.data()),
+            num_bytes_to_send);
+    start_timeout(request);
 }
 
 inline void udp_tracker::on_message_received(
-        const error_code& error, const size_t num_bytes_received)
+        const udp::endpoint& endpoint, const char* message, const int size)
 {
-    if((error == asio::error::operation_aborted) || is_aborted_) {
-        return;
-    } else if((error == std::errc::timed_out) || (error == asio::error::timed_out)) {
-        is_reachable_ = false;
-        // TODO we should probably let others know? and we should retry a few times
-        return;
-    } else if(error) {
-        on_global_error(error);
-        return;
-    }
-
-    is_receiving_ = false;
-
-    if(num_bytes_received < 8) {
-        // We need at least 8 bytes for the action and transaction_id.
-        had_protocol_error_ = true;
-        on_global_error(make_error_code(tracker_errc::wrong_response_length));
+    if(is_aborted_ || (endpoint != endpoint_)) {
         return;
     }
 
-    assert(receive_buffer_);
-    const char* buffer = receive_buffer_->data();
-    const int32_t action = endian::read_network<int32_t>(buffer);
-    const int32_t transaction_id = endian::read_network<int32_t>(buffer + 4);
+    // The socket only routes datagrams that have at least the action and
+    // transaction_id fields and carry one of our transaction ids.
+    assert(size >= 8);
+    const int32_t action = endian::read_network<int32_t>(message);
+    const int32_t transaction_id = endian::read_network<int32_t>(message + 4);
+    auto it = requests_.find(transaction_id);
+    assert(it != requests_.end());
+    request& request = *it->second;
     if((action < action::connect) || (action > action::error)) {
         had_protocol_error_ = true;
-        on_global_error(make_error_code(tracker_errc::invalid_response));
-        return;
-    }
-
-    // Now we have to find the request with this transaction id.
-    auto it = requests_.find(transaction_id);
-    if(it == requests_.end()) {
-        // Tracker sent us a bad transaction id, so we have no choice but let all pending
-        // requests know (since we don't know to which requests this reply was addressed).
-        on_global_error(make_error_code(tracker_errc::invalid_transaction_id));
+        request.on_error(make_error_code(tracker_errc::invalid_response));
+        remove_request(transaction_id);
         return;
     }
 
-    request& request = *it->second;
     error_code ec;
     request.timeout_timer.cancel(ec);
     if((action != action::error) && (action != request.action)) {
         request.on_error(make_error_code(tracker_errc::wrong_response_type));
-        requests_.erase(request.transaction_id);
-        // This request resulted in an error but others may not, so continue.
-        receive_message();
+        remove_request(transaction_id);
         return;
     }
 
-    log(log_event::incoming, "received %i bytes (trans_id: %i; action: %i)",
-            num_bytes_received, request.transaction_id, action);
+    log(log_event::incoming, "received %i bytes (trans_id: %i; action: %i)", size,
+            request.transaction_id, action);
 
+    if(action == action::error) {
+        handle_error_response(request, message, size);
+        return;
+    }
     switch(request.action) {
-    case action::connect: handle_connect_response(request, num_bytes_received); break;
+    case action::connect: handle_connect_response(request, message, size); break;
     case action::announce_:
-        handle_announce_response(
-                static_cast<announce_request&>(request), num_bytes_received);
-        receive_message();
+        handle_announce_response(static_cast<announce_request&>(request), message, size);
         break;
     case action::scrape_:
-        handle_scrape_response(static_cast<scrape_request&>(request), num_bytes_received);
-        receive_message();
-        break;
-    case action::error:
-        handle_error_response(request, num_bytes_received);
-        receive_message();
+        handle_scrape_response(static_cast<scrape_request&>(request), message, size);
         break;
     }
 }
@@ -933,11 +1159,11 @@ inline void udp_tracker::on_message_received(
  * string message
  */
 inline void udp_tracker::handle_error_response(
-        request& request, const size_t num_bytes_received)
+        request& request, const char* message, const int size)
 {
     // Skip action and transaction_id fields.
-    const auto buffer = receive_buffer_->data() + 8;
-    const int error_msg_len = num_bytes_received - 8;
+    const auto buffer = message + 8;
+    const int error_msg_len = size - 8;
     // TODO this is a pretty ugly way to do "polymorphism", try to unify handler
     // invocation in the base class
     if(dynamic_cast<announce_request*>(&request)) {
@@ -953,17 +1179,7 @@ inline void udp_tracker::handle_error_response(
                 request.transaction_id, r.failure_reason.c_str());
         static_cast<scrape_request&>(request).handler({}, std::move(r));
     }
-    requests_.erase(request.transaction_id);
-}
-
-inline void udp_tracker::on_global_error(const error_code& error)
-{
-    // TODO this is a place holder until a better solution is found
-    for(auto& entry : requests_) {
-        entry.second->on_error(error);
-    }
-    // requests_.clear();
-    // TODO we want to remove pending requests -- probably?
+    remove_request(request.transaction_id);
 }
 
 inline void udp_tracker::start_timeout(request& request)
@@ -989,13 +1205,18 @@ inline void udp_tracker::on_timeout(const error_code& error, request& request)
         log(log_event::timeout, "request#%i timed out after %i seconds of retrying",
                 request.transaction_id,
                 15 * static_cast<size_t>(std::pow(2, request.num_retries)));
-        requests_.erase(request.transaction_id);
+        remove_request(request.transaction_id);
     }
 }
 
 inline void udp_tracker::retry(request& request)
 {
     ++request.num_retries;
+    // If this was the request establishing the connection, it has to start over,
+    // otherwise it would wait for itself.
+    if(request.action == action::connect) {
+        state_ = state::disconnected;
+    }
     if(dynamic_cast<announce_request*>(&request))
         retry(static_cast<announce_request&>(request));
     else
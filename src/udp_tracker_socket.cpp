@@ -0,0 +1,198 @@
+#include "udp_tracker_socket.hpp"
+#include "endian.hpp"
+#include "random.hpp"
+#include "utp_socket.hpp"
+
+#include <algorithm> // min
+#include <cassert>
+#include <cerrno>
+#include <limits>
+
+#ifdef __linux__
+#include <sys/socket.h>
+#endif // __linux__
+
+#include <asio/error.hpp>
+#include <asio/post.hpp>
+
+namespace tide {
+
+// BEP 15 lets clients use a connection id for a minute after receiving it.
+constexpr auto connection_id_ttl = minutes(1);
+
+udp_tracker_socket::udp_tracker_socket(utp_socket_manager& socket) : socket_(socket)
+{
+    socket_.add_datagram_handler(
+            this, [this](const udp::endpoint& endpoint, const uint8_t* data, int size) {
+                handle_datagram(endpoint, reinterpret_cast<const char*>(data), size);
+            });
+}
+
+udp_tracker_socket::~udp_tracker_socket()
+{
+    socket_.remove_datagram_handler(this);
+}
+
+asio::io_context& udp_tracker_socket::get_io_context() noexcept
+{
+    return socket_.get_io_context();
+}
+
+bool udp_tracker_socket::is_open() const noexcept
+{
+    return socket_.is_open();
+}
+
+udp::endpoint udp_tracker_socket::local_endpoint(error_code& error) const
+{
+    return socket_.local_endpoint(error);
+}
+
+int32_t udp_tracker_socket::register_transaction(receive_handler handler)
+{
+    // 0 is reserved to denote an uninitialized transaction id.
+    int32_t id;
+    do {
+        id = util::random_int(1, std::numeric_limits<int32_t>::max());
+    } while(transactions_.count(id));
+    transactions_.emplace(id, std::move(handler));
+    return id;
+}
+
+void udp_tracker_socket::unregister_transaction(const int32_t transaction_id)
+{
+    transactions_.erase(transaction_id);
+}
+
+bool udp_tracker_socket::find_connection_id(const udp::endpoint& endpoint, int64_t& id)
+{
+    auto it = connections_.find(endpoint);
+    if(it == connections_.end()) {
+        return false;
+    } else if(cached_clock::now() - it->second.receive_time >= connection_id_ttl) {
+        connections_.erase(it);
+        return false;
+    }
+    id = it->second.id;
+    return true;
+}
+
+void udp_tracker_socket::save_connection_id(
+        const udp::endpoint& endpoint, const int64_t id)
+{
+    connection& c = connections_[endpoint];
+    c.id = id;
+    c.receive_time = cached_clock::now();
+}
+
+void udp_tracker_socket::send_to(
+        const udp::endpoint& endpoint, const char* data, const int size)
+{
+    if(!is_open()) {
+        return;
+    }
+    datagram d;
+    d.endpoint = endpoint;
+    d.data.assign(data, data + size);
+    send_queue_.emplace_back(std::move(d));
+    // All datagrams queued before control returns to the event loop (e.g. when many
+    // torrents announce in the same update round) are sent in one batch.
+    if(!is_flush_scheduled_ && !is_waiting_to_send_) {
+        is_flush_scheduled_ = true;
+        asio::post(get_io_context(), [this] {
+            is_flush_scheduled_ = false;
+            flush_send_queue();
+        });
+    }
+}
+
+void udp_tracker_socket::flush_send_queue()
+{
+    if(!is_open()) {
+        return;
+    }
+    int num_sent = 0;
+    while(num_sent < int(send_queue_.size())) {
+        error_code ec;
+        const int n = send_batch(num_sent, ec);
+        if(n < 0) {
+            // Wait for the socket's send buffer to drain before sending the rest.
+            is_waiting_to_send_ = true;
+            socket_.udp_socket().async_wait(
+                    udp::socket::wait_write, [this](const error_code& error) {
+                        is_waiting_to_send_ = false;
+                        if(error != asio::error::operation_aborted) {
+                            flush_send_queue();
+                        }
+                    });
+            break;
+        } else if(ec) {
+            // Errors are specific to the datagram (e.g. an unreachable host), so
+            // drop it and carry on with the rest.
+            ++num_sent;
+        }
+        num_sent += n;
+    }
+    send_queue_.erase(send_queue_.begin(), send_queue_.begin() + num_sent);
+}
+
+int udp_tracker_socket::send_batch(const int first, error_code& error)
+{
+    const int num_datagrams
+            = std::min(int(send_queue_.size()) - first, int(max_batch_size));
+#ifdef __linux__
+    std::array<mmsghdr, max_batch_size> messages;
+    std::array<iovec, max_batch_size> iovecs;
+    for(auto i = 0; i < num_datagrams; ++i) {
+        datagram& d = send_queue_[first + i];
+        iovecs[i].iov_base = d.data.data();
+        iovecs[i].iov_len = d.data.size();
+        messages[i] = mmsghdr();
+        messages[i].msg_hdr.msg_name = d.endpoint.data();
+        messages[i].msg_hdr.msg_namelen = d.endpoint.size();
+        messages[i].msg_hdr.msg_iov = &iovecs[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+    }
+    const int n = ::sendmmsg(
+            socket_.udp_socket().native_handle(), messages.data(), num_datagrams, 0);
+    if(n >= 0) {
+        return n;
+    } else if((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+        return -1;
+    }
+    error.assign(errno, asio::error::get_system_category());
+    return 0;
+#else // __linux__
+    for(auto i = 0; i < num_datagrams; ++i) {
+        const datagram& d = send_queue_[first + i];
+        socket_.udp_socket().send_to(asio::buffer(d.data), d.endpoint, 0, error);
+        if(error == asio::error::would_block) {
+            error.clear();
+            return i > 0 ? i : -1;
+        } else if(error) {
+            return i;
+        }
+    }
+    return num_datagrams;
+#endif // __linux__
+}
+
+void udp_tracker_socket::handle_datagram(
+        const udp::endpoint& endpoint, const char* data, const int size)
+{
+    // Every response starts with the action, which is at most 3, so its first byte is
+    // 0, and the transaction id. Anything else on the shared socket, such as the
+    // DHT's messages, which start with 'd', is not for us.
+    if((size < 8) || (data[0] != 0)) {
+        return;
+    }
+    const int32_t transaction_id = endian::read_network<int32_t>(data + 4);
+    auto it = transactions_.find(transaction_id);
+    if(it != transactions_.end()) {
+        // The handler may unregister the transaction, so don't invoke it in place.
+        auto handler = it->second;
+        handler(endpoint, data, size);
+    }
+}
+
+} // tide
@@ -0,0 +1,147 @@
+#include "upload_slot_allocator.hpp"
+
+#include <algorithm> // find_if, make_heap, pop_heap, push_heap, sort
+#include <cassert>
+#include <utility> // pair
+
+namespace tide {
+
+void upload_slot_allocator::set_max_upload_slots(const int n)
+{
+    assert(n >= 0);
+    max_upload_slots_ = n;
+}
+
+void upload_slot_allocator::set_min_slots_per_torrent(const int n)
+{
+    assert(n >= 0);
+    min_slots_per_torrent_ = n;
+}
+
+void upload_slot_allocator::set_round_interval(const duration d)
+{
+    assert(d >= duration(0));
+    round_interval_ = d;
+}
+
+void upload_slot_allocator::subscribe(const token_type token,
+        rank_handler rank_candidates, std::function<void(int)> handler)
+{
+    auto it = std::find_if(subscribers_.begin(), subscribers_.end(),
+            [&token](const auto& s) { return s.token == token; });
+    if(it == subscribers_.end()) {
+        subscriber s;
+        s.token = token;
+        s.rank_candidates = std::move(rank_candidates);
+        s.handler = std::move(handler);
+        subscribers_.emplace_back(std::move(s));
+    } else {
+        it->rank_candidates = std::move(rank_candidates);
+        it->handler = std::move(handler);
+    }
+}
+
+void upload_slot_allocator::unsubscribe(const token_type token)
+{
+    auto it = std::find_if(subscribers_.begin(), subscribers_.end(),
+            [&token](const auto& s) { return s.token == token; });
+    if(it != subscribers_.end()) {
+        subscribers_.erase(it);
+    }
+}
+
+void upload_slot_allocator::allot_slots(const bool force)
+{
+    const auto now = cached_clock::now();
+    if(!force && (now - last_round_time_ < round_interval_)) {
+        return;
+    }
+    last_round_time_ = now;
+
+    for(auto& s : subscribers_) {
+        s.expected_rates.clear();
+        s.num_allotted_slots = 0;
+        s.rank_candidates(s.expected_rates, max_upload_slots_);
+    }
+    divide_slots();
+
+    // Handlers may unsubscribe (e.g. if choking peers leads to the torrent being
+    // stopped), so they're only invoked once the round is over.
+    std::vector<std::pair<std::function<void(int)>, int>> handlers;
+    handlers.reserve(subscribers_.size());
+    for(const auto& s : subscribers_) {
+        handlers.emplace_back(s.handler, s.num_allotted_slots);
+    }
+    for(auto& h : handlers) {
+        h.first(h.second);
+    }
+}
+
+void upload_slot_allocator::divide_slots()
+{
+    int num_free_slots = max_upload_slots_;
+
+    // When there aren't enough slots to give every subscriber its minimum, those
+    // whose best candidates are expected to be the fastest are served first.
+    std::vector<int> order;
+    order.reserve(subscribers_.size());
+    for(auto i = 0; i < int(subscribers_.size()); ++i) {
+        if(!subscribers_[i].expected_rates.empty()) {
+            order.push_back(i);
+        }
+    }
+    std::sort(order.begin(), order.end(), [this](const int a, const int b) {
+        return subscribers_[a].expected_rates[0] > subscribers_[b].expected_rates[0];
+    });
+    for(auto round = 0; round < min_slots_per_torrent_; ++round) {
+        for(const int i : order) {
+            auto& s = subscribers_[i];
+            if(num_free_slots == 0) {
+                return;
+            } else if(s.num_allotted_slots < int(s.expected_rates.size())) {
+                ++s.num_allotted_slots;
+                --num_free_slots;
+            }
+        }
+    }
+
+    // The rest of the slots go to the candidates with the highest expected rates,
+    // which are found by keeping every subscriber's next best candidate in a heap.
+    // Of equally fast candidates, those of subscribers with fewer slots are
+    // preferred, spreading the slots among the swarms.
+    const auto next_rate = [this](const int i) {
+        const auto& s = subscribers_[i];
+        return s.expected_rates[s.num_allotted_slots];
+    };
+    const auto is_worse = [this, &next_rate](const int a, const int b) {
+        const int rate_a = next_rate(a);
+        const int rate_b = next_rate(b);
+        if(rate_a == rate_b) {
+            return subscribers_[a].num_allotted_slots
+                    > subscribers_[b].num_allotted_slots;
+        }
+        return rate_a < rate_b;
+    };
+    std::vector<int> heap;
+    for(const int i : order) {
+        const auto& s = subscribers_[i];
+        if(s.num_allotted_slots < int(s.expected_rates.size())) {
+            heap.push_back(i);
+        }
+    }
+    std::make_heap(heap.begin(), heap.end(), is_worse);
+    while((num_free_slots > 0) && !heap.empty()) {
+        std::pop_heap(heap.begin(), heap.end(), is_worse);
+        const int i = heap.back();
+        heap.pop_back();
+        auto& s = subscribers_[i];
+        ++s.num_allotted_slots;
+        --num_free_slots;
+        if(s.num_allotted_slots < int(s.expected_rates.size())) {
+            heap.push_back(i);
+            std::push_heap(heap.begin(), heap.end(), is_worse);
+        }
+    }
+}
+
+} // tide
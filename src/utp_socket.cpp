@@ -0,0 +1,1179 @@
+#include "utp_socket.hpp"
+#include "endian.hpp"
+#include "random.hpp"
+
+#include <algorithm> // min, max, find, sort, remove_if
+#include <cassert>
+#include <cstdlib> // abs
+#include <cstring> // memcpy
+#include <limits>
+
+#ifdef __linux__
+#include <sys/socket.h>
+#endif // __linux__
+
+#include <asio/error.hpp>
+#include <asio/post.hpp>
+
+namespace tide {
+
+// The uTP version implemented, as sent in the lower nibble of the first byte.
+constexpr uint8_t utp_version = 1;
+
+// The selective ACK extension's type in the extension chain.
+constexpr uint8_t selective_ack_extension = 1;
+
+// The number of packets beyond the next expected one that we can buffer when they
+// arrive out of order, and which we can acknowledge selectively.
+constexpr int reorder_buffer_size = 1024;
+
+// The most bits of the selective ACK bitmask we send (it must be a multiple of 32).
+constexpr int max_sack_bits = 64;
+
+// A SYN is sent this many times before the connection attempt is deemed a failure.
+// With the initial timeout of a second and exponential backoff this amounts to
+// 7 seconds, which is well below `peer_session_settings::peer_connect_timeout`, so
+// that a TCP connection may still be attempted in time.
+constexpr int max_syn_transmissions = 3;
+
+// An established connection is deemed dead after this many timeouts in a row.
+constexpr int max_consecutive_timeouts = 6;
+
+// A packet is deemed lost if at least this many packets sent after it were
+// acknowledged (or if this many duplicate ACKs for the preceding packet arrive).
+constexpr int fast_retransmit_threshold = 3;
+
+/** Returns the lower 32 bits of the current time in microseconds. */
+inline uint32_t timestamp_us() noexcept
+{
+    return uint32_t(to_int<microseconds>(clock::now()));
+}
+
+/** Returns true if sequence number `a` precedes `b`, accounting for wrap-around. */
+inline bool seq_less(const uint16_t a, const uint16_t b) noexcept
+{
+    return int16_t(uint16_t(a - b)) < 0;
+}
+
+// -- utp_socket --
+
+utp_socket::utp_socket(utp_socket_manager& manager) : manager_(manager) {}
+
+utp_socket::~utp_socket()
+{
+    if(is_registered_) {
+        manager_.unregister_socket(*this);
+    }
+}
+
+asio::io_context& utp_socket::get_io_context() noexcept
+{
+    return manager_.get_io_context();
+}
+
+void utp_socket::open(const tcp& protocol, error_code& error)
+{
+    error.clear();
+    if(is_open_) {
+        error = asio::error::already_open;
+    } else if(!manager_.is_open()) {
+        error = asio::error::network_down;
+    } else if(protocol != tcp::v4()) {
+        // The manager's socket is only bound on IPv4.
+        error = asio::error::address_family_not_supported;
+    } else {
+        reset_state();
+        is_open_ = true;
+    }
+}
+
+void utp_socket::non_blocking(const bool b, error_code& error)
+{
+    // There's nothing to do here: our synchronous operations never block.
+    error.clear();
+}
+
+tcp::endpoint utp_socket::local_endpoint(error_code& error) const
+{
+    const auto ep = manager_.local_endpoint(error);
+    return tcp::endpoint(ep.address(), ep.port());
+}
+
+void utp_socket::async_connect(const tcp::endpoint& endpoint, connect_handler handler)
+{
+    if(!is_open_ || (state_ != state::closed)) {
+        const auto error = is_open_ ? asio::error::already_started
+                                    : asio::error::bad_descriptor;
+        asio::post(get_io_context(),
+                [h = std::move(handler), error] { h(make_error_code(error)); });
+        return;
+    }
+
+    remote_endpoint_ = udp::endpoint(endpoint.address(), endpoint.port());
+    receive_id_ = manager_.allocate_connection_id(remote_endpoint_);
+    send_id_ = receive_id_ + 1;
+    seq_nr_ = 1;
+    manager_.register_socket(*this);
+
+    connect_handler_ = std::move(handler);
+    state_ = state::syn_sent;
+    // The SYN is handled like any other packet, so it is retransmitted until peer
+    // acknowledges it.
+    packet& syn = create_packet(st_syn);
+    in_flight_packets_.emplace_back(std::move(syn));
+    send_queue_.pop_back();
+    transmit(in_flight_packets_.back());
+}
+
+void utp_socket::accept(const udp::endpoint& endpoint, const packet_header& syn)
+{
+    reset_state();
+    is_open_ = true;
+    remote_endpoint_ = endpoint;
+    receive_id_ = syn.connection_id + 1;
+    send_id_ = syn.connection_id;
+    seq_nr_ = util::random_int(std::numeric_limits<uint16_t>::max());
+    ack_nr_ = syn.seq_nr;
+    reply_micro_ = timestamp_us() - syn.timestamp_us;
+    peer_window_ = syn.wnd_size;
+    state_ = state::connected;
+    manager_.register_socket(*this);
+    send_state();
+}
+
+void utp_socket::async_write_some(
+        const std::vector<asio::const_buffer>& buffers, io_handler handler)
+{
+    error_code error = error_;
+    if(!error && (state_ != state::connected)) {
+        error = state_ == state::fin_sent ? asio::error::shut_down
+                                          : asio::error::not_connected;
+    }
+    if(error) {
+        asio::post(get_io_context(), [h = std::move(handler), error] { h(error, 0); });
+        return;
+    }
+
+    const int num_written_bytes = append_to_send_queue(buffers);
+    if(num_written_bytes > 0) {
+        asio::post(get_io_context(), [h = std::move(handler), num_written_bytes] {
+            h(error_code(), num_written_bytes);
+        });
+        send_packets();
+    } else {
+        // The send buffer is full, we can only accept more once peer has
+        // acknowledged some of it.
+        write_handler_ = std::move(handler);
+        write_buffers_ = buffers;
+    }
+}
+
+void utp_socket::async_read_some(asio::mutable_buffer buffer, io_handler handler)
+{
+    assert(!read_handler_);
+    if(!is_open_ || ((state_ == state::closed) && !error_ && !is_eof())) {
+        const auto error = is_open_ ? asio::error::not_connected
+                                    : asio::error::bad_descriptor;
+        asio::post(get_io_context(), [h = std::move(handler), error] {
+            h(make_error_code(error), 0);
+        });
+        return;
+    }
+    read_handler_ = std::move(handler);
+    read_buffer_ = buffer;
+    try_complete_read();
+}
+
+size_t utp_socket::available(error_code& error) const
+{
+    error = error_;
+    return num_received_bytes_;
+}
+
+size_t utp_socket::read_some(asio::mutable_buffer buffer, error_code& error)
+{
+    error.clear();
+    if(num_received_bytes_ > 0) {
+        return copy_received_bytes(buffer);
+    } else if(error_) {
+        error = error_;
+    } else if(is_eof()) {
+        error = asio::error::eof;
+    } else {
+        error = asio::error::would_block;
+    }
+    return 0;
+}
+
+void utp_socket::shutdown(error_code& error)
+{
+    error.clear();
+    if(state_ == state::connected) {
+        // The FIN is sequenced after all data we've accepted so far.
+        create_packet(st_fin);
+        state_ = state::fin_sent;
+        send_packets();
+    } else if(state_ == state::syn_sent) {
+        fail(asio::error::operation_aborted);
+    } else if(state_ == state::closed) {
+        error = asio::error::not_connected;
+    }
+}
+
+void utp_socket::close(error_code& error)
+{
+    error.clear();
+    if(!is_open_) {
+        return;
+    }
+    if(state_ == state::connected) {
+        // Let peer know we're gone, but we can't linger to ensure it arrives as
+        // we're about to be destroyed.
+        shutdown(error);
+    }
+    abort_pending_ops(asio::error::operation_aborted);
+    if(is_registered_) {
+        manager_.unregister_socket(*this);
+    }
+    state_ = state::closed;
+    is_open_ = false;
+}
+
+void utp_socket::reset_state()
+{
+    state_ = state::closed;
+    error_.clear();
+    send_queue_.clear();
+    in_flight_packets_.clear();
+    num_packets_needing_resend_ = 0;
+    num_buffered_send_bytes_ = 0;
+    num_bytes_in_flight_ = 0;
+    num_duplicate_acks_ = 0;
+    max_window_ = min_window_size;
+    peer_window_ = max_payload_size;
+    has_base_delay_ = false;
+    current_delays_.fill(0);
+    rtt_ = rtt_var_ = 0;
+    timeout_ = milliseconds(1000);
+    num_consecutive_timeouts_ = 0;
+    receive_buffer_.clear();
+    receive_buffer_offset_ = 0;
+    num_received_bytes_ = 0;
+    reorder_buffer_.clear();
+    num_reordered_packets_ = num_reordered_bytes_ = 0;
+    has_received_fin_ = false;
+    num_unacked_packets_ = 0;
+}
+
+bool utp_socket::parse_header(const uint8_t* data, const int size, packet_header& header)
+{
+    if(size < header_size) {
+        return false;
+    }
+    const uint8_t type = data[0] >> 4;
+    if(((data[0] & 0xf) != utp_version) || (type > st_syn)) {
+        return false;
+    }
+    header.type = packet_type(type);
+    header.extension = data[1];
+    header.connection_id = endian::read_network<uint16_t>(data + 2);
+    header.timestamp_us = endian::read_network<uint32_t>(data + 4);
+    header.timestamp_difference_us = endian::read_network<uint32_t>(data + 8);
+    header.wnd_size = endian::read_network<uint32_t>(data + 12);
+    header.seq_nr = endian::read_network<uint16_t>(data + 16);
+    header.ack_nr = endian::read_network<uint16_t>(data + 18);
+    return true;
+}
+
+void utp_socket::handle_packet(
+        const packet_header& header, const uint8_t* data, const int size)
+{
+    if(state_ == state::closed) {
+        return;
+    }
+
+    if(header.type == st_reset) {
+        fail(state_ == state::syn_sent ? asio::error::connection_refused
+                                       : asio::error::connection_reset);
+        return;
+    }
+
+    // Walk the extension chain to find the selective ACK and the start of payload.
+    const uint8_t* sack = nullptr;
+    int sack_size = 0;
+    int offset = header_size;
+    for(auto extension = header.extension; extension != 0;) {
+        if(offset + 2 > size) {
+            return;
+        }
+        const uint8_t next_extension = data[offset];
+        const int length = data[offset + 1];
+        offset += 2;
+        if(offset + length > size) {
+            return;
+        }
+        if(extension == selective_ack_extension) {
+            sack = data + offset;
+            sack_size = length;
+        }
+        extension = next_extension;
+        offset += length;
+    }
+
+    const auto now = clock::now();
+    reply_micro_ = timestamp_us() - header.timestamp_us;
+    peer_window_ = header.wnd_size;
+
+    if(header.type == st_syn) {
+        // Peer must have missed our reply to its SYN.
+        ++num_unacked_packets_;
+        manager_.defer_ack(*this);
+        return;
+    }
+
+    if(state_ == state::syn_sent) {
+        if(header.type != st_state) {
+            return;
+        }
+        // Peer's first data packet will have the same sequence number as this.
+        ack_nr_ = header.seq_nr - 1;
+        last_received_ack_nr_ = header.ack_nr;
+        state_ = state::connected;
+        if(connect_handler_) {
+            asio::post(get_io_context(),
+                    [h = std::move(connect_handler_)] { h(error_code()); });
+            connect_handler_ = nullptr;
+        }
+    }
+
+    if(header.timestamp_difference_us != 0) {
+        update_delay(header.timestamp_difference_us, now);
+    }
+
+    const int payload_size = size - offset;
+    const bool is_pure_ack = (header.type == st_state) && (payload_size == 0);
+    const int num_acked_bytes
+            = handle_ack(header.ack_nr, sack, sack_size, is_pure_ack, now);
+    if(num_acked_bytes > 0) {
+        num_consecutive_timeouts_ = 0;
+        update_window(num_acked_bytes, now);
+        try_complete_write();
+    }
+
+    if(((header.type == st_data) && (payload_size > 0)) || (header.type == st_fin)) {
+        handle_payload(header, data + offset, payload_size);
+        if(++num_unacked_packets_ >= 2) {
+            send_state();
+        } else {
+            manager_.defer_ack(*this);
+        }
+    }
+
+    send_packets();
+}
+
+int utp_socket::handle_ack(const uint16_t ack_nr, const uint8_t* sack,
+        const int sack_size, const bool is_pure_ack, const time_point& now)
+{
+    int num_acked_bytes = 0;
+    const auto ack = [this, &num_acked_bytes, &now](packet& p) {
+        if(p.is_in_flight) {
+            num_bytes_in_flight_ -= p.payload_size();
+            p.is_in_flight = false;
+        }
+        if(p.needs_resend) {
+            p.needs_resend = false;
+            --num_packets_needing_resend_;
+        }
+        // Per Karn's algorithm, only packets that were sent once yield reliable
+        // round trip time samples.
+        if(p.num_transmissions == 1) {
+            update_rtt(now - p.send_time);
+        }
+        num_acked_bytes += p.payload_size();
+        p.is_acked = true;
+    };
+
+    // Every packet up to and including `ack_nr` has been received by peer.
+    bool has_acked_new_packets = false;
+    while(!in_flight_packets_.empty()
+            && !seq_less(ack_nr, in_flight_packets_.front().seq_nr)) {
+        auto& p = in_flight_packets_.front();
+        if(!p.is_acked) {
+            ack(p);
+        }
+        num_buffered_send_bytes_ -= p.payload_size();
+        in_flight_packets_.pop_front();
+        has_acked_new_packets = true;
+    }
+
+    if(!has_acked_new_packets && is_pure_ack && (ack_nr == last_received_ack_nr_)
+            && !in_flight_packets_.empty()) {
+        if(++num_duplicate_acks_ == fast_retransmit_threshold) {
+            mark_lost(in_flight_packets_.front());
+            decay_window(now);
+        }
+    } else if(has_acked_new_packets) {
+        num_duplicate_acks_ = 0;
+    }
+    last_received_ack_nr_ = ack_nr;
+
+    if(sack && !in_flight_packets_.empty()) {
+        // Bit i of the bitmask (in little endian byte order) is set if packet
+        // `ack_nr + 2 + i` has been received. Since sequence numbers of packets in
+        // flight are consecutive, the packet's position is its distance from the
+        // first one's.
+        const uint16_t first_seq_nr = in_flight_packets_.front().seq_nr;
+        int last_acked_pos = -1;
+        for(auto i = 0; i < sack_size * 8; ++i) {
+            if(!(sack[i / 8] & (1 << (i % 8)))) {
+                continue;
+            }
+            const int pos = uint16_t(ack_nr + 2 + i - first_seq_nr);
+            if(pos >= int(in_flight_packets_.size())) {
+                break;
+            }
+            auto& p = in_flight_packets_[pos];
+            if(!p.is_acked) {
+                ack(p);
+            }
+            last_acked_pos = pos;
+        }
+        // A packet is deemed lost if enough packets sent after it have arrived.
+        // Packets are compared by the time they were (last) sent rather than by
+        // their position, as otherwise a retransmitted packet would be deemed lost
+        // again as soon as the next ACK arrived. To that end we track the send
+        // times of the last `fast_retransmit_threshold` packets that arrived,
+        // the earliest of which is kept at the front.
+        std::array<time_point, fast_retransmit_threshold> latest_send_times;
+        latest_send_times.fill(time_point());
+        bool has_lost_packets = false;
+        for(auto pos = last_acked_pos; pos >= 0; --pos) {
+            auto& p = in_flight_packets_[pos];
+            if(p.is_acked) {
+                if(p.send_time > latest_send_times[0]) {
+                    latest_send_times[0] = p.send_time;
+                    std::sort(latest_send_times.begin(), latest_send_times.end());
+                }
+            } else if(p.is_in_flight && (p.send_time < latest_send_times[0])) {
+                mark_lost(p);
+                has_lost_packets = true;
+            }
+        }
+        if(has_lost_packets) {
+            decay_window(now);
+        }
+    }
+
+    return num_acked_bytes;
+}
+
+void utp_socket::handle_payload(
+        const packet_header& header, const uint8_t* payload, const int payload_size)
+{
+    if(has_received_fin_ && seq_less(fin_seq_nr_, header.seq_nr)) {
+        return;
+    }
+    if(header.type == st_fin) {
+        has_received_fin_ = true;
+        fin_seq_nr_ = header.seq_nr;
+    }
+
+    const uint16_t distance = header.seq_nr - ack_nr_;
+    if((distance == 0) || (distance >= reorder_buffer_size)) {
+        // Either a duplicate or too far ahead for us to buffer.
+        return;
+    }
+
+    if(distance > 1) {
+        if(payload_size == 0) {
+            // An early FIN, which is recorded above.
+            return;
+        }
+        if(reorder_buffer_.empty()) {
+            reorder_buffer_.resize(reorder_buffer_size);
+        }
+        auto& slot = reorder_buffer_[header.seq_nr % reorder_buffer_size];
+        if(slot.empty() && (payload_size <= receive_window())) {
+            slot.assign(payload, payload + payload_size);
+            ++num_reordered_packets_;
+            num_reordered_bytes_ += payload_size;
+        }
+        return;
+    }
+
+    if(payload_size > 0) {
+        if(payload_size > receive_window()) {
+            // User isn't reading fast enough and peer ignored our window.
+            return;
+        }
+        receive_buffer_.emplace_back(payload, payload + payload_size);
+        num_received_bytes_ += payload_size;
+    }
+    ack_nr_ = header.seq_nr;
+
+    // The gap may have been filled, in which case the packets after it are now in
+    // order as well.
+    while(num_reordered_packets_ > 0) {
+        auto& slot = reorder_buffer_[uint16_t(ack_nr_ + 1) % reorder_buffer_size];
+        if(slot.empty()) {
+            break;
+        }
+        num_reordered_bytes_ -= slot.size();
+        num_received_bytes_ += slot.size();
+        --num_reordered_packets_;
+        receive_buffer_.emplace_back(std::move(slot));
+        slot.clear();
+        ++ack_nr_;
+    }
+    if(has_received_fin_ && (uint16_t(ack_nr_ + 1) == fin_seq_nr_)) {
+        ack_nr_ = fin_seq_nr_;
+    }
+
+    try_complete_read();
+}
+
+void utp_socket::update_delay(const uint32_t delay_us, const time_point& now)
+{
+    // The delay includes the offset between peer's clock and ours, so it's only
+    // meaningful relative to other samples, and may even wrap around.
+    if(!has_base_delay_) {
+        base_delays_.fill(delay_us);
+        has_base_delay_ = true;
+        last_base_delay_rotation_time_ = now;
+    } else if(now - last_base_delay_rotation_time_ >= minutes(1)) {
+        base_delays_[0] = base_delays_[1];
+        base_delays_[1] = delay_us;
+        last_base_delay_rotation_time_ = now;
+    } else if(int32_t(delay_us - base_delays_[1]) < 0) {
+        base_delays_[1] = delay_us;
+    }
+
+    const uint32_t base_delay = int32_t(base_delays_[1] - base_delays_[0]) < 0
+            ? base_delays_[1]
+            : base_delays_[0];
+    const int32_t delay = delay_us - base_delay;
+    current_delays_[current_delay_pos_] = std::max(delay, 0);
+    current_delay_pos_ = (current_delay_pos_ + 1) % current_delays_.size();
+}
+
+int utp_socket::queuing_delay() const noexcept
+{
+    return *std::min_element(current_delays_.begin(), current_delays_.end());
+}
+
+void utp_socket::update_window(const int num_acked_bytes, const time_point& now)
+{
+    // LEDBAT: the window grows or shrinks in proportion to how far the queuing
+    // delay is from the target, by at most `max_window_increase_per_rtt` per round
+    // trip (which is spread over the ACKs received in a round trip).
+    const int64_t off_target = target_delay_us - queuing_delay();
+    const int64_t window_factor_num = std::min(num_acked_bytes, max_window_);
+    const int64_t window_factor_den = std::max(num_acked_bytes, max_window_);
+    int64_t gain = max_window_increase_per_rtt * off_target * window_factor_num
+            / (int64_t(target_delay_us) * window_factor_den);
+    // If we haven't been using all of the window, there is no evidence that the
+    // path could take more, so don't grow it.
+    if((gain > 0) && (now - last_window_full_time_ > seconds(1))) {
+        gain = 0;
+    }
+    max_window_ = std::min<int64_t>(
+            std::max<int64_t>(max_window_ + gain, min_window_size),
+            receive_buffer_capacity);
+}
+
+void utp_socket::update_rtt(const duration& sample)
+{
+    const int sample_us = to_int<microseconds>(sample);
+    if(rtt_ == 0) {
+        rtt_ = sample_us;
+        rtt_var_ = sample_us / 2;
+    } else {
+        rtt_var_ += (std::abs(rtt_ - sample_us) - rtt_var_) / 4;
+        rtt_ += (sample_us - rtt_) / 8;
+    }
+    timeout_ = std::max(milliseconds((rtt_ + 4 * rtt_var_) / 1000), milliseconds(500));
+}
+
+void utp_socket::decay_window(const time_point& now)
+{
+    if(now - last_window_decay_time_ >= microseconds(rtt_)) {
+        max_window_ = std::max(max_window_ / 2, min_window_size);
+        last_window_decay_time_ = now;
+    }
+}
+
+void utp_socket::mark_lost(packet& p)
+{
+    if(p.is_in_flight) {
+        num_bytes_in_flight_ -= p.payload_size();
+        p.is_in_flight = false;
+    }
+    if(!p.needs_resend) {
+        p.needs_resend = true;
+        ++num_packets_needing_resend_;
+    }
+}
+
+void utp_socket::on_tick(const time_point& now)
+{
+    if((state_ == state::closed) || in_flight_packets_.empty()) {
+        // A partially filled packet may be held back while there are packets in
+        // flight (see `send_packets`), and if those were all acked it can go now.
+        send_packets();
+        return;
+    }
+
+    // The first packet in flight is never acknowledged (or it'd be removed), so if
+    // anything timed out, it's this.
+    const auto& oldest = in_flight_packets_.front();
+    if(now - oldest.send_time < timeout_) {
+        return;
+    }
+
+    ++num_consecutive_timeouts_;
+    if(((state_ == state::syn_sent)
+               && (num_consecutive_timeouts_ >= max_syn_transmissions))
+            || (num_consecutive_timeouts_ > max_consecutive_timeouts)) {
+        fail(asio::error::timed_out);
+        return;
+    }
+
+    // Consider everything in flight lost and start over with the smallest window.
+    for(auto& p : in_flight_packets_) {
+        if(!p.is_acked) {
+            mark_lost(p);
+        }
+    }
+    max_window_ = min_window_size;
+    timeout_ = std::min(timeout_ * 2, milliseconds(60000));
+    send_packets();
+}
+
+int utp_socket::append_to_send_queue(const std::vector<asio::const_buffer>& buffers)
+{
+    int num_written_bytes = 0;
+    for(const auto& buffer : buffers) {
+        auto data = static_cast<const uint8_t*>(buffer.data());
+        int num_left = buffer.size();
+        while(num_left > 0) {
+            const int room = send_buffer_capacity - num_buffered_send_bytes_;
+            if(room <= 0) {
+                return num_written_bytes;
+            }
+            if(send_queue_.empty() || (send_queue_.back().type != st_data)
+                    || (send_queue_.back().payload_size() == max_payload_size)) {
+                create_packet(st_data);
+            }
+            auto& p = send_queue_.back();
+            const int n = std::min({num_left, room, max_payload_size - p.payload_size()});
+            p.buffer.insert(p.buffer.end(), data, data + n);
+            data += n;
+            num_left -= n;
+            num_written_bytes += n;
+            num_buffered_send_bytes_ += n;
+        }
+    }
+    return num_written_bytes;
+}
+
+utp_socket::packet& utp_socket::create_packet(const packet_type type)
+{
+    packet p;
+    p.type = type;
+    p.seq_nr = seq_nr_++;
+    p.buffer.reserve(header_size + (type == st_data ? max_payload_size : 0));
+    p.buffer.resize(header_size);
+    send_queue_.emplace_back(std::move(p));
+    return send_queue_.back();
+}
+
+inline bool utp_socket::has_window_room_for(const int num_bytes) const noexcept
+{
+    // A packet may always be sent when nothing is in flight, otherwise a window
+    // smaller than a packet (e.g. when peer's receive buffer is full) would stall
+    // the connection for good.
+    return (num_bytes_in_flight_ == 0)
+            || (num_bytes_in_flight_ + num_bytes <= std::min(max_window_, peer_window_));
+}
+
+void utp_socket::send_packets()
+{
+    if(state_ == state::closed) {
+        return;
+    }
+
+    if(num_packets_needing_resend_ > 0) {
+        for(auto& p : in_flight_packets_) {
+            if(!p.needs_resend) {
+                continue;
+            } else if(!has_window_room_for(p.payload_size())) {
+                last_window_full_time_ = clock::now();
+                return;
+            }
+            transmit(p);
+        }
+    }
+
+    while(!send_queue_.empty()) {
+        auto& p = send_queue_.front();
+        // Like Nagle's algorithm, hold back the last packet if it's not full and
+        // there's data in flight, as the user may be about to write more.
+        if((p.type == st_data) && (send_queue_.size() == 1)
+                && (p.payload_size() < max_payload_size) && (num_bytes_in_flight_ > 0)) {
+            break;
+        }
+        if(!has_window_room_for(p.payload_size())) {
+            last_window_full_time_ = clock::now();
+            break;
+        }
+        in_flight_packets_.emplace_back(std::move(p));
+        send_queue_.pop_front();
+        transmit(in_flight_packets_.back());
+    }
+}
+
+void utp_socket::transmit(packet& p)
+{
+    write_header(p.buffer.data(), p.type, 0, p.seq_nr);
+    manager_.send_to(remote_endpoint_, p.buffer.data(), p.buffer.size());
+    if(p.needs_resend) {
+        p.needs_resend = false;
+        --num_packets_needing_resend_;
+    }
+    if(!p.is_in_flight) {
+        num_bytes_in_flight_ += p.payload_size();
+        p.is_in_flight = true;
+    }
+    p.send_time = clock::now();
+    ++p.num_transmissions;
+    // Every packet acknowledges what we've received so far.
+    num_unacked_packets_ = 0;
+}
+
+void utp_socket::send_state()
+{
+    std::array<uint8_t, header_size + 2 + max_sack_bits / 8> buffer;
+    int size = header_size;
+    uint8_t extension = 0;
+    if(num_reordered_packets_ > 0) {
+        // Let peer know which packets past the gap we've received, so that it only
+        // resends what is missing.
+        extension = selective_ack_extension;
+        uint8_t* sack = &buffer[header_size + 2];
+        std::fill(sack, sack + max_sack_bits / 8, 0);
+        for(auto i = 0; i < max_sack_bits; ++i) {
+            const uint16_t seq_nr = ack_nr_ + 2 + i;
+            if(!reorder_buffer_[seq_nr % reorder_buffer_size].empty()) {
+                sack[i / 8] |= 1 << (i % 8);
+            }
+        }
+        buffer[header_size] = 0;
+        buffer[header_size + 1] = max_sack_bits / 8;
+        size += 2 + max_sack_bits / 8;
+    }
+    // A STATE packet does not consume a sequence number.
+    write_header(buffer.data(), st_state, extension, seq_nr_);
+    manager_.send_to(remote_endpoint_, buffer.data(), size);
+    num_unacked_packets_ = 0;
+}
+
+void utp_socket::write_header(uint8_t* buffer, const packet_type type,
+        const uint8_t extension, const uint16_t seq_nr) const
+{
+    buffer[0] = (type << 4) | utp_version;
+    buffer[1] = extension;
+    endian::write_network<uint16_t>(
+            buffer + 2, type == st_syn ? receive_id_ : send_id_);
+    endian::write_network<uint32_t>(buffer + 4, timestamp_us());
+    endian::write_network<uint32_t>(buffer + 8, reply_micro_);
+    endian::write_network<uint32_t>(buffer + 12, receive_window());
+    endian::write_network<uint16_t>(buffer + 16, seq_nr);
+    endian::write_network<uint16_t>(buffer + 18, ack_nr_);
+}
+
+inline int utp_socket::receive_window() const noexcept
+{
+    return std::max(
+            receive_buffer_capacity - num_received_bytes_ - num_reordered_bytes_, 0);
+}
+
+inline bool utp_socket::is_eof() const noexcept
+{
+    return has_received_fin_ && (ack_nr_ == fin_seq_nr_);
+}
+
+int utp_socket::copy_received_bytes(asio::mutable_buffer buffer)
+{
+    const bool was_window_closed = receive_window() < max_payload_size;
+    auto out = static_cast<uint8_t*>(buffer.data());
+    int num_copied_bytes = 0;
+    while(!receive_buffer_.empty() && (num_copied_bytes < int(buffer.size()))) {
+        auto& chunk = receive_buffer_.front();
+        const int n = std::min<int>(chunk.size() - receive_buffer_offset_,
+                buffer.size() - num_copied_bytes);
+        std::memcpy(out + num_copied_bytes, chunk.data() + receive_buffer_offset_, n);
+        num_copied_bytes += n;
+        receive_buffer_offset_ += n;
+        if(receive_buffer_offset_ == int(chunk.size())) {
+            receive_buffer_.pop_front();
+            receive_buffer_offset_ = 0;
+        }
+    }
+    num_received_bytes_ -= num_copied_bytes;
+    // Peer stops sending when our window is full, so let it know as soon as it
+    // opens up again.
+    if(was_window_closed && (receive_window() >= max_payload_size)
+            && (state_ != state::closed)) {
+        send_state();
+    }
+    return num_copied_bytes;
+}
+
+void utp_socket::try_complete_read()
+{
+    if(!read_handler_) {
+        return;
+    }
+    error_code error;
+    int num_bytes_read = 0;
+    if(num_received_bytes_ > 0) {
+        num_bytes_read = copy_received_bytes(read_buffer_);
+    } else if(error_) {
+        error = error_;
+    } else if(is_eof()) {
+        error = asio::error::eof;
+    } else {
+        return;
+    }
+    asio::post(get_io_context(), [h = std::move(read_handler_), error, num_bytes_read] {
+        h(error, num_bytes_read);
+    });
+    read_handler_ = nullptr;
+}
+
+void utp_socket::try_complete_write()
+{
+    if(!write_handler_) {
+        return;
+    }
+    const int num_written_bytes = append_to_send_queue(write_buffers_);
+    if(num_written_bytes == 0) {
+        return;
+    }
+    asio::post(get_io_context(), [h = std::move(write_handler_), num_written_bytes] {
+        h(error_code(), num_written_bytes);
+    });
+    write_handler_ = nullptr;
+    write_buffers_.clear();
+}
+
+void utp_socket::fail(const error_code& error)
+{
+    error_ = error;
+    state_ = state::closed;
+    if(is_registered_) {
+        manager_.unregister_socket(*this);
+    }
+    abort_pending_ops(error);
+}
+
+void utp_socket::abort_pending_ops(const error_code& error)
+{
+    auto& ios = get_io_context();
+    if(connect_handler_) {
+        asio::post(ios, [h = std::move(connect_handler_), error] { h(error); });
+        connect_handler_ = nullptr;
+    }
+    if(write_handler_) {
+        asio::post(ios, [h = std::move(write_handler_), error] { h(error, 0); });
+        write_handler_ = nullptr;
+        write_buffers_.clear();
+    }
+    if(read_handler_) {
+        // Whatever was received before the connection was torn down may still be
+        // read, unless the user aborted.
+        if(error == asio::error::operation_aborted) {
+            asio::post(ios, [h = std::move(read_handler_), error] { h(error, 0); });
+            read_handler_ = nullptr;
+        } else {
+            try_complete_read();
+        }
+    }
+}
+
+// -- utp_socket_manager --
+
+utp_socket_manager::utp_socket_manager(asio::io_context& ios)
+    : ios_(ios), socket_(ios), tick_timer_(ios)
+{}
+
+utp_socket_manager::~utp_socket_manager()
+{
+    close();
+}
+
+void utp_socket_manager::open(const uint16_t port, error_code& error)
+{
+    assert(!is_open());
+    socket_.open(udp::v4(), error);
+    if(error) {
+        return;
+    }
+    socket_.bind(udp::endpoint(udp::v4(), port), error);
+    if(!error) {
+        socket_.non_blocking(true, error);
+    }
+    if(error) {
+        error_code ec;
+        socket_.close(ec);
+        return;
+    }
+    receive();
+}
+
+void utp_socket_manager::add_datagram_handler(
+        const void* token, datagram_handler handler)
+{
+    remove_datagram_handler(token);
+    datagram_handlers_.emplace_back(token, std::move(handler));
+}
+
+void utp_socket_manager::remove_datagram_handler(const void* token)
+{
+    datagram_handlers_.erase(std::remove_if(datagram_handlers_.begin(),
+                                     datagram_handlers_.end(),
+                                     [token](const auto& h) { return h.first == token; }),
+            datagram_handlers_.end());
+}
+
+void utp_socket_manager::close()
+{
+    error_code ec;
+    tick_timer_.cancel(ec);
+    socket_.close(ec);
+}
+
+udp::endpoint utp_socket_manager::local_endpoint(error_code& error) const
+{
+    return socket_.local_endpoint(error);
+}
+
+uint16_t utp_socket_manager::allocate_connection_id(const udp::endpoint& endpoint) const
+{
+    // Our connection will use both this id and the one after it.
+    uint16_t id;
+    do {
+        id = util::random_int(std::numeric_limits<uint16_t>::max());
+    } while(sockets_.count({endpoint, id})
+            || sockets_.count({endpoint, uint16_t(id + 1)}));
+    return id;
+}
+
+void utp_socket_manager::register_socket(utp_socket& socket)
+{
+    assert(!socket.is_registered_);
+    sockets_.emplace(
+            std::make_pair(socket.remote_endpoint_, socket.receive_id_), &socket);
+    socket.is_registered_ = true;
+    if(!is_ticking_) {
+        start_ticking();
+    }
+}
+
+void utp_socket_manager::unregister_socket(utp_socket& socket)
+{
+    assert(socket.is_registered_);
+    sockets_.erase({socket.remote_endpoint_, socket.receive_id_});
+    socket.is_registered_ = false;
+    auto it = std::find(
+            sockets_needing_ack_.begin(), sockets_needing_ack_.end(), &socket);
+    if(it != sockets_needing_ack_.end()) {
+        sockets_needing_ack_.erase(it);
+    }
+}
+
+void utp_socket_manager::defer_ack(utp_socket& socket)
+{
+    if(std::find(sockets_needing_ack_.begin(), sockets_needing_ack_.end(), &socket)
+            == sockets_needing_ack_.end()) {
+        sockets_needing_ack_.push_back(&socket);
+    }
+}
+
+void utp_socket_manager::send_to(
+        const udp::endpoint& endpoint, const uint8_t* data, const int size)
+{
+    error_code ec;
+    socket_.send_to(asio::buffer(data, size), endpoint, 0, ec);
+}
+
+void utp_socket_manager::send_reset(const udp::endpoint& endpoint,
+        const uint16_t connection_id, const uint16_t ack_nr)
+{
+    std::array<uint8_t, utp_socket::header_size> buffer;
+    buffer.fill(0);
+    buffer[0] = (utp_socket::st_reset << 4) | utp_version;
+    endian::write_network<uint16_t>(&buffer[2], connection_id);
+    endian::write_network<uint32_t>(&buffer[4], timestamp_us());
+    endian::write_network<uint16_t>(&buffer[16], util::random_int(0xffff));
+    endian::write_network<uint16_t>(&buffer[18], ack_nr);
+    send_to(endpoint, buffer.data(), buffer.size());
+}
+
+void utp_socket_manager::receive()
+{
+    if(is_receiving_) {
+        return;
+    }
+    socket_.async_receive_from(asio::buffer(receive_buffer_), sender_endpoint_,
+            [this](const error_code& error, size_t num_bytes_received) {
+                on_received(error, num_bytes_received);
+            });
+    is_receiving_ = true;
+}
+
+void utp_socket_manager::on_received(
+        const error_code& error, const size_t num_bytes_received)
+{
+    is_receiving_ = false;
+    if((error == asio::error::operation_aborted) || !socket_.is_open()) {
+        return;
+    }
+    // Errors on a UDP socket (e.g. an ICMP port unreachable in response to an
+    // earlier datagram) only concern a single peer, so they're not fatal.
+    if(!error) {
+        handle_datagram(sender_endpoint_, receive_buffer_.data(), num_bytes_received);
+        // Process the datagrams that have queued up (up to two batches, so as not to
+        // starve other handlers), so that each connection only sends a single ACK for
+        // all of them.
+        for(auto i = 0; i < 2; ++i) {
+            const int n = receive_batch();
+            for(auto j = 0; j < n; ++j) {
+                handle_datagram(
+                        batch_endpoints_[j], batch_buffers_[j].data(), batch_sizes_[j]);
+            }
+            if(n < max_receive_batch_size) {
+                break;
+            }
+        }
+    }
+    send_deferred_acks();
+    receive();
+}
+
+int utp_socket_manager::receive_batch()
+{
+    if(batch_buffers_.empty()) {
+        batch_buffers_.resize(max_receive_batch_size);
+    }
+#ifdef __linux__
+    std::array<mmsghdr, max_receive_batch_size> messages;
+    std::array<iovec, max_receive_batch_size> iovecs;
+    for(auto i = 0; i < max_receive_batch_size; ++i) {
+        iovecs[i].iov_base = batch_buffers_[i].data();
+        iovecs[i].iov_len = batch_buffers_[i].size();
+        messages[i] = mmsghdr();
+        messages[i].msg_hdr.msg_name = batch_endpoints_[i].data();
+        messages[i].msg_hdr.msg_namelen = batch_endpoints_[i].capacity();
+        messages[i].msg_hdr.msg_iov = &iovecs[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+    }
+    // Errors (including there being nothing to receive) are treated like in the
+    // asynchronous receive: they only concern a single datagram, so we just stop.
+    const int n = ::recvmmsg(socket_.native_handle(), messages.data(),
+            max_receive_batch_size, MSG_DONTWAIT, nullptr);
+    for(auto i = 0; i < n; ++i) {
+        batch_endpoints_[i].resize(messages[i].msg_hdr.msg_namelen);
+        batch_sizes_[i] = messages[i].msg_len;
+    }
+    return std::max(n, 0);
+#else // __linux__
+    error_code ec;
+    for(auto i = 0; i < max_receive_batch_size; ++i) {
+        batch_sizes_[i] = socket_.receive_from(
+                asio::buffer(batch_buffers_[i]), batch_endpoints_[i], 0, ec);
+        if(ec) {
+            return i;
+        }
+    }
+    return max_receive_batch_size;
+#endif // __linux__
+}
+
+void utp_socket_manager::handle_datagram(
+        const udp::endpoint& sender, const uint8_t* datagram, const int size)
+{
+    utp_socket::packet_header header;
+    if(!utp_socket::parse_header(datagram, size, header)) {
+        // A handler may add or remove handlers, so they're indexed rather than
+        // iterated over, and each is copied before it's invoked.
+        for(auto i = 0; i < int(datagram_handlers_.size()); ++i) {
+            auto handler = datagram_handlers_[i].second;
+            handler(sender, datagram, size);
+        }
+        return;
+    }
+
+    if(header.type == utp_socket::st_syn) {
+        // The initiator's SYN carries its receive id, and we receive with the id
+        // after it.
+        auto it = sockets_.find({sender, uint16_t(header.connection_id + 1)});
+        if(it != sockets_.end()) {
+            it->second->handle_packet(header, datagram, size);
+        } else if(accept_handler_
+                && (!accept_filter_ || accept_filter_(sender))) {
+            auto socket = std::make_unique<utp_socket>(*this);
+            socket->accept(sender, header);
+            accept_handler_(std::move(socket));
+        } else {
+            send_reset(sender, header.connection_id, header.seq_nr);
+        }
+        return;
+    }
+
+    auto it = sockets_.find({sender, header.connection_id});
+    if(it != sockets_.end()) {
+        it->second->handle_packet(header, datagram, size);
+    }
+}
+
+void utp_socket_manager::send_deferred_acks()
+{
+    for(auto socket : sockets_needing_ack_) {
+        if(socket->num_unacked_packets_ > 0) {
+            socket->send_state();
+        }
+    }
+    sockets_needing_ack_.clear();
+}
+
+void utp_socket_manager::start_ticking()
+{
+    is_ticking_ = true;
+    start_timer(tick_timer_, milliseconds(100),
+            [this](const error_code& error) { on_tick(error); });
+}
+
+void utp_socket_manager::on_tick(const error_code& error)
+{
+    is_ticking_ = false;
+    if(error == asio::error::operation_aborted) {
+        return;
+    }
+    // Sockets may unregister themselves when they time out, so work on a copy.
+    std::vector<utp_socket*> sockets;
+    sockets.reserve(sockets_.size());
+    for(const auto& entry : sockets_) {
+        sockets.push_back(entry.second);
+    }
+    const auto now = clock::now();
+    for(auto socket : sockets) {
+        socket->on_tick(now);
+    }
+    if(!sockets_.empty()) {
+        start_ticking();
+    }
+}
+
+} // tide